@@ -29,6 +29,7 @@
 
 hdb_db_t            hobbes_master_db = NULL;
 static xemem_apid_t hobbes_db_apid;
+static xemem_apid_t hobbes_part_apids[HDB_NUM_PARTS];
 static bool         hobbes_enabled   = false;
 static pid_t        hobbes_pid       = 0;
 
@@ -102,48 +103,103 @@ hobbes_app_auto_deinit()
 }
 
 
-int 
-hobbes_client_init()
+static hdb_db_t
+__attach_db(xemem_segid_t   segid,
+	    uint64_t        size,
+	    xemem_apid_t  * apid)
 {
-    void       * db_addr    = NULL;
-
-    assert(!hobbes_is_master_inittask());
+    struct xemem_addr   addr;
+    void              * db_addr = NULL;
+    hdb_db_t            db      = NULL;
 
-    hobbes_db_apid = xemem_get(HDB_MASTER_DB_SEGID, XEMEM_RDWR);
+    *apid = xemem_get(segid, XEMEM_RDWR);
 
-    if (hobbes_db_apid <= 0) {
-        ERROR("xpmem get failed\n");
-	return -1;
+    if (*apid <= 0) {
+        ERROR("xpmem get failed (segid=%ld)\n", segid);
+	return NULL;
     }
 
+    addr.apid   = *apid;
+    addr.offset = 0;
 
-    {
-	struct xemem_addr addr;
-
-        addr.apid   = hobbes_db_apid;
-        addr.offset = 0;
+    db_addr = xemem_attach(addr, size, NULL);
 
-        db_addr = xemem_attach(addr, HDB_MASTER_DB_SIZE, NULL);
-        if (db_addr == MAP_FAILED) {
-            ERROR("xpmem attach failed\n");
-            xemem_release(hobbes_db_apid);
-            return -1;
-        }
+    if (db_addr == MAP_FAILED) {
+	ERROR("xpmem attach failed (segid=%ld)\n", segid);
+	xemem_release(*apid);
+	return NULL;
     }
 
     //    printf("Attaching to local database (db_addr=%p)\n", db_addr);
 
-    hobbes_master_db  = hdb_attach(db_addr);
+    db = hdb_attach(db_addr);
+
+    if (db == NULL) {
+	ERROR("Error: Could not connect to database (segid=%ld)\n", segid);
+	xemem_detach(db_addr);
+	xemem_release(*apid);
+	return NULL;
+    }
+
+    return db;
+}
+
+static void
+__detach_db(hdb_db_t     db,
+	    xemem_apid_t apid)
+{
+    void * db_addr = hdb_get_db_addr(db);
+
+    hdb_detach(db);
+
+    xemem_detach(db_addr);
+
+    xemem_release(apid);
+}
+
+
+int 
+hobbes_client_init()
+{
+    hdb_part_t part = HDB_PART_REGISTRY;
+
+    assert(!hobbes_is_master_inittask());
+
+    hobbes_master_db = __attach_db(HDB_MASTER_DB_SEGID, HDB_MASTER_DB_SIZE, &hobbes_db_apid);
 
     if (hobbes_master_db == NULL) {
 	ERROR("Error: Could not connect to database\n");
 	return -1;
     }
 
+    /* Attach the partitions that are kept outside the master DB */
+    for (part = HDB_PART_REGISTRY + 1; part < HDB_NUM_PARTS; part++) {
+	hdb_db_t part_db = __attach_db(hdb_get_partition_segid(part), 
+				       hdb_get_partition_size(part), 
+				       &(hobbes_part_apids[part]));
+
+	if (part_db == NULL) {
+	    ERROR("Error: Could not connect to database partition (%d)\n", part);
+	    goto err;
+	}
+
+	hdb_set_partition(hobbes_master_db, part, part_db);
+    }
+
     /* Save process pid to prevent fork'ed processes from touching the DB on teardown */
     hobbes_pid = getpid();
 
     return 0;
+
+ err:
+    while (--part > HDB_PART_REGISTRY) {
+	__detach_db(hdb_get_partition(hobbes_master_db, part), hobbes_part_apids[part]);
+    }
+
+    __detach_db(hobbes_master_db, hobbes_db_apid);
+    hobbes_master_db = NULL;
+
+    return -1;
 }
 
 
@@ -151,17 +207,22 @@ hobbes_client_init()
 int
 hobbes_client_deinit()
 {
-    void * db_addr = NULL;
+    hdb_part_t part = HDB_PART_REGISTRY;
 
     assert(!hobbes_is_master_inittask());
 
-    db_addr = hdb_get_db_addr(hobbes_master_db);
-    
-    hdb_detach(hobbes_master_db);
+    hobbes_flush_enclave_cmdqs();
+    xemem_flush_apid_cache();
 
-    xemem_detach(db_addr);
+    for (part = HDB_PART_REGISTRY + 1; part < HDB_NUM_PARTS; part++) {
+	hdb_db_t part_db = hdb_get_partition(hobbes_master_db, part);
+
+	if (part_db != hobbes_master_db) {
+	    __detach_db(part_db, hobbes_part_apids[part]);
+	}
+    }
 
-    xemem_release(hobbes_db_apid);
+    __detach_db(hobbes_master_db, hobbes_db_apid);
 
     return 0;
 }
@@ -241,7 +241,6 @@ hobbes_launch_app(hobbes_id_t       enclave_id,
 		  hobbes_app_spec_t spec)
 {
     hcq_handle_t  hcq      = hobbes_open_enclave_cmdq(enclave_id);
-    hcq_cmd_t     cmd      = HCQ_INVALID_CMD;
     char        * spec_str = NULL;
     int           ret      = 0;
 
@@ -254,23 +253,15 @@ hobbes_launch_app(hobbes_id_t       enclave_id,
 
     printf("[libhobbes] Launching Application\n");
 
-    cmd = hcq_cmd_issue(hcq, HOBBES_CMD_APP_LAUNCH, smart_strlen(spec_str) + 1, spec_str);
+    ret = hcq_call(hcq, HOBBES_CMD_APP_LAUNCH, spec_str, smart_strlen(spec_str) + 1, NULL, 0, NULL);
     
     free(spec_str);
 
-    if (cmd == HCQ_INVALID_CMD) {
-	printf("No Response\n");
-	return -1;
-    }
-
-    ret = hcq_get_ret_code(hcq, cmd);
-
     if (ret != 0) {
 	printf("App launch Error\n");
 	return -1;
     }
 
-    hcq_cmd_complete(hcq, cmd);
     hobbes_close_enclave_cmdq(hcq);
 
     return ret;
@@ -281,26 +272,17 @@ hobbes_kill_app(hobbes_id_t enclave_id,
 		hobbes_id_t app_id)
 {
     hcq_handle_t  hcq      = hobbes_open_enclave_cmdq(enclave_id);
-    hcq_cmd_t     cmd      = HCQ_INVALID_CMD;
     int           ret      = 0;
 
     printf("Killing Application\n");
 
-    cmd = hcq_cmd_issue(hcq, HOBBES_CMD_APP_KILL, sizeof(hobbes_id_t), &app_id);
-    
-    if (cmd == HCQ_INVALID_CMD) {
-	printf("No Response\n");
-	return -1;
-    }
-
-    ret = hcq_get_ret_code(hcq, cmd);
+    ret = hcq_call(hcq, HOBBES_CMD_APP_KILL, &app_id, sizeof(hobbes_id_t), NULL, 0, NULL);
 
     if (ret != 0) {
 	printf("App kill Error\n");
 	return -1;
     }
 
-    hcq_cmd_complete(hcq, cmd);
     hobbes_close_enclave_cmdq(hcq);
 
     return ret;
@@ -349,39 +331,41 @@ struct app_info *
 hobbes_get_app_list(int * num_apps)
 {
     struct app_info * info_arr = NULL;
-    hobbes_id_t     * id_arr   = NULL;
 
-    int id_cnt = -1;
-    int i      =  0;
+    int max_cnt =  0;
+    int cnt     = -1;
 
-    id_arr = hdb_get_apps(hobbes_master_db, &id_cnt);
-    
-    if (id_cnt == -1) {
-	ERROR("could not retrieve list of app IDs\n");
+    /* Size the array, then snapshot. Retry if apps were added in between */
+    if (hdb_snapshot_apps(hobbes_master_db, NULL, 0, &cnt) == -1) {
+	ERROR("could not retrieve list of apps\n");
 	return NULL;
     }
-    
-    *num_apps = id_cnt;
 
-    if (id_cnt == 0) {
-	return NULL;
-    }
+    while (cnt > max_cnt) {
+	free(info_arr);
 
+	max_cnt  = cnt;
+	info_arr = calloc(sizeof(struct app_info), max_cnt);
 
-    info_arr = calloc(sizeof(struct app_info), id_cnt);
+	if (info_arr == NULL) {
+	    ERROR("could not allocate app list\n");
+	    return NULL;
+	}
 
-    for (i = 0; i < id_cnt; i++) {
-	info_arr[i].id         = id_arr[i];
+	if (hdb_snapshot_apps(hobbes_master_db, info_arr, max_cnt, &cnt) == -1) {
+	    ERROR("could not retrieve list of apps\n");
+	    free(info_arr);
+	    return NULL;
+	}
+    }
 
-	info_arr[i].state      = hdb_get_app_state  ( hobbes_master_db, id_arr[i] );
-	info_arr[i].enclave_id = hdb_get_app_enclave( hobbes_master_db, id_arr[i] );
-	info_arr[i].hio_id     = hdb_get_app_hio_id ( hobbes_master_db, id_arr[i] );
+    *num_apps = cnt;
 
-	strncpy(info_arr[i].name, hdb_get_app_name(hobbes_master_db, id_arr[i]), 31);
+    if (cnt == 0) {
+	free(info_arr);
+	return NULL;
     }
 
-    free(id_arr);
-    
     return info_arr;
 }
 
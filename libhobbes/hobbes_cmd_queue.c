@@ -13,20 +13,29 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <poll.h>
+#include <errno.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <dbapi.h>
 #include <dballoc.h>
+#include <indexapi.h>
 
 #include <pet_log.h>
 #include <pet_hashtable.h>
 
 
 #include "hobbes_cmd_queue.h"
+#include "hobbes_util.h"
 #include "xpmem.h"
 
 
-#define CMD_QUEUE_SIZE (16 * 1024 * 1024)
+/* Bytes mapped to read a segment's header before attaching the full segment */
+#define HCQ_PROBE_SIZE            (4096)
+
+/* Not exported by indexapi.h, and dbindex.h conflicts with dbapi.h */
+extern wg_int wg_search_hash(void * db, wg_int index_id, wg_int * values, wg_int count);
 
 
 /* Command Queue Row Types */
@@ -41,6 +50,24 @@
 #define HCQ_HDR_FIELD_NEXT_AVAIL  1
 #define HCQ_HDR_FIELD_PENDING     2
 #define HCQ_HDR_FIELD_OUTSTANDING 3
+#define HCQ_HDR_FIELD_STATS       4
+#define HCQ_HDR_FIELD_PRIO_CODES  5
+#define HCQ_HDR_FIELD_HI_NEXT     6
+#define HCQ_HDR_FIELD_HI_PENDING  7
+#define HCQ_HDR_FIELD_HI_OUTSTAND 8
+
+#define HCQ_HDR_REC_LEN           9
+
+/* Queue position fields of each priority lane */
+#define HCQ_HDR_NEXT_AVAIL(prio)  ((prio) ? HCQ_HDR_FIELD_HI_NEXT      : HCQ_HDR_FIELD_NEXT_AVAIL)
+#define HCQ_HDR_PENDING(prio)     ((prio) ? HCQ_HDR_FIELD_HI_PENDING   : HCQ_HDR_FIELD_PENDING)
+#define HCQ_HDR_OUTSTANDING(prio) ((prio) ? HCQ_HDR_FIELD_HI_OUTSTAND  : HCQ_HDR_FIELD_OUTSTANDING)
+
+/* Each lane numbers its commands separately, the lane is encoded in the ID. 
+ * Bit 56 keeps the ID within WhiteDB's small integer encoding. 
+ */
+#define HCQ_CMD_LANE_ID(prio, n)  ((((uint64_t)(prio)) << 56) | (uint64_t)(n))
+#define HCQ_CMD_PRIO(cmd)         ((hcq_prio_t)(((cmd) >> 56) & 0x1))
 
 /* Commands */
 #define HCQ_CMD_FIELD_ID          1
@@ -52,6 +79,196 @@
 #define HCQ_CMD_FIELD_RET_CODE    7
 #define HCQ_CMD_FIELD_RET_SIZE    8
 #define HCQ_CMD_FIELD_RET_DATA    9 
+#define HCQ_CMD_FIELD_FLAGS       10
+#define HCQ_CMD_FIELD_ISSUE_TSC   11
+#define HCQ_CMD_FIELD_START_TSC   12
+#define HCQ_CMD_FIELD_DEADLINE    13
+#define HCQ_CMD_FIELD_BULK_SEGID  14
+
+#define HCQ_CMD_REC_LEN           15
+
+/* Status of a command released by its client before it returned. The server frees it */
+#define HCQ_CMD_CANCELLED         2
+
+/* Command flags */
+#define HCQ_CMD_FLAG_DOORBELL     0x1   /* The client signalled the server after queuing this command */
+#define HCQ_CMD_FLAG_BULK         0x2   /* The command owns the client's large payload buffer         */
+#define HCQ_CMD_FLAG_BULK_CMD     0x4   /* Command data is in the large payload buffer                */
+#define HCQ_CMD_FLAG_BULK_RET     0x8   /* Return data is in the large payload buffer                 */
+#define HCQ_CMD_FLAG_DISCONNECT   0x10  /* Not a command: the client is going away                    */
+
+/* How often the server checks that its clients still exist, and how many lost ones it reaps per check */
+#define HCQ_SWEEP_INTERVAL_US     (1000 * 1000)
+#define HCQ_SWEEP_MAX_CLIENTS     16
+
+/* How long hcq_disconnect() waits for the server to let go of the large payload buffer */
+#define HCQ_DISCONNECT_WAIT_US    (100 * 1000)
+
+/* Status checks between clock reads while spinning in hcq_cmd_wait() */
+#define HCQ_SPIN_CHECK_INTERVAL   64
+
+/* IDs handed out by hcq_cmd_reserve() on the DB backend, before a record exists */
+#define HCQ_CMD_RESERVATION(n)    ((1ULL << 62) | (uint64_t)(n))
+
+
+/* 
+ * Ring backend layout 
+ *
+ * The segment starts with a struct hcq_ring header, followed by the
+ * submission ring cells of each priority lane and then by the command slots. Each slot is a
+ * cache line of metadata followed by a command data area and a return
+ * data area of ring->data_size bytes each. 
+ *
+ * Command IDs encode the slot index in the low 32 bits and the slot's
+ * reuse generation in the high 32 bits, so a lookup is a bounds check
+ * plus an ID comparison. The generation is also kept next to the slot's
+ * status, so a status change can be tied to one use of the slot.
+ */
+#define HCQ_RING_MAGIC            0x48435152    /* "HCQR" */
+#define HCQ_RING_SLOT_SIZE        (64 * 1024)
+#define HCQ_RING_NIL              ((uint32_t)-1)
+#define HCQ_RING_SLOT_FREE        ((uint32_t)-1)
+#define HCQ_RING_SLOT_RESERVED    ((uint32_t)-2)  /* Allocated by hcq_cmd_reserve(), not yet queued */
+#define HCQ_CACHE_LINE            64
+
+#define HCQ_RING_CMD_IDX(cmd)     ((uint32_t)((cmd) & 0xffffffffULL))
+#define HCQ_RING_CMD_GEN(cmd)     ((uint32_t)((cmd) >> 32))
+#define HCQ_RING_CMD_ID(gen, idx) ((((uint64_t)(gen)) << 32) | (uint64_t)(idx))
+
+struct hcq_ring_cell {
+    uint64_t seq;
+    uint64_t slot;
+};
+
+/* A slot's status and the generation of its command, swapped as one word */
+union hcq_slot_state {
+    uint64_t word;
+    struct {
+	uint32_t status;
+	uint32_t gen;
+    };
+};
+
+struct hcq_slot {
+    uint64_t cmd_id;
+    union {
+	uint64_t state;
+	struct {
+	    uint32_t status;
+	    uint32_t gen;
+	};
+    };
+    uint32_t next_free;
+    uint64_t cmd_code;
+    int64_t  segid;
+    int64_t  bulk_segid;
+    int64_t  ret_code;
+    uint32_t cmd_size;
+    uint32_t ret_size;
+    uint32_t flags;
+    uint32_t prio;
+    uint64_t issue_tsc;
+    uint64_t start_tsc;
+    uint64_t deadline_tsc;
+} __attribute__((aligned(HCQ_CACHE_LINE)));
+
+/* Submission ring positions of a lane (producers advance tail, the server advances head) */
+struct hcq_ring_lane {
+    uint64_t tail __attribute__((aligned(HCQ_CACHE_LINE)));
+    uint64_t head __attribute__((aligned(HCQ_CACHE_LINE)));
+};
+
+/* Command codes the server has marked high priority */
+struct hcq_prio_codes {
+    uint32_t num_codes;
+    uint32_t rsvd;
+    uint64_t codes[HCQ_PRIO_MAX_CODES];
+};
+
+struct hcq_ring {
+    uint32_t magic;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t data_size;
+    uint64_t size;
+    uint64_t slot_offset;
+
+    /* Free slot stack: ABA tag in the high 32 bits, slot index in the low 32 bits */
+    uint64_t free_head __attribute__((aligned(HCQ_CACHE_LINE)));
+
+    struct hcq_ring_lane  lanes[HCQ_NUM_PRIOS];
+
+    struct hcq_prio_codes prio_codes __attribute__((aligned(HCQ_CACHE_LINE)));
+    struct hcq_stats      stats      __attribute__((aligned(HCQ_CACHE_LINE)));
+
+    /* num_slots cells per lane */
+    struct hcq_ring_cell  cells[0]   __attribute__((aligned(HCQ_CACHE_LINE)));
+};
+
+
+/* 
+ * Large payload buffer
+ *
+ * Each client can export one buffer as a segment of its own, whose segid
+ * travels with its commands. The client creates it the first time a payload 
+ * exceeds its threshold (on the ring backend, where a return larger than a slot
+ * has nowhere else to go, with its first command), and the server attaches it 
+ * the first time a command needs it. Payloads above the threshold are copied 
+ * there instead of into the queue, so large transfers never fragment the queue
+ * segment. The buffer holds one command payload and one return payload, and 
+ * belongs to a single outstanding command at a time. Commands issued while it 
+ * is busy fall back to carrying their payloads inline.
+ */
+#define HCQ_BULK_MAGIC            0x48435142    /* "HCQB" */
+#define HCQ_BULK_CLAIMED          ((hcq_cmd_t)-2)
+
+struct hcq_bulk {
+    uint32_t magic;
+    uint32_t threshold;
+    uint64_t size;
+    uint64_t data_size;
+} __attribute__((aligned(HCQ_CACHE_LINE)));
+
+/* Server side state of a client connection */
+struct hcq_conn {
+    xemem_apid_t      apid;
+    xemem_apid_t      bulk_apid;
+    struct hcq_bulk * bulk;
+
+    /* Commands dequeued but not yet returned. A closed connection (the client 
+     * disconnected or can no longer be signalled) is freed once they are done, 
+     * since their handlers may still be using the large payload buffer.
+     */
+    uint32_t          active;
+    int               closed;
+};
+
+
+/* Registered command handler */
+struct hcq_handler {
+    hcq_cmd_fn      fn;
+    hcq_cmd_class_t cmd_class;
+};
+
+/* Commands handed to a worker pool by hcq_dispatch_cmd() */
+struct hcq_work {
+    hcq_cmd_t         cmd;
+    hcq_cmd_fn        fn;
+    struct hcq_work * next;
+};
+
+struct hcq_worker_pool {
+    hcq_handle_t      hcq;
+
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;
+    struct hcq_work * head;
+    struct hcq_work * tail;
+    int               stop;
+
+    uint32_t          num_threads;
+    pthread_t         threads[0];
+};
 
 
 typedef enum {
@@ -71,9 +288,25 @@ struct server_cmd_queue {
     struct hashtable * cmd_handlers;
 
     /* hashtable of client connections 
-     * (maps client segid to server-attached apid)
+     * (maps client segid to a struct hcq_conn)
      */
     struct hashtable * connections;
+
+    /* hashtable of return payloads staged by hcq_ret_reserve() (DB backend only) */
+    struct hashtable * ret_staging;
+
+    /* Protects connections and ret_staging against concurrent handlers */
+    pthread_mutex_t    lock;
+
+    /* Worker pools started by hcq_start_workers() (NULL = run handlers inline) */
+    struct hcq_worker_pool * serial_pool;
+    struct hcq_worker_pool * parallel_pool;
+
+    /* High priority commands dequeued in a row while normal ones were waiting */
+    uint32_t           hi_streak;
+
+    /* Next check for clients that went away without disconnecting (0 = not scheduled) */
+    uint64_t           next_sweep_tsc;
 };
 
 struct client_cmd_queue {
@@ -85,16 +318,54 @@ struct client_cmd_queue {
 
     /* fd to poll for command responses */
     int                fd;
+
+    /* hashtable of command payloads staged by hcq_cmd_reserve() (DB backend only) */
+    struct hashtable * reservations;
+    uint64_t           next_reservation;
+
+    /* Spin budget before hcq_cmd_wait() blocks on fd (0 = always block) */
+    uint32_t              spin_us;
+    struct hcq_wait_stats wait_stats;
+
+    /* Large payload buffer (NULL until a payload needs it, never created if 
+     * bulk_size is 0), its segid, and the command currently using it 
+     */
+    struct hcq_bulk     * bulk;
+    xemem_segid_t         bulk_segid;
+    uint64_t              bulk_size;
+    uint32_t              bulk_threshold;
+    volatile hcq_cmd_t    bulk_owner;
+
+    /* A return above the threshold came back inline, so the next command creates the buffer */
+    volatile int          bulk_wanted;
+
+    /* The owner was cancelled while the server still held it, so the buffer 
+     * stays busy until the server frees the command 
+     */
+    volatile int          bulk_orphaned;
 };
 
 
 struct cmd_queue {
-    hcq_type_t type; 
+    hcq_type_t    type; 
+    hcq_backend_t backend;
 
     /* Database memory mappings */
     void  * db_addr;
     void  * db;
 
+    /* Hash index on (type, cmd ID), DB backend only */
+    wg_int  cmd_index;
+
+    /* Ring mapping (same address as db_addr, ring backend only) */
+    struct hcq_ring * ring;
+
+    /* Instrumentation counters in the shared segment (NULL if the queue has none) */
+    struct hcq_stats * stats;
+
+    /* High priority code table in the shared segment (NULL if the queue has none) */
+    struct hcq_prio_codes * prio_codes;
+
     union {
 	struct server_cmd_queue server;
 	struct client_cmd_queue client;
@@ -102,6 +373,11 @@ struct cmd_queue {
 };
 
 
+static hcq_cmd_t __cmd_submit(struct cmd_queue * cq, uint64_t cmd_code, uint32_t data_size, 
+			      void * data, uint32_t flags, uint64_t deadline_tsc);
+static void      __bulk_reclaim(struct cmd_queue * cq);
+
+
 static uint32_t
 handler_hash_fn(uintptr_t key)
 {
@@ -116,456 +392,3129 @@ handler_eq_fn(uintptr_t key1,
 }
 
 
+/* 
+ * Payload staging for the DB backend: WhiteDB interns blobs, so a reserved
+ * payload cannot live in the database until it is committed. Payloads 
+ * reserved in a large payload buffer (flags) only record their size here.
+ */
+struct hcq_staged_data {
+    uint64_t cmd_code;
+    uint32_t data_size;
+    uint32_t flags;
+    uint8_t  data[0];
+};
 
-
-static int
-init_cmd_queue(struct cmd_queue * cq) 
+static void *
+__stage_data(struct hashtable ** staging,
+	     uintptr_t           key,
+	     uint64_t            cmd_code,
+	     uint32_t            data_size,
+	     uint32_t            flags)
 {
-    void * rec = NULL;
-    void * db  = cq->db;
+    struct hcq_staged_data * stage      = NULL;
+    uint32_t                 alloc_size = data_size;
 
-    /* Create Header */
-    rec = wg_create_record(cq->db, 4);
-    wg_set_field(db, rec, HCQ_TYPE_FIELD,             wg_encode_int(db, HCQ_HEADER_TYPE));
-    wg_set_field(db, rec, HCQ_HDR_FIELD_NEXT_AVAIL,   wg_encode_int(db, 0));
-    wg_set_field(db, rec, HCQ_HDR_FIELD_PENDING,      wg_encode_int(db, 0));
-    wg_set_field(db, rec, HCQ_HDR_FIELD_OUTSTANDING,  wg_encode_int(db, 0));
+    if (*staging == NULL) {
+	*staging = pet_create_htable(0, handler_hash_fn, handler_eq_fn);
 
-    return 0;
+	if (*staging == NULL) {
+	    ERROR("Could not create payload staging hashtable\n");
+	    return NULL;
+	}
+    }
+
+    if (flags & (HCQ_CMD_FLAG_BULK_CMD | HCQ_CMD_FLAG_BULK_RET)) {
+	alloc_size = 0;
+    }
+
+    stage = calloc(sizeof(struct hcq_staged_data) + alloc_size, 1);
+
+    if (stage == NULL) {
+	ERROR("Could not allocate payload staging buffer (size=%u)\n", data_size);
+	return NULL;
+    }
+
+    stage->cmd_code  = cmd_code;
+    stage->data_size = data_size;
+    stage->flags     = flags;
+
+    if (pet_htable_insert(*staging, key, (uintptr_t)stage) == 0) {
+	ERROR("Could not insert staged payload into hashtable\n");
+	free(stage);
+	return NULL;
+    }
+
+    return stage->data;
 }
 
-static void *
-get_db_addr(void * db) {
-#ifdef USE_DATABASE_HANDLE
-   return ((db_handle *)db)->db;
-#else
-    return db;
-#endif
+static struct hcq_staged_data *
+__unstage_data(struct hashtable * staging,
+	       uintptr_t          key)
+{
+    if (staging == NULL) {
+	return NULL;
+    }
+
+    return (struct hcq_staged_data *)pet_htable_remove(staging, key, 0);
 }
 
 
-xemem_segid_t
-hcq_get_segid(hcq_handle_t hcq)
+
+
+/* 
+ * Instrumentation 
+ */
+static inline uint64_t
+__rdtsc(void)
 {
-    struct cmd_queue * cq = hcq;
+    uint32_t lo = 0;
+    uint32_t hi = 0;
 
-    if (cq->type != HCQ_SERVER)
-	return XEMEM_INVALID_SEGID;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
 
-    return cq->server.segid;
+    return ((uint64_t)hi << 32) | lo;
 }
 
-int
-hcq_get_fd(hcq_handle_t hcq)
+/* 
+ * Deadlines are TSC values, so that the server can check them against its own 
+ * clock. Relative timeouts are converted with a rate measured once per process.
+ */
+static double         tsc_per_us     = 0;
+static pthread_once_t tsc_calibrated = PTHREAD_ONCE_INIT;
+
+static void
+__calibrate_tsc(void)
 {
-    struct cmd_queue * cq = hcq;
+    struct timespec start_ts;
+    struct timespec now_ts;
+    uint64_t        start_tsc = 0;
+    uint64_t        nsecs     = 0;
 
-    if (cq->type == HCQ_SERVER)
-	return cq->server.fd;
-    else if (cq->type == HCQ_CLIENT)
-	return cq->client.fd;
-    else
-	return -1;
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+    start_tsc = __rdtsc();
+
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &now_ts);
+	nsecs = ((now_ts.tv_sec - start_ts.tv_sec) * 1000000000ULL) + now_ts.tv_nsec - start_ts.tv_nsec;
+    } while (nsecs < 1000000);
+
+    tsc_per_us = ((double)(__rdtsc() - start_tsc) * 1000.0) / nsecs;
 }
 
-hcq_handle_t
-hcq_create_queue(char * name) 
+static uint64_t
+__deadline_tsc(uint64_t timeout_us)
 {
-    struct cmd_queue * cq     = NULL;
-    struct hashtable * cmd_ht = NULL;
-    struct hashtable * seg_ht = NULL;
-    xemem_segid_t      segid  = 0;
+    pthread_once(&tsc_calibrated, __calibrate_tsc);
 
-    void * db_addr = NULL;
-    void * db      = NULL;
-    int    fd      = 0;
+    return __rdtsc() + (uint64_t)(timeout_us * tsc_per_us);
+}
+
+static inline int
+__deadline_passed(uint64_t deadline_tsc)
+{
+    return ((deadline_tsc != 0) && ((int64_t)(__rdtsc() - deadline_tsc) > 0));
+}
 
+static void
+__init_stats(struct hcq_stats * stats)
+{
+    uint32_t i = 0;
 
-    db = wg_attach_local_database(CMD_QUEUE_SIZE);
+    memset(stats, 0, sizeof(struct hcq_stats));
 
-    if (db == NULL) {
-	ERROR("Could not create database\n");
-	return HCQ_INVALID_HANDLE;
+    for (i = 0; i < HCQ_STATS_MAX_CODES - 1; i++) {
+	stats->codes[i].cmd_code = HCQ_STATS_UNUSED_CODE;
     }
 
+    stats->codes[HCQ_STATS_MAX_CODES - 1].cmd_code = HCQ_STATS_OTHER_CODES;
+}
 
-    db_addr = get_db_addr(db);
+/* Find (or claim) the entry of a command code */
+static struct hcq_code_stats *
+__stats_code(struct hcq_stats * stats,
+	     uint64_t           cmd_code)
+{
+    uint32_t i = 0;
 
-    /* Create the signallable segid */
-    segid = xemem_make_signalled(db_addr, CMD_QUEUE_SIZE,
-				 name, &fd);
+    for (i = 0; i < HCQ_STATS_MAX_CODES - 1; i++) {
+	uint64_t code = *(volatile uint64_t *)&(stats->codes[i].cmd_code);
 
-    if (segid <= 0) {
-        ERROR("Could not register XEMEM segment for command queue\n");
-	goto segid_out;
-    }
+	if (code == cmd_code) {
+	    return &(stats->codes[i]);
+	}
 
-    /* Create the htable of handlers */
-    cmd_ht = pet_create_htable(0, handler_hash_fn, handler_eq_fn);
+	if ((code == HCQ_STATS_UNUSED_CODE) &&
+	    (__sync_bool_compare_and_swap(&(stats->codes[i].cmd_code), HCQ_STATS_UNUSED_CODE, cmd_code))) {
+	    return &(stats->codes[i]);
+	}
 
-    if (cmd_ht == NULL) {
-	ERROR("Could not create hcq command hashtable\n");
-	goto cmd_ht_out;
+	/* Lost a race for this entry, it may have gone to the same code */
+	if (*(volatile uint64_t *)&(stats->codes[i].cmd_code) == cmd_code) {
+	    return &(stats->codes[i]);
+	}
     }
 
-    /* Create the htable of segids */
-    seg_ht = pet_create_htable(0, handler_hash_fn, handler_eq_fn);
+    return &(stats->codes[HCQ_STATS_MAX_CODES - 1]);
+}
 
-    if (seg_ht == NULL) {
-	ERROR("Could not create hcq connection hashtable\n");
-	goto seg_ht_out;
+static void
+__stats_hist(uint64_t * hist,
+	     uint64_t   start_tsc)
+{
+    uint64_t cycles = __rdtsc() - start_tsc;
+    uint32_t bucket = 0;
+
+    if ((int64_t)cycles > 0) {
+	bucket = 63 - __builtin_clzll(cycles);
     }
-    
-    cq = calloc(sizeof(struct cmd_queue), 1);
-    if (!cq) {
-	ERROR("Could not calloc command queue\n");
-	goto cq_out;
+
+    if (bucket >= HCQ_STATS_HIST_BUCKETS) {
+	bucket = HCQ_STATS_HIST_BUCKETS - 1;
     }
 
-    cq->type    = HCQ_SERVER;
-    cq->db_addr = db_addr;
-    cq->db      = db;
+    __sync_fetch_and_add(&(hist[bucket]), 1);
+}
 
-    cq->server.segid        = segid;
-    cq->server.fd	    = fd;
-    cq->server.cmd_handlers = cmd_ht;
-    cq->server.connections  = seg_ht;
+static void
+__stats_issued(struct cmd_queue * cq)
+{
+    struct hcq_stats * stats = cq->stats;
+    uint64_t           depth = 0;
+    uint64_t           max   = 0;
 
-    init_cmd_queue(cq);
+    if (stats == NULL) {
+	return;
+    }
 
-    return cq;
+    __sync_fetch_and_add(&(stats->issued), 1);
 
-cq_out:
-    pet_free_htable(seg_ht, 0, 0);
+    depth = __sync_add_and_fetch(&(stats->depth), 1);
 
-seg_ht_out:
-    pet_free_htable(cmd_ht, 0, 0);
+    do {
+	max = *(volatile uint64_t *)&(stats->max_depth);
+    } while ((depth > max) && 
+	     (!__sync_bool_compare_and_swap(&(stats->max_depth), max, depth)));
+}
 
-cmd_ht_out:
-    xemem_remove(segid);
+static void
+__stats_completed(struct cmd_queue * cq,
+		  int                returned)
+{
+    struct hcq_stats * stats = cq->stats;
 
-segid_out:
-    wg_delete_local_database(db);
+    if (stats == NULL) {
+	return;
+    }
 
-    return HCQ_INVALID_HANDLE;
+    __sync_fetch_and_add(&(stats->completed), 1);
+    __sync_fetch_and_sub(&(stats->depth),     1);
+
+    if (!returned) {
+	__sync_fetch_and_add(&(stats->abandoned), 1);
+    }
 }
 
+/* The server skipped a command whose deadline had passed */
+static void
+__stats_expired(struct cmd_queue * cq)
+{
+    if (cq->stats == NULL) {
+	return;
+    }
 
-void 
-hcq_free_queue(hcq_handle_t hcq)
+    __sync_fetch_and_add(&(cq->stats->expired), 1);
+}
+
+/* The server dequeued a command */
+static void
+__stats_started(struct cmd_queue * cq,
+		uint64_t           cmd_code,
+		uint64_t           issue_tsc)
 {
-    struct cmd_queue * cq = hcq;
+    if (cq->stats == NULL) {
+	return;
+    }
 
-    if (cq->type != HCQ_SERVER) {
-	ERROR("Only server can free HCQs\n");
+    __stats_hist(__stats_code(cq->stats, cmd_code)->wait_hist, issue_tsc);
+}
+
+/* The server returned a command */
+static void
+__stats_returned(struct cmd_queue * cq,
+		 uint64_t           cmd_code,
+		 uint64_t           start_tsc)
+{
+    struct hcq_code_stats * code = NULL;
+
+    if (cq->stats == NULL) {
 	return;
     }
 
-    wg_delete_local_database(cq->db);
+    code = __stats_code(cq->stats, cmd_code);
 
-    close(cq->server.fd);
-    xemem_remove(cq->server.segid);
+    __sync_fetch_and_add(&(code->returned), 1);
+    __stats_hist(code->service_hist, start_tsc);
+}
+
+
+static int
+init_cmd_queue(struct cmd_queue * cq) 
+{
+    void * rec       = NULL;
+    void * db        = cq->db;
+    gint   stats_off = 0;
+    gint   prio_off  = 0;
 
-    /* Remove all apids from the connection table */
+    /* Hash index on (type, cmd ID), so command lookups do not scan the queue */
     {
-	struct hashtable_iter * iter = NULL;
+	wg_int cols[2] = {HCQ_TYPE_FIELD, HCQ_CMD_FIELD_ID};
 
-	iter = pet_htable_create_iter(cq->server.connections);
-	if (iter == NULL) {
-	    ERROR("Could not create connections table iterator\n");
-	    goto out;
+	/* wg_create_multi_index() returns 0 on success, not the index ID */
+	if (wg_create_multi_index(db, cols, 2, WG_INDEX_TYPE_HASH, NULL, 0) == -1) {
+	    ERROR("Could not create command index\n");
+	    return -1;
 	}
 
-	do {
-	    xemem_apid_t apid = (xemem_apid_t)pet_htable_get_iter_value(iter);
-	    xemem_release(apid);
-	} while (pet_htable_iter_remove(iter, 0) != 0);
-
-	pet_htable_free_iter(iter);
+	cq->cmd_index = wg_multi_column_to_index_id(db, cols, 2, WG_INDEX_TYPE_HASH, NULL, 0);
     }
 
-out:
-    pet_free_htable(cq->server.connections, 0, 0);
+    /* Instrumentation counters live in raw memory of the string area, 
+     * which WhiteDB never scans for records 
+     */
+    stats_off = wg_alloc_gints(db, &(dbmemsegh(db)->longstr_area_header), 
+			       1 + (sizeof(struct hcq_stats) + sizeof(gint) - 1) / sizeof(gint));
 
-    pet_free_htable(cq->server.cmd_handlers, 0, 0);
+    if (stats_off == 0) {
+	ERROR("Could not allocate command queue statistics\n");
+	return -1;
+    }
 
-    free(cq);
+    /* Skip the object length that WhiteDB keeps in the first gint */
+    stats_off += sizeof(gint);
 
-    return;
-}
+    cq->stats = offsettoptr(db, stats_off);
+    __init_stats(cq->stats);
 
-int
-hcq_register_cmd(hcq_handle_t hcq,
-		 uint64_t     cmd_code,
-		 hcq_cmd_fn   handler_fn)
-{
-    struct cmd_queue * cq = hcq;
+    prio_off = wg_alloc_gints(db, &(dbmemsegh(db)->longstr_area_header), 
+			      1 + (sizeof(struct hcq_prio_codes) + sizeof(gint) - 1) / sizeof(gint));
 
-    if (cq->type != HCQ_SERVER) {
-	ERROR("Only the server can register an HCQ command\n");
+    if (prio_off == 0) {
+	ERROR("Could not allocate command priority table\n");
 	return -1;
     }
 
-    if (pet_htable_search(cq->server.cmd_handlers, cmd_code) != 0) {
-	ERROR("Attempted to register duplicate command handler (cmd=%lu)\n", cmd_code);
-	return -1;
-    }
+    prio_off += sizeof(gint);
 
-    if (pet_htable_insert(cq->server.cmd_handlers, cmd_code, (uintptr_t)handler_fn) == 0) {
-	ERROR("Could not register hcq command (cmd=%lu)\n", cmd_code);
-	return -1;
-    }
+    cq->prio_codes = offsettoptr(db, prio_off);
+    memset(cq->prio_codes, 0, sizeof(struct hcq_prio_codes));
+
+    /* Create Header */
+    rec = wg_create_record(cq->db, HCQ_HDR_REC_LEN);
+    wg_set_field(db, rec, HCQ_TYPE_FIELD,             wg_encode_int(db, HCQ_HEADER_TYPE));
+    wg_set_field(db, rec, HCQ_HDR_FIELD_NEXT_AVAIL,   wg_encode_int(db, 0));
+    wg_set_field(db, rec, HCQ_HDR_FIELD_PENDING,      wg_encode_int(db, 0));
+    wg_set_field(db, rec, HCQ_HDR_FIELD_OUTSTANDING,  wg_encode_int(db, 0));
+    wg_set_field(db, rec, HCQ_HDR_FIELD_STATS,        wg_encode_int(db, stats_off));
+    wg_set_field(db, rec, HCQ_HDR_FIELD_PRIO_CODES,   wg_encode_int(db, prio_off));
+    wg_set_field(db, rec, HCQ_HDR_FIELD_HI_NEXT,      wg_encode_int(db, 0));
+    wg_set_field(db, rec, HCQ_HDR_FIELD_HI_PENDING,   wg_encode_int(db, 0));
+    wg_set_field(db, rec, HCQ_HDR_FIELD_HI_OUTSTAND,  wg_encode_int(db, 0));
 
     return 0;
 }
 
-hcq_cmd_fn
-hcq_get_cmd_handler(hcq_handle_t hcq,
-		    hcq_cmd_t    cmd)
+static void *
+get_db_addr(void * db) {
+#ifdef USE_DATABASE_HANDLE
+   return ((db_handle *)db)->db;
+#else
+    return db;
+#endif
+}
+
+/* Size recorded in the header of a command queue or large payload buffer */
+static uint64_t
+__segment_size(void * hdr)
 {
-    struct cmd_queue * cq = hcq;
+    uint32_t magic = *(volatile uint32_t *)hdr;
 
-    if (cq->type != HCQ_SERVER) {
-	ERROR("Only the server can access command handlers\n");
+    if (magic == HCQ_RING_MAGIC) {
+	return ((struct hcq_ring *)hdr)->size;
+    } else if (magic == HCQ_BULK_MAGIC) {
+	return ((struct hcq_bulk *)hdr)->size;
+    }
+
+    return ((db_memsegment_header *)hdr)->size;
+}
+
+/* Attach a segment whose size is only known from its header */
+static void *
+__attach_segment(xemem_apid_t   apid,
+		 uint64_t     * size)
+{
+    struct xemem_addr   addr;
+    void              * hdr  = NULL;
+    void              * seg  = NULL;
+
+    addr.apid   = apid;
+    addr.offset = 0;
+
+    hdr = xemem_attach(addr, HCQ_PROBE_SIZE, NULL);
+
+    if (hdr == MAP_FAILED) {
+	ERROR("Failed to attach segment header\n");
 	return NULL;
     }
 
-    return (hcq_cmd_fn)pet_htable_search(cq->server.cmd_handlers, (uintptr_t)hcq_get_cmd_code(hcq, cmd));
+    *size = __segment_size(hdr);
+
+    xemem_detach(hdr);
+
+    if (*size < HCQ_PROBE_SIZE) {
+	ERROR("Invalid segment size (%lu)\n", *size);
+	return NULL;
+    }
+
+    seg = xemem_attach(addr, *size, NULL);
+
+    if (seg == MAP_FAILED) {
+	ERROR("Failed to attach segment (size=%lu)\n", *size);
+	return NULL;
+    }
+
+    return seg;
 }
 
-hcq_handle_t
-hcq_connect(xemem_segid_t segid)
+
+static inline void *
+__bulk_cmd_data(struct hcq_bulk * bulk)
 {
-    struct cmd_queue * cq      = NULL;
-    xemem_apid_t       apid    = 0;
-    void             * db_addr = NULL;
-    void             * db      = NULL;
+    return (void *)(bulk + 1);
+}
 
-    xemem_segid_t client_segid = 0;
-    int           client_fd    = 0;
+static inline void *
+__bulk_ret_data(struct hcq_bulk * bulk)
+{
+    return (void *)((uintptr_t)(bulk + 1) + bulk->data_size);
+}
 
-    struct xemem_addr addr;
-    
-//    printf("HCQ SEGID = %ld\n", segid);
+/* Whether a payload of data_size bytes should go through the large payload buffer */
+static int
+__use_bulk(struct cmd_queue * cq,
+	   struct hcq_bulk  * bulk,
+	   uint32_t           data_size)
+{
+    if ((bulk == NULL) || (data_size > bulk->data_size)) {
+	return 0;
+    }
 
-    client_segid = xemem_make_signalled(NULL, 0, NULL, &client_fd);
-    
-    if (client_segid <= 0) {
-	ERROR("Could not create client signal segid\n");
-	goto out_xemem_make;
+    if (data_size > bulk->threshold) {
+	return 1;
     }
 
-    apid = xemem_get(segid, XEMEM_RDWR);
-    
-    if (apid <= 0) {
-	ERROR("Failed to get APID for command queue\n");
-	goto out_xemem_get;
+    /* Ring slots cannot hold anything larger than their data area */
+    return ((cq->backend == HCQ_BACKEND_RING) && (data_size > cq->ring->data_size));
+}
+
+
+static inline struct hcq_slot *
+__ring_slot(struct hcq_ring * ring,
+	    uint32_t          idx)
+{
+    return (struct hcq_slot *)((uintptr_t)ring + ring->slot_offset + ((uint64_t)idx * ring->slot_size));
+}
+
+static inline void *
+__ring_cmd_data(struct hcq_ring * ring,
+		struct hcq_slot * slot)
+{
+    return (void *)(slot + 1);
+}
+
+static inline void *
+__ring_ret_data(struct hcq_ring * ring,
+		struct hcq_slot * slot)
+{
+    return (void *)((uintptr_t)(slot + 1) + ring->data_size);
+}
+
+static int
+init_cmd_ring(struct cmd_queue * cq,
+	      uint64_t           size)
+{
+    struct hcq_ring * ring      = cq->ring;
+    uint64_t          num_slots = 0;
+    uint32_t          i         = 0;
+
+    num_slots = (size - sizeof(struct hcq_ring) - HCQ_CACHE_LINE) / 
+	(HCQ_RING_SLOT_SIZE + (HCQ_NUM_PRIOS * sizeof(struct hcq_ring_cell)));
+
+    if (num_slots == 0) {
+	ERROR("Command queue too small for ring backend (size=%lu)\n", size);
+	return -1;
     }
 
-    addr.apid   = apid;
-    addr.offset = 0;
+    ring->num_slots   = num_slots;
+    ring->size        = size;
+    ring->slot_size   = HCQ_RING_SLOT_SIZE;
+    ring->data_size   = (HCQ_RING_SLOT_SIZE - sizeof(struct hcq_slot)) / 2;
+    ring->slot_offset = sizeof(struct hcq_ring) + (HCQ_NUM_PRIOS * num_slots * sizeof(struct hcq_ring_cell));
+    ring->slot_offset = (ring->slot_offset + HCQ_CACHE_LINE - 1) & ~((uint64_t)HCQ_CACHE_LINE - 1);
 
-    db_addr = xemem_attach(addr, CMD_QUEUE_SIZE, NULL);
+    for (i = 0; i < num_slots; i++) {
+	struct hcq_slot * slot = __ring_slot(ring, i);
 
-    if (db_addr == MAP_FAILED) {
-	ERROR("Failed to attach to command queue\n");
-	goto out_xemem_attach;
+	slot->cmd_id    = HCQ_RING_CMD_ID(0, i);
+	slot->gen       = 0;
+	slot->status    = HCQ_RING_SLOT_FREE;
+	slot->next_free = (i + 1 < num_slots) ? (i + 1) : HCQ_RING_NIL;
     }
 
+    for (i = 0; i < HCQ_NUM_PRIOS * num_slots; i++) {
+	ring->cells[i].seq  = i % num_slots;
+	ring->cells[i].slot = HCQ_RING_NIL;
+    }
 
-    db = wg_attach_existing_local_database(db_addr);
+    ring->free_head = 0;
 
-    if (db == NULL) {
-	ERROR("Failed to attach command queue database\n");
-	goto out_db_attach;
+    for (i = 0; i < HCQ_NUM_PRIOS; i++) {
+	ring->lanes[i].head = 0;
+	ring->lanes[i].tail = 0;
     }
 
+    cq->stats = &(ring->stats);
+    __init_stats(cq->stats);
 
-    cq = calloc(sizeof(struct cmd_queue), 1);
+    cq->prio_codes = &(ring->prio_codes);
+    memset(cq->prio_codes, 0, sizeof(struct hcq_prio_codes));
 
-    cq->type    = HCQ_CLIENT;
-    cq->db_addr = db_addr;
-    cq->db      = db;
+    /* Publish the ring to clients last */
+    __sync_synchronize();
+    ring->magic     = HCQ_RING_MAGIC;
+
+    return 0;
+}
 
-    cq->client.fd    = client_fd;
-    cq->client.apid  = apid;
-    cq->client.segid = client_segid;
+/* Pop a slot off of the free stack, NULL if every slot is in use */
+static struct hcq_slot *
+__ring_alloc_slot(struct hcq_ring * ring)
+{
+    struct hcq_slot * slot     = NULL;
+    uint64_t          old_head = 0;
+    uint64_t          new_head = 0;
+    uint32_t          idx      = 0;
 
-    return cq;
+    do {
+	old_head = *(volatile uint64_t *)&(ring->free_head);
+	idx      = (uint32_t)old_head;
 
-out_db_attach:
-    xemem_detach(db_addr);
+	if (idx == HCQ_RING_NIL) {
+	    return NULL;
+	}
 
-out_xemem_attach:
-    xemem_release(apid);
+	slot     = __ring_slot(ring, idx);
+	new_head = HCQ_RING_CMD_ID((old_head >> 32) + 1, *(volatile uint32_t *)&(slot->next_free));
+    } while (!__sync_bool_compare_and_swap(&(ring->free_head), old_head, new_head));
 
-out_xemem_get:
-    xemem_remove(client_segid);
+    return slot;
+}
 
-out_xemem_make:
-    return HCQ_INVALID_HANDLE;
+static void
+__ring_free_slot(struct hcq_ring * ring,
+		 struct hcq_slot * slot)
+{
+    uint32_t idx      = HCQ_RING_CMD_IDX(slot->cmd_id);
+    uint64_t old_head = 0;
+    uint64_t new_head = 0;
+
+    slot->status = HCQ_RING_SLOT_FREE;
+
+    do {
+	old_head        = *(volatile uint64_t *)&(ring->free_head);
+	slot->next_free = (uint32_t)old_head;
+	new_head        = HCQ_RING_CMD_ID((old_head >> 32) + 1, idx);
+    } while (!__sync_bool_compare_and_swap(&(ring->free_head), old_head, new_head));
 }
 
+/* Cells of a priority lane's submission ring */
+static inline struct hcq_ring_cell *
+__ring_lane_cells(struct hcq_ring * ring,
+		  hcq_prio_t        prio)
+{
+    return &(ring->cells[prio * ring->num_slots]);
+}
 
-void
-hcq_disconnect(hcq_handle_t hcq)
+/* Append a slot to a lane's submission ring. 
+ * Each lane has one cell per slot, so it can never fill up. 
+ */
+static void
+__ring_push(struct hcq_ring * ring,
+	    hcq_prio_t        prio,
+	    uint32_t          idx)
 {
-    struct cmd_queue * cq = hcq;
+    struct hcq_ring_lane * lane  = &(ring->lanes[prio]);
+    struct hcq_ring_cell * cells = __ring_lane_cells(ring, prio);
+    struct hcq_ring_cell * cell  = NULL;
+    uint64_t               pos   = 0;
 
-    if (cq->type != HCQ_CLIENT) {
-	ERROR("Only clients can disconnect an HCQ\n");
-	return;
+    while (1) {
+	pos  = *(volatile uint64_t *)&(lane->tail);
+	cell = &(cells[pos % ring->num_slots]);
+
+	if ((*(volatile uint64_t *)&(cell->seq) == pos) &&
+	    (__sync_bool_compare_and_swap(&(lane->tail), pos, pos + 1))) {
+	    break;
+	}
     }
 
-    wg_detach_local_database(cq->db);
+    cell->slot = idx;
+    __sync_synchronize();
+    cell->seq  = pos + 1;
+}
 
-    xemem_detach(cq->db_addr);
+/* Remove the oldest slot from a lane's submission ring, HCQ_RING_NIL if it is empty */
+static uint32_t
+__ring_pop(struct hcq_ring * ring,
+	   hcq_prio_t        prio)
+{
+    struct hcq_ring_lane * lane  = &(ring->lanes[prio]);
+    struct hcq_ring_cell * cells = __ring_lane_cells(ring, prio);
+    struct hcq_ring_cell * cell  = NULL;
+    uint64_t               pos   = 0;
+    uint64_t               seq   = 0;
+    uint32_t               idx   = 0;
 
-    xemem_release(cq->client.apid);
+    while (1) {
+	pos  = *(volatile uint64_t *)&(lane->head);
+	cell = &(cells[pos % ring->num_slots]);
+	seq  = *(volatile uint64_t *)&(cell->seq);
 
-    close(cq->client.fd);
-    xemem_remove(cq->client.segid);
+	if ((int64_t)(seq - (pos + 1)) < 0) {
+	    return HCQ_RING_NIL;
+	}
 
-    free(cq);
+	if ((seq == pos + 1) && 
+	    (__sync_bool_compare_and_swap(&(lane->head), pos, pos + 1))) {
+	    break;
+	}
+    }
 
-    return;
+    idx = cell->slot;
+    __sync_synchronize();
+    cell->seq = pos + ring->num_slots;
+
+    return idx;
 }
 
-static void * 
-__get_cmd_rec(struct cmd_queue * cq, 
-	      hcq_cmd_t          cmd)
+/* Whether a lane may have queued slots (a push may still be in progress) */
+static inline int
+__ring_lane_busy(struct hcq_ring * ring,
+		 hcq_prio_t        prio)
 {
-    void        * cmd_rec  = NULL;
-    wg_query    * query    = NULL;
-    wg_query_arg  arglist[2];
-
-    arglist[0].column = HCQ_TYPE_FIELD;
-    arglist[0].cond   = WG_COND_EQUAL;
-    arglist[0].value  = wg_encode_query_param_int(cq->db, HCQ_CMD_TYPE);    
+    struct hcq_ring_lane * lane = &(ring->lanes[prio]);
 
-    arglist[1].column = HCQ_CMD_FIELD_ID;
-    arglist[1].cond   = WG_COND_EQUAL;
-    arglist[1].value  = wg_encode_query_param_int(cq->db, cmd);
+    return (*(volatile uint64_t *)&(lane->tail) != *(volatile uint64_t *)&(lane->head));
+}
 
-    query   = wg_make_query(cq->db, NULL, 0, arglist, 2);
+static struct hcq_slot *
+__ring_get_slot(struct cmd_queue * cq,
+		hcq_cmd_t          cmd)
+{
+    struct hcq_ring * ring = cq->ring;
+    struct hcq_slot * slot = NULL;
 
-    cmd_rec = wg_fetch(cq->db, query);
+    if ((cmd == HCQ_INVALID_CMD) || 
+	(HCQ_RING_CMD_IDX(cmd) >= ring->num_slots)) {
+	return NULL;
+    }
 
-    wg_free_query(cq->db, query);
-    wg_free_query_param(cq->db, arglist[0].value);
-    wg_free_query_param(cq->db, arglist[1].value);
+    slot = __ring_slot(ring, HCQ_RING_CMD_IDX(cmd));
 
-    return cmd_rec;
+    if ((*(volatile uint64_t *)&(slot->cmd_id) != cmd) ||
+	(*(volatile uint32_t *)&(slot->status) == HCQ_RING_SLOT_FREE)) {
+	return NULL;
+    }
 
+    return slot;
 }
 
 
+/* 
+ * Cancel the command in a slot if it is a pending or returned command of the client 
+ * segid. The status is only swapped if the generation read with it is unchanged, so 
+ * a slot that was freed and reused by another client in the meantime is left alone. 
+ * Returns the status the command was cancelled from, HCQ_RING_SLOT_FREE if none was.
+ */
+static uint32_t
+__ring_cancel_client_slot(struct hcq_slot * slot,
+			  xemem_segid_t     segid)
+{
+    union hcq_slot_state old_state;
+    union hcq_slot_state new_state;
+
+    do {
+	old_state.word = *(volatile uint64_t *)&(slot->state);
+
+	/* Uncommitted reservations are left alone, the slot may already be reused */
+	if ((old_state.status != HCQ_CMD_PENDING) && 
+	    (old_state.status != HCQ_CMD_RETURNED)) {
+	    return HCQ_RING_SLOT_FREE;
+	}
 
+	/* The segid is set before the command is queued, and kept until the slot is freed */
+	__sync_synchronize();
 
-static hcq_cmd_t
-__cmd_issue(struct cmd_queue * cq,
-	    uint64_t           cmd_code,
-	    uint32_t           data_size,
-	    void             * data)
+	if (*(volatile int64_t *)&(slot->segid) != segid) {
+	    return HCQ_RING_SLOT_FREE;
+	}
+
+	new_state        = old_state;
+	new_state.status = HCQ_CMD_CANCELLED;
+    } while (!__sync_bool_compare_and_swap(&(slot->state), old_state.word, new_state.word));
+
+    return old_state.status;
+}
+
+
+/* Look up (or open) the connection to a client. Called with server.lock held */
+static struct hcq_conn *
+__get_conn(struct cmd_queue * cq,
+	   xemem_segid_t      segid)
 {
-    void     * db      = cq->db;
-    void     * hdr_rec = NULL;
-    void     * cmd_rec = NULL;
-    hcq_cmd_t  cmd_id  = HCQ_INVALID_CMD;
-    uint64_t   cmd_cnt = 0;
+    struct hcq_conn * conn = NULL;
+    xemem_apid_t      apid = 0;
 
-    if ((data_size > 0) && (data == NULL)) {
-	ERROR("NULL data pointer, but positive data size\n");
-	return HCQ_INVALID_CMD;
+    /* Query connections table for apid */
+    conn = (struct hcq_conn *)pet_htable_search(cq->server.connections, (uintptr_t)segid);
+
+    if (conn != NULL) {
+	return conn;
     }
 
+    /* Look it up now */
+    apid = xemem_get(segid, XEMEM_RDWR);
 
-    hdr_rec = wg_find_record_int(db, HCQ_TYPE_FIELD, WG_COND_EQUAL, HCQ_HEADER_TYPE, NULL);
-    
-    if (!hdr_rec) {
-	ERROR("malformed database. Missing Header\n");
-	return HCQ_INVALID_CMD;
+    if (apid == -1) {
+	ERROR("Could not find apid for HCQ client\n");
+	return NULL;
+    } 
+
+    conn = calloc(sizeof(struct hcq_conn), 1);
+
+    if (conn == NULL) {
+	ERROR("Could not allocate HCQ connection\n");
+	xemem_release(apid);
+	return NULL;
     }
 
-    /* Get CMD ID */
-    // grab + increment next_id
-    cmd_id  = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_FIELD_NEXT_AVAIL));
-    cmd_cnt = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_FIELD_OUTSTANDING));
+    conn->apid = apid;
 
-    /* Create Command */
-    cmd_rec = wg_create_record(db, 10);
+    /* Remember it for future commands issued from this client */
+    if (pet_htable_insert(cq->server.connections, (uintptr_t)segid, (uintptr_t)conn) == 0) {
+	ERROR("Could not update connections hashtable. This may result in a large "
+	      "performance penalty\n");
+	xemem_release(apid);
+	free(conn);
+	return NULL;
+    }
 
-    wg_set_field(db, cmd_rec, HCQ_TYPE_FIELD,             wg_encode_int(db, HCQ_CMD_TYPE));
-    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_ID,           wg_encode_int(db, cmd_id));
-    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_CMD_CODE,     wg_encode_int(db, cmd_code));
-    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_SEGID,        wg_encode_int(db, cq->client.segid));  
-    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_CMD_SIZE,     wg_encode_int(db, data_size));
+    return conn;
+}
 
-    if (data_size > 0) {
-	wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_CMD_DATA,     wg_encode_blob(db, data, NULL, data_size)); 
+static void
+__free_conn(struct hcq_conn * conn)
+{
+    if (conn->bulk) {
+	xemem_detach(conn->bulk);
     }
 
-    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_STATUS,       wg_encode_int(db, HCQ_CMD_PENDING)); 
+    if (conn->bulk_apid > 0) {
+	xemem_release(conn->bulk_apid);
+    }
 
-    /* Activate in queue */
-    wg_set_field(db, hdr_rec, HCQ_HDR_FIELD_NEXT_AVAIL,   wg_encode_int(db, cmd_id  + 1));
-    wg_set_field(db, hdr_rec, HCQ_HDR_FIELD_OUTSTANDING,  wg_encode_int(db, cmd_cnt + 1));
+    xemem_release(conn->apid);
+    free(conn);
+}
+
+/* Close the connection to a client, now or once its running commands are done. 
+ * Called with server.lock held 
+ */
+static void
+__drop_conn(struct cmd_queue * cq,
+	    xemem_segid_t      segid)
+{
+    struct hcq_conn * conn = NULL;
 
+    conn = (struct hcq_conn *)pet_htable_search(cq->server.connections, (uintptr_t)segid);
 
-    //printf("Signalling apid %lu\n", cq->apid);
+    if (conn == NULL) {
+	return;
+    }
 
-    xemem_signal(cq->client.apid);
+    if (conn->active > 0) {
+	conn->closed = 1;
+	return;
+    }
 
-    return cmd_id;
+    pet_htable_remove(cq->server.connections, (uintptr_t)segid, 0);
+    __free_conn(conn);
 }
 
+/* The server dequeued a command of the client */
+static void
+__conn_start(struct cmd_queue * cq,
+	     xemem_segid_t      segid)
+{
+    struct hcq_conn * conn = NULL;
+
+    if (segid == 0) 
+	return;
 
+    pthread_mutex_lock(&(cq->server.lock));
 
-hcq_cmd_t 
-hcq_cmd_issue(hcq_handle_t hcq, 
-	      uint64_t     cmd_code,
-	      uint32_t     data_size,
-	      void       * data)
+    conn = __get_conn(cq, segid);
+
+    if (conn) {
+	conn->active++;
+    }
+
+    pthread_mutex_unlock(&(cq->server.lock));
+}
+
+/* The server returned a command of the client */
+static void
+__conn_done(struct cmd_queue * cq,
+	    xemem_segid_t      segid)
 {
-    struct cmd_queue * cq  = hcq;
-    hcq_cmd_t          cmd = HCQ_INVALID_CMD;
+    struct hcq_conn * conn = NULL;
 
-    wg_int    lock_id;
+    if (segid == 0) 
+	return;
 
-    if (cq->type != HCQ_CLIENT) {
-	ERROR("Only clients can issue HCQ commands\n");
-	return HCQ_INVALID_CMD;
-    }
+    pthread_mutex_lock(&(cq->server.lock));
 
-    lock_id = wg_start_write(cq->db);
+    conn = (struct hcq_conn *)pet_htable_search(cq->server.connections, (uintptr_t)segid);
 
-    if (!lock_id) {
-	ERROR("Could not lock database\n");
-	return HCQ_INVALID_CMD;
-    }
+    if ((conn) && (conn->active > 0)) {
+	conn->active--;
 
-    cmd = __cmd_issue(cq, cmd_code, data_size, data);
-    
-    if (!wg_end_write(cq->db, lock_id)) {
-	ERROR("Apparently this is catastrophic...\n");
-	return HCQ_INVALID_CMD;
+	if (conn->closed) {
+	    __drop_conn(cq, segid);
+	}
     }
-    
-    /* poll for completion */
-    {
-	struct pollfd ufd = {cq->client.fd, POLLIN, 0};
 
-	while (hcq_get_cmd_status(hcq, cmd) != HCQ_CMD_RETURNED) {
-	    if (poll(&ufd, 1, -1) == -1) { 
-		ERROR("poll() error\n");
-	    } else {
-		xemem_ack(cq->client.fd);
+    pthread_mutex_unlock(&(cq->server.lock));
+}
+
+/* 
+ * Release the commands of a client that went away without disconnecting. Returned
+ * ones are freed, and pending ones are cancelled so the server frees them when it 
+ * dequeues or returns them. Called with the database write lock held (DB backend only)
+ */
+static void
+__reap_client_cmds(struct cmd_queue * cq,
+		   xemem_segid_t      segid)
+{
+    void     * db      = cq->db;
+    void     * cmd_rec = NULL;
+    void     * next    = NULL;
+    uint32_t   status  = 0;
+    uint32_t   i       = 0;
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	for (i = 0; i < cq->ring->num_slots; i++) {
+	    struct hcq_slot * slot = __ring_slot(cq->ring, i);
+
+	    status = __ring_cancel_client_slot(slot, segid);
+
+	    if (status == HCQ_CMD_PENDING) {
+		__stats_completed(cq, 0);
+	    } else if (status == HCQ_CMD_RETURNED) {
+		__stats_completed(cq, 0);
+		__ring_free_slot(cq->ring, slot);
+	    }
+	}
+
+	return;
+    }
+
+    cmd_rec = wg_find_record_int(db, HCQ_CMD_FIELD_SEGID, WG_COND_EQUAL, segid, NULL);
+
+    while (cmd_rec != NULL) {
+	next = wg_find_record_int(db, HCQ_CMD_FIELD_SEGID, WG_COND_EQUAL, segid, cmd_rec);
+
+	if (wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_TYPE_FIELD)) != HCQ_CMD_TYPE) {
+	    cmd_rec = next;
+	    continue;
+	}
+
+	status = wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_STATUS));
+
+	if (status == HCQ_CMD_RETURNED) {
+	    __stats_completed(cq, 0);
+	    wg_delete_record(db, cmd_rec);
+	} else if (status == HCQ_CMD_PENDING) {
+	    __stats_completed(cq, 0);
+	    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_STATUS, wg_encode_int(db, HCQ_CMD_CANCELLED));
+	}
+
+	cmd_rec = next;
+    }
+}
+
+/* Forget a client that went away without disconnecting. Same locking as __reap_client_cmds() */
+static void
+__reap_client(struct cmd_queue * cq,
+	      xemem_segid_t      segid)
+{
+    ERROR("Lost HCQ client (segid=%ld), reclaiming its commands\n", segid);
+
+    __reap_client_cmds(cq, segid);
+
+    pthread_mutex_lock(&(cq->server.lock));
+    __drop_conn(cq, segid);
+    pthread_mutex_unlock(&(cq->server.lock));
+}
+
+/* 
+ * Periodically look for clients that can no longer be reached. A client that dies
+ * after its last command returned is never signalled again, so its records would 
+ * otherwise stay in the queue. Same locking as __reap_client_cmds()
+ */
+static void
+__sweep_clients(struct cmd_queue * cq)
+{
+    struct hashtable_iter * iter = NULL;
+    struct hcq_conn       * conn = NULL;
+    xemem_segid_t           lost[HCQ_SWEEP_MAX_CLIENTS];
+    xemem_segid_t           segid = 0;
+    xemem_apid_t            apid  = 0;
+    uint32_t                cnt   = 0;
+    uint32_t                i     = 0;
+
+    if (cq->server.next_sweep_tsc == 0) {
+	cq->server.next_sweep_tsc = __deadline_tsc(HCQ_SWEEP_INTERVAL_US);
+	return;
+    }
+
+    if (!__deadline_passed(cq->server.next_sweep_tsc)) {
+	return;
+    }
+
+    cq->server.next_sweep_tsc = __deadline_tsc(HCQ_SWEEP_INTERVAL_US);
+
+    pthread_mutex_lock(&(cq->server.lock));
+
+    if (pet_htable_count(cq->server.connections) > 0) {
+	iter = pet_htable_create_iter(cq->server.connections);
+    }
+
+    if (iter != NULL) {
+	do {
+	    segid = (xemem_segid_t)pet_htable_get_iter_key(iter);
+	    conn  = (struct hcq_conn *)pet_htable_get_iter_value(iter);
+
+	    if (conn->closed) {
+		continue;
+	    }
+
+	    apid = xemem_get(segid, XEMEM_RDWR);
+
+	    if (apid <= 0) {
+		lost[cnt++] = segid;
+	    } else {
+		xemem_release(apid);
+	    }
+	} while ((cnt < HCQ_SWEEP_MAX_CLIENTS) && (pet_htable_iter_advance(iter) != 0));
+
+	pet_htable_free_iter(iter);
+    }
+
+    pthread_mutex_unlock(&(cq->server.lock));
+
+    for (i = 0; i < cnt; i++) {
+	__reap_client(cq, lost[i]);
+    }
+}
+
+/* Kick a client. Same locking as __reap_client_cmds(), since a lost client is reaped */
+static void
+__signal_client(struct cmd_queue * cq,
+		xemem_segid_t      segid)
+{
+    struct hcq_conn * conn = NULL;
+    xemem_apid_t      apid = 0; 
+
+    if (segid == 0) 
+	return;
+
+    pthread_mutex_lock(&(cq->server.lock));
+
+    conn = __get_conn(cq, segid);
+
+    if (conn) {
+	apid = (conn->closed) ? -1 : conn->apid;
+    }
+
+    pthread_mutex_unlock(&(cq->server.lock));
+
+    /* Nobody is left to wait on a closed connection */
+    if (apid == -1) {
+	return;
+    }
+
+    if (apid == 0) {
+	ERROR("Cannot kick HCQ client (segid=%ld)\n", segid);
+	return;
+    }
+
+    if (xemem_signal(apid) != 0) {
+	/* The client is gone without disconnecting */
+	__reap_client(cq, segid);
+    }
+}
+
+/* The large payload buffer of the client that issued a command, attached on first use */
+static struct hcq_bulk *
+__get_client_bulk(struct cmd_queue * cq,
+		  xemem_segid_t      segid,
+		  xemem_segid_t      bulk_segid)
+{
+    struct hcq_conn * conn = NULL;
+    struct hcq_bulk * bulk = NULL;
+    uint64_t          size = 0;
+
+    pthread_mutex_lock(&(cq->server.lock));
+
+    conn = __get_conn(cq, segid);
+
+    if ((conn != NULL) && (conn->bulk == NULL) && (bulk_segid > 0)) {
+	if (conn->bulk_apid <= 0) {
+	    conn->bulk_apid = xemem_get(bulk_segid, XEMEM_RDWR);
+	}
+
+	if (conn->bulk_apid > 0) {
+	    bulk = __attach_segment(conn->bulk_apid, &size);
+	} else {
+	    ERROR("Could not find apid for large payload buffer (segid=%ld)\n", bulk_segid);
+	    conn->bulk_apid = 0;
+	}
+
+	if ((bulk != NULL) && (bulk->magic != HCQ_BULK_MAGIC)) {
+	    ERROR("Client segment is not a large payload buffer (segid=%ld)\n", bulk_segid);
+	    xemem_detach(bulk);
+	    bulk = NULL;
+	}
+
+	conn->bulk = bulk;
+    }
+
+    if (conn != NULL) {
+	bulk = conn->bulk;
+    }
+
+    pthread_mutex_unlock(&(cq->server.lock));
+
+    return bulk;
+}
+
+
+xemem_segid_t
+hcq_get_segid(hcq_handle_t hcq)
+{
+    struct cmd_queue * cq = hcq;
+
+    if (cq->type != HCQ_SERVER)
+	return XEMEM_INVALID_SEGID;
+
+    return cq->server.segid;
+}
+
+int
+hcq_get_fd(hcq_handle_t hcq)
+{
+    struct cmd_queue * cq = hcq;
+
+    if (cq->type == HCQ_SERVER)
+	return cq->server.fd;
+    else if (cq->type == HCQ_CLIENT)
+	return cq->client.fd;
+    else
+	return -1;
+}
+
+hcq_handle_t
+hcq_create_queue(char * name) 
+{
+    hcq_backend_t   backend = HCQ_BACKEND_DB;
+    char          * env_str = NULL;
+
+    env_str = getenv(HCQ_ENV_BACKEND);
+
+    if ((env_str) && (strcmp(env_str, "ring") == 0)) {
+	backend = HCQ_BACKEND_RING;
+    }
+
+    return hcq_create_queue_ext(name, backend);
+}
+
+hcq_handle_t
+hcq_create_queue_ext(char          * name,
+		     hcq_backend_t   backend) 
+{
+    return hcq_create_queue_sized(name, backend, 
+				  smart_atou64(HCQ_DEFAULT_QUEUE_SIZE, getenv(HCQ_ENV_QUEUE_SIZE)));
+}
+
+hcq_handle_t
+hcq_create_queue_sized(char          * name,
+		       hcq_backend_t   backend,
+		       uint64_t        queue_size) 
+{
+    struct cmd_queue * cq     = NULL;
+    struct hashtable * cmd_ht = NULL;
+    struct hashtable * seg_ht = NULL;
+    xemem_segid_t      segid  = 0;
+
+    void * db_addr = NULL;
+    void * db      = NULL;
+    int    fd      = 0;
+
+    /* Clients find the size in the segment header, so it must fit in the probed page */
+    queue_size = (queue_size + HCQ_PROBE_SIZE - 1) & ~((uint64_t)HCQ_PROBE_SIZE - 1);
+
+    if (queue_size < HCQ_PROBE_SIZE) {
+	ERROR("Invalid command queue size (%lu)\n", queue_size);
+	return HCQ_INVALID_HANDLE;
+    }
+
+    if (backend == HCQ_BACKEND_RING) {
+	if (posix_memalign(&db_addr, sysconf(_SC_PAGESIZE), queue_size) != 0) {
+	    ERROR("Could not allocate command ring\n");
+	    return HCQ_INVALID_HANDLE;
+	}
+
+	memset(db_addr, 0, queue_size);
+    } else {
+	db = wg_attach_local_database(queue_size);
+
+	if (db == NULL) {
+	    ERROR("Could not create database\n");
+	    return HCQ_INVALID_HANDLE;
+	}
+
+	db_addr = get_db_addr(db);
+    }
+
+    /* Create the signallable segid */
+    segid = xemem_make_signalled(db_addr, queue_size,
+				 name, &fd);
+
+    if (segid <= 0) {
+        ERROR("Could not register XEMEM segment for command queue\n");
+	goto segid_out;
+    }
+
+    /* Create the htable of handlers */
+    cmd_ht = pet_create_htable(0, handler_hash_fn, handler_eq_fn);
+
+    if (cmd_ht == NULL) {
+	ERROR("Could not create hcq command hashtable\n");
+	goto cmd_ht_out;
+    }
+
+    /* Create the htable of segids */
+    seg_ht = pet_create_htable(0, handler_hash_fn, handler_eq_fn);
+
+    if (seg_ht == NULL) {
+	ERROR("Could not create hcq connection hashtable\n");
+	goto seg_ht_out;
+    }
+    
+    cq = calloc(sizeof(struct cmd_queue), 1);
+    if (!cq) {
+	ERROR("Could not calloc command queue\n");
+	goto cq_out;
+    }
+
+    cq->type    = HCQ_SERVER;
+    cq->backend = backend;
+    cq->db_addr = db_addr;
+    cq->db      = db;
+
+    cq->server.segid        = segid;
+    cq->server.fd	    = fd;
+    cq->server.cmd_handlers = cmd_ht;
+    cq->server.connections  = seg_ht;
+
+    pthread_mutex_init(&(cq->server.lock), NULL);
+
+    if (backend == HCQ_BACKEND_RING) {
+	cq->ring = db_addr;
+
+	if (init_cmd_ring(cq, queue_size) != 0) {
+	    ERROR("Could not initialize command ring\n");
+	    goto init_out;
+	}
+    } else if (init_cmd_queue(cq) != 0) {
+	ERROR("Could not initialize command queue\n");
+	goto init_out;
+    }
+
+    return cq;
+
+init_out:
+    free(cq);
+
+cq_out:
+    pet_free_htable(seg_ht, 0, 0);
+
+seg_ht_out:
+    pet_free_htable(cmd_ht, 0, 0);
+
+cmd_ht_out:
+    xemem_remove(segid);
+
+segid_out:
+    if (backend == HCQ_BACKEND_RING) {
+	free(db_addr);
+    } else {
+	wg_delete_local_database(db);
+    }
+
+    return HCQ_INVALID_HANDLE;
+}
+
+
+void 
+hcq_free_queue(hcq_handle_t hcq)
+{
+    struct cmd_queue * cq = hcq;
+
+    if (cq->type != HCQ_SERVER) {
+	ERROR("Only server can free HCQs\n");
+	return;
+    }
+
+    hcq_stop_workers(hcq);
+
+    close(cq->server.fd);
+    xemem_remove(cq->server.segid);
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	free(cq->db_addr);
+    } else {
+	wg_delete_local_database(cq->db);
+    }
+
+    /* Remove all apids from the connection table (clients that disconnected are already gone) */
+    if (pet_htable_count(cq->server.connections) > 0) {
+	struct hashtable_iter * iter = NULL;
+
+	iter = pet_htable_create_iter(cq->server.connections);
+	if (iter == NULL) {
+	    ERROR("Could not create connections table iterator\n");
+	    goto out;
+	}
+
+	do {
+	    __free_conn((struct hcq_conn *)pet_htable_get_iter_value(iter));
+	} while (pet_htable_iter_remove(iter, 0) != 0);
+
+	pet_htable_free_iter(iter);
+    }
+
+out:
+    pet_free_htable(cq->server.connections, 0, 0);
+
+    pet_free_htable(cq->server.cmd_handlers, 1, 0);
+
+    if (cq->server.ret_staging) {
+	pet_free_htable(cq->server.ret_staging, 1, 0);
+    }
+
+    pthread_mutex_destroy(&(cq->server.lock));
+
+    free(cq);
+
+    return;
+}
+
+int
+hcq_register_cmd(hcq_handle_t hcq,
+		 uint64_t     cmd_code,
+		 hcq_cmd_fn   handler_fn)
+{
+    return hcq_register_cmd_ext(hcq, cmd_code, handler_fn, HCQ_CMD_SERIAL);
+}
+
+int
+hcq_register_cmd_ext(hcq_handle_t    hcq,
+		     uint64_t        cmd_code,
+		     hcq_cmd_fn      handler_fn,
+		     hcq_cmd_class_t cmd_class)
+{
+    struct cmd_queue   * cq      = hcq;
+    struct hcq_handler * handler = NULL;
+
+    if (cq->type != HCQ_SERVER) {
+	ERROR("Only the server can register an HCQ command\n");
+	return -1;
+    }
+
+    if (pet_htable_search(cq->server.cmd_handlers, cmd_code) != 0) {
+	ERROR("Attempted to register duplicate command handler (cmd=%lu)\n", cmd_code);
+	return -1;
+    }
+
+    handler = calloc(sizeof(struct hcq_handler), 1);
+
+    if (handler == NULL) {
+	ERROR("Could not allocate hcq command handler\n");
+	return -1;
+    }
+
+    handler->fn        = handler_fn;
+    handler->cmd_class = cmd_class;
+
+    if (pet_htable_insert(cq->server.cmd_handlers, cmd_code, (uintptr_t)handler) == 0) {
+	ERROR("Could not register hcq command (cmd=%lu)\n", cmd_code);
+	free(handler);
+	return -1;
+    }
+
+    return 0;
+}
+
+/* Lane a client issues a command code on */
+static hcq_prio_t
+__cmd_prio(struct cmd_queue * cq,
+	   uint64_t           cmd_code)
+{
+    struct hcq_prio_codes * prio_codes = cq->prio_codes;
+    uint32_t                num_codes  = 0;
+    uint32_t                i          = 0;
+
+    if (prio_codes == NULL) {
+	return HCQ_PRIO_NORMAL;
+    }
+
+    num_codes = *(volatile uint32_t *)&(prio_codes->num_codes);
+
+    for (i = 0; (i < num_codes) && (i < HCQ_PRIO_MAX_CODES); i++) {
+	if (prio_codes->codes[i] == cmd_code) {
+	    return HCQ_PRIO_HIGH;
+	}
+    }
+
+    return HCQ_PRIO_NORMAL;
+}
+
+/* Lane a queued command was issued on */
+static hcq_prio_t
+__get_cmd_prio(struct cmd_queue * cq,
+	       hcq_cmd_t          cmd)
+{
+    struct hcq_slot * slot = NULL;
+
+    if (cq->backend == HCQ_BACKEND_DB) {
+	return HCQ_CMD_PRIO(cmd);
+    }
+
+    slot = __ring_get_slot(cq, cmd);
+
+    return (slot) ? slot->prio : HCQ_PRIO_NORMAL;
+}
+
+int
+hcq_set_cmd_priority(hcq_handle_t hcq,
+		     uint64_t     cmd_code,
+		     hcq_prio_t   prio)
+{
+    struct cmd_queue      * cq         = hcq;
+    struct hcq_prio_codes * prio_codes = cq->prio_codes;
+    uint32_t                num_codes  = 0;
+    uint32_t                i          = 0;
+
+    if (cq->type != HCQ_SERVER) {
+	ERROR("Only the server can set HCQ command priorities\n");
+	return -1;
+    }
+
+    if (prio_codes == NULL) {
+	ERROR("Command queue has no priority lanes\n");
+	return -1;
+    }
+
+    num_codes = prio_codes->num_codes;
+
+    for (i = 0; i < num_codes; i++) {
+	if (prio_codes->codes[i] == cmd_code) {
+	    break;
+	}
+    }
+
+    if (prio == HCQ_PRIO_HIGH) {
+	if (i < num_codes) {
+	    return 0;
+	}
+
+	if (num_codes >= HCQ_PRIO_MAX_CODES) {
+	    ERROR("Too many high priority HCQ commands (max=%d)\n", HCQ_PRIO_MAX_CODES);
+	    return -1;
+	}
+
+	/* Clients may be scanning the table, so the code is in place before it is counted */
+	prio_codes->codes[num_codes] = cmd_code;
+	__sync_synchronize();
+	prio_codes->num_codes        = num_codes + 1;
+    } else if (i < num_codes) {
+	/* A client racing with the removal at worst issues one command on the wrong lane */
+	prio_codes->codes[i]  = prio_codes->codes[num_codes - 1];
+	__sync_synchronize();
+	prio_codes->num_codes = num_codes - 1;
+    }
+
+    return 0;
+}
+
+static struct hcq_handler *
+__get_handler(struct cmd_queue * cq,
+	      hcq_cmd_t          cmd)
+{
+    return (struct hcq_handler *)pet_htable_search(cq->server.cmd_handlers, 
+						   (uintptr_t)hcq_get_cmd_code(cq, cmd));
+}
+
+hcq_cmd_fn
+hcq_get_cmd_handler(hcq_handle_t hcq,
+		    hcq_cmd_t    cmd)
+{
+    struct cmd_queue   * cq      = hcq;
+    struct hcq_handler * handler = NULL;
+
+    if (cq->type != HCQ_SERVER) {
+	ERROR("Only the server can access command handlers\n");
+	return NULL;
+    }
+
+    handler = __get_handler(cq, cmd);
+
+    if (handler == NULL) {
+	return NULL;
+    }
+
+    return handler->fn;
+}
+
+
+static void *
+__worker_thread(void * arg)
+{
+    struct hcq_worker_pool * pool = arg;
+    struct hcq_work        * work = NULL;
+
+    while (1) {
+	pthread_mutex_lock(&(pool->lock));
+
+	while ((pool->head == NULL) && (pool->stop == 0)) {
+	    pthread_cond_wait(&(pool->cond), &(pool->lock));
+	}
+
+	/* Queued commands are drained before the pool stops */
+	work = pool->head;
+
+	if (work == NULL) {
+	    pthread_mutex_unlock(&(pool->lock));
+	    break;
+	}
+
+	pool->head = work->next;
+
+	if (pool->head == NULL) {
+	    pool->tail = NULL;
+	}
+
+	pthread_mutex_unlock(&(pool->lock));
+
+	if (work->fn(pool->hcq, work->cmd) != 0) {
+	    ERROR("Handler failed for command (ID=%lu)\n", work->cmd);
+	}
+
+	free(work);
+    }
+
+    return NULL;
+}
+
+static struct hcq_worker_pool *
+__create_pool(hcq_handle_t hcq,
+	      uint32_t     num_threads)
+{
+    struct hcq_worker_pool * pool = NULL;
+    uint32_t                 i    = 0;
+
+    pool = calloc(sizeof(struct hcq_worker_pool) + (sizeof(pthread_t) * num_threads), 1);
+
+    if (pool == NULL) {
+	ERROR("Could not allocate worker pool\n");
+	return NULL;
+    }
+
+    pool->hcq = hcq;
+
+    pthread_mutex_init(&(pool->lock), NULL);
+    pthread_cond_init(&(pool->cond), NULL);
+
+    for (i = 0; i < num_threads; i++) {
+	if (pthread_create(&(pool->threads[i]), NULL, __worker_thread, pool) != 0) {
+	    ERROR("Could not create worker thread %u\n", i);
+	    break;
+	}
+    }
+
+    pool->num_threads = i;
+
+    if (pool->num_threads == 0) {
+	pthread_cond_destroy(&(pool->cond));
+	pthread_mutex_destroy(&(pool->lock));
+	free(pool);
+	return NULL;
+    }
+
+    return pool;
+}
+
+static void
+__destroy_pool(struct hcq_worker_pool * pool)
+{
+    uint32_t i = 0;
+
+    pthread_mutex_lock(&(pool->lock));
+    pool->stop = 1;
+    pthread_cond_broadcast(&(pool->cond));
+    pthread_mutex_unlock(&(pool->lock));
+
+    for (i = 0; i < pool->num_threads; i++) {
+	pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&(pool->cond));
+    pthread_mutex_destroy(&(pool->lock));
+
+    free(pool);
+}
+
+/* Urgent (high priority) work is started ahead of everything already queued */
+static int
+__pool_queue(struct hcq_worker_pool * pool,
+	     hcq_cmd_t                cmd,
+	     hcq_cmd_fn               fn,
+	     int                      urgent)
+{
+    struct hcq_work * work = NULL;
+
+    work = calloc(sizeof(struct hcq_work), 1);
+
+    if (work == NULL) {
+	ERROR("Could not allocate work item\n");
+	return -1;
+    }
+
+    work->cmd = cmd;
+    work->fn  = fn;
+
+    pthread_mutex_lock(&(pool->lock));
+
+    if (urgent) {
+	work->next = pool->head;
+	pool->head = work;
+
+	if (pool->tail == NULL) {
+	    pool->tail = work;
+	}
+    } else {
+	if (pool->tail) {
+	    pool->tail->next = work;
+	} else {
+	    pool->head = work;
+	}
+
+	pool->tail = work;
+    }
+
+    pthread_cond_signal(&(pool->cond));
+    pthread_mutex_unlock(&(pool->lock));
+
+    return 0;
+}
+
+
+int
+hcq_start_workers(hcq_handle_t hcq,
+		  uint32_t     num_workers)
+{
+    struct cmd_queue * cq = hcq;
+
+    if (cq->type != HCQ_SERVER) {
+	ERROR("Only the server can start command workers\n");
+	return -1;
+    }
+
+    if (cq->server.serial_pool != NULL) {
+	ERROR("Command workers are already running\n");
+	return -1;
+    }
+
+    if (num_workers == 0) {
+	return 0;
+    }
+
+    /* Serial handlers run one at a time, in arrival order, on their own thread */
+    cq->server.serial_pool = __create_pool(hcq, 1);
+
+    if (cq->server.serial_pool == NULL) {
+	ERROR("Could not start serial command worker\n");
+	return -1;
+    }
+
+    cq->server.parallel_pool = __create_pool(hcq, num_workers);
+
+    if (cq->server.parallel_pool == NULL) {
+	ERROR("Could not start parallel command workers\n");
+	__destroy_pool(cq->server.serial_pool);
+	cq->server.serial_pool = NULL;
+	return -1;
+    }
+
+    return 0;
+}
+
+void
+hcq_stop_workers(hcq_handle_t hcq)
+{
+    struct cmd_queue * cq = hcq;
+
+    if (cq->type != HCQ_SERVER) {
+	ERROR("Only the server can stop command workers\n");
+	return;
+    }
+
+    if (cq->server.parallel_pool) {
+	__destroy_pool(cq->server.parallel_pool);
+	cq->server.parallel_pool = NULL;
+    }
+
+    if (cq->server.serial_pool) {
+	__destroy_pool(cq->server.serial_pool);
+	cq->server.serial_pool = NULL;
+    }
+}
+
+int
+hcq_dispatch_cmd(hcq_handle_t hcq,
+		 hcq_cmd_t    cmd)
+{
+    struct cmd_queue       * cq      = hcq;
+    struct hcq_handler     * handler = NULL;
+    struct hcq_worker_pool * pool    = NULL;
+
+    if (cq->type != HCQ_SERVER) {
+	ERROR("Only the server can dispatch HCQ commands\n");
+	return -1;
+    }
+
+    handler = __get_handler(cq, cmd);
+    
+    if (handler == NULL) {
+	ERROR("Received invalid HCQ command (%lu)\n", hcq_get_cmd_code(hcq, cmd));
+	hcq_cmd_return(hcq, cmd, -1, 0, NULL);
+	return -1;
+    }
+
+    if (handler->cmd_class == HCQ_CMD_PARALLEL) {
+	pool = cq->server.parallel_pool;
+    } else {
+	pool = cq->server.serial_pool;
+    }
+
+    if (pool == NULL) {
+	return handler->fn(hcq, cmd);
+    }
+
+    return __pool_queue(pool, cmd, handler->fn, (__get_cmd_prio(cq, cmd) == HCQ_PRIO_HIGH));
+}
+
+/* Locate a raw memory area (e.g. the instrumentation counters) of an existing DB queue */
+static void *
+__find_hdr_area(void * db,
+		int    field)
+{
+    void   * area    = NULL;
+    void   * hdr_rec = NULL;
+    wg_int   lock_id;
+
+    lock_id = wg_start_read(db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return NULL;
+    }
+
+    hdr_rec = wg_find_record_int(db, HCQ_TYPE_FIELD, WG_COND_EQUAL, HCQ_HEADER_TYPE, NULL);
+
+    /* Queues created by older versions have a shorter header */
+    if ((hdr_rec != NULL) && (wg_get_record_len(db, hdr_rec) > field)) {
+	area = offsettoptr(db, wg_decode_int(db, wg_get_field(db, hdr_rec, field)));
+    }
+
+    if (!wg_end_read(db, lock_id)) {
+	ERROR("Apparently this is catastrophic...\n");
+	return NULL;
+    }
+
+    return area;
+}
+
+hcq_handle_t
+hcq_connect(xemem_segid_t segid)
+{
+    struct cmd_queue * cq      = NULL;
+    xemem_apid_t       apid    = 0;
+    void             * db_addr = NULL;
+    void             * db      = NULL;
+    hcq_backend_t      backend = HCQ_BACKEND_DB;
+    wg_int             cmd_index = -1;
+    struct hcq_stats * stats   = NULL;
+
+    struct hcq_prio_codes * prio_codes = NULL;
+
+    xemem_segid_t client_segid = 0;
+    int           client_fd    = 0;
+
+    uint64_t      bulk_size    = 0;
+    uint64_t      size         = 0;
+    
+//    printf("HCQ SEGID = %ld\n", segid);
+
+    /* The large payload buffer is only allocated once a payload needs it */
+    bulk_size = smart_atou64(HCQ_DEFAULT_BULK_SIZE, getenv(HCQ_ENV_BULK_SIZE));
+    bulk_size = (bulk_size + HCQ_PROBE_SIZE - 1) & ~((uint64_t)HCQ_PROBE_SIZE - 1);
+
+    if (bulk_size <= sizeof(struct hcq_bulk)) {
+	bulk_size = 0;
+    }
+
+    client_segid = xemem_make_signalled(NULL, 0, NULL, &client_fd);
+    
+    if (client_segid <= 0) {
+	ERROR("Could not create client signal segid\n");
+	goto out_xemem_make;
+    }
+
+    apid = xemem_get(segid, XEMEM_RDWR);
+    
+    if (apid <= 0) {
+	ERROR("Failed to get APID for command queue\n");
+	goto out_xemem_get;
+    }
+
+    db_addr = __attach_segment(apid, &size);
+
+    if (db_addr == NULL) {
+	ERROR("Failed to attach to command queue\n");
+	goto out_xemem_attach;
+    }
+
+
+    if (*(volatile uint32_t *)db_addr == HCQ_RING_MAGIC) {
+	backend = HCQ_BACKEND_RING;
+    } else {
+	db = wg_attach_existing_local_database(db_addr);
+
+	if (db == NULL) {
+	    ERROR("Failed to attach command queue database\n");
+	    goto out_db_attach;
+	}
+
+	/* Queues created without the index fall back to query scans */
+	{
+	    wg_int cols[2] = {HCQ_TYPE_FIELD, HCQ_CMD_FIELD_ID};
+
+	    cmd_index = wg_multi_column_to_index_id(db, cols, 2, WG_INDEX_TYPE_HASH, NULL, 0);
+	}
+
+	stats      = __find_hdr_area(db, HCQ_HDR_FIELD_STATS);
+	prio_codes = __find_hdr_area(db, HCQ_HDR_FIELD_PRIO_CODES);
+    }
+
+
+    cq = calloc(sizeof(struct cmd_queue), 1);
+
+    if (cq == NULL) {
+	ERROR("Could not calloc command queue\n");
+	goto out_cq_alloc;
+    }
+
+    cq->type      = HCQ_CLIENT;
+    cq->backend   = backend;
+    cq->db_addr   = db_addr;
+    cq->db        = db;
+    cq->cmd_index = cmd_index;
+    cq->stats     = stats;
+
+    cq->prio_codes = prio_codes;
+
+    if (backend == HCQ_BACKEND_RING) {
+	cq->ring       = db_addr;
+	cq->stats      = &(cq->ring->stats);
+	cq->prio_codes = &(cq->ring->prio_codes);
+    }
+
+    cq->client.fd      = client_fd;
+    cq->client.apid    = apid;
+    cq->client.segid   = client_segid;
+    cq->client.spin_us = smart_atou32(0, getenv(HCQ_ENV_SPIN_US));
+
+    cq->client.bulk_size      = bulk_size;
+    cq->client.bulk_threshold = smart_atou32(HCQ_DEFAULT_BULK_THRESHOLD, getenv(HCQ_ENV_BULK_THRESHOLD));
+    cq->client.bulk_owner     = HCQ_INVALID_CMD;
+
+    return cq;
+
+out_cq_alloc:
+    if (db != NULL) {
+	wg_detach_local_database(db);
+    }
+
+out_db_attach:
+    xemem_detach(db_addr);
+
+out_xemem_attach:
+    xemem_release(apid);
+
+out_xemem_get:
+    close(client_fd);
+    xemem_remove(client_segid);
+
+out_xemem_make:
+    return HCQ_INVALID_HANDLE;
+}
+
+
+/* 
+ * Release a command record. A command that has not returned yet is marked cancelled
+ * instead, and freed by the server when it dequeues or returns it. 
+ * Returns 1 if the server still holds the command, 0 if it was freed, -1 on error.
+ */
+static int
+__release_cmd_rec(struct cmd_queue * cq,
+		  void             * cmd_rec)
+{
+    int status = wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_STATUS));
+
+    __stats_completed(cq, (status == HCQ_CMD_RETURNED));
+
+    if (status != HCQ_CMD_RETURNED) {
+	wg_set_field(cq->db, cmd_rec, HCQ_CMD_FIELD_STATUS, wg_encode_int(cq->db, HCQ_CMD_CANCELLED));
+	return 1;
+    }
+
+    if (wg_delete_record(cq->db, cmd_rec) != 0) {
+	ERROR("Could not delete completed Command from queue\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+/* Release every command a client has left in the queue */
+static void
+__cancel_client_cmds(struct cmd_queue * cq)
+{
+    void     * db      = cq->db;
+    void     * cmd_rec = NULL;
+    void     * next    = NULL;
+    uint32_t   i       = 0;
+    wg_int     lock_id;
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	for (i = 0; i < cq->ring->num_slots; i++) {
+	    struct hcq_slot * slot   = __ring_slot(cq->ring, i);
+	    uint32_t          status = __ring_cancel_client_slot(slot, cq->client.segid);
+
+	    if (status == HCQ_CMD_PENDING) {
+		__stats_completed(cq, 0);
+	    } else if (status == HCQ_CMD_RETURNED) {
+		__stats_completed(cq, 1);
+		__ring_free_slot(cq->ring, slot);
+	    }
+	}
+
+	return;
+    }
+
+    lock_id = wg_start_write(db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return;
+    }
+
+    cmd_rec = wg_find_record_int(db, HCQ_CMD_FIELD_SEGID, WG_COND_EQUAL, cq->client.segid, NULL);
+
+    while (cmd_rec != NULL) {
+	next = wg_find_record_int(db, HCQ_CMD_FIELD_SEGID, WG_COND_EQUAL, cq->client.segid, cmd_rec);
+
+	if ((wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_TYPE_FIELD))       == HCQ_CMD_TYPE) &&
+	    (wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_STATUS)) != HCQ_CMD_CANCELLED)) {
+	    __release_cmd_rec(cq, cmd_rec);
+	}
+
+	cmd_rec = next;
+    }
+
+    if (!wg_end_write(db, lock_id)) {
+	ERROR("Apparently this is catastrophic...\n");
+	return;
+    }
+}
+
+/* 
+ * Wait for the server to free the command holding the large payload buffer, 
+ * if any. Returns 1 if the server may still write to the buffer. 
+ */
+static int
+__bulk_busy(struct cmd_queue * cq)
+{
+    uint64_t deadline_tsc = __deadline_tsc(HCQ_DISCONNECT_WAIT_US);
+
+    while (1) {
+	if (cq->client.bulk_owner == HCQ_INVALID_CMD) {
+	    return 0;
+	}
+
+	__bulk_reclaim(cq);
+
+	if (cq->client.bulk_owner == HCQ_INVALID_CMD) {
+	    return 0;
+	}
+
+	if (__deadline_passed(deadline_tsc)) {
+	    return 1;
+	}
+
+	usleep(1000);
+    }
+}
+
+void
+hcq_disconnect(hcq_handle_t hcq)
+{
+    struct cmd_queue * cq        = hcq;
+    int                bulk_busy = 0;
+
+    if (cq->type != HCQ_CLIENT) {
+	ERROR("Only clients can disconnect an HCQ\n");
+	return;
+    }
+
+    __cancel_client_cmds(cq);
+
+    /* Let the server release its apids and its mapping of the large payload buffer. 
+     * The notice is freed by the server, so its ID is not kept.
+     */
+    if (__cmd_submit(cq, 0, 0, NULL, HCQ_CMD_FLAG_DISCONNECT, 0) == HCQ_INVALID_CMD) {
+	ERROR("Could not notify the server of HCQ disconnect\n");
+    }
+
+    if (cq->client.bulk) {
+	bulk_busy = __bulk_busy(cq);
+    }
+
+    if (cq->backend == HCQ_BACKEND_DB) {
+	wg_detach_local_database(cq->db);
+    }
+
+    xemem_detach(cq->db_addr);
+
+    xemem_release(cq->client.apid);
+
+    close(cq->client.fd);
+    xemem_remove(cq->client.segid);
+
+    /* A command the server is still running may write its return into the buffer at 
+     * any time. Nothing tells the client when the server is done with it once the 
+     * queue is detached, so the buffer (and its segment) is leaked instead.
+     */
+    if (bulk_busy) {
+	ERROR("Server still holds the large payload buffer, leaking it\n");
+    } else if (cq->client.bulk) {
+	xemem_remove(cq->client.bulk_segid);
+	free(cq->client.bulk);
+    }
+
+    if (cq->client.reservations) {
+	pet_free_htable(cq->client.reservations, 1, 0);
+    }
+
+    free(cq);
+
+    return;
+}
+
+static void * 
+__get_cmd_rec(struct cmd_queue * cq, 
+	      hcq_cmd_t          cmd)
+{
+    void        * cmd_rec  = NULL;
+    wg_query    * query    = NULL;
+    wg_query_arg  arglist[2];
+
+    if (cq->cmd_index > 0) {
+	wg_int values[2];
+	wg_int reclist = 0;
+
+	values[0] = wg_encode_query_param_int(cq->db, HCQ_CMD_TYPE);
+	values[1] = wg_encode_query_param_int(cq->db, cmd);
+
+	reclist   = wg_search_hash(cq->db, cq->cmd_index, values, 2);
+
+	/* Hash buckets are keyed on 32 bit integers, so lane IDs can share a bucket */
+	while (reclist > 0) {
+	    gcell * cell = (gcell *)offsettoptr(cq->db, reclist);
+	    void  * rec  = offsettoptr(cq->db, cell->car);
+
+	    if ((hcq_cmd_t)wg_decode_int(cq->db, wg_get_field(cq->db, rec, HCQ_CMD_FIELD_ID)) == cmd) {
+		cmd_rec = rec;
+		break;
+	    }
+
+	    reclist = cell->cdr;
+	}
+
+	wg_free_query_param(cq->db, values[0]);
+	wg_free_query_param(cq->db, values[1]);
+
+	return cmd_rec;
+    }
+
+    arglist[0].column = HCQ_TYPE_FIELD;
+    arglist[0].cond   = WG_COND_EQUAL;
+    arglist[0].value  = wg_encode_query_param_int(cq->db, HCQ_CMD_TYPE);    
+
+    arglist[1].column = HCQ_CMD_FIELD_ID;
+    arglist[1].cond   = WG_COND_EQUAL;
+    arglist[1].value  = wg_encode_query_param_int(cq->db, cmd);
+
+    query   = wg_make_query(cq->db, NULL, 0, arglist, 2);
+
+    cmd_rec = wg_fetch(cq->db, query);
+
+    wg_free_query(cq->db, query);
+    wg_free_query_param(cq->db, arglist[0].value);
+    wg_free_query_param(cq->db, arglist[1].value);
+
+    return cmd_rec;
+
+}
+
+
+
+
+/* Take the buffer back from a cancelled command once the server has freed it */
+static void
+__bulk_reclaim(struct cmd_queue * cq)
+{
+    hcq_cmd_t   owner = cq->client.bulk_owner;
+    void      * rec   = NULL;
+    wg_int      lock_id;
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	rec = __ring_get_slot(cq, owner);
+    } else {
+	lock_id = wg_start_read(cq->db);
+
+	if (!lock_id) {
+	    ERROR("Could not lock database\n");
+	    return;
+	}
+
+	rec = __get_cmd_rec(cq, owner);
+
+	if (!wg_end_read(cq->db, lock_id)) {
+	    ERROR("Apparently this is catastrophic...\n");
+	    return;
+	}
+    }
+
+    if (rec == NULL) {
+	cq->client.bulk_orphaned = 0;
+	__sync_bool_compare_and_swap(&(cq->client.bulk_owner), owner, HCQ_INVALID_CMD);
+    }
+}
+
+/* Allocate and export the large payload buffer. Called by the thread that claimed it */
+static int
+__bulk_create(struct cmd_queue * cq)
+{
+    struct hcq_bulk * bulk  = NULL;
+    xemem_segid_t     segid = 0;
+
+    if (posix_memalign((void **)&bulk, HCQ_PROBE_SIZE, cq->client.bulk_size) != 0) {
+	ERROR("Could not allocate large payload buffer, payloads will be sent inline\n");
+	return -1;
+    }
+
+    bulk->magic     = HCQ_BULK_MAGIC;
+    bulk->size      = cq->client.bulk_size;
+    bulk->threshold = cq->client.bulk_threshold;
+    bulk->data_size = (cq->client.bulk_size - sizeof(struct hcq_bulk)) / 2;
+
+    segid = xemem_make(bulk, cq->client.bulk_size, NULL);
+
+    if (segid <= 0) {
+	ERROR("Could not export large payload buffer, payloads will be sent inline\n");
+	free(bulk);
+	return -1;
+    }
+
+    cq->client.bulk_segid = segid;
+
+    __sync_synchronize();
+    cq->client.bulk       = bulk;
+
+    return 0;
+}
+
+/* Whether a command with data_size bytes of command data should create the buffer */
+static int
+__bulk_needed(struct cmd_queue * cq,
+	      uint32_t           data_size)
+{
+    if ((cq->backend == HCQ_BACKEND_RING) || (cq->client.bulk_wanted)) {
+	return 1;
+    }
+
+    return (data_size > cq->client.bulk_threshold);
+}
+
+/* A return payload came back inline. If it was a large one, later commands get the buffer */
+static void
+__bulk_note_ret(struct cmd_queue * cq,
+		uint32_t           data_size)
+{
+    if ((cq->client.bulk == NULL) && (data_size > cq->client.bulk_threshold)) {
+	cq->client.bulk_wanted = 1;
+    }
+}
+
+/* 
+ * Claim the client's large payload buffer for a new command, creating it if the 
+ * command is the first to need it. Returns the command's flags: HCQ_CMD_FLAG_BULK 
+ * if it got the buffer, plus HCQ_CMD_FLAG_BULK_CMD if its data_size bytes of 
+ * command data belong there.
+ */
+static uint32_t
+__bulk_claim(struct cmd_queue * cq,
+	     uint32_t           data_size)
+{
+    if (cq->client.bulk_orphaned) {
+	__bulk_reclaim(cq);
+    }
+
+    if ((cq->client.bulk_size == 0) || 
+	(!__sync_bool_compare_and_swap(&(cq->client.bulk_owner), HCQ_INVALID_CMD, HCQ_BULK_CLAIMED))) {
+	return 0;
+    }
+
+    if (cq->client.bulk == NULL) {
+	if (!__bulk_needed(cq, data_size)) {
+	    cq->client.bulk_owner = HCQ_INVALID_CMD;
+	    return 0;
+	}
+
+	if (__bulk_create(cq) != 0) {
+	    /* Do not retry on every command */
+	    cq->client.bulk_size  = 0;
+	    cq->client.bulk_owner = HCQ_INVALID_CMD;
+	    return 0;
+	}
+    }
+
+    if (__use_bulk(cq, cq->client.bulk, data_size)) {
+	return (HCQ_CMD_FLAG_BULK | HCQ_CMD_FLAG_BULK_CMD);
+    }
+
+    return HCQ_CMD_FLAG_BULK;
+}
+
+/* Hand a claimed buffer to the command issued with it, or give it back if the issue failed */
+static void
+__bulk_bind(struct cmd_queue * cq,
+	    hcq_cmd_t          cmd,
+	    uint32_t           flags)
+{
+    if (flags & HCQ_CMD_FLAG_BULK) {
+	__sync_synchronize();
+	cq->client.bulk_owner = cmd;
+    }
+}
+
+static void
+__bulk_release(struct cmd_queue * cq,
+	       hcq_cmd_t          cmd)
+{
+    if ((cq->type == HCQ_CLIENT) && (cq->client.bulk != NULL)) {
+	__sync_bool_compare_and_swap(&(cq->client.bulk_owner), cmd, HCQ_INVALID_CMD);
+    }
+}
+
+/* A cancelled command still held by the server keeps the buffer until the server frees it */
+static void
+__bulk_orphan(struct cmd_queue * cq,
+	      hcq_cmd_t          cmd)
+{
+    if ((cq->client.bulk != NULL) && (cq->client.bulk_owner == cmd)) {
+	cq->client.bulk_orphaned = 1;
+    }
+}
+
+
+static hcq_cmd_t
+__cmd_issue(struct cmd_queue * cq,
+	    uint64_t           cmd_code,
+	    uint32_t           data_size,
+	    void             * data,
+	    uint32_t           flags,
+	    uint64_t           deadline_tsc)
+{
+    void       * db      = cq->db;
+    void       * hdr_rec = NULL;
+    void       * cmd_rec = NULL;
+    hcq_cmd_t    cmd_id  = HCQ_INVALID_CMD;
+    uint64_t     cmd_cnt = 0;
+    hcq_prio_t   prio    = __cmd_prio(cq, cmd_code);
+
+    if ((data_size > 0) && (data == NULL)) {
+	ERROR("NULL data pointer, but positive data size\n");
+	return HCQ_INVALID_CMD;
+    }
+
+
+    hdr_rec = wg_find_record_int(db, HCQ_TYPE_FIELD, WG_COND_EQUAL, HCQ_HEADER_TYPE, NULL);
+    
+    if (!hdr_rec) {
+	ERROR("malformed database. Missing Header\n");
+	return HCQ_INVALID_CMD;
+    }
+
+    /* Get CMD ID */
+    // grab + increment next_id
+    cmd_id  = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_NEXT_AVAIL(prio)));
+    cmd_cnt = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_OUTSTANDING(prio)));
+
+    /* Create Command */
+    cmd_rec = wg_create_record(db, HCQ_CMD_REC_LEN);
+
+    if (cmd_rec == NULL) {
+	ERROR("Could not create command record\n");
+	return HCQ_INVALID_CMD;
+    }
+
+    wg_set_field(db, cmd_rec, HCQ_TYPE_FIELD,             wg_encode_int(db, HCQ_CMD_TYPE));
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_ID,           wg_encode_int(db, HCQ_CMD_LANE_ID(prio, cmd_id)));
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_CMD_CODE,     wg_encode_int(db, cmd_code));
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_SEGID,        wg_encode_int(db, cq->client.segid));  
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_BULK_SEGID,   wg_encode_int(db, cq->client.bulk_segid));  
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_CMD_SIZE,     wg_encode_int(db, data_size));
+
+    if ((data_size > 0) && !(flags & HCQ_CMD_FLAG_BULK_CMD)) {
+	wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_CMD_DATA,     wg_encode_blob(db, data, NULL, data_size)); 
+    }
+
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_STATUS,       wg_encode_int(db, HCQ_CMD_PENDING)); 
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_FLAGS,        wg_encode_int(db, flags)); 
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_ISSUE_TSC,    wg_encode_int(db, __rdtsc())); 
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_DEADLINE,     wg_encode_int(db, deadline_tsc)); 
+
+    if (!(flags & HCQ_CMD_FLAG_DISCONNECT)) {
+	__stats_issued(cq);
+    }
+
+    /* Activate in queue */
+    wg_set_field(db, hdr_rec, HCQ_HDR_NEXT_AVAIL(prio),   wg_encode_int(db, cmd_id  + 1));
+    wg_set_field(db, hdr_rec, HCQ_HDR_OUTSTANDING(prio),  wg_encode_int(db, cmd_cnt + 1));
+
+    return HCQ_CMD_LANE_ID(prio, cmd_id);
+}
+
+static int
+__cmd_issue_batch(struct cmd_queue    * cq,
+		  uint32_t              num_cmds,
+		  struct hcq_cmd_desc * cmds)
+{
+    void     * cmd_rec = NULL;
+    uint32_t   i       = 0;
+
+    for (i = 0; i < num_cmds; i++) {
+	cmds[i].cmd = HCQ_INVALID_CMD;
+    }
+
+    for (i = 0; i < num_cmds; i++) {
+	uint32_t flags = (i == num_cmds - 1) ? HCQ_CMD_FLAG_DOORBELL : 0;
+
+	cmds[i].cmd = __cmd_issue(cq, cmds[i].cmd_code, cmds[i].data_size, cmds[i].data, flags, 0);
+
+	if (cmds[i].cmd == HCQ_INVALID_CMD) {
+	    break;
+	}
+    }
+
+    if (i == 0) {
+	return -1;
+    }
+
+    if (i < num_cmds) {
+	/* Partial batch: the last queued command carries the doorbell */
+	ERROR("Only queued %u of %u commands\n", i, num_cmds);
+
+	cmd_rec = __get_cmd_rec(cq, cmds[i - 1].cmd);
+	wg_set_field(cq->db, cmd_rec, HCQ_CMD_FIELD_FLAGS, wg_encode_int(cq->db, HCQ_CMD_FLAG_DOORBELL));
+    }
+
+    xemem_signal(cq->client.apid);
+
+    return i;
+}
+
+/* Reserve a command slot. The payload is written in place before the slot is activated */
+static struct hcq_slot *
+__ring_cmd_alloc(struct cmd_queue * cq,
+		 uint64_t           cmd_code,
+		 uint32_t           data_size,
+		 uint32_t           flags)
+{
+    struct hcq_ring * ring   = cq->ring;
+    struct hcq_slot * slot   = NULL;
+    hcq_cmd_t         cmd_id = HCQ_INVALID_CMD;
+
+    if ((data_size > ring->data_size) && !(flags & HCQ_CMD_FLAG_BULK_CMD)) {
+	ERROR("Command data too large for command ring (size=%u, max=%u)\n", 
+	      data_size, ring->data_size);
+	return NULL;
+    }
+
+    slot = __ring_alloc_slot(ring);
+
+    if (slot == NULL) {
+	ERROR("Command ring is full\n");
+	return NULL;
+    }
+
+    cmd_id = HCQ_RING_CMD_ID(HCQ_RING_CMD_GEN(slot->cmd_id) + 1, HCQ_RING_CMD_IDX(slot->cmd_id));
+
+    slot->cmd_code   = cmd_code;
+    slot->segid      = cq->client.segid;
+    slot->bulk_segid = cq->client.bulk_segid;
+    slot->cmd_size   = data_size;
+    slot->ret_code   = 0;
+    slot->ret_size   = 0;
+    slot->flags      = flags;
+    slot->prio       = __cmd_prio(cq, cmd_code);
+    slot->gen        = HCQ_RING_CMD_GEN(cmd_id);
+    slot->status     = HCQ_RING_SLOT_RESERVED;
+
+    slot->deadline_tsc = 0;
+
+    slot->cmd_id   = cmd_id;
+
+    return slot;
+}
+
+/* Allocate and fill in a command slot. The caller activates it with __ring_push() */
+static struct hcq_slot *
+__ring_cmd_prepare(struct cmd_queue * cq,
+		   uint64_t           cmd_code,
+		   uint32_t           data_size,
+		   void             * data,
+		   uint32_t           flags,
+		   uint64_t           deadline_tsc)
+{
+    struct hcq_slot * slot = NULL;
+
+    if ((data_size > 0) && (data == NULL)) {
+	ERROR("NULL data pointer, but positive data size\n");
+	return NULL;
+    }
+
+    slot = __ring_cmd_alloc(cq, cmd_code, data_size, flags);
+
+    if (slot == NULL) {
+	return NULL;
+    }
+
+    if ((data_size > 0) && !(flags & HCQ_CMD_FLAG_BULK_CMD)) {
+	memcpy(__ring_cmd_data(cq->ring, slot), data, data_size);
+    }
+
+    slot->deadline_tsc = deadline_tsc;
+    slot->issue_tsc    = __rdtsc();
+
+    /* Cancellers match the segid once they see the command pending */
+    __sync_synchronize();
+    slot->status       = HCQ_CMD_PENDING;
+
+    if (!(flags & HCQ_CMD_FLAG_DISCONNECT)) {
+	__stats_issued(cq);
+    }
+
+    return slot;
+}
+
+static hcq_cmd_t
+__ring_cmd_issue(struct cmd_queue * cq,
+		 uint64_t           cmd_code,
+		 uint32_t           data_size,
+		 void             * data,
+		 uint32_t           flags,
+		 uint64_t           deadline_tsc)
+{
+    struct hcq_slot * slot = NULL;
+
+    slot = __ring_cmd_prepare(cq, cmd_code, data_size, data, flags, deadline_tsc);
+
+    if (slot == NULL) {
+	return HCQ_INVALID_CMD;
+    }
+
+    slot->flags |= HCQ_CMD_FLAG_DOORBELL;
+
+    /* Activate in queue */
+    __ring_push(cq->ring, slot->prio, HCQ_RING_CMD_IDX(slot->cmd_id));
+
+    xemem_signal(cq->client.apid);
+
+    return slot->cmd_id;
+}
+
+static int
+__ring_cmd_issue_batch(struct cmd_queue    * cq,
+		       uint32_t              num_cmds,
+		       struct hcq_cmd_desc * cmds)
+{
+    struct hcq_slot * prev = NULL;
+    struct hcq_slot * slot = NULL;
+    uint32_t          i    = 0;
+
+    for (i = 0; i < num_cmds; i++) {
+	cmds[i].cmd = HCQ_INVALID_CMD;
+    }
+
+    /* Each slot is activated once the next one is allocated, 
+     * so the last queued command is the one that carries the doorbell 
+     */
+    for (i = 0; i < num_cmds; i++) {
+	slot = __ring_cmd_prepare(cq, cmds[i].cmd_code, cmds[i].data_size, cmds[i].data, 0, 0);
+
+	if (slot == NULL) {
+	    ERROR("Only queued %u of %u commands\n", i, num_cmds);
+	    break;
+	}
+
+	cmds[i].cmd = slot->cmd_id;
+
+	if (prev) {
+	    __ring_push(cq->ring, prev->prio, HCQ_RING_CMD_IDX(prev->cmd_id));
+	}
+
+	prev = slot;
+    }
+
+    if (prev == NULL) {
+	return -1;
+    }
+
+    prev->flags = HCQ_CMD_FLAG_DOORBELL;
+    __ring_push(cq->ring, prev->prio, HCQ_RING_CMD_IDX(prev->cmd_id));
+
+    xemem_signal(cq->client.apid);
+
+    return i;
+}
+
+
+static hcq_cmd_t 
+__cmd_submit(struct cmd_queue * cq, 
+	     uint64_t           cmd_code,
+	     uint32_t           data_size,
+	     void             * data,
+	     uint32_t           flags,
+	     uint64_t           deadline_tsc)
+{
+    hcq_cmd_t cmd = HCQ_INVALID_CMD;
+    wg_int    lock_id;
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	return __ring_cmd_issue(cq, cmd_code, data_size, data, flags, deadline_tsc);
+    }
+
+    lock_id = wg_start_write(cq->db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return HCQ_INVALID_CMD;
+    }
+
+    cmd = __cmd_issue(cq, cmd_code, data_size, data, flags | HCQ_CMD_FLAG_DOORBELL, deadline_tsc);
+
+    if (cmd != HCQ_INVALID_CMD) {
+	xemem_signal(cq->client.apid);
+    }
+    
+    if (!wg_end_write(cq->db, lock_id)) {
+	ERROR("Apparently this is catastrophic...\n");
+	return HCQ_INVALID_CMD;
+    }
+
+    return cmd;
+}
+
+static hcq_cmd_t 
+__submit(struct cmd_queue * cq, 
+	 uint64_t           cmd_code,
+	 uint32_t           data_size,
+	 void             * data,
+	 uint64_t           deadline_tsc)
+{
+    hcq_cmd_t cmd   = HCQ_INVALID_CMD;
+    uint32_t  flags = 0;
+
+    if (cq->type != HCQ_CLIENT) {
+	ERROR("Only clients can issue HCQ commands\n");
+	return HCQ_INVALID_CMD;
+    }
+
+    if ((data_size > 0) && (data == NULL)) {
+	ERROR("NULL data pointer, but positive data size\n");
+	return HCQ_INVALID_CMD;
+    }
+
+    flags = __bulk_claim(cq, data_size);
+
+    if (flags & HCQ_CMD_FLAG_BULK_CMD) {
+	memcpy(__bulk_cmd_data(cq->client.bulk), data, data_size);
+    }
+
+    cmd = __cmd_submit(cq, cmd_code, data_size, data, flags, deadline_tsc);
+
+    __bulk_bind(cq, cmd, flags);
+
+    return cmd;
+}
+
+hcq_cmd_t 
+hcq_cmd_submit(hcq_handle_t hcq, 
+	       uint64_t     cmd_code,
+	       uint32_t     data_size,
+	       void       * data)
+{
+    return __submit(hcq, cmd_code, data_size, data, 0);
+}
+
+hcq_cmd_t 
+hcq_cmd_submit_timeout(hcq_handle_t hcq, 
+		       uint64_t     cmd_code,
+		       uint32_t     data_size,
+		       void       * data,
+		       uint64_t     timeout_us)
+{
+    return __submit(hcq, cmd_code, data_size, data, __deadline_tsc(timeout_us));
+}
+
+
+int
+hcq_cmd_submit_batch(hcq_handle_t          hcq, 
+		     uint32_t              num_cmds,
+		     struct hcq_cmd_desc * cmds)
+{
+    struct cmd_queue * cq  = hcq;
+    int                ret = 0;
+
+    wg_int    lock_id;
+
+    if (cq->type != HCQ_CLIENT) {
+	ERROR("Only clients can issue HCQ commands\n");
+	return -1;
+    }
+
+    if (num_cmds == 0) {
+	return 0;
+    }
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	return __ring_cmd_issue_batch(cq, num_cmds, cmds);
+    }
+
+    lock_id = wg_start_write(cq->db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return -1;
+    }
+
+    ret = __cmd_issue_batch(cq, num_cmds, cmds);
+    
+    if (!wg_end_write(cq->db, lock_id)) {
+	ERROR("Apparently this is catastrophic...\n");
+	return -1;
+    }
+
+    return ret;
+}
+
+
+hcq_cmd_t
+hcq_cmd_reserve(hcq_handle_t   hcq,
+		uint64_t       cmd_code,
+		uint32_t       data_size,
+		void        ** data)
+{
+    struct cmd_queue * cq    = hcq;
+    struct hcq_slot  * slot  = NULL;
+    hcq_cmd_t          cmd   = HCQ_INVALID_CMD;
+    uint32_t           flags = 0;
+
+    *data = NULL;
+
+    if (cq->type != HCQ_CLIENT) {
+	ERROR("Only clients can issue HCQ commands\n");
+	return HCQ_INVALID_CMD;
+    }
+
+    flags = __bulk_claim(cq, data_size);
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	slot = __ring_cmd_alloc(cq, cmd_code, data_size, flags);
+
+	if (slot == NULL) {
+	    __bulk_bind(cq, HCQ_INVALID_CMD, flags);
+	    return HCQ_INVALID_CMD;
+	}
+
+	cmd   = slot->cmd_id;
+	*data = __ring_cmd_data(cq->ring, slot);
+    } else {
+	cmd   = HCQ_CMD_RESERVATION(cq->client.next_reservation++);
+	*data = __stage_data(&(cq->client.reservations), (uintptr_t)cmd, cmd_code, data_size, flags);
+
+	if (*data == NULL) {
+	    __bulk_bind(cq, HCQ_INVALID_CMD, flags);
+	    return HCQ_INVALID_CMD;
+	}
+    }
+
+    if (flags & HCQ_CMD_FLAG_BULK_CMD) {
+	*data = __bulk_cmd_data(cq->client.bulk);
+    }
+
+    /* On the DB backend the buffer moves to the real command ID at commit time */
+    __bulk_bind(cq, cmd, flags);
+
+    return cmd;
+}
+
+
+hcq_cmd_t
+hcq_cmd_commit(hcq_handle_t hcq,
+	       hcq_cmd_t    cmd)
+{
+    struct cmd_queue       * cq    = hcq;
+    struct hcq_slot        * slot  = NULL;
+    struct hcq_staged_data * stage = NULL;
+    void                   * data  = NULL;
+
+    if (cq->type != HCQ_CLIENT) {
+	ERROR("Only clients can issue HCQ commands\n");
+	return HCQ_INVALID_CMD;
+    }
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	slot = __ring_get_slot(cq, cmd);
+
+	if ((slot == NULL) || (slot->status != HCQ_RING_SLOT_RESERVED)) {
+	    ERROR("Could not find reserved command to commit (ID=%lu)\n", cmd);
+	    return HCQ_INVALID_CMD;
+	}
+
+	slot->issue_tsc  = __rdtsc();
+	slot->status     = HCQ_CMD_PENDING;
+	slot->flags     |= HCQ_CMD_FLAG_DOORBELL;
+
+	__stats_issued(cq);
+
+	/* Activate in queue */
+	__ring_push(cq->ring, slot->prio, HCQ_RING_CMD_IDX(cmd));
+
+	xemem_signal(cq->client.apid);
+
+	return cmd;
+    }
+
+    stage = __unstage_data(cq->client.reservations, (uintptr_t)cmd);
+
+    if (stage == NULL) {
+	ERROR("Could not find reserved command to commit (ID=%lu)\n", cmd);
+	return HCQ_INVALID_CMD;
+    }
+
+    if (stage->flags & HCQ_CMD_FLAG_BULK_CMD) {
+	data = __bulk_cmd_data(cq->client.bulk);
+    } else {
+	data = stage->data;
+    }
+
+    cmd = __cmd_submit(cq, stage->cmd_code, stage->data_size, data, stage->flags, 0);
+
+    __bulk_bind(cq, cmd, stage->flags);
+
+    free(stage);
+
+    return cmd;
+}
+
+
+int
+hcq_cmd_abort(hcq_handle_t hcq,
+	      hcq_cmd_t    cmd)
+{
+    struct cmd_queue       * cq    = hcq;
+    struct hcq_slot        * slot  = NULL;
+    struct hcq_staged_data * stage = NULL;
+
+    if (cq->type != HCQ_CLIENT) {
+	ERROR("Only clients can abort HCQ commands\n");
+	return -1;
+    }
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	slot = __ring_get_slot(cq, cmd);
+
+	if ((slot == NULL) || (slot->status != HCQ_RING_SLOT_RESERVED)) {
+	    ERROR("Could not find reserved command to abort (ID=%lu)\n", cmd);
+	    return -1;
+	}
+
+	__ring_free_slot(cq->ring, slot);
+	__bulk_release(cq, cmd);
+
+	return 0;
+    }
+
+    stage = __unstage_data(cq->client.reservations, (uintptr_t)cmd);
+
+    if (stage == NULL) {
+	ERROR("Could not find reserved command to abort (ID=%lu)\n", cmd);
+	return -1;
+    }
+
+    __bulk_release(cq, cmd);
+
+    free(stage);
+
+    return 0;
+}
+
+
+hcq_cmd_t 
+hcq_cmd_issue_timeout(hcq_handle_t hcq, 
+		      uint64_t     cmd_code,
+		      uint32_t     data_size,
+		      void       * data,
+		      uint64_t     timeout_us)
+{
+    hcq_cmd_t cmd = HCQ_INVALID_CMD;
+    int       ret = 0;
+
+    cmd = hcq_cmd_submit_timeout(hcq, cmd_code, data_size, data, timeout_us);
+
+    if (cmd == HCQ_INVALID_CMD) {
+	return HCQ_INVALID_CMD;
+    }
+
+    ret = hcq_cmd_wait_timeout(hcq, cmd, timeout_us);
+
+    if (ret != 0) {
+	if (ret != -ETIMEDOUT) {
+	    ERROR("Error waiting for command (ID=%lu)\n", cmd);
+	}
+
+	hcq_cmd_cancel(hcq, cmd);
+	return HCQ_INVALID_CMD;
+    }
+
+    return cmd;
+}
+
+hcq_cmd_t 
+hcq_cmd_issue(hcq_handle_t hcq, 
+	      uint64_t     cmd_code,
+	      uint32_t     data_size,
+	      void       * data)
+{
+    hcq_cmd_t cmd = HCQ_INVALID_CMD;
+
+    cmd = hcq_cmd_submit(hcq, cmd_code, data_size, data);
+
+    if (cmd == HCQ_INVALID_CMD) {
+	return HCQ_INVALID_CMD;
+    }
+    
+    /* poll for completion */
+    if (hcq_cmd_wait(hcq, cmd) != 0) {
+	ERROR("Error waiting for command (ID=%lu)\n", cmd);
+    }
+
+    return cmd;
+}
+
+
+int
+hcq_cmd_issue_batch(hcq_handle_t          hcq, 
+		    uint32_t              num_cmds,
+		    struct hcq_cmd_desc * cmds)
+{
+    int ret = 0;
+    int i   = 0;
+
+    ret = hcq_cmd_submit_batch(hcq, num_cmds, cmds);
+
+    for (i = 0; i < ret; i++) {
+	if (hcq_cmd_wait(hcq, cmds[i].cmd) != 0) {
+	    ERROR("Error waiting for command (ID=%lu)\n", cmds[i].cmd);
+	}
+    }
+
+    return ret;
+}
+
+
+int
+hcq_cmd_test(hcq_handle_t hcq,
+	     hcq_cmd_t    cmd)
+{
+    hcq_cmd_status_t status = hcq_get_cmd_status(hcq, cmd);
+
+    if (status == (hcq_cmd_status_t)-1) {
+	return -1;
+    }
+
+    return (status == HCQ_CMD_RETURNED) ? 1 : 0;
+}
+
+
+static uint64_t
+__now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+static inline void
+__cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    asm volatile ("pause" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
+/* 
+ * Spin on the command's status word until it returns or the spin budget runs out.
+ * Returns 1 if the command returned, 0 if the budget expired, -1 on error.
+ *
+ * The DB record is located once under the read lock. The status field is then 
+ * polled without the lock so the spinning client does not contend with the server
+ * for it. This is safe because a record is only deleted by the issuing client, or
+ * by the server once that client has cancelled it.
+ */
+static int
+__spin_wait(struct cmd_queue * cq,
+	    hcq_cmd_t          cmd)
+{
+    struct hcq_slot * slot     = NULL;
+    void            * cmd_rec  = NULL;
+    uint64_t          deadline = 0;
+    uint32_t          i        = 0;
+
+    wg_int lock_id;
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	slot = __ring_get_slot(cq, cmd);
+
+	if (slot == NULL) {
+	    ERROR("Could not find command (ID=%lu) in queue\n", cmd);
+	    return -1;
+	}
+    } else {
+	lock_id = wg_start_read(cq->db);
+	
+	if (!lock_id) {
+	    ERROR("Could not lock database\n");
+	    return -1;
+	}
+	
+	cmd_rec = __get_cmd_rec(cq, cmd);
+	
+	if (!wg_end_read(cq->db, lock_id)) {
+	    ERROR("Apparently this is catastrophic...\n");
+	    return -1;
+	}
+	
+	if (cmd_rec == NULL) {
+	    ERROR("Could not find command (ID=%lu) in queue\n", cmd);
+	    return -1;
+	}
+    }
+
+    deadline = __now_us() + cq->client.spin_us;
+
+    while (1) {
+	for (i = 0; i < HCQ_SPIN_CHECK_INTERVAL; i++) {
+	    uint32_t status = 0;
+
+	    if (slot) {
+		status = *(volatile uint32_t *)&(slot->status);
+	    } else {
+		status = wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_STATUS));
+	    }
+
+	    if (status == HCQ_CMD_RETURNED) {
+		__sync_synchronize();
+		return 1;
+	    }
+
+	    __cpu_relax();
+	}
+
+	if (__now_us() >= deadline) {
+	    return 0;
+	}
+    }
+}
+
+/* Wait until the command returns or deadline_us (0 = never) passes */
+static int
+__cmd_wait(struct cmd_queue * cq,
+	   hcq_cmd_t          cmd,
+	   uint64_t           deadline_us)
+{
+    struct hcq_wait_stats * stats   = NULL;
+    struct pollfd           ufd     = {cq->client.fd, POLLIN, 0};
+    int                     timeout = -1;
+    int                     ret     = 0;
+
+    if (cq->type != HCQ_CLIENT) {
+	ERROR("Only clients can wait on HCQ commands\n");
+	return -1;
+    }
+
+    stats = &(cq->client.wait_stats);
+
+    __sync_fetch_and_add(&(stats->waits), 1);
+
+    if (cq->client.spin_us > 0) {
+	ret = __spin_wait(cq, cmd);
+
+	if (ret == 1) {
+	    __sync_fetch_and_add(&(stats->spin_hits), 1);
+
+	    /* Consume the completion signal if it has already arrived */
+	    if ((poll(&ufd, 1, 0) == 1) && (ufd.revents & POLLIN)) {
+		xemem_ack(cq->client.fd);
+	    }
+
+	    return 0;
+	} else if (ret == -1) {
+	    return -1;
+	}
+
+	__sync_fetch_and_add(&(stats->spin_misses), 1);
+    }
+
+    /* Other waiters may consume our signal, so always recheck the status before sleeping */
+    while ((ret = hcq_cmd_test(cq, cmd)) == 0) {
+	if (deadline_us != 0) {
+	    uint64_t now = __now_us();
+
+	    if (now >= deadline_us) {
+		return -ETIMEDOUT;
+	    }
+
+	    timeout = (deadline_us - now + 999) / 1000;
+	}
+
+	__sync_fetch_and_add(&(stats->blocks), 1);
+
+	if (poll(&ufd, 1, timeout) == -1) { 
+	    if (errno == EINTR) {
+		continue;
+	    }
+
+	    ERROR("poll() error\n");
+	    return -1;
+	}
+
+	if (ufd.revents & POLLIN) {
+	    xemem_ack(cq->client.fd);
+	}
+    }
+
+    return (ret == 1) ? 0 : -1;
+}
+
+int
+hcq_cmd_wait(hcq_handle_t hcq,
+	     hcq_cmd_t    cmd)
+{
+    return __cmd_wait(hcq, cmd, 0);
+}
+
+int
+hcq_cmd_wait_timeout(hcq_handle_t hcq,
+		     hcq_cmd_t    cmd,
+		     uint64_t     timeout_us)
+{
+    return __cmd_wait(hcq, cmd, __now_us() + timeout_us);
+}
+
+
+int
+hcq_set_spin_budget(hcq_handle_t hcq,
+		    uint32_t     spin_us)
+{
+    struct cmd_queue * cq = hcq;
+
+    if (cq->type != HCQ_CLIENT) {
+	ERROR("Only clients have a wait policy\n");
+	return -1;
+    }
+
+    cq->client.spin_us = spin_us;
+
+    return 0;
+}
+
+
+int
+hcq_get_wait_stats(hcq_handle_t            hcq,
+		   struct hcq_wait_stats * stats)
+{
+    struct cmd_queue * cq = hcq;
+
+    if (cq->type != HCQ_CLIENT) {
+	ERROR("Only clients have wait statistics\n");
+	return -1;
+    }
+
+    *stats = cq->client.wait_stats;
+
+    return 0;
+}
+
+
+int
+hcq_cmd_wait_any(uint32_t       num_cmds,
+		 hcq_handle_t * hcqs,
+		 hcq_cmd_t    * cmds)
+{
+    struct pollfd * ufds    = NULL;
+    uint32_t        num_fds = 0;
+    uint32_t        i       = 0;
+    uint32_t        j       = 0;
+    int             ret     = -1;
+
+    ufds = calloc(sizeof(struct pollfd), num_cmds);
+
+    if (ufds == NULL) {
+	ERROR("Could not allocate pollfd array\n");
+	return -1;
+    }
+
+    /* Poll each client fd once, even if several commands share a queue */
+    for (i = 0; i < num_cmds; i++) {
+	struct cmd_queue * cq = hcqs[i];
+
+	if (cmds[i] == HCQ_INVALID_CMD) {
+	    continue;
+	}
+
+	if (cq->type != HCQ_CLIENT) {
+	    ERROR("Only clients can wait on HCQ commands\n");
+	    goto out;
+	}
+
+	for (j = 0; j < num_fds; j++) {
+	    if (ufds[j].fd == cq->client.fd) {
+		break;
+	    }
+	}
+
+	if (j == num_fds) {
+	    ufds[num_fds].fd     = cq->client.fd;
+	    ufds[num_fds].events = POLLIN;
+	    num_fds++;
+	}
+    }
+
+    if (num_fds == 0) {
+	ERROR("No valid commands to wait on\n");
+	goto out;
+    }
+
+    while (1) {
+	for (i = 0; i < num_cmds; i++) {
+	    int status = 0;
+
+	    if (cmds[i] == HCQ_INVALID_CMD) {
+		continue;
+	    }
+
+	    status = hcq_cmd_test(hcqs[i], cmds[i]);
+
+	    if (status == 1) {
+		ret = i;
+		goto out;
+	    } else if (status == -1) {
+		ERROR("Could not get status of command (ID=%lu)\n", cmds[i]);
+		goto out;
+	    }
+	}
+
+	if (poll(ufds, num_fds, -1) == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+
+	    ERROR("poll() error\n");
+	    goto out;
+	}
+
+	for (j = 0; j < num_fds; j++) {
+	    if (ufds[j].revents & POLLIN) {
+		xemem_ack(ufds[j].fd);
 	    }
 	}
     }
 
+ out:
+    free(ufds);
 
-    return cmd;
+    return ret;
 }
 
 
@@ -588,6 +3537,28 @@ __get_cmd_status(struct cmd_queue * cq,
     return status;
 }
 
+static hcq_cmd_status_t
+__ring_get_cmd_status(struct cmd_queue * cq, 
+		      hcq_cmd_t          cmd)
+{
+    struct hcq_slot  * slot   = NULL;
+    hcq_cmd_status_t   status = -1;
+
+    slot = __ring_get_slot(cq, cmd);
+
+    if (slot == NULL) {
+	ERROR("Could not find command (ID=%lu) in queue\n", cmd);
+	return -1;
+    }
+
+    status = *(volatile uint32_t *)&(slot->status);
+
+    /* Order the status read before any reads of the return fields */
+    __sync_synchronize();
+
+    return status;
+}
+
 
 hcq_cmd_status_t
 hcq_get_cmd_status(hcq_handle_t hcq, 
@@ -597,6 +3568,10 @@ hcq_get_cmd_status(hcq_handle_t hcq,
     hcq_cmd_status_t   status = -1;
     wg_int             lock_id;
 
+    if (cq->backend == HCQ_BACKEND_RING) {
+	return __ring_get_cmd_status(cq, cmd);
+    }
+
     lock_id = wg_start_read(cq->db);
 
     if (!lock_id) {
@@ -635,6 +3610,22 @@ __get_ret_code(struct cmd_queue * cq,
     return ret_code;
 }
 
+static int64_t
+__ring_get_ret_code(struct cmd_queue * cq, 
+		    hcq_cmd_t          cmd)
+{
+    struct hcq_slot * slot = NULL;
+
+    slot = __ring_get_slot(cq, cmd);
+
+    if (slot == NULL) {
+	ERROR("Could not find command (ID=%lu) in queue\n", cmd);
+	return -1;
+    }
+
+    return slot->ret_code;
+}
+
 
 int64_t
 hcq_get_ret_code(hcq_handle_t hcq, 
@@ -644,6 +3635,10 @@ hcq_get_ret_code(hcq_handle_t hcq,
     int64_t            ret_code = -1;
     wg_int             lock_id;
 
+    if (cq->backend == HCQ_BACKEND_RING) {
+	return __ring_get_ret_code(cq, cmd);
+    }
+
     lock_id = wg_start_read(cq->db);
 
     if (!lock_id) {
@@ -670,6 +3665,7 @@ __get_ret_data(struct cmd_queue * cq,
     void    * cmd_rec   = NULL;
     void    * data      = NULL;
     uint32_t  data_size = 0;
+    uint32_t  flags     = 0;
 
     cmd_rec = __get_cmd_rec(cq, cmd);
 
@@ -679,15 +3675,45 @@ __get_ret_data(struct cmd_queue * cq,
     }
 
     data_size = wg_decode_int(cq->db,  wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_RET_SIZE));
+    flags     = wg_decode_int(cq->db,  wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_FLAGS));
 
-    if (data_size > 0) {
+    if ((data_size > 0) && (flags & HCQ_CMD_FLAG_BULK_RET)) {
+	data  = __bulk_ret_data(cq->client.bulk);
+    } else if (data_size > 0) {
 	data  = wg_decode_blob(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_RET_DATA));
+	__bulk_note_ret(cq, data_size);
     }
 
     *size = data_size;
     return data;
 }
 
+static void *
+__ring_get_ret_data(struct cmd_queue * cq, 
+		    hcq_cmd_t          cmd,
+		    uint32_t         * size)
+{
+    struct hcq_slot * slot = NULL;
+    void            * data = NULL;
+
+    slot = __ring_get_slot(cq, cmd);
+
+    if (slot == NULL) {
+	ERROR("Could not find command (ID=%lu) in queue\n", cmd);
+	*size = 0;
+	return NULL;
+    }
+
+    if ((slot->ret_size > 0) && (slot->flags & HCQ_CMD_FLAG_BULK_RET)) {
+	data = __bulk_ret_data(cq->client.bulk);
+    } else if (slot->ret_size > 0) {
+	data = __ring_ret_data(cq->ring, slot);
+    }
+
+    *size = slot->ret_size;
+    return data;
+}
+
 
 void *
 hcq_get_ret_data(hcq_handle_t  hcq, 
@@ -700,6 +3726,10 @@ hcq_get_ret_data(hcq_handle_t  hcq,
     uint32_t   data_size = 0;
     wg_int     lock_id;
 
+    if (cq->backend == HCQ_BACKEND_RING) {
+	return __ring_get_ret_data(cq, cmd, size);
+    }
+
     lock_id = wg_start_read(cq->db);
 
     if (!lock_id) {
@@ -733,14 +3763,61 @@ __complete_cmd(struct cmd_queue * cq,
 	return -1;
     }
 
-    if (wg_delete_record(cq->db, cmd_rec) != 0) {
-	ERROR("Could not delete completed Command from queue\n");
+    if (wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_STATUS)) == HCQ_CMD_CANCELLED) {
+	ERROR("Command (ID=%lu) was already cancelled\n", cmd);
+	return -1;
+    }
+
+    return __release_cmd_rec(cq, cmd_rec);
+}
+
+static int
+__ring_complete_cmd(struct cmd_queue * cq, 
+		    hcq_cmd_t          cmd)
+{
+    struct hcq_slot * slot = NULL;
+
+    slot = __ring_get_slot(cq, cmd);
+
+    if (slot == NULL) {
+	ERROR("Could not find Command (ID=%lu) in queue\n", cmd);
 	return -1;
     }
 
+    /* The server's return races with the cancellation, whoever loses frees the slot */
+    if (__sync_bool_compare_and_swap(&(slot->status), HCQ_CMD_PENDING, HCQ_CMD_CANCELLED)) {
+	__stats_completed(cq, 0);
+	return 1;
+    }
+
+    if (slot->status != HCQ_CMD_RETURNED) {
+	ERROR("Command (ID=%lu) is not outstanding\n", cmd);
+	return -1;
+    }
+
+    __stats_completed(cq, 1);
+
+    __ring_free_slot(cq->ring, slot);
+
     return 0;
 }
 
+/* Drop the large payload buffer from a released command */
+static int
+__complete_bulk(struct cmd_queue * cq,
+		hcq_cmd_t          cmd,
+		int                ret)
+{
+    if (ret == 1) {
+	__bulk_orphan(cq, cmd);
+	return 0;
+    }
+
+    __bulk_release(cq, cmd);
+
+    return ret;
+}
+
 int 
 hcq_cmd_complete(hcq_handle_t hcq,
 		 hcq_cmd_t    cmd)
@@ -749,6 +3826,12 @@ hcq_cmd_complete(hcq_handle_t hcq,
     wg_int lock_id;
     int    ret = 0;
 
+    if (cq->backend == HCQ_BACKEND_RING) {
+	ret = __ring_complete_cmd(cq, cmd);
+
+	return __complete_bulk(cq, cmd, ret);
+    }
+
     lock_id = wg_start_write(cq->db);
 
     if (!lock_id) {
@@ -763,18 +3846,282 @@ hcq_cmd_complete(hcq_handle_t hcq,
 	return -1;
     }
 
-    return ret; 
+    return __complete_bulk(cq, cmd, ret);
+}
+
+int
+hcq_cmd_cancel(hcq_handle_t hcq,
+	       hcq_cmd_t    cmd)
+{
+    struct cmd_queue * cq = hcq;
+
+    if (cq->type != HCQ_CLIENT) {
+	ERROR("Only clients can cancel HCQ commands\n");
+	return -1;
+    }
+
+    return hcq_cmd_complete(hcq, cmd);
+}
+
+
+/* Fetch the return code and data, and release the command in one step */
+static int64_t
+__collect_cmd(struct cmd_queue * cq,
+	      hcq_cmd_t          cmd,
+	      void             * out,
+	      uint32_t           out_cap,
+	      uint32_t         * out_len)
+{
+    void     * cmd_rec   = NULL;
+    void     * data      = NULL;
+    int64_t    ret_code  = 0;
+    uint32_t   data_size = 0;
+    uint32_t   flags     = 0;
+
+    cmd_rec = __get_cmd_rec(cq, cmd);
+
+    if (cmd_rec == NULL) {
+	ERROR("Could not find command (ID=%lu) in queue\n", cmd);
+	return -1;
+    }
+
+    if (wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_STATUS)) != HCQ_CMD_RETURNED) {
+	ERROR("Command (ID=%lu) has not returned\n", cmd);
+	return -1;
+    }
+
+    ret_code  = wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_RET_CODE));
+    data_size = wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_RET_SIZE));
+    flags     = wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_FLAGS));
+
+    if ((data_size > 0) && (out_cap > 0)) {
+	if (flags & HCQ_CMD_FLAG_BULK_RET) {
+	    data = __bulk_ret_data(cq->client.bulk);
+	} else {
+	    data = wg_decode_blob(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_RET_DATA));
+	    __bulk_note_ret(cq, data_size);
+	}
+
+	memcpy(out, data, (data_size < out_cap) ? data_size : out_cap);
+    }
+
+    *out_len = data_size;
+
+    __stats_completed(cq, 1);
+
+    if (wg_delete_record(cq->db, cmd_rec) != 0) {
+	ERROR("Could not delete completed Command from queue\n");
+    }
+
+    return ret_code;
+}
+
+static int64_t
+__ring_collect_cmd(struct cmd_queue * cq,
+		   hcq_cmd_t          cmd,
+		   void             * out,
+		   uint32_t           out_cap,
+		   uint32_t         * out_len)
+{
+    struct hcq_slot * slot      = NULL;
+    int64_t           ret_code  = 0;
+    uint32_t          data_size = 0;
+
+    slot = __ring_get_slot(cq, cmd);
+
+    if (slot == NULL) {
+	ERROR("Could not find command (ID=%lu) in queue\n", cmd);
+	return -1;
+    }
+
+    if (*(volatile uint32_t *)&(slot->status) != HCQ_CMD_RETURNED) {
+	ERROR("Command (ID=%lu) has not returned\n", cmd);
+	return -1;
+    }
+
+    __sync_synchronize();
+
+    ret_code  = slot->ret_code;
+    data_size = slot->ret_size;
+
+    if ((data_size > 0) && (out_cap > 0)) {
+	void * data = (slot->flags & HCQ_CMD_FLAG_BULK_RET) ? 
+	    __bulk_ret_data(cq->client.bulk) : __ring_ret_data(cq->ring, slot);
+
+	memcpy(out, data, (data_size < out_cap) ? data_size : out_cap);
+    }
+
+    *out_len = data_size;
+
+    __stats_completed(cq, 1);
+
+    __ring_free_slot(cq->ring, slot);
+
+    return ret_code;
+}
+
+int64_t
+hcq_cmd_collect(hcq_handle_t   hcq,
+		hcq_cmd_t      cmd,
+		void         * out,
+		uint32_t       out_cap,
+		uint32_t     * out_len)
+{
+    struct cmd_queue * cq       = hcq;
+    uint32_t           len      = 0;
+    int64_t            ret_code = 0;
+    wg_int             lock_id;
+
+    if (out_len == NULL) {
+	out_len = &len;
+    }
+
+    *out_len = 0;
+
+    if ((out_cap > 0) && (out == NULL)) {
+	ERROR("NULL output buffer, but positive output capacity\n");
+	return -1;
+    }
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	ret_code = __ring_collect_cmd(cq, cmd, out, out_cap, out_len);
+	__bulk_release(cq, cmd);
+
+	return ret_code;
+    }
+
+    /* Releasing the record modifies the database, so this needs the write lock */
+    lock_id = wg_start_write(cq->db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return -1;
+    }
+
+    ret_code = __collect_cmd(cq, cmd, out, out_cap, out_len);
+    
+    if (!wg_end_write(cq->db, lock_id)) {
+	ERROR("Apparently this is catastrophic...\n");
+	return -1;
+    }
+
+    __bulk_release(cq, cmd);
+
+    return ret_code;
+}
+
+
+int64_t
+hcq_call(hcq_handle_t   hcq,
+	 uint64_t       cmd_code,
+	 void         * in,
+	 uint32_t       in_len,
+	 void         * out,
+	 uint32_t       out_cap,
+	 uint32_t     * out_len)
+{
+    hcq_cmd_t cmd = HCQ_INVALID_CMD;
+
+    if (out_len != NULL) {
+	*out_len = 0;
+    }
+
+    cmd = hcq_cmd_submit(hcq, cmd_code, in_len, in);
+
+    if (cmd == HCQ_INVALID_CMD) {
+	ERROR("Could not issue command (code=%lu)\n", cmd_code);
+	return -1;
+    }
+
+    if (hcq_cmd_wait(hcq, cmd) != 0) {
+	ERROR("Error waiting for command (ID=%lu)\n", cmd);
+	hcq_cmd_cancel(hcq, cmd);
+	return -1;
+    }
+
+    return hcq_cmd_collect(hcq, cmd, out, out_cap, out_len);
+}
+
+
+/* 
+ * Handle a dequeued command that should not run. Cancelled commands are freed, 
+ * expired ones are returned with HCQ_RET_EXPIRED, and disconnect notices close
+ * the client's connection. Returns 1 if it was skipped.
+ */
+static int
+__skip_cmd(struct cmd_queue * cq,
+	   void             * cmd_rec)
+{
+    void         * db    = cq->db;
+    xemem_segid_t  segid = 0;
+    uint32_t       flags = 0;
+
+    segid = wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_SEGID));
+    flags = wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_FLAGS));
+
+    if (flags & HCQ_CMD_FLAG_DISCONNECT) {
+	wg_delete_record(db, cmd_rec);
+
+	pthread_mutex_lock(&(cq->server.lock));
+	__drop_conn(cq, segid);
+	pthread_mutex_unlock(&(cq->server.lock));
+
+	return 1;
+    }
+
+    if (wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_STATUS)) == HCQ_CMD_CANCELLED) {
+	wg_delete_record(db, cmd_rec);
+	return 1;
+    }
+
+    if (!__deadline_passed(wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_DEADLINE)))) {
+	return 0;
+    }
+
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_RET_CODE, wg_encode_int(db, HCQ_RET_EXPIRED));
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_RET_SIZE, wg_encode_int(db, 0));
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_FLAGS,    wg_encode_int(db, flags & ~HCQ_CMD_FLAG_BULK_RET));
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_STATUS,   wg_encode_int(db, HCQ_CMD_RETURNED));
+
+    __stats_expired(cq);
+
+    __signal_client(cq, segid);
+
+    return 1;
 }
 
+/* 
+ * Choose the lane to dequeue from. High priority commands go first, but after 
+ * HCQ_PRIO_BURST of them in a row a waiting normal command gets its turn.
+ */
+static hcq_prio_t
+__pick_lane(struct cmd_queue * cq,
+	    int                hi_ready,
+	    int                lo_ready)
+{
+    if ((hi_ready) && 
+	((!lo_ready) || (cq->server.hi_streak < HCQ_PRIO_BURST))) {
+	cq->server.hi_streak = (lo_ready) ? cq->server.hi_streak + 1 : 0;
+	return HCQ_PRIO_HIGH;
+    }
+
+    cq->server.hi_streak = 0;
+    return HCQ_PRIO_NORMAL;
+}
 
 static hcq_cmd_t
 __get_next_cmd(struct cmd_queue * cq)
 {
     hcq_cmd_t   next_cmd = HCQ_INVALID_CMD;
     uint64_t    cmd_cnt  = 0;
+    uint64_t    hi_cnt   = 0;
+    hcq_prio_t  prio     = HCQ_PRIO_NORMAL;
     void      * hdr_rec  = NULL;
+    void      * cmd_rec  = NULL;
     void      * db       = cq->db;
     
+    __sweep_clients(cq);
+
     hdr_rec = wg_find_record_int(db, HCQ_TYPE_FIELD, WG_COND_EQUAL, HCQ_HEADER_TYPE, NULL);
     
     if (!hdr_rec) {
@@ -782,21 +4129,132 @@ __get_next_cmd(struct cmd_queue * cq)
 	return HCQ_INVALID_CMD;
     }
 
-    cmd_cnt  = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_FIELD_OUTSTANDING));
-    next_cmd = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_FIELD_PENDING));
+    do {
+	cmd_cnt  = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_FIELD_OUTSTANDING));
+	hi_cnt   = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_FIELD_HI_OUTSTAND));
+
+	if ((cmd_cnt <= 0) && (hi_cnt <= 0)) {
+	    return HCQ_INVALID_CMD;
+	}
+
+	prio     = __pick_lane(cq, (hi_cnt > 0), (cmd_cnt > 0));
+	cmd_cnt  = (prio == HCQ_PRIO_HIGH) ? hi_cnt : cmd_cnt;
+	next_cmd = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_PENDING(prio)));
+
+	/* Mark command as taken */
+	wg_set_field(db, hdr_rec, HCQ_HDR_OUTSTANDING(prio), wg_encode_int(db, cmd_cnt - 1));
+	wg_set_field(db, hdr_rec, HCQ_HDR_PENDING(prio),     wg_encode_int(db, next_cmd + 1));
+
+	next_cmd = HCQ_CMD_LANE_ID(prio, next_cmd);
+	cmd_rec  = __get_cmd_rec(cq, next_cmd);
+
+	/* Quiesce the signal, if one was sent for this command */
+	if ((cmd_rec == NULL) ||
+	    (wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_FLAGS)) & HCQ_CMD_FLAG_DOORBELL)) {
+	    xemem_ack(cq->server.fd);
+	}
+    } while ((cmd_rec != NULL) && (__skip_cmd(cq, cmd_rec)));
+
+    if (cmd_rec != NULL) {
+	wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_START_TSC, wg_encode_int(db, __rdtsc()));
+
+	__stats_started(cq, 
+			wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_CMD_CODE)),
+			wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_ISSUE_TSC)));
+
+	__conn_start(cq, wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_SEGID)));
+    }
+
+    return next_cmd;
+}
+
+/* 
+ * Hand a returned slot back to its client. If the client cancelled the command
+ * in the meantime nobody is waiting for it, so the slot is freed instead.
+ */
+static void
+__ring_publish(struct cmd_queue * cq,
+	       struct hcq_slot  * slot)
+{
+    /* The client may free the slot as soon as it sees it returned */
+    xemem_segid_t segid = slot->segid;
+
+    if (!__sync_bool_compare_and_swap(&(slot->status), HCQ_CMD_PENDING, HCQ_CMD_RETURNED)) {
+	__ring_free_slot(cq->ring, slot);
+	return;
+    }
+
+    /* Signal Client apid */
+    __signal_client(cq, segid);
+}
+
+static hcq_cmd_t
+__ring_get_next_cmd(struct cmd_queue * cq)
+{
+    struct hcq_ring * ring = cq->ring;
+    struct hcq_slot * slot = NULL;
+    uint32_t          idx  = 0;
+    hcq_prio_t        prio = HCQ_PRIO_NORMAL;
+
+    __sweep_clients(cq);
+
+    while (1) {
+	prio = __pick_lane(cq, 
+			   __ring_lane_busy(ring, HCQ_PRIO_HIGH), 
+			   __ring_lane_busy(ring, HCQ_PRIO_NORMAL));
+
+	idx  = __ring_pop(ring, prio);
+
+	if (idx == HCQ_RING_NIL) {
+	    idx = __ring_pop(ring, !prio);
+	}
+
+	if (idx == HCQ_RING_NIL) {
+	    return HCQ_INVALID_CMD;
+	}
+
+	slot = __ring_slot(ring, idx);
 
-    if (cmd_cnt <= 0) {
-	return HCQ_INVALID_CMD;
+	/* Quiesce the signal, if one was sent for this command */
+	if (slot->flags & HCQ_CMD_FLAG_DOORBELL) {
+	    xemem_ack(cq->server.fd);
+	}
+
+	if (slot->flags & HCQ_CMD_FLAG_DISCONNECT) {
+	    xemem_segid_t segid = slot->segid;
+
+	    __ring_free_slot(ring, slot);
+
+	    pthread_mutex_lock(&(cq->server.lock));
+	    __drop_conn(cq, segid);
+	    pthread_mutex_unlock(&(cq->server.lock));
+	    continue;
+	}
+
+	if (*(volatile uint32_t *)&(slot->status) == HCQ_CMD_CANCELLED) {
+	    __ring_free_slot(ring, slot);
+	    continue;
+	}
+
+	if (__deadline_passed(slot->deadline_tsc)) {
+	    slot->ret_code = HCQ_RET_EXPIRED;
+	    slot->ret_size = 0;
+	    slot->flags   &= ~HCQ_CMD_FLAG_BULK_RET;
+
+	    __stats_expired(cq);
+	    __ring_publish(cq, slot);
+	    continue;
+	}
+
+	break;
     }
 
-    /* Mark command as taken */
-    wg_set_field(db, hdr_rec, HCQ_HDR_FIELD_OUTSTANDING, wg_encode_int(db, cmd_cnt - 1));
-    wg_set_field(db, hdr_rec, HCQ_HDR_FIELD_PENDING,     wg_encode_int(db, next_cmd + 1));
+    slot->start_tsc = __rdtsc();
+    __stats_started(cq, slot->cmd_code, slot->issue_tsc);
 
-    /* Quiesce the signal */
-    xemem_ack(cq->server.fd);
+    __conn_start(cq, slot->segid);
 
-    return next_cmd;
+    return slot->cmd_id;
 }
 
 hcq_cmd_t
@@ -812,7 +4270,12 @@ hcq_get_next_cmd(hcq_handle_t hcq)
 	return HCQ_INVALID_CMD;
     }
 
-    lock_id = wg_start_read(cq->db);
+    if (cq->backend == HCQ_BACKEND_RING) {
+	return __ring_get_next_cmd(cq);
+    }
+
+    /* Dequeueing updates the header record, so this needs the write lock */
+    lock_id = wg_start_write(cq->db);
 
     if (!lock_id) {
 	ERROR("Could not lock database\n");
@@ -821,7 +4284,7 @@ hcq_get_next_cmd(hcq_handle_t hcq)
 
     cmd = __get_next_cmd(cq);
     
-    if (!wg_end_read(cq->db, lock_id)) {
+    if (!wg_end_write(cq->db, lock_id)) {
 	ERROR("Apparently this is catastrophic...\n");
 	return HCQ_INVALID_CMD;
     }
@@ -829,6 +4292,60 @@ hcq_get_next_cmd(hcq_handle_t hcq)
     return cmd; 
 }
 
+int
+hcq_get_next_cmds(hcq_handle_t   hcq,
+		  uint32_t       max_cmds,
+		  hcq_cmd_t    * cmds)
+{
+    struct cmd_queue * cq  = hcq;
+
+    uint32_t   cnt  = 0;
+    wg_int     lock_id;
+
+    if (cq->type != HCQ_SERVER) {
+	ERROR("Only server can retrieve HCQ commands\n");
+	return -1;
+    }
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	while (cnt < max_cmds) {
+	    cmds[cnt] = __ring_get_next_cmd(cq);
+
+	    if (cmds[cnt] == HCQ_INVALID_CMD) {
+		break;
+	    }
+
+	    cnt++;
+	}
+
+	return cnt;
+    }
+
+    lock_id = wg_start_write(cq->db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return -1;
+    }
+
+    while (cnt < max_cmds) {
+	cmds[cnt] = __get_next_cmd(cq);
+
+	if (cmds[cnt] == HCQ_INVALID_CMD) {
+	    break;
+	}
+
+	cnt++;
+    }
+    
+    if (!wg_end_write(cq->db, lock_id)) {
+	ERROR("Apparently this is catastrophic...\n");
+	return -1;
+    }
+
+    return cnt; 
+}
+
 
 static uint64_t 
 __get_cmd_code(struct cmd_queue * cq,
@@ -850,6 +4367,22 @@ __get_cmd_code(struct cmd_queue * cq,
     return cmd_code;
 }
 
+static uint64_t 
+__ring_get_cmd_code(struct cmd_queue * cq,
+		    hcq_cmd_t          cmd)
+{
+    struct hcq_slot * slot = NULL;
+
+    slot = __ring_get_slot(cq, cmd);
+
+    if (slot == NULL) {
+	ERROR("Could not find command (ID=%lu) in queue\n", cmd);
+	return 0;
+    }
+
+    return slot->cmd_code;
+}
+
 
 uint64_t
 hcq_get_cmd_code(hcq_handle_t hcq,
@@ -859,6 +4392,10 @@ hcq_get_cmd_code(hcq_handle_t hcq,
     uint64_t   cmd_code = 0;
     wg_int     lock_id;
 
+    if (cq->backend == HCQ_BACKEND_RING) {
+	return __ring_get_cmd_code(cq, cmd);
+    }
+
     lock_id = wg_start_read(cq->db);
 
     if (!lock_id) {
@@ -882,9 +4419,11 @@ __get_cmd_data(struct cmd_queue * cq,
 	       hcq_cmd_t          cmd,
 	       uint32_t         * size)
 {
-    void    * cmd_rec   = NULL;
-    void    * data      = NULL;
-    uint32_t  data_size = 0;
+    struct hcq_bulk * bulk      = NULL;
+    void            * cmd_rec   = NULL;
+    void            * data      = NULL;
+    uint32_t          data_size = 0;
+    uint32_t          flags     = 0;
 
     cmd_rec = __get_cmd_rec(cq, cmd);
 
@@ -894,8 +4433,20 @@ __get_cmd_data(struct cmd_queue * cq,
     }
 
     data_size = wg_decode_int(cq->db,  wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_CMD_SIZE));
+    flags     = wg_decode_int(cq->db,  wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_FLAGS));
 
-    if (data_size > 0) {
+    if ((data_size > 0) && (flags & HCQ_CMD_FLAG_BULK_CMD)) {
+	bulk = __get_client_bulk(cq, 
+				 wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_SEGID)),
+				 wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_BULK_SEGID)));
+
+	if (bulk == NULL) {
+	    ERROR("Could not map large payload buffer of command (ID=%lu)\n", cmd);
+	    return NULL;
+	}
+
+	data  = __bulk_cmd_data(bulk);
+    } else if (data_size > 0) {
 	data  = wg_decode_blob(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_CMD_DATA));
     }
 
@@ -903,6 +4454,40 @@ __get_cmd_data(struct cmd_queue * cq,
     return data;
 }
 
+static void *
+__ring_get_cmd_data(struct cmd_queue * cq, 
+		    hcq_cmd_t          cmd,
+		    uint32_t         * size)
+{
+    struct hcq_slot * slot = NULL;
+    void            * data = NULL;
+
+    slot = __ring_get_slot(cq, cmd);
+
+    if (slot == NULL) {
+	ERROR("Could not find command (ID=%lu) in queue\n", cmd);
+	*size = 0;
+	return NULL;
+    }
+
+    if ((slot->cmd_size > 0) && (slot->flags & HCQ_CMD_FLAG_BULK_CMD)) {
+	struct hcq_bulk * bulk = __get_client_bulk(cq, slot->segid, slot->bulk_segid);
+
+	if (bulk == NULL) {
+	    ERROR("Could not map large payload buffer of command (ID=%lu)\n", cmd);
+	    *size = 0;
+	    return NULL;
+	}
+
+	data = __bulk_cmd_data(bulk);
+    } else if (slot->cmd_size > 0) {
+	data = __ring_cmd_data(cq->ring, slot);
+    }
+
+    *size = slot->cmd_size;
+    return data;
+}
+
 
 void *
 hcq_get_cmd_data(hcq_handle_t  hcq, 
@@ -915,6 +4500,10 @@ hcq_get_cmd_data(hcq_handle_t  hcq,
     uint32_t   data_size = 0;
     wg_int     lock_id;
 
+    if (cq->backend == HCQ_BACKEND_RING) {
+	return __ring_get_cmd_data(cq, cmd, size);
+    }
+
     lock_id = wg_start_read(cq->db);
 
     if (!lock_id) {
@@ -941,8 +4530,11 @@ __cmd_return(struct cmd_queue * cq,
 	     uint32_t           data_size,
 	     void             * data)
 {
-    void        * db      = cq->db;
-    void        * cmd_rec = NULL;
+    void            * db      = cq->db;
+    void            * cmd_rec = NULL;
+    struct hcq_bulk * bulk    = NULL;
+    xemem_segid_t     segid   = 0;
+    uint32_t          flags   = 0;
     
     if ((data_size > 0) && (data == NULL)) {
 	ERROR("NULL Data pointer, but positive data size\n");
@@ -956,48 +4548,121 @@ __cmd_return(struct cmd_queue * cq,
 	return -1;
     }
 
+    segid = wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_SEGID));
+
+    /* The client gave up on the command while it ran */
+    if (wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_STATUS)) == HCQ_CMD_CANCELLED) {
+	wg_delete_record(db, cmd_rec);
+	__conn_done(cq, segid);
+	return 0;
+    }
+
+    flags = wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_FLAGS));
+    flags = flags & ~HCQ_CMD_FLAG_BULK_RET;
+
+    /* Large returns go to the client's buffer if the command owns it */
+    if ((data_size > 0) && (flags & HCQ_CMD_FLAG_BULK)) {
+	bulk = __get_client_bulk(cq, segid, 
+				 wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_BULK_SEGID)));
+
+	if (__use_bulk(cq, bulk, data_size)) {
+	    if (data != __bulk_ret_data(bulk)) {
+		memcpy(__bulk_ret_data(bulk), data, data_size);
+	    }
+
+	    flags |= HCQ_CMD_FLAG_BULK_RET;
+	}
+    }
+
     wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_RET_CODE, wg_encode_int(db, ret_code));
     wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_RET_SIZE, wg_encode_int(db, data_size));
+    wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_FLAGS,    wg_encode_int(db, flags));
 
-    if (data_size > 0) {
+    if ((data_size > 0) && !(flags & HCQ_CMD_FLAG_BULK_RET)) {
 	wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_RET_DATA, wg_encode_blob(db, data, NULL, data_size));
     }
 
     wg_set_field(db, cmd_rec, HCQ_CMD_FIELD_STATUS,   wg_encode_int(db, HCQ_CMD_RETURNED));
 
+    __stats_returned(cq, 
+		     wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_CMD_CODE)),
+		     wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_START_TSC)));
+
+    __conn_done(cq, segid);
 
     /* Signal Client apid */
-    {
-	xemem_segid_t segid  = 0;
-	xemem_apid_t  apid   = 0; 
+    __signal_client(cq, segid);
 
-	segid = wg_decode_int(db, wg_get_field(db, cmd_rec, HCQ_CMD_FIELD_SEGID));
+    return 0;
+}	     
 
-	if (segid == 0) 
-	    return 0;
+static int
+__ring_cmd_return(struct cmd_queue * cq, 
+		  hcq_cmd_t          cmd, 
+		  int64_t            ret_code, 
+		  uint32_t           data_size,
+		  void             * data)
+{
+    struct hcq_ring * ring = cq->ring;
+    struct hcq_slot * slot = NULL;
+    struct hcq_bulk * bulk = NULL;
+    int               ret  = 0;
 
-	/* Query connections table for apid */
-	apid = (xemem_apid_t)pet_htable_search(cq->server.connections, (uintptr_t)segid);
-	if (apid == 0) { 
-	    /* Look it up now */
-	    apid = xemem_get(segid, XEMEM_RDWR);
-	    if (apid == -1) {
-		ERROR("Could not find apid for HCQ client: cannot kick client\n");
-		return 0;
-	    } 
-
-	    /* Remember it for future commands issued from this client */
-	    if (pet_htable_insert(cq->server.connections, (uintptr_t)segid, (uintptr_t)apid) == 0) {
-		ERROR("Could not update connections hashtable. This may result in a large "
-			"performance penalty\n");
+    if ((data_size > 0) && (data == NULL)) {
+	ERROR("NULL Data pointer, but positive data size\n");
+	return -1;
+    }
+
+    slot = __ring_get_slot(cq, cmd);
+
+    if (slot == NULL) {
+	ERROR("Could not find command to return (ID=%lu)\n", cmd);
+	return -1;
+    }
+
+    slot->flags &= ~HCQ_CMD_FLAG_BULK_RET;
+
+    /* Large returns go to the client's buffer if the command owns it */
+    if ((data_size > 0) && (slot->flags & HCQ_CMD_FLAG_BULK)) {
+	bulk = __get_client_bulk(cq, slot->segid, slot->bulk_segid);
+
+	if (__use_bulk(cq, bulk, data_size)) {
+	    if (data != __bulk_ret_data(bulk)) {
+		memcpy(__bulk_ret_data(bulk), data, data_size);
 	    }
+
+	    slot->flags |= HCQ_CMD_FLAG_BULK_RET;
 	}
+    }
 
-	xemem_signal(apid);
+    if ((data_size > ring->data_size) && !(slot->flags & HCQ_CMD_FLAG_BULK_RET)) {
+	/* Fail the command rather than leaving the client waiting on it */
+	ERROR("Return data too large for command ring (size=%u, max=%u)\n", 
+	      data_size, ring->data_size);
+
+	ret_code  = -1;
+	data_size = 0;
+	ret       = -1;
     }
 
-    return 0;
-}	     
+    /* Payloads built in place by hcq_ret_reserve() are already where they belong */
+    if ((data_size > 0) && 
+	!(slot->flags & HCQ_CMD_FLAG_BULK_RET) && 
+	(data != __ring_ret_data(ring, slot))) {
+	memcpy(__ring_ret_data(ring, slot), data, data_size);
+    }
+
+    slot->ret_code = ret_code;
+    slot->ret_size = data_size;
+
+    __stats_returned(cq, slot->cmd_code, slot->start_tsc);
+
+    __conn_done(cq, slot->segid);
+
+    __ring_publish(cq, slot);
+
+    return ret;
+}
 
 
 int
@@ -1017,6 +4682,10 @@ hcq_cmd_return(hcq_handle_t hcq,
 	return -1;
     }
 
+    if (cq->backend == HCQ_BACKEND_RING) {
+	return __ring_cmd_return(cq, cmd, ret_code, data_size, data);
+    }
+
     lock_id = wg_start_write(cq->db);
 
     if (!lock_id) {
@@ -1034,6 +4703,202 @@ hcq_cmd_return(hcq_handle_t hcq,
     return ret;
 }
 
+
+/* The large payload buffer owned by a command, NULL if it does not own one */
+static struct hcq_bulk *
+__get_cmd_bulk(struct cmd_queue * cq,
+	       hcq_cmd_t          cmd)
+{
+    struct hcq_slot * slot       = NULL;
+    void            * cmd_rec    = NULL;
+    xemem_segid_t     segid      = 0;
+    xemem_segid_t     bulk_segid = 0;
+    uint32_t          flags      = 0;
+    wg_int            lock_id;
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	slot = __ring_get_slot(cq, cmd);
+
+	if ((slot == NULL) || !(slot->flags & HCQ_CMD_FLAG_BULK)) {
+	    return NULL;
+	}
+
+	return __get_client_bulk(cq, slot->segid, slot->bulk_segid);
+    }
+
+    lock_id = wg_start_read(cq->db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return NULL;
+    }
+
+    cmd_rec = __get_cmd_rec(cq, cmd);
+
+    if (cmd_rec != NULL) {
+	segid      = wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_SEGID));
+	bulk_segid = wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_BULK_SEGID));
+	flags      = wg_decode_int(cq->db, wg_get_field(cq->db, cmd_rec, HCQ_CMD_FIELD_FLAGS));
+    }
+
+    if (!wg_end_read(cq->db, lock_id)) {
+	ERROR("Apparently this is catastrophic...\n");
+	return NULL;
+    }
+
+    if (!(flags & HCQ_CMD_FLAG_BULK)) {
+	return NULL;
+    }
+
+    return __get_client_bulk(cq, segid, bulk_segid);
+}
+
+void *
+hcq_ret_reserve(hcq_handle_t hcq,
+		hcq_cmd_t    cmd,
+		uint32_t     data_size)
+{
+    struct cmd_queue * cq    = hcq;
+    struct hcq_slot  * slot  = NULL;
+    struct hcq_bulk  * bulk  = NULL;
+    void             * data  = NULL;
+    uint32_t           flags = 0;
+
+    if (cq->type != HCQ_SERVER) {
+	ERROR("Only server can return an HCQ command\n");
+	return NULL;
+    }
+
+    bulk = __get_cmd_bulk(cq, cmd);
+
+    if (__use_bulk(cq, bulk, data_size)) {
+	flags = HCQ_CMD_FLAG_BULK_RET;
+    }
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	slot = __ring_get_slot(cq, cmd);
+
+	if (slot == NULL) {
+	    ERROR("Could not find command to return (ID=%lu)\n", cmd);
+	    return NULL;
+	}
+
+	/* Remembered until hcq_ret_commit() */
+	slot->flags = (slot->flags & ~HCQ_CMD_FLAG_BULK_RET) | flags;
+
+	if (flags & HCQ_CMD_FLAG_BULK_RET) {
+	    return __bulk_ret_data(bulk);
+	}
+
+	if (data_size > cq->ring->data_size) {
+	    ERROR("Return data too large for command ring (size=%u, max=%u)\n", 
+		  data_size, cq->ring->data_size);
+	    return NULL;
+	}
+
+	return __ring_ret_data(cq->ring, slot);
+    }
+
+    pthread_mutex_lock(&(cq->server.lock));
+    data = __stage_data(&(cq->server.ret_staging), (uintptr_t)cmd, 0, data_size, flags);
+    pthread_mutex_unlock(&(cq->server.lock));
+
+    if ((data != NULL) && (flags & HCQ_CMD_FLAG_BULK_RET)) {
+	data = __bulk_ret_data(bulk);
+    }
+
+    return data;
+}
+
+
+int
+hcq_ret_commit(hcq_handle_t hcq,
+	       hcq_cmd_t    cmd,
+	       int64_t      ret_code,
+	       uint32_t     data_size)
+{
+    struct cmd_queue       * cq    = hcq;
+    struct hcq_slot        * slot  = NULL;
+    struct hcq_staged_data * stage = NULL;
+    struct hcq_bulk        * bulk  = NULL;
+    void                   * data  = NULL;
+    int                      ret   = 0;
+
+    if (cq->type != HCQ_SERVER) {
+	ERROR("Only server can return an HCQ command\n");
+	return -1;
+    }
+
+    if (cq->backend == HCQ_BACKEND_RING) {
+	slot = __ring_get_slot(cq, cmd);
+
+	if (slot == NULL) {
+	    ERROR("Could not find command to return (ID=%lu)\n", cmd);
+	    return -1;
+	}
+
+	data = __ring_ret_data(cq->ring, slot);
+
+	if (slot->flags & HCQ_CMD_FLAG_BULK_RET) {
+	    bulk = __get_client_bulk(cq, slot->segid, slot->bulk_segid);
+	    data = __bulk_ret_data(bulk);
+	}
+
+	return __ring_cmd_return(cq, cmd, ret_code, data_size, data);
+    }
+
+    pthread_mutex_lock(&(cq->server.lock));
+    stage = __unstage_data(cq->server.ret_staging, (uintptr_t)cmd);
+    pthread_mutex_unlock(&(cq->server.lock));
+
+    if (stage == NULL) {
+	ERROR("Could not find reserved return data (ID=%lu)\n", cmd);
+	return -1;
+    }
+
+    if (data_size > stage->data_size) {
+	/* Fail the command rather than leaving the client waiting on it */
+	ERROR("Return data overflows its reservation (size=%u, reserved=%u)\n", 
+	      data_size, stage->data_size);
+	
+	ret_code  = -1;
+	data_size = 0;
+	ret       = -1;
+    }
+
+    data = stage->data;
+
+    if (stage->flags & HCQ_CMD_FLAG_BULK_RET) {
+	bulk = __get_cmd_bulk(cq, cmd);
+	data = __bulk_ret_data(bulk);
+    }
+
+    if (hcq_cmd_return(hcq, cmd, ret_code, data_size, data) != 0) {
+	ret = -1;
+    }
+
+    free(stage);
+
+    return ret;
+}
+
+int
+hcq_get_stats(hcq_handle_t       hcq, 
+	      struct hcq_stats * stats)
+{
+    struct cmd_queue * cq = hcq;
+
+    if (cq->stats == NULL) {
+	ERROR("Command queue has no statistics\n");
+	return -1;
+    }
+
+    /* Counters only move forward, so a torn copy is still a usable snapshot */
+    memcpy(stats, cq->stats, sizeof(struct hcq_stats));
+
+    return 0;
+}
+
 void
 __dump_queue(struct cmd_queue * cq)
 {
@@ -1043,6 +4908,7 @@ __dump_queue(struct cmd_queue * cq)
 
     hcq_cmd_t     pending = HCQ_INVALID_CMD;
     uint64_t      cmd_cnt = 0;
+    hcq_prio_t    prio    = HCQ_PRIO_NORMAL;
 
     hdr_rec = wg_find_record_int(db, HCQ_TYPE_FIELD, WG_COND_EQUAL, HCQ_HEADER_TYPE, NULL);
 
@@ -1050,11 +4916,13 @@ __dump_queue(struct cmd_queue * cq)
 	ERROR("Malformed database: Missing Header field\n");
     }
 
-    pending = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_FIELD_PENDING));
-    cmd_cnt = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_FIELD_OUTSTANDING));
+    for (prio = HCQ_PRIO_NORMAL; prio < HCQ_NUM_PRIOS; prio++) {
+	pending = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_PENDING(prio)));
+	cmd_cnt = wg_decode_int(db, wg_get_field(db, hdr_rec, HCQ_HDR_OUTSTANDING(prio)));
 
-    printf("HCQ -- Command Count: %lu ;  Pending Command: %lu\n", 
-	   cmd_cnt, pending);
+	printf("HCQ -- Lane %d -- Command Count: %lu ;  Pending Command: %lu\n", 
+	       prio, cmd_cnt, pending);
+    }
 
 
     while (1) {
@@ -1078,6 +4946,40 @@ __dump_queue(struct cmd_queue * cq)
     return;
 }
 
+static void
+__ring_dump_queue(struct cmd_queue * cq)
+{
+    struct hcq_ring * ring = cq->ring;
+    uint32_t          i    = 0;
+
+    printf("HCQ -- Ring Slots: %u\n", ring->num_slots);
+
+    for (i = 0; i < HCQ_NUM_PRIOS; i++) {
+	printf("HCQ -- Lane %u -- Head: %lu ;  Tail: %lu\n", 
+	       i, ring->lanes[i].head, ring->lanes[i].tail);
+    }
+
+    for (i = 0; i < ring->num_slots; i++) {
+	struct hcq_slot * slot = __ring_slot(ring, i);
+
+	if (slot->status == HCQ_RING_SLOT_FREE) {
+	    continue;
+	}
+
+	printf("CMD %lu: CODE=%lu, PRIO=%u, SIZE=%u, STATUS=%u, SEGID=%ld,  RET_CODE=%ld, RET_SIZE=%u\n",
+	       slot->cmd_id,
+	       slot->cmd_code,
+	       slot->prio,
+	       slot->cmd_size,
+	       slot->status,
+	       slot->segid,
+	       slot->ret_code,
+	       slot->ret_size);
+    }
+
+    return;
+}
+
 
 void
 hcq_dump_queue(hcq_handle_t hcq)
@@ -1085,6 +4987,11 @@ hcq_dump_queue(hcq_handle_t hcq)
     struct cmd_queue * cq = hcq;
     wg_int lock_id;
 
+    if (cq->backend == HCQ_BACKEND_RING) {
+	__ring_dump_queue(cq);
+	return;
+    }
+
     lock_id = wg_start_read(cq->db);
     
     if (!lock_id) {
@@ -15,6 +15,7 @@ extern "C" {
 
 
 #include <stdint.h>
+#include <errno.h>
 
 #include "xemem.h"
 #include "hobbes_cmds.h"
@@ -22,10 +23,39 @@ extern "C" {
 #define HCQ_INVALID_CMD    ((uint64_t)-1)
 #define HCQ_INVALID_HANDLE (NULL)
 
+/* Selects the backend used by hcq_create_queue() ("db" or "ring") */
+#define HCQ_ENV_BACKEND    "HCQ_BACKEND"
+
+/* Default spin budget (in microseconds) of hcq_cmd_wait() on new connections */
+#define HCQ_ENV_SPIN_US    "HCQ_SPIN_US"
+
+/* Number of parallel command workers started by the init tasks (0 = handle inline) */
+#define HCQ_ENV_WORKERS    "HCQ_WORKERS"
+
+/* Size in bytes of the queues made by hcq_create_queue() and hcq_create_queue_ext(), 
+ * for either backend (the ring gets as many slots as fit) 
+ */
+#define HCQ_ENV_QUEUE_SIZE     "HCQ_QUEUE_SIZE"
+
+/* Size in bytes of each client's large payload buffer (0 = send all payloads inline) */
+#define HCQ_ENV_BULK_SIZE      "HCQ_BULK_SIZE"
+
+/* Payloads larger than this many bytes go through the large payload buffer */
+#define HCQ_ENV_BULK_THRESHOLD "HCQ_BULK_THRESHOLD"
+
+#define HCQ_DEFAULT_QUEUE_SIZE     (16 * 1024 * 1024)
+#define HCQ_DEFAULT_BULK_SIZE      (8 * 1024 * 1024)
+#define HCQ_DEFAULT_BULK_THRESHOLD (16 * 1024)
+
 typedef enum {
     HCQ_CMD_PENDING  = 0,
     HCQ_CMD_RETURNED = 1} hcq_cmd_status_t;
 
+typedef enum {
+    HCQ_BACKEND_DB   = 0,   /* WhiteDB records, protected by the database lock */
+    HCQ_BACKEND_RING = 1    /* Lock-free ring of fixed size command slots      */
+} hcq_backend_t;
+
 
 typedef void *   hcq_handle_t;
 typedef uint64_t hcq_cmd_t;
@@ -33,34 +63,265 @@ typedef uint64_t hcq_cmd_t;
 typedef int (*hcq_cmd_fn)(hcq_handle_t hcq,
 			  hcq_cmd_t    cmd);
 
+/* Concurrency class of a command handler when a worker pool is running */
+typedef enum {
+    HCQ_CMD_SERIAL   = 0,   /* Runs one at a time, in arrival order      */
+    HCQ_CMD_PARALLEL = 1    /* May run concurrently with any other command */
+} hcq_cmd_class_t;
+
 hcq_handle_t hcq_create_queue(char * name);
+hcq_handle_t hcq_create_queue_ext(char * name, hcq_backend_t backend);
+
+/* Queue segment size is rounded up to a page. Clients read it from the segment when connecting */
+hcq_handle_t hcq_create_queue_sized(char          * name, 
+				    hcq_backend_t   backend, 
+				    uint64_t        queue_size);
 void hcq_free_queue(hcq_handle_t hcq);
 
+/* hcq_register_cmd() registers a serial handler */
 int
 hcq_register_cmd(hcq_handle_t hcq,
 		 uint64_t     cmd_code,
 		 hcq_cmd_fn   handler_fn);
 
+int
+hcq_register_cmd_ext(hcq_handle_t    hcq,
+		     uint64_t        cmd_code,
+		     hcq_cmd_fn      handler_fn,
+		     hcq_cmd_class_t cmd_class);
+
 hcq_cmd_fn 
 hcq_get_cmd_handler(hcq_handle_t hcq,
 		    hcq_cmd_t    cmd);
 
+/* Worker pool dispatch
+ *   hcq_start_workers() starts num_workers threads for parallel handlers, plus one 
+ *   thread that runs serial handlers in arrival order. hcq_dispatch_cmd() looks up
+ *   a command's handler and hands it to the matching pool, or runs it in the calling
+ *   thread when no workers are running. Commands without a handler are failed.
+ *   hcq_stop_workers() finishes the queued commands and joins the threads.
+ */
+int hcq_start_workers(hcq_handle_t hcq,
+		      uint32_t     num_workers);
+
+void hcq_stop_workers(hcq_handle_t hcq);
+
+int hcq_dispatch_cmd(hcq_handle_t hcq,
+		     hcq_cmd_t    cmd);
+
+/* Priority lanes
+ *   Commands with a code the server has marked HCQ_PRIO_HIGH go to a separate lane,
+ *   which hcq_get_next_cmd() drains first. So that bulk traffic cannot starve, a
+ *   normal command is taken after every HCQ_PRIO_BURST high priority commands in a
+ *   row. Worker pools also start high priority commands ahead of the queued ones.
+ *   The code table lives in the queue segment, so clients pick the lane when they
+ *   issue a command without any change to the command API.
+ */
+typedef enum {
+    HCQ_PRIO_NORMAL  = 0,
+    HCQ_PRIO_HIGH    = 1
+} hcq_prio_t;
+
+#define HCQ_NUM_PRIOS      2
+#define HCQ_PRIO_MAX_CODES 32
+#define HCQ_PRIO_BURST     16
+
+int hcq_set_cmd_priority(hcq_handle_t hcq,
+			 uint64_t     cmd_code,
+			 hcq_prio_t   prio);
+
 xemem_segid_t hcq_get_segid(hcq_handle_t hcq);
 int hcq_get_fd(hcq_handle_t hcq);
 
 
+/* Large payloads
+ *   A connection exports a buffer of HCQ_BULK_SIZE bytes to the server once its
+ *   first payload above HCQ_BULK_THRESHOLD bytes goes through the queue (on a ring
+ *   queue, once it issues its first command). Later command and return payloads 
+ *   above the threshold (or above a ring slot's capacity) are copied through it 
+ *   instead of the queue segment. The buffer serves one outstanding command at a 
+ *   time; other commands carry their payloads inline. This is transparent to 
+ *   callers of the command API.
+ *
+ *   hcq_disconnect() tells the server to drop the connection, and the server also
+ *   drops connections it can no longer signal.
+ */
 hcq_handle_t hcq_connect(xemem_segid_t segid);
 void hcq_disconnect(hcq_handle_t hcq);
 
 
 void hcq_dump_queue(hcq_handle_t hcq);
 
+
+/* Instrumentation
+ *   Every queue keeps counters in its shared segment. Clients and the server update 
+ *   them with atomic operations, and hcq_get_stats() copies them without taking any
+ *   queue lock, so a monitor can watch a saturated queue without adding to it.
+ *   Times are in TSC cycles, which all enclaves on a host share. Histogram bucket i
+ *   counts commands that took [2^i, 2^(i+1)) cycles; the last bucket also holds 
+ *   anything slower.
+ */
+#define HCQ_STATS_MAX_CODES      32
+#define HCQ_STATS_HIST_BUCKETS   32
+
+#define HCQ_STATS_UNUSED_CODE    ((uint64_t)-1)   /* Entry not yet assigned to a command code  */
+#define HCQ_STATS_OTHER_CODES    ((uint64_t)-2)   /* Last entry: codes that did not get their own */
+
+struct hcq_code_stats {
+    uint64_t cmd_code;
+    uint64_t returned;
+    uint64_t wait_hist[HCQ_STATS_HIST_BUCKETS];     /* Issue to dequeue by the server */
+    uint64_t service_hist[HCQ_STATS_HIST_BUCKETS];  /* Dequeue to return              */
+};
+
+struct hcq_stats {
+    uint64_t issued;
+    uint64_t completed;
+    uint64_t abandoned;     /* Completed by the client before the server returned them */
+    uint64_t expired;       /* Returned by the server unrun because their deadline passed */
+    uint64_t depth;         /* Issued but not yet completed                           */
+    uint64_t max_depth;
+
+    struct hcq_code_stats codes[HCQ_STATS_MAX_CODES];
+};
+
+int hcq_get_stats(hcq_handle_t       hcq, 
+		  struct hcq_stats * stats);
+
 hcq_cmd_t hcq_cmd_issue(hcq_handle_t hcq, 
 			uint64_t     cmd_code,
 			uint32_t     data_size,
 			void       * data);
 
 
+/* Asynchronous interface
+ *   hcq_cmd_submit() returns as soon as the command is queued.
+ *   hcq_cmd_test() returns 1 if the command has returned, 0 if it is pending, -1 on error.
+ *   hcq_cmd_wait() blocks until the command has returned.
+ *   hcq_cmd_wait_any() blocks until one of the commands (possibly on different queues)
+ *   has returned, and returns its index. HCQ_INVALID_CMD entries are ignored.
+ * Returned commands must still be released with hcq_cmd_complete().
+ */
+hcq_cmd_t hcq_cmd_submit(hcq_handle_t hcq, 
+			 uint64_t     cmd_code,
+			 uint32_t     data_size,
+			 void       * data);
+
+int hcq_cmd_test(hcq_handle_t hcq,
+		 hcq_cmd_t    cmd);
+
+int hcq_cmd_wait(hcq_handle_t hcq,
+		 hcq_cmd_t    cmd);
+
+int hcq_cmd_wait_any(uint32_t       num_cmds,
+		     hcq_handle_t * hcqs,
+		     hcq_cmd_t    * cmds);
+
+
+/* Deadlines and cancellation
+ *   hcq_cmd_submit_timeout() queues a command that must be dequeued by the server
+ *   within timeout_us microseconds. Commands found past their deadline are not run:
+ *   the server returns them with HCQ_RET_EXPIRED.
+ *   hcq_cmd_wait_timeout() returns 0 once the command has returned, -ETIMEDOUT if 
+ *   it has not returned within timeout_us, or -1 on error.
+ *   hcq_cmd_issue_timeout() submits a command with a deadline and waits for it up to 
+ *   the same timeout. On a timeout the command is cancelled and HCQ_INVALID_CMD is
+ *   returned.
+ *   hcq_cmd_cancel() releases a command whether or not it has returned. The server 
+ *   skips it if it has not started yet, and otherwise drops its return value. 
+ *   hcq_cmd_complete() on a command that has not returned cancels it, and 
+ *   hcq_disconnect() cancels every command the connection has not completed.
+ *   The server does the same for a client that exits without disconnecting, once
+ *   signalling it fails or a periodic check (while dequeuing) finds it gone.
+ */
+#define HCQ_RET_EXPIRED ((int64_t)-ETIMEDOUT)
+
+hcq_cmd_t hcq_cmd_submit_timeout(hcq_handle_t hcq, 
+				 uint64_t     cmd_code,
+				 uint32_t     data_size,
+				 void       * data,
+				 uint64_t     timeout_us);
+
+hcq_cmd_t hcq_cmd_issue_timeout(hcq_handle_t hcq, 
+				uint64_t     cmd_code,
+				uint32_t     data_size,
+				void       * data,
+				uint64_t     timeout_us);
+
+int hcq_cmd_wait_timeout(hcq_handle_t hcq,
+			 hcq_cmd_t    cmd,
+			 uint64_t     timeout_us);
+
+int hcq_cmd_cancel(hcq_handle_t hcq,
+		   hcq_cmd_t    cmd);
+
+
+/* Wait policy
+ *   hcq_cmd_wait() spins on the command's status for up to spin_us microseconds 
+ *   before blocking on the queue's signal fd. A budget of 0 always blocks. 
+ *   The initial budget comes from the HCQ_SPIN_US environment variable.
+ */
+struct hcq_wait_stats {
+    uint64_t waits;         /* Calls to hcq_cmd_wait()                          */
+    uint64_t spin_hits;     /* Waits that completed while spinning              */
+    uint64_t spin_misses;   /* Waits that exhausted the spin budget             */
+    uint64_t blocks;        /* Number of times a waiter blocked on the signal fd */
+};
+
+int hcq_set_spin_budget(hcq_handle_t hcq,
+			uint32_t     spin_us);
+
+int hcq_get_wait_stats(hcq_handle_t            hcq,
+		       struct hcq_wait_stats * stats);
+
+
+/* Batched interface
+ *   All commands are queued in one step and the server is signalled once.
+ *   Both calls return the number of commands queued (cmds[0..ret-1].cmd are valid),
+ *   or -1 on error. hcq_cmd_issue_batch() also waits for every queued command.
+ */
+struct hcq_cmd_desc {
+    uint64_t    cmd_code;
+    uint32_t    data_size;
+    void      * data;
+
+    /* Set on submission */
+    hcq_cmd_t   cmd;
+};
+
+int hcq_cmd_submit_batch(hcq_handle_t          hcq,
+			 uint32_t              num_cmds,
+			 struct hcq_cmd_desc * cmds);
+
+int hcq_cmd_issue_batch(hcq_handle_t          hcq,
+			uint32_t              num_cmds,
+			struct hcq_cmd_desc * cmds);
+
+
+
+/* Zero-copy interface
+ *   hcq_cmd_reserve() allocates a command and returns a pointer to its payload buffer,
+ *   which the caller fills in place before queuing it with hcq_cmd_commit(). 
+ *   The ID returned by hcq_cmd_commit() is the one to wait on: it may differ from 
+ *   the reservation ID. Uncommitted reservations are released with hcq_cmd_abort().
+ *
+ *   hcq_ret_reserve() returns a buffer for a command's return data, which the server
+ *   fills in place and publishes with hcq_ret_commit() (data_size <= reserved size).
+ *
+ *   The ring backend hands out the queue's own memory. The DB backend stages 
+ *   payloads in local memory, and copies them into the database on commit.
+ */
+hcq_cmd_t hcq_cmd_reserve(hcq_handle_t   hcq,
+			  uint64_t       cmd_code,
+			  uint32_t       data_size,
+			  void        ** data);
+
+hcq_cmd_t hcq_cmd_commit(hcq_handle_t hcq,
+			 hcq_cmd_t    cmd);
+
+int hcq_cmd_abort(hcq_handle_t hcq,
+		  hcq_cmd_t    cmd);
+
 
 hcq_cmd_status_t hcq_get_cmd_status(hcq_handle_t hcq, 
 				    hcq_cmd_t    cmd);
@@ -75,11 +336,39 @@ void * hcq_get_ret_data(hcq_handle_t hcq,
 int hcq_cmd_complete(hcq_handle_t hcq, 
 		     hcq_cmd_t    cmd);
 
+/* Single call RPC interface
+ *   hcq_cmd_collect() fetches the return code of a returned command, copies up to 
+ *   out_cap bytes of its return data into out, and releases the command. 
+ *   *out_len (optional) is set to the full size of the return data, which may 
+ *   exceed out_cap. 
+ *   hcq_call() issues a command, waits for it, and collects it.
+ *   Both return the command's return code, or -1 if the command could not be 
+ *   issued or found.
+ */
+int64_t hcq_cmd_collect(hcq_handle_t   hcq,
+			hcq_cmd_t      cmd,
+			void         * out,
+			uint32_t       out_cap,
+			uint32_t     * out_len);
+
+int64_t hcq_call(hcq_handle_t   hcq,
+		 uint64_t       cmd_code,
+		 void         * in,
+		 uint32_t       in_len,
+		 void         * out,
+		 uint32_t       out_cap,
+		 uint32_t     * out_len);
+
 
 
 
 hcq_cmd_t hcq_get_next_cmd(hcq_handle_t hcq);
 
+/* Dequeue up to max_cmds commands at once, returns the number dequeued or -1 on error */
+int hcq_get_next_cmds(hcq_handle_t   hcq,
+		      uint32_t       max_cmds,
+		      hcq_cmd_t    * cmds);
+
 
 uint64_t hcq_get_cmd_code(hcq_handle_t hcq, 
 			  hcq_cmd_t    cmd);
@@ -95,6 +384,15 @@ int hcq_cmd_return(hcq_handle_t hcq,
 		   uint32_t     data_size,
 		   void       * data);
 
+void * hcq_ret_reserve(hcq_handle_t hcq,
+		       hcq_cmd_t    cmd,
+		       uint32_t     data_size);
+
+int hcq_ret_commit(hcq_handle_t hcq,
+		   hcq_cmd_t    cmd,
+		   int64_t      ret_code,
+		   uint32_t     data_size);
+
 
 
 #ifdef __cplusplus
@@ -6,6 +6,7 @@
  * redistribute, and modify it as specified in the file "PETLAB_LICENSE".
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -13,6 +14,7 @@
 
 #include <dbapi.h>
 #include <dballoc.h>
+#include <indexapi.h>
 
 #include <pet_log.h>
 
@@ -22,64 +24,869 @@
 
 #define PAGE_SIZE sysconf(_SC_PAGESIZE)
 
+/* Not exported by indexapi.h, and dbindex.h/dbcompare.h conflict with dbapi.h */
+extern wg_int wg_search_hash(void * db, wg_int index_id, wg_int * values, wg_int count);
+extern wg_int wg_compare(void * db, wg_int a, wg_int b, int depth);
+extern gint   wg_check_dump(void * db, char * file_name, gint * min_size, gint * max_size);
+
 hdb_db_t 
 hdb_create(uint64_t size) 
 {
     void * db      = NULL;
 
-    if (size % PAGE_SIZE) {
-	ERROR("Database must be integral number of pages\n");
-	return NULL;
+    if (size % PAGE_SIZE) {
+	ERROR("Database must be integral number of pages\n");
+	return NULL;
+    }
+
+    db = wg_attach_local_database(size);
+
+    if (db == NULL) {
+	ERROR("Could not create database\n");
+	return NULL;
+    }
+
+    return db;
+}
+
+hdb_db_t 
+hdb_attach(void * db_addr) 
+{ 
+    hdb_db_t db = NULL;
+
+    db = wg_attach_existing_local_database(db_addr);
+
+    return db;
+}    
+
+
+/* 
+ * Partition routing
+ *    Handles differ in each process, so the map from a master DB to its partitions 
+ *    lives in process memory. It is filled in while the process attaches to the DB, 
+ *    before the handle is shared with other threads.
+ */
+#define HDB_MAX_PART_MAPS       4
+
+static struct {
+    hdb_db_t master;
+    hdb_db_t parts[HDB_NUM_PARTS];
+} part_maps[HDB_MAX_PART_MAPS];
+
+
+hdb_db_t
+hdb_get_partition(hdb_db_t   db,
+		  hdb_part_t part)
+{
+    int i = 0;
+
+    for (i = 0; i < HDB_MAX_PART_MAPS; i++) {
+	if ((part_maps[i].master == db) && (db != NULL)) {
+	    return (part_maps[i].parts[part]) ? part_maps[i].parts[part] : db;
+	}
+    }
+
+    /* Not partitioned, so the master DB holds everything */
+    return db;
+}
+
+int
+hdb_set_partition(hdb_db_t   db,
+		  hdb_part_t part,
+		  hdb_db_t   part_db)
+{
+    int map = -1;
+    int i   = 0;
+
+    if ((part <= HDB_PART_REGISTRY) || (part >= HDB_NUM_PARTS)) {
+	ERROR("Invalid database partition (%d)\n", part);
+	return -1;
+    }
+
+    for (i = 0; i < HDB_MAX_PART_MAPS; i++) {
+	if (part_maps[i].master == db) {
+	    map = i;
+	    break;
+	}
+
+	if ((map == -1) && (part_maps[i].master == NULL)) {
+	    map = i;
+	}
+    }
+
+    if (map == -1) {
+	ERROR("Too many partitioned databases\n");
+	return -1;
+    }
+
+    part_maps[map].master      = db;
+    part_maps[map].parts[part] = part_db;
+
+    return 0;
+}
+
+static void
+__clear_partitions(hdb_db_t db)
+{
+    int i = 0;
+
+    for (i = 0; i < HDB_MAX_PART_MAPS; i++) {
+	if (part_maps[i].master == db) {
+	    memset(&(part_maps[i]), 0, sizeof(part_maps[i]));
+	}
+    }
+}
+
+xemem_segid_t
+hdb_get_partition_segid(hdb_part_t part)
+{
+    switch (part) {
+	case HDB_PART_REGISTRY:
+	    return HDB_MASTER_DB_SEGID;
+	case HDB_PART_SYSTEM:
+	    return HDB_SYS_DB_SEGID;
+	case HDB_PART_PMI:
+	    return HDB_PMI_DB_SEGID;
+	case HDB_PART_NOTIFY:
+	    return HDB_NOTIF_DB_SEGID;
+	default:
+	    return XEMEM_INVALID_SEGID;
+    }
+}
+
+uint64_t
+hdb_get_partition_size(hdb_part_t part)
+{
+    switch (part) {
+	case HDB_PART_REGISTRY:
+	    return HDB_MASTER_DB_SIZE;
+	case HDB_PART_SYSTEM:
+	    return HDB_SYS_DB_SIZE;
+	case HDB_PART_PMI:
+	    return HDB_PMI_DB_SIZE;
+	case HDB_PART_NOTIFY:
+	    return HDB_NOTIF_DB_SIZE;
+	default:
+	    return 0;
+    }
+}
+
+
+void 
+hdb_detach(hdb_db_t db)
+{
+    __clear_partitions(db);
+    wg_detach_local_database(db);
+}
+
+
+/* Create a hash index on a list of columns, unless it already exists */
+int
+hdb_create_hash_index(hdb_db_t   db,
+		      wg_int   * cols,
+		      int        num_cols)
+{
+    if (wg_multi_column_to_index_id(db, cols, num_cols, WG_INDEX_TYPE_HASH, NULL, 0) > 0) {
+	return 0;
+    }
+
+    if (wg_create_multi_index(db, cols, num_cols, WG_INDEX_TYPE_HASH, NULL, 0) == -1) {
+	ERROR("Could not create database index\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Fetch the first record matching a list of WG_COND_EQUAL arguments
+ *  - The arguments must be in column order
+ *  - Uses the hash index on exactly those columns if there is one, otherwise 
+ *    falls back to a query (which scans the database)
+ *  - Returns NULL if no record matches
+ **/
+void *
+hdb_find_record(hdb_db_t       db,
+		wg_query_arg * arglist,
+		int            argc)
+{
+    wg_query * query    = NULL;
+    void     * rec      = NULL;
+    wg_int     index_id = -1;
+    wg_int     cols[HDB_MAX_INDEX_COLS];
+    wg_int     values[HDB_MAX_INDEX_COLS];
+    int        i        = 0;
+
+    if (argc <= HDB_MAX_INDEX_COLS) {
+	for (i = 0; i < argc; i++) {
+	    cols[i]   = arglist[i].column;
+	    values[i] = arglist[i].value;
+	}
+
+	index_id = wg_multi_column_to_index_id(db, cols, argc, WG_INDEX_TYPE_HASH, NULL, 0);
+    }
+
+    if (index_id > 0) {
+	wg_int reclist = wg_search_hash(db, index_id, values, argc);
+
+	/* Hash buckets are keyed on 32 bit integers, so recheck each candidate */
+	while (reclist > 0) {
+	    gcell * cell = (gcell *)offsettoptr(db, reclist);
+
+	    rec = offsettoptr(db, cell->car);
+
+	    for (i = 0; i < argc; i++) {
+		if (wg_compare(db, wg_get_field(db, rec, arglist[i].column), arglist[i].value, 0) != 0) {
+		    break;
+		}
+	    }
+
+	    if (i == argc) {
+		return rec;
+	    }
+
+	    reclist = cell->cdr;
+	}
+
+	return NULL;
+    }
+
+    query = wg_make_query(db, NULL, 0, arglist, argc);
+    rec   = wg_fetch(db, query);
+
+    wg_free_query(db, query);
+
+    return rec;
+}
+
+
+static int
+__hdr_dir_field(int hdr_type)
+{
+    switch (hdr_type) {
+	case HDB_REC_ENCLAVE_HDR:
+	    return HDB_DIR_ENCLAVE_HDR;
+	case HDB_REC_APP_HDR:
+	    return HDB_DIR_APP_HDR;
+	case HDB_REC_XEMEM_HDR:
+	    return HDB_DIR_XEMEM_HDR;
+	case HDB_REC_SYS_HDR:
+	    return HDB_DIR_SYS_HDR;
+	default:
+	    return -1;
+    }
+}
+
+/* 
+ * The header directory is the first record in the DB, so finding it does not 
+ * depend on the number of records. Returns NULL for DBs created without one.
+ */
+static void *
+__get_hdr_dir(hdb_db_t db)
+{
+    void * dir = wg_get_first_record(db);
+
+    if ((dir == NULL) || 
+	(wg_get_record_len(db, dir) < HDB_DIR_REC_LEN) ||
+	(wg_decode_int(db, wg_get_field(db, dir, HDB_TYPE_FIELD)) != HDB_REC_DIRECTORY)) {
+	return NULL;
+    }
+
+    return dir;
+}
+
+/**
+ * Get the header record of a record type (HDB_REC_*_HDR)
+ *  - Returns NULL if the header does not exist
+ **/
+void *
+hdb_get_hdr_rec(hdb_db_t db,
+		int      hdr_type)
+{
+    void   * dir   = __get_hdr_dir(db);
+    int      idx   = __hdr_dir_field(hdr_type);
+    wg_int   field = 0;
+
+    if ((dir == NULL) || (idx == -1)) {
+	return wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, hdr_type, NULL);
+    }
+
+    field = wg_get_field(db, dir, idx);
+
+    if (wg_get_encoded_type(db, field) != WG_RECORDTYPE) {
+	return NULL;
+    }
+
+    return wg_decode_record(db, field);
+}
+
+/* Record a header in the directory, must be called with the write lock held */
+int
+hdb_set_hdr_rec(hdb_db_t   db,
+		int        hdr_type,
+		void     * hdr_rec)
+{
+    void * dir = __get_hdr_dir(db);
+    int    idx = __hdr_dir_field(hdr_type);
+
+    if (idx == -1) {
+	ERROR("Invalid header record type (%d)\n", hdr_type);
+	return -1;
+    }
+
+    if (dir == NULL) {
+	/* Headers of DBs without a directory are found by scanning */
+	return 0;
+    }
+
+    return wg_set_field(db, dir, idx, wg_encode_record(db, hdr_rec));
+}
+
+
+
+/* 
+ * Change log 
+ *    Lives in raw memory of the string area, which WhiteDB never scans for records.
+ *    Entry i of the ring holds the change with generation i (mod HDB_CHANGE_LOG_LEN)
+ */
+struct hdb_change_log {
+    uint64_t          gen;
+    uint64_t          table_gen[HDB_NUM_TABLES];
+    struct hdb_change entries[HDB_CHANGE_LOG_LEN];
+};
+
+static struct hdb_change_log *
+__get_change_log(hdb_db_t db)
+{
+    void   * dir = __get_hdr_dir(db);
+    wg_int   off = 0;
+
+    if (dir == NULL) {
+	return NULL;
+    }
+
+    off = wg_decode_int(db, wg_get_field(db, dir, HDB_DIR_CHANGE_LOG));
+
+    if (off == 0) {
+	return NULL;
+    }
+
+    return offsettoptr(db, off);
+}
+
+void
+hdb_log_change(hdb_db_t        db,
+	       hdb_table_t     table,
+	       uint64_t        id,
+	       hdb_change_op_t op)
+{
+    struct hdb_change_log * log   = __get_change_log(db);
+    struct hdb_change     * entry = NULL;
+
+    if (log == NULL) {
+	return;
+    }
+
+    log->gen++;
+    log->table_gen[table] = log->gen;
+
+    entry = &(log->entries[log->gen % HDB_CHANGE_LOG_LEN]);
+
+    entry->gen   = log->gen;
+    entry->table = table;
+    entry->op    = op;
+    entry->id    = id;
+}
+
+
+static uint64_t
+__get_generation(hdb_db_t db,
+		 int      table)
+{
+    struct hdb_change_log * log = __get_change_log(db);
+
+    if (log == NULL) {
+	return 0;
+    }
+
+    if (table == -1) {
+	return log->gen;
+    }
+
+    return log->table_gen[table];
+}
+
+static uint64_t
+__hdb_get_generation(hdb_db_t db,
+		     int      table)
+{
+    uint64_t gen = 0;
+    wg_int   lock_id;
+
+    lock_id = wg_start_read(db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return 0;
+    }
+
+    gen = __get_generation(db, table);
+
+    if (!wg_end_read(db, lock_id)) {
+	ERROR("Catastrophic database locking error\n");
+	return 0;
+    }
+
+    return gen;
+}
+
+/* Generation of the last change to any table (0 if nothing changed yet) */
+uint64_t
+hdb_get_generation(hdb_db_t db)
+{
+    return __hdb_get_generation(db, -1);
+}
+
+/* Generation of the last change to a table, comparable with hdb_get_generation() of its partition */
+uint64_t
+hdb_get_table_generation(hdb_db_t    db,
+			 hdb_table_t table)
+{
+    if ((table < 0) || (table >= HDB_NUM_TABLES)) {
+	ERROR("Invalid table (%d)\n", table);
+	return 0;
+    }
+
+    if ((table == HDB_TABLE_CPU) || (table == HDB_TABLE_MEM)) {
+	db = hdb_get_partition(db, HDB_PART_SYSTEM);
+    }
+
+    return __hdb_get_generation(db, table);
+}
+
+
+static int
+__get_changes(hdb_db_t            db,
+	      uint64_t            since_gen,
+	      struct hdb_change * changes,
+	      int                 max_changes,
+	      uint64_t          * cur_gen)
+{
+    struct hdb_change_log * log = __get_change_log(db);
+    uint64_t                gen = 0;
+    int                     cnt = 0;
+
+    if (log == NULL) {
+	ERROR("Database does not have a change log\n");
+	return -1;
+    }
+
+    *cur_gen = log->gen;
+
+    if (since_gen >= log->gen) {
+	return 0;
+    }
+
+    /* Changes older than the log length have been overwritten */
+    if ((log->gen - since_gen) > HDB_CHANGE_LOG_LEN) {
+	return HDB_CHANGES_LOST;
+    }
+
+    for (gen = since_gen + 1; (gen <= log->gen) && (cnt < max_changes); gen++) {
+	changes[cnt++] = log->entries[gen % HDB_CHANGE_LOG_LEN];
+    }
+
+    return cnt;
+}
+
+/**
+ * Copy the changes made after generation since_gen into changes, oldest first
+ *  - Returns the number of changes copied (at most max_changes). If it equals 
+ *    max_changes, call again with since_gen set to the last copied generation
+ *  - Returns HDB_CHANGES_LOST if some of those changes have already left the log. 
+ *    The caller must then re-read the tables, and can continue from *cur_gen
+ *  - *cur_gen is set to the current generation
+ **/
+int
+hdb_get_changes(hdb_db_t            db,
+		uint64_t            since_gen,
+		struct hdb_change * changes,
+		int                 max_changes,
+		uint64_t          * cur_gen)
+{
+    wg_int lock_id;
+    int    ret = -1;
+
+    if ((!cur_gen) || ((changes == NULL) && (max_changes > 0))) {
+	return -1;
+    }
+
+    lock_id = wg_start_read(db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return -1;
+    }
+
+    ret = __get_changes(db, since_gen, changes, max_changes, cur_gen);
+
+    if (!wg_end_read(db, lock_id)) {
+	ERROR("Catastrophic database locking error\n");
+	return -1;
+    }
+
+    return ret;
+}
+
+
+
+/* 
+ * State table
+ *    Enclave and app states are polled by every process, so a copy of each is kept in 
+ *    slots that can be read without taking the database lock. Writers update a slot with 
+ *    the write lock held, making its sequence count odd while they do. Readers retry if 
+ *    the count was odd or changed under them.
+ *
+ *    Slots are indexed by ID. A reader that does not find its ID in the slot (it was 
+ *    taken by a newer ID, or the record is gone) falls back to the locked lookup.
+ */
+#define HDB_STATE_SLOTS         1024
+#define HDB_STATE_READ_TRIES    64
+
+struct hdb_state_slot {
+    uint32_t    seq;
+    hobbes_id_t id;
+    int         state;
+};
+
+struct hdb_state_table {
+    struct hdb_state_slot enclaves[HDB_STATE_SLOTS];
+    struct hdb_state_slot apps[HDB_STATE_SLOTS];
+};
+
+static struct hdb_state_slot *
+__get_state_slot(hdb_db_t    db,
+		 hdb_table_t table,
+		 hobbes_id_t id)
+{
+    struct hdb_state_table * states = NULL;
+    void                   * dir    = __get_hdr_dir(db);
+    wg_int                   off    = 0;
+
+    if ((dir == NULL) || (id < 0)) {
+	return NULL;
+    }
+
+    off = wg_decode_int(db, wg_get_field(db, dir, HDB_DIR_STATE_TABLE));
+
+    if (off == 0) {
+	return NULL;
+    }
+
+    states = offsettoptr(db, off);
+
+    switch (table) {
+	case HDB_TABLE_ENCLAVE:
+	    return &(states->enclaves[id % HDB_STATE_SLOTS]);
+	case HDB_TABLE_APP:
+	    return &(states->apps[id % HDB_STATE_SLOTS]);
+	default:
+	    return NULL;
+    }
+}
+
+/* Must be called with the write lock held */
+static void
+__set_state_slot(hdb_db_t    db,
+		 hdb_table_t table,
+		 hobbes_id_t id,
+		 hobbes_id_t slot_id,
+		 int         state)
+{
+    struct hdb_state_slot * slot = __get_state_slot(db, table, id);
+    uint32_t                seq  = 0;
+
+    if (slot == NULL) {
+	return;
+    }
+
+    seq = slot->seq;
+
+    __atomic_store_n(&(slot->seq), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&(slot->id),    slot_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&(slot->state), state,   __ATOMIC_RELAXED);
+
+    __atomic_store_n(&(slot->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+static void
+__cache_state(hdb_db_t    db,
+	      hdb_table_t table,
+	      hobbes_id_t id,
+	      int         state)
+{
+    __set_state_slot(db, table, id, id, state);
+}
+
+static void
+__uncache_state(hdb_db_t    db,
+		hdb_table_t table,
+		hobbes_id_t id)
+{
+    struct hdb_state_slot * slot = __get_state_slot(db, table, id);
+
+    if ((slot == NULL) || (slot->id != id)) {
+	return;
+    }
+
+    __set_state_slot(db, table, id, HOBBES_INVALID_ID, 0);
+}
+
+/* Lock free read of a cached state, returns -1 if the caller must take the lock instead */
+static int
+__read_cached_state(hdb_db_t    db,
+		    hdb_table_t table,
+		    hobbes_id_t id,
+		    int       * state)
+{
+    struct hdb_state_slot * slot    = __get_state_slot(db, table, id);
+    hobbes_id_t             slot_id = HOBBES_INVALID_ID;
+    uint32_t                seq     = 0;
+    int                     val     = 0;
+    int                     i       = 0;
+
+    if (slot == NULL) {
+	return -1;
+    }
+
+    for (i = 0; i < HDB_STATE_READ_TRIES; i++) {
+	seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+
+	if (seq & 0x1) {
+	    continue;
+	}
+
+	slot_id = __atomic_load_n(&(slot->id),    __ATOMIC_RELAXED);
+	val     = __atomic_load_n(&(slot->state), __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != seq) {
+	    continue;
+	}
+
+	if (slot_id != id) {
+	    return -1;
+	}
+
+	*state = val;
+	return 0;
+    }
+
+    return -1;
+}
+
+
+
+#define HDB_PART_MASK(part)     (1U << (part))
+#define HDB_ALL_PARTS           (HDB_PART_MASK(HDB_NUM_PARTS) - 1)
+
+/* Set up a new database to hold the partitions in part_mask */
+static int
+__init_db(hdb_db_t db,
+	  uint32_t part_mask)
+{
+    void * rec     = NULL;
+    void * dir     = NULL;
+    gint   log_off = 0;
+
+    /* Create lookup indexes while the database is still empty */
+    {
+	wg_int id_cols[2]   = {HDB_TYPE_FIELD, HDB_ID_INDEX_COL};
+	wg_int name_cols[2] = {HDB_TYPE_FIELD, HDB_NAME_INDEX_COL};
+	wg_int pmi_cols[4]  = {HDB_TYPE_FIELD, HDB_PMI_KVS_ENTRY_APPID, HDB_PMI_KVS_ENTRY_KVSNAME, HDB_PMI_KVS_ENTRY_KEY};
+
+	if ((hdb_create_hash_index(db, id_cols, 2) != 0) ||
+	    ((part_mask & HDB_PART_MASK(HDB_PART_REGISTRY)) && (hdb_create_hash_index(db, name_cols, 2) != 0)) ||
+	    ((part_mask & HDB_PART_MASK(HDB_PART_PMI))      && (hdb_create_hash_index(db, pmi_cols,  4) != 0))) {
+	    ERROR("Could not create master database indexes\n");
+	    return -1;
+	}
+    }
+
+    /* Create the header directory first, so it is always the first record */
+    dir = wg_create_record(db, HDB_DIR_REC_LEN);
+
+    if (dir != wg_get_first_record(db)) {
+	ERROR("Header directory must be the first record in the database\n");
+	return -1;
+    }
+
+    wg_set_field(db, dir, HDB_TYPE_FIELD,       wg_encode_int(db, HDB_REC_DIRECTORY));
+    wg_set_field(db, dir, HDB_DIR_PART_MASK,    wg_encode_int(db, part_mask));
+
+    /* Create the change log */
+    log_off = wg_alloc_gints(db, &(dbmemsegh(db)->longstr_area_header), 
+			     1 + (sizeof(struct hdb_change_log) + sizeof(gint) - 1) / sizeof(gint));
+
+    if (log_off == 0) {
+	ERROR("Could not allocate database change log\n");
+	return -1;
     }
 
-    db = wg_attach_local_database(size);
+    /* Skip the object length that WhiteDB keeps in the first gint */
+    log_off += sizeof(gint);
 
-    if (db == NULL) {
-	ERROR("Could not create database\n");
-	return NULL;
+    memset(offsettoptr(db, log_off), 0, sizeof(struct hdb_change_log));
+    wg_set_field(db, dir, HDB_DIR_CHANGE_LOG,   wg_encode_int(db, log_off));
+
+    /* The rest belongs to the registry */
+    if (!(part_mask & HDB_PART_MASK(HDB_PART_REGISTRY))) {
+	return 0;
     }
 
-    return db;
-}
+    /* Create the state table, with every slot empty */
+    {
+	struct hdb_state_table * states    = NULL;
+	gint                     state_off = 0;
+	int                      i         = 0;
 
-hdb_db_t 
-hdb_attach(void * db_addr) 
-{ 
-    hdb_db_t db = NULL;
+	state_off = wg_alloc_gints(db, &(dbmemsegh(db)->longstr_area_header), 
+				   1 + (sizeof(struct hdb_state_table) + sizeof(gint) - 1) / sizeof(gint));
 
-    db = wg_attach_existing_local_database(db_addr);
+	if (state_off == 0) {
+	    ERROR("Could not allocate database state table\n");
+	    return -1;
+	}
 
-    return db;
-}    
+	state_off += sizeof(gint);
+	states     = offsettoptr(db, state_off);
 
-void 
-hdb_detach(hdb_db_t db)
-{
-    wg_detach_local_database(db);
-}
+	memset(states, 0, sizeof(struct hdb_state_table));
 
+	for (i = 0; i < HDB_STATE_SLOTS; i++) {
+	    states->enclaves[i].id = HOBBES_INVALID_ID;
+	    states->apps[i].id     = HOBBES_INVALID_ID;
+	}
 
-int
-hdb_init_master_db(hdb_db_t db)
-{
-    void * rec = NULL;
+	wg_set_field(db, dir, HDB_DIR_STATE_TABLE, wg_encode_int(db, state_off));
+    }
     
     /* Create Enclave Header */
     rec = wg_create_record(db, 3);
     wg_set_field(db, rec, HDB_TYPE_FIELD,       wg_encode_int(db, HDB_REC_ENCLAVE_HDR));
     wg_set_field(db, rec, HDB_ENCLAVE_HDR_NEXT, wg_encode_int(db, 0));
     wg_set_field(db, rec, HDB_ENCLAVE_HDR_CNT,  wg_encode_int(db, 0));
+    wg_set_field(db, dir, HDB_DIR_ENCLAVE_HDR,  wg_encode_record(db, rec));
     
     /* Create Application Header */
     rec = wg_create_record(db, 3);
     wg_set_field(db, rec, HDB_TYPE_FIELD,       wg_encode_int(db, HDB_REC_APP_HDR));
     wg_set_field(db, rec, HDB_APP_HDR_NEXT,     wg_encode_int(db, 1));
     wg_set_field(db, rec, HDB_APP_HDR_CNT,      wg_encode_int(db, 0));
+    wg_set_field(db, dir, HDB_DIR_APP_HDR,      wg_encode_record(db, rec));
     
     /* Create XEMEM header */
     rec = wg_create_record(db, 2);
     wg_set_field(db, rec, HDB_TYPE_FIELD,       wg_encode_int(db, HDB_REC_XEMEM_HDR));
     wg_set_field(db, rec, HDB_SEGMENT_HDR_CNT,  wg_encode_int(db, 0));
+    wg_set_field(db, dir, HDB_DIR_XEMEM_HDR,    wg_encode_record(db, rec));
+
+    return 0;
+}
+
+int
+hdb_init_master_db(hdb_db_t db)
+{
+    /* Until partitions are split off, the master DB holds every table */
+    return __init_db(db, HDB_ALL_PARTS);
+}
+
+int
+hdb_init_partition(hdb_db_t   db,
+		   hdb_part_t part)
+{
+    if ((part < 0) || (part >= HDB_NUM_PARTS)) {
+	ERROR("Invalid database partition (%d)\n", part);
+	return -1;
+    }
+
+    return __init_db(db, HDB_PART_MASK(part));
+}
+
+
+/* 
+ * Checkpoints
+ *    A checkpoint is a WhiteDB dump of the whole database image. It is written to a 
+ *    temporary file first, so a crash while checkpointing leaves the previous one intact.
+ */
+int
+hdb_checkpoint(hdb_db_t   db,
+	       char     * path)
+{
+    char tmp_path[256] = {[0 ... 255] = 0};
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+	ERROR("Checkpoint path is too long (%s)\n", path);
+	return -1;
+    }
+
+    /* wg_dump() takes the database lock itself */
+    if (wg_dump(db, tmp_path) != 0) {
+	ERROR("Could not write database checkpoint (%s)\n", tmp_path);
+	unlink(tmp_path);
+	return -1;
+    }
+
+    if (rename(tmp_path, path) != 0) {
+	ERROR("Could not move database checkpoint into place (%s)\n", path);
+	unlink(tmp_path);
+	return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Replace the contents of a new partition database with a checkpoint
+ *  - The checkpoint must be intact, and must have been taken from the same partition
+ *  - Nothing else may be using the database, and it must not be exported yet
+ *  - On failure the database contents are undefined, and it should be recreated
+ **/
+int
+hdb_restore(hdb_db_t     db,
+	    hdb_part_t   part,
+	    char       * path)
+{
+    void * dir      = NULL;
+    gint   min_size = 0;
+    gint   max_size = 0;
+
+    if ((part < 0) || (part >= HDB_NUM_PARTS)) {
+	ERROR("Invalid database partition (%d)\n", part);
+	return -1;
+    }
+
+    /* Checks the header version, file size and CRC */
+    if (wg_check_dump(db, path, &min_size, &max_size) != 0) {
+	ERROR("Invalid database checkpoint (%s)\n", path);
+	return -1;
+    }
+
+    if (wg_import_dump(db, path) != 0) {
+	ERROR("Could not import database checkpoint (%s)\n", path);
+	return -1;
+    }
+
+    dir = __get_hdr_dir(db);
+
+    if ((dir == NULL) ||
+	(wg_decode_int(db, wg_get_field(db, dir, HDB_DIR_PART_MASK)) != (wg_int)HDB_PART_MASK(part))) {
+	ERROR("Database checkpoint (%s) does not hold partition %d\n", path, part);
+	return -1;
+    }
 
     return 0;
 }
@@ -111,7 +918,6 @@ __get_enclave_by_id(hdb_db_t    db,
 		    hobbes_id_t enclave_id) 
 {
     hdb_enclave_t enclave  = NULL;
-    wg_query    * query    = NULL;
     wg_query_arg  arglist[2];
 
     arglist[0].column = HDB_TYPE_FIELD;
@@ -122,11 +928,8 @@ __get_enclave_by_id(hdb_db_t    db,
     arglist[1].cond   = WG_COND_EQUAL;
     arglist[1].value  = wg_encode_query_param_int(db, enclave_id);
 
-    query   = wg_make_query(db, NULL, 0, arglist, 2);
+    enclave = hdb_find_record(db, arglist, 2);
 
-    enclave = wg_fetch(db, query);
-
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
 
@@ -146,7 +949,6 @@ __get_enclave_by_name(hdb_db_t   db,
 		      char     * name)
 {
     hdb_enclave_t   enclave  = NULL;
-    wg_query      * query    = NULL;
     wg_query_arg    arglist[2];    
  
     arglist[0].column = HDB_TYPE_FIELD;
@@ -157,11 +959,8 @@ __get_enclave_by_name(hdb_db_t   db,
     arglist[1].cond   = WG_COND_EQUAL;
     arglist[1].value  = wg_encode_query_param_str(db, name, NULL);
 
-    query = wg_make_query(db, NULL, 0, arglist, 2);
+    enclave = hdb_find_record(db, arglist, 2);
 
-    enclave = wg_fetch(db, query);
-
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
 
@@ -187,7 +986,7 @@ __create_enclave_record(hdb_db_t         db,
     hdb_enclave_t enclave   = NULL;
 
     
-    hdr_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_ENCLAVE_HDR, NULL);
+    hdr_rec = hdb_get_hdr_rec(db, HDB_REC_ENCLAVE_HDR);
     
     if (!hdr_rec) {
 	ERROR("malformed database. Missing enclave Header\n");
@@ -227,10 +1026,10 @@ __create_enclave_record(hdb_db_t         db,
     enclave = wg_create_record(db, 8);
     wg_set_field(db, enclave, HDB_TYPE_FIELD,       wg_encode_int(db, HDB_REC_ENCLAVE));
     wg_set_field(db, enclave, HDB_ENCLAVE_ID,       wg_encode_int(db, enclave_id));
-    wg_set_field(db, enclave, HDB_ENCLAVE_TYPE,     wg_encode_int(db, type));
+    wg_set_field(db, enclave, HDB_ENCLAVE_NAME,     wg_encode_str(db, name, NULL));
     wg_set_field(db, enclave, HDB_ENCLAVE_DEV_ID,   wg_encode_int(db, mgmt_dev_id));
     wg_set_field(db, enclave, HDB_ENCLAVE_STATE,    wg_encode_int(db, ENCLAVE_INITTED));
-    wg_set_field(db, enclave, HDB_ENCLAVE_NAME,     wg_encode_str(db, name, NULL));
+    wg_set_field(db, enclave, HDB_ENCLAVE_TYPE,     wg_encode_int(db, type));
     wg_set_field(db, enclave, HDB_ENCLAVE_CMDQ_ID,  wg_encode_int(db, 0));
     wg_set_field(db, enclave, HDB_ENCLAVE_PARENT,   wg_encode_int(db, parent));
 
@@ -239,6 +1038,10 @@ __create_enclave_record(hdb_db_t         db,
     wg_set_field(db, hdr_rec, HDB_ENCLAVE_HDR_NEXT, wg_encode_int(db, enclave_id  + 1));
     wg_set_field(db, hdr_rec, HDB_ENCLAVE_HDR_CNT,  wg_encode_int(db, enclave_cnt + 1));
 
+    __cache_state(db, HDB_TABLE_ENCLAVE, enclave_id, ENCLAVE_INITTED);
+
+    hdb_log_change(db, HDB_TABLE_ENCLAVE, enclave_id, HDB_CHANGE_CREATE);
+
     return enclave_id;
 }
 
@@ -279,7 +1082,7 @@ __delete_enclave(hdb_db_t    db,
     hdb_enclave_t enclave     = NULL;
 
 
-    hdr_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_ENCLAVE_HDR, NULL);
+    hdr_rec = hdb_get_hdr_rec(db, HDB_REC_ENCLAVE_HDR);
     
     if (!hdr_rec) {
 	ERROR("Malformed database. Missing enclave Header\n");
@@ -301,6 +1104,10 @@ __delete_enclave(hdb_db_t    db,
     enclave_cnt = wg_decode_int(db, wg_get_field(db, hdr_rec, HDB_ENCLAVE_HDR_CNT));
     wg_set_field(db, hdr_rec, HDB_ENCLAVE_HDR_CNT, wg_encode_int(db, enclave_cnt - 1));
 
+    __uncache_state(db, HDB_TABLE_ENCLAVE, enclave_id);
+
+    hdb_log_change(db, HDB_TABLE_ENCLAVE, enclave_id, HDB_CHANGE_DELETE);
+
     return 0;
 }
 
@@ -439,6 +1246,8 @@ __set_enclave_dev_id(hdb_db_t    db,
 
     wg_set_field(db, enclave, HDB_ENCLAVE_DEV_ID, wg_encode_int(db, dev_id));
 
+    hdb_log_change(db, HDB_TABLE_ENCLAVE, enclave_id, HDB_CHANGE_UPDATE);
+
     return 0;
 }
 
@@ -541,7 +1350,13 @@ hdb_get_enclave_state(hdb_db_t    db,
 		      hobbes_id_t enclave_id)
 {
     wg_int lock_id;
-    enclave_state_t state = ENCLAVE_ERROR;
+    enclave_state_t state  = ENCLAVE_ERROR;
+    int             cached = 0;
+
+    /* Polled constantly, so try the state table before taking the lock */
+    if (__read_cached_state(db, HDB_TABLE_ENCLAVE, enclave_id, &cached) == 0) {
+	return cached;
+    }
 
     lock_id = wg_start_read(db);
 
@@ -578,6 +1393,10 @@ __set_enclave_state(hdb_db_t        db,
 
     wg_set_field(db, enclave, HDB_ENCLAVE_STATE, wg_encode_int(db, state));
 
+    __cache_state(db, HDB_TABLE_ENCLAVE, enclave_id, state);
+
+    hdb_log_change(db, HDB_TABLE_ENCLAVE, enclave_id, HDB_CHANGE_UPDATE);
+
     return 0;
 }
 
@@ -714,6 +1533,8 @@ __set_enclave_cmdq(hdb_db_t      db,
 
     wg_set_field(db, enclave, HDB_ENCLAVE_CMDQ_ID, wg_encode_int(db, segid));
 
+    hdb_log_change(db, HDB_TABLE_ENCLAVE, enclave_id, HDB_CHANGE_UPDATE);
+
     return 0;
 }
 
@@ -797,7 +1618,7 @@ __get_enclaves(hdb_db_t    db,
     uint32_t      cnt     = 0;
     uint32_t      i       = 0;
     
-    hdr_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_ENCLAVE_HDR, NULL);    
+    hdr_rec = hdb_get_hdr_rec(db, HDB_REC_ENCLAVE_HDR);    
 
     if (!hdr_rec) {
 	ERROR("Malformed database. Missing enclave Header\n");
@@ -856,6 +1677,72 @@ hdb_get_enclaves(hdb_db_t   db,
 }
 
 
+static int
+__snapshot_enclaves(hdb_db_t              db,
+		    struct enclave_info * info_arr,
+		    uint32_t              max_enclaves,
+		    uint32_t            * num_enclaves)
+{
+    void     * db_rec = NULL;
+    uint32_t   cnt    = 0;
+
+    while ((db_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_ENCLAVE, db_rec)) != NULL) {
+
+	if (cnt < max_enclaves) {
+	    struct enclave_info * info = &(info_arr[cnt]);
+
+	    info->id    = wg_decode_int(db, wg_get_field(db, db_rec, HDB_ENCLAVE_ID));
+	    info->type  = wg_decode_int(db, wg_get_field(db, db_rec, HDB_ENCLAVE_TYPE));
+	    info->state = wg_decode_int(db, wg_get_field(db, db_rec, HDB_ENCLAVE_STATE));
+
+	    strncpy(info->name, wg_decode_str(db, wg_get_field(db, db_rec, HDB_ENCLAVE_NAME)), sizeof(info->name) - 1);
+	}
+
+	cnt++;
+    }
+
+    *num_enclaves = cnt;
+
+    return 0;
+}
+
+/**
+ * Copy the state of every enclave into info_arr under a single read lock
+ *  - At most max_enclaves entries are filled in
+ *  - *num_enclaves is set to the number of enclaves in the database, which can be 
+ *    larger than max_enclaves (the caller should then retry with a larger array)
+ **/
+int
+hdb_snapshot_enclaves(hdb_db_t              db,
+		      struct enclave_info * info_arr,
+		      uint32_t              max_enclaves,
+		      uint32_t            * num_enclaves)
+{
+    wg_int lock_id;
+    int    ret = -1;
+
+    if (!num_enclaves) {
+	return -1;
+    }
+
+    lock_id = wg_start_read(db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return -1;
+    }
+
+    ret = __snapshot_enclaves(db, info_arr, max_enclaves, num_enclaves);
+
+    if (!wg_end_read(db, lock_id)) {
+	ERROR("Catastrophic database locking error\n");
+	return -1;
+    }
+
+    return ret;
+}
+
+
 
 
 
@@ -871,7 +1758,6 @@ __get_segment_by_segid(hdb_db_t      db,
 		       xemem_segid_t segid) 
 {
     hdb_segment_t segment = NULL;
-    wg_query    * query   = NULL;
     wg_query_arg  arglist[2];
 
     /* Convert segid to string (TODO: can the db encode 64 bit values automatically?) */
@@ -883,11 +1769,8 @@ __get_segment_by_segid(hdb_db_t      db,
     arglist[1].cond   = WG_COND_EQUAL;
     arglist[1].value  = wg_encode_query_param_int(db, segid);
 
-    query = wg_make_query(db, NULL, 0, arglist, 2);
-
-    segment = wg_fetch(db, query);
+    segment = hdb_find_record(db, arglist, 2);
 
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
 
@@ -899,7 +1782,6 @@ __get_segment_by_name(hdb_db_t   db,
 		      char     * name)
 {
     hdb_segment_t segment = NULL;
-    wg_query    * query   = NULL;
     wg_query_arg  arglist[2];
 
     arglist[0].column = HDB_TYPE_FIELD;
@@ -910,11 +1792,8 @@ __get_segment_by_name(hdb_db_t   db,
     arglist[1].cond   = WG_COND_EQUAL;
     arglist[1].value  = wg_encode_query_param_str(db, name, NULL);
 
-    query = wg_make_query(db, NULL, 0, arglist, 2);
-
-    segment = wg_fetch(db, query);
+    segment = hdb_find_record(db, arglist, 2);
 
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
 
@@ -932,7 +1811,7 @@ __create_segment_record(hdb_db_t        db,
     void * rec            = NULL;
     int    segment_cnt    = 0;
 
-    hdr_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_XEMEM_HDR, NULL);
+    hdr_rec = hdb_get_hdr_rec(db, HDB_REC_XEMEM_HDR);
     
     if (!hdr_rec) {
         ERROR("malformed database. Missing xemem Header\n");
@@ -970,6 +1849,8 @@ __create_segment_record(hdb_db_t        db,
     segment_cnt = wg_decode_int(db, wg_get_field(db, hdr_rec, HDB_SEGMENT_HDR_CNT));
     wg_set_field(db, hdr_rec, HDB_SEGMENT_HDR_CNT, wg_encode_int(db, segment_cnt + 1));
 
+    hdb_log_change(db, HDB_TABLE_SEGMENT, segid, HDB_CHANGE_CREATE);
+
     return 0;
 }
 
@@ -1013,7 +1894,7 @@ __delete_segment(hdb_db_t        db,
     hdb_segment_t segment = NULL;
 
 
-    hdr_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_XEMEM_HDR, NULL);
+    hdr_rec = hdb_get_hdr_rec(db, HDB_REC_XEMEM_HDR);
     
     if (!hdr_rec) {
         ERROR("malformed database. Missing xemem Header\n");
@@ -1038,6 +1919,8 @@ __delete_segment(hdb_db_t        db,
     segment_cnt = wg_decode_int(db, wg_get_field(db, hdr_rec, HDB_SEGMENT_HDR_CNT));
     wg_set_field(db, hdr_rec, HDB_SEGMENT_HDR_CNT, wg_encode_int(db, segment_cnt - 1));
 
+    hdb_log_change(db, HDB_TABLE_SEGMENT, segid, HDB_CHANGE_DELETE);
+
     return 0;
 }
 
@@ -1259,7 +2142,7 @@ __get_segments(hdb_db_t   db,
 
     xemem_segid_t * segid_arr = NULL;
 
-    hdr_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_XEMEM_HDR, NULL);    
+    hdr_rec = hdb_get_hdr_rec(db, HDB_REC_XEMEM_HDR);    
 
     if (!hdr_rec) {
         ERROR("Malformed database. Missing xemem Header\n");
@@ -1315,6 +2198,72 @@ hdb_get_segments(hdb_db_t db,
 }
 
 
+static int
+__snapshot_segments(hdb_db_t               db,
+		    struct xemem_segment * seg_arr,
+		    int                    max_segments,
+		    int                  * num_segments)
+{
+    void * db_rec = NULL;
+    int    cnt    = 0;
+
+    while ((db_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_XEMEM_SEGMENT, db_rec)) != NULL) {
+
+	if (cnt < max_segments) {
+	    struct xemem_segment * seg = &(seg_arr[cnt]);
+
+	    seg->segid      = wg_decode_int(db, wg_get_field(db, db_rec, HDB_SEGMENT_SEGID));
+	    seg->enclave_id = wg_decode_int(db, wg_get_field(db, db_rec, HDB_SEGMENT_ENCLAVE));
+	    seg->app_id     = wg_decode_int(db, wg_get_field(db, db_rec, HDB_SEGMENT_APP));
+
+	    strncpy(seg->name, wg_decode_str(db, wg_get_field(db, db_rec, HDB_SEGMENT_NAME)), XEMEM_SEG_NAME_LEN - 1);
+	}
+
+	cnt++;
+    }
+
+    *num_segments = cnt;
+
+    return 0;
+}
+
+/**
+ * Copy every exported XEMEM segment into seg_arr under a single read lock
+ *  - At most max_segments entries are filled in
+ *  - *num_segments is set to the number of segments in the database, which can be 
+ *    larger than max_segments (the caller should then retry with a larger array)
+ **/
+int
+hdb_snapshot_segments(hdb_db_t               db,
+		      struct xemem_segment * seg_arr,
+		      int                    max_segments,
+		      int                  * num_segments)
+{
+    wg_int lock_id;
+    int    ret = -1;
+
+    if (!num_segments) {
+	return -1;
+    }
+
+    lock_id = wg_start_read(db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return -1;
+    }
+
+    ret = __snapshot_segments(db, seg_arr, max_segments, num_segments);
+
+    if (!wg_end_read(db, lock_id)) {
+	ERROR("Catastrophic database locking error\n");
+	return -1;
+    }
+
+    return ret;
+}
+
+
 
 
 /* *******
@@ -1333,7 +2282,6 @@ __get_app_by_id(hdb_db_t    db,
 		hobbes_id_t app_id) 
 {
     hdb_app_t     app  = NULL;
-    wg_query    * query    = NULL;
     wg_query_arg  arglist[2];
 
     arglist[0].column = HDB_TYPE_FIELD;
@@ -1344,11 +2292,8 @@ __get_app_by_id(hdb_db_t    db,
     arglist[1].cond   = WG_COND_EQUAL;
     arglist[1].value  = wg_encode_query_param_int(db, app_id);
 
-    query = wg_make_query(db, NULL, 0, arglist, 2);
-
-    app = wg_fetch(db, query);
+    app = hdb_find_record(db, arglist, 2);
 
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
 
@@ -1368,7 +2313,6 @@ __get_app_by_name(hdb_db_t   db,
 		  char     * name)
 {
     hdb_app_t       app      = NULL;
-    wg_query      * query    = NULL;
     wg_query_arg    arglist[2];    
  
     arglist[0].column = HDB_TYPE_FIELD;
@@ -1379,10 +2323,8 @@ __get_app_by_name(hdb_db_t   db,
     arglist[1].cond   = WG_COND_EQUAL;
     arglist[1].value  = wg_encode_query_param_str(db, name, NULL);
 
-    query = wg_make_query(db, NULL, 0, arglist, 2);
-    app   = wg_fetch(db, query);
+    app   = hdb_find_record(db, arglist, 2);
 
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
 
@@ -1406,7 +2348,7 @@ __create_app_record(hdb_db_t    db,
     hdb_app_t app   = NULL;
 
     
-    hdr_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_APP_HDR, NULL);
+    hdr_rec = hdb_get_hdr_rec(db, HDB_REC_APP_HDR);
     
     if (!hdr_rec) {
 	ERROR("malformed database. Missing app Header\n");
@@ -1449,6 +2391,10 @@ __create_app_record(hdb_db_t    db,
     wg_set_field(db, hdr_rec, HDB_APP_HDR_NEXT, wg_encode_int(db, app_id  + 1));
     wg_set_field(db, hdr_rec, HDB_APP_HDR_CNT,  wg_encode_int(db, app_cnt + 1));
 
+    __cache_state(db, HDB_TABLE_APP, app_id, APP_INITTED);
+
+    hdb_log_change(db, HDB_TABLE_APP, app_id, HDB_CHANGE_CREATE);
+
     return app_id;
 }
 
@@ -1489,7 +2435,7 @@ __delete_app(hdb_db_t    db,
     hdb_app_t     app     = NULL;
 
 
-    hdr_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_APP_HDR, NULL);
+    hdr_rec = hdb_get_hdr_rec(db, HDB_REC_APP_HDR);
     
     if (!hdr_rec) {
 	ERROR("Malformed database. Missing app Header\n");
@@ -1511,6 +2457,10 @@ __delete_app(hdb_db_t    db,
     app_cnt = wg_decode_int(db, wg_get_field(db, hdr_rec, HDB_APP_HDR_CNT));
     wg_set_field(db, hdr_rec, HDB_APP_HDR_CNT, wg_encode_int(db, app_cnt - 1));
 
+    __uncache_state(db, HDB_TABLE_APP, app_id);
+
+    hdb_log_change(db, HDB_TABLE_APP, app_id, HDB_CHANGE_DELETE);
+
     return 0;
 }
 
@@ -1560,6 +2510,10 @@ __set_app_state(hdb_db_t        db,
 
     wg_set_field(db, app, HDB_APP_STATE, wg_encode_int(db, state));
 
+    __cache_state(db, HDB_TABLE_APP, app_id, state);
+
+    hdb_log_change(db, HDB_TABLE_APP, app_id, HDB_CHANGE_UPDATE);
+
     return 0;
 }
 
@@ -1746,7 +2700,13 @@ hdb_get_app_state(hdb_db_t    db,
 		  hobbes_id_t app_id)
 {
     wg_int lock_id;
-    app_state_t state = 0;
+    app_state_t state  = 0;
+    int         cached = 0;
+
+    /* Polled constantly, so try the state table before taking the lock */
+    if (__read_cached_state(db, HDB_TABLE_APP, app_id, &cached) == 0) {
+	return cached;
+    }
 
     lock_id = wg_start_read(db);
 
@@ -1820,7 +2780,7 @@ __get_apps(hdb_db_t   db,
     int           cnt     = 0;
     int           i       = 0;
     
-    hdr_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_APP_HDR, NULL);    
+    hdr_rec = hdb_get_hdr_rec(db, HDB_REC_APP_HDR);    
 
     if (!hdr_rec) {
 	ERROR("Malformed database. Missing app Header\n");
@@ -1884,6 +2844,73 @@ hdb_get_apps(hdb_db_t   db,
 }
 
 
+static int
+__snapshot_apps(hdb_db_t          db,
+		struct app_info * info_arr,
+		int               max_apps,
+		int             * num_apps)
+{
+    void * db_rec = NULL;
+    int    cnt    = 0;
+
+    while ((db_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_APP, db_rec)) != NULL) {
+
+	if (cnt < max_apps) {
+	    struct app_info * info = &(info_arr[cnt]);
+
+	    info->id         = wg_decode_int(db, wg_get_field(db, db_rec, HDB_APP_ID));
+	    info->state      = wg_decode_int(db, wg_get_field(db, db_rec, HDB_APP_STATE));
+	    info->enclave_id = wg_decode_int(db, wg_get_field(db, db_rec, HDB_APP_ENCLAVE));
+	    info->hio_id     = wg_decode_int(db, wg_get_field(db, db_rec, HDB_APP_HIO_APP_ID));
+
+	    strncpy(info->name, wg_decode_str(db, wg_get_field(db, db_rec, HDB_APP_NAME)), sizeof(info->name) - 1);
+	}
+
+	cnt++;
+    }
+
+    *num_apps = cnt;
+
+    return 0;
+}
+
+/**
+ * Copy the state of every app into info_arr under a single read lock
+ *  - At most max_apps entries are filled in
+ *  - *num_apps is set to the number of apps in the database, which can be 
+ *    larger than max_apps (the caller should then retry with a larger array)
+ **/
+int
+hdb_snapshot_apps(hdb_db_t          db,
+		  struct app_info * info_arr,
+		  int               max_apps,
+		  int             * num_apps)
+{
+    wg_int lock_id;
+    int    ret = -1;
+
+    if (!num_apps) {
+	return -1;
+    }
+
+    lock_id = wg_start_read(db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return -1;
+    }
+
+    ret = __snapshot_apps(db, info_arr, max_apps, num_apps);
+
+    if (!wg_end_read(db, lock_id)) {
+	ERROR("Catastrophic database locking error\n");
+	return -1;
+    }
+
+    return ret;
+}
+
+
 
 
 /*
@@ -1923,6 +2950,8 @@ hdb_put_pmi_keyval(hdb_db_t      db,
     wg_int lock_id;
     int    ret;
 
+    db = hdb_get_partition(db, HDB_PART_PMI);
+
     lock_id = wg_start_write(db);
     if (!lock_id) {
 	ERROR("Could not lock database\n");
@@ -1948,7 +2977,6 @@ __get_pmi_keyval(hdb_db_t        db,
 		 const char **   val)
 {
     hdb_pmi_keyval_t kvs_entry = NULL;
-    wg_query *       query     = NULL;
     wg_query_arg     arglist[4];
     int              ret = -1;
 
@@ -1970,8 +2998,7 @@ __get_pmi_keyval(hdb_db_t        db,
     arglist[3].value  = wg_encode_query_param_str(db, (char *)key, NULL);
 
     /* Execute the query */
-    query = wg_make_query(db, NULL, 0, arglist, 4);
-    kvs_entry = wg_fetch(db, query);
+    kvs_entry = hdb_find_record(db, arglist, 4);
 
     /* If the query succeeded, decode the value string */
     if (kvs_entry) {
@@ -1980,7 +3007,6 @@ __get_pmi_keyval(hdb_db_t        db,
     }
 
     /* Free memory */
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
     wg_free_query_param(db, arglist[2].value);
@@ -2000,6 +3026,8 @@ hdb_get_pmi_keyval(hdb_db_t      db,
     wg_int lock_id;
     int    ret;
 
+    db = hdb_get_partition(db, HDB_PART_PMI);
+
     lock_id = wg_start_read(db);
     if (!lock_id) {
 	ERROR("Could not lock database\n");
@@ -2021,7 +3049,6 @@ __get_pmi_barrier(hdb_db_t  db,
                   int       appid)
 {
     hdb_pmi_barrier_t         barrier_entry = NULL;
-    wg_query                * query         = NULL;
     wg_query_arg              arglist[2];
 
     arglist[0].column = HDB_TYPE_FIELD;
@@ -2032,11 +3059,8 @@ __get_pmi_barrier(hdb_db_t  db,
     arglist[1].cond   = WG_COND_EQUAL;
     arglist[1].value  = wg_encode_query_param_int(db, appid);
 
-    query = wg_make_query(db, NULL, 0, arglist, 2);
-
-    barrier_entry = wg_fetch(db, query);
+    barrier_entry = hdb_find_record(db, arglist, 2);
 
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
 
@@ -2053,6 +3077,8 @@ hdb_create_pmi_barrier(hdb_db_t      db,
     wg_int lock_id;
     void * rec = NULL;
 
+    db = hdb_get_partition(db, HDB_PART_PMI);
+
     if ((lock_id = wg_start_write(db)) == 0) {
 	ERROR("Could not lock database\n");
 	return -1;
@@ -2082,6 +3108,8 @@ hdb_pmi_barrier_increment(hdb_db_t db,
 {
     wg_int lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_PMI);
+
     if ((lock_id = wg_start_write(db)) == 0) {
 	ERROR("Could not lock database\n");
 	return -1;
@@ -2109,6 +3137,8 @@ hdb_pmi_barrier_retire(hdb_db_t         db,
 {
     wg_int lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_PMI);
+
     if ((lock_id = wg_start_write(db)) == 0) {
 	ERROR("Could not lock database\n");
 	return NULL;
@@ -2150,7 +3180,6 @@ __get_notifier_by_segid(hdb_db_t      db,
 			xemem_segid_t segid)
 {
     hdb_notif_t   notifier = NULL;
-    wg_query    * query    = NULL;
     wg_query_arg  arglist[2];
 
     arglist[0].column = HDB_TYPE_FIELD;
@@ -2161,10 +3190,8 @@ __get_notifier_by_segid(hdb_db_t      db,
     arglist[1].cond   = WG_COND_EQUAL;
     arglist[1].value  = wg_encode_query_param_int(db, segid);
 
-    query    = wg_make_query(db, NULL, 0, arglist, 2);
-    notifier = wg_fetch(db, query);
+    notifier = hdb_find_record(db, arglist, 2);
 
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
 		      
@@ -2201,6 +3228,8 @@ hdb_create_notifier(hdb_db_t      db,
 {
     wg_int lock_id;
     int    ret = 0;
+
+    db = hdb_get_partition(db, HDB_PART_NOTIFY);
 	
     lock_id = wg_start_write(db);
     
@@ -2249,6 +3278,8 @@ hdb_delete_notifier(hdb_db_t      db,
 {
     wg_int lock_id;
     int    ret = 0;
+
+    db = hdb_get_partition(db, HDB_PART_NOTIFY);
 	
     lock_id = wg_start_write(db);
     
@@ -2317,6 +3348,8 @@ hdb_get_event_subscribers(hdb_db_t   db,
 {
     wg_int lock_id;
     xemem_segid_t * segids = NULL;
+
+    db = hdb_get_partition(db, HDB_PART_NOTIFY);
 	
     lock_id = wg_start_read(db);
     
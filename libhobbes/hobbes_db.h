@@ -29,6 +29,14 @@ struct hobbes_segment;
 #define HDB_MASTER_DB_SIZE  (64 * 1024 * 1024) 
 #define HDB_MASTER_DB_SEGID (1)
 
+/* Partitions split off from the master DB, see hdb_set_partition() */
+#define HDB_SYS_DB_SIZE     (64 * 1024 * 1024)
+#define HDB_SYS_DB_SEGID    (2)
+#define HDB_PMI_DB_SIZE     (32 * 1024 * 1024)
+#define HDB_PMI_DB_SEGID    (3)
+#define HDB_NOTIF_DB_SIZE   (4  * 1024 * 1024)
+#define HDB_NOTIF_DB_SEGID  (4)
+
 
 typedef void * hdb_db_t;
 
@@ -53,6 +61,104 @@ void * hdb_get_db_addr(hdb_db_t db);
 
 
 
+/* 
+ * Partitions
+ *    The master DB can be split into separately locked databases, each in its own XEMEM 
+ *    segment, so that traffic on one (e.g. a PMI exchange) does not stall the others. 
+ *    The master DB handle stays the handle for everything: each hdb_* call is routed to 
+ *    the partition that holds its records. Partitions that were never set are kept in 
+ *    the master DB itself, which is the registry partition.
+ */
+
+typedef enum {
+    HDB_PART_REGISTRY = 0,  /* Enclaves, apps and XEMEM segments */
+    HDB_PART_SYSTEM   = 1,  /* CPUs and memory */
+    HDB_PART_PMI      = 2,  /* PMI key/values and barriers */
+    HDB_PART_NOTIFY   = 3   /* Event notifier subscriptions */
+} hdb_part_t;
+
+#define HDB_NUM_PARTS           4
+
+/* Initialize a new database to hold a single partition */
+int hdb_init_partition(hdb_db_t   db, 
+		       hdb_part_t part);
+
+/* Route a partition of the master DB to part_db in this process (NULL to remove) */
+int hdb_set_partition(hdb_db_t   db,
+		      hdb_part_t part,
+		      hdb_db_t   part_db);
+
+/* The database holding a partition of the master DB */
+hdb_db_t hdb_get_partition(hdb_db_t   db,
+			   hdb_part_t part);
+
+xemem_segid_t hdb_get_partition_segid(hdb_part_t part);
+uint64_t      hdb_get_partition_size(hdb_part_t part);
+
+
+/* Save a database image to a file, or load one into a new partition database */
+int hdb_checkpoint(hdb_db_t   db,
+		   char     * path);
+
+int hdb_restore(hdb_db_t     db,
+		hdb_part_t   part,
+		char       * path);
+
+
+
+/* 
+ * Change tracking
+ *    Every mutation of a table bumps the DB generation and is recorded in a 
+ *    bounded change log, so readers can refresh only what changed.
+ *    Each partition has its own generation and log: CPU and memory changes are 
+ *    read from hdb_get_partition(db, HDB_PART_SYSTEM).
+ */
+
+typedef enum {
+    HDB_TABLE_ENCLAVE = 0,
+    HDB_TABLE_APP     = 1,
+    HDB_TABLE_SEGMENT = 2,
+    HDB_TABLE_CPU     = 3,
+    HDB_TABLE_MEM     = 4
+} hdb_table_t;
+
+#define HDB_NUM_TABLES          5
+
+typedef enum {
+    HDB_CHANGE_CREATE = 1,
+    HDB_CHANGE_UPDATE = 2,
+    HDB_CHANGE_DELETE = 3
+} hdb_change_op_t;
+
+/* Number of changes kept in the change log */
+#define HDB_CHANGE_LOG_LEN      1024
+
+/* Returned by hdb_get_changes() when the log no longer holds every change 
+ * since the requested generation. The caller must re-read the tables. 
+ */
+#define HDB_CHANGES_LOST        -2
+
+struct hdb_change {
+    uint64_t        gen;
+    hdb_table_t     table;
+    hdb_change_op_t op;
+    uint64_t        id;    /* Enclave/app ID, segid, CPU ID or memory block address */
+};
+
+uint64_t hdb_get_generation(hdb_db_t db);
+
+uint64_t hdb_get_table_generation(hdb_db_t    db,
+				  hdb_table_t table);
+
+int hdb_get_changes(hdb_db_t            db,
+		    uint64_t            since_gen,
+		    struct hdb_change * changes,
+		    int                 max_changes,
+		    uint64_t          * cur_gen);
+
+
+
+
 
 /* 
  *  Creating/deleting enclave records
@@ -71,6 +177,11 @@ int             hdb_delete_enclave(hdb_db_t    db,
 hobbes_id_t *   hdb_get_enclaves(hdb_db_t   db, 
 				 uint32_t * num_enclaves);
 
+int hdb_snapshot_enclaves(hdb_db_t              db,
+			  struct enclave_info * info_arr,
+			  uint32_t              max_enclaves,
+			  uint32_t            * num_enclaves);
+
 /*
  * Enclave field Accessors 
  */
@@ -144,6 +255,11 @@ hobbes_id_t     hdb_get_xemem_app(hdb_db_t      db,
 xemem_segid_t * hdb_get_segments(hdb_db_t   db, 
 				 int      * num_segments);
 
+int hdb_snapshot_segments(hdb_db_t               db,
+			  struct xemem_segment * seg_arr,
+			  int                    max_segments,
+			  int                  * num_segments);
+
 
 
 /* 
@@ -163,6 +279,11 @@ int             hdb_delete_app(hdb_db_t    db,
 hobbes_id_t *   hdb_get_apps(hdb_db_t   db,
 			     int      * num_apps);
 
+int hdb_snapshot_apps(hdb_db_t          db,
+		      struct app_info * info_arr,
+		      int               max_apps,
+		      int             * num_apps);
+
 
 /* Application field accessors */
 int             hdb_set_app_state(hdb_db_t        db,
@@ -32,6 +32,7 @@ extern "C" {
 #define HDB_REC_CPU                   11
 #define HDB_REC_MEM                   12
 #define HDB_REC_NOTIFIER              13
+#define HDB_REC_DIRECTORY             14
 
 /*
  * Database Field definitions
@@ -41,16 +42,29 @@ extern "C" {
 /* The first column of every row specifies the row type */
 #define HDB_TYPE_FIELD                0 
 
+/* Columns for the header directory 
+ *    The directory is the first record of the DB, each column references a header record
+ */
+#define HDB_DIR_ENCLAVE_HDR           1
+#define HDB_DIR_APP_HDR               2
+#define HDB_DIR_XEMEM_HDR             3
+#define HDB_DIR_SYS_HDR               4
+#define HDB_DIR_CHANGE_LOG            5 /* Offset of the change log (raw memory, not a record) */
+#define HDB_DIR_STATE_TABLE           6 /* Offset of the lock free state table (raw memory, not a record) */
+#define HDB_DIR_PART_MASK             7 /* Mask of the partitions the DB was created to hold */
+
+#define HDB_DIR_REC_LEN               8
+
 /* Columns for enclave header */
 #define HDB_ENCLAVE_HDR_NEXT          1
 #define HDB_ENCLAVE_HDR_CNT           2
 
 /* Columns for enclave records */
 #define HDB_ENCLAVE_ID                1
-#define HDB_ENCLAVE_TYPE              2
+#define HDB_ENCLAVE_NAME              2 /* In HDB_NAME_INDEX_COL, so name lookups are hashed */
 #define HDB_ENCLAVE_DEV_ID            3
 #define HDB_ENCLAVE_STATE             4
-#define HDB_ENCLAVE_NAME              5
+#define HDB_ENCLAVE_TYPE              5
 #define HDB_ENCLAVE_CMDQ_ID           6
 #define HDB_ENCLAVE_PARENT            7
 
@@ -92,20 +106,24 @@ extern "C" {
 #define HDB_SYS_HDR_MEM_BLK_SIZE      3
 #define HDB_SYS_HDR_MEM_BLK_CNT       4
 #define HDB_SYS_HDR_MEM_FREE_BLK_CNT  5
-#define HDB_SYS_HDR_MEM_FREE_LIST     6
+#define HDB_SYS_HDR_MEM_ZONES         6 /* Offset of the per-NUMA free memory zones (raw memory, not a record) */
 #define HDB_SYS_HDR_MEM_BLK_LIST      7
+#define HDB_SYS_HDR_CPU_MAP           8 /* Offset of the free CPU bitmaps (raw memory, not a record) */
+
+#define HDB_SYS_HDR_REC_LEN           9
 
 /* Columns for memory resource records */
-#define HDB_MEM_BASE_ADDR             1
-#define HDB_MEM_BLK_SIZE              2
-#define HDB_MEM_NUMA_NODE             3
-#define HDB_MEM_STATE                 4
-#define HDB_MEM_ENCLAVE_ID            5
-#define HDB_MEM_APP_ID                6
-#define HDB_MEM_NEXT_FREE             7
-#define HDB_MEM_PREV_FREE             8
-#define HDB_MEM_NEXT_BLK              9
-#define HDB_MEM_PREV_BLK              10
+#define HDB_MEM_BLK_IDX               1 /* base_addr / blk_size: hashes well, unlike aligned 64 bit addresses */
+#define HDB_MEM_BASE_ADDR             2
+#define HDB_MEM_BLK_SIZE              3
+#define HDB_MEM_NUMA_NODE             4
+#define HDB_MEM_STATE                 5
+#define HDB_MEM_ENCLAVE_ID            6
+#define HDB_MEM_APP_ID                7
+#define HDB_MEM_NEXT_BLK              8
+#define HDB_MEM_PREV_BLK              9
+
+#define HDB_MEM_REC_LEN               10
 
 /* Columns for CPU resource records */
 #define HDB_CPU_ID                    1
@@ -114,11 +132,50 @@ extern "C" {
 #define HDB_CPU_STATE                 4
 #define HDB_CPU_ENCLAVE_ID            5
 #define HDB_CPU_ENCLAVE_LOGICAL_ID    6
+#define HDB_CPU_CORE_ID               7 /* Lowest CPU ID among the CPU and its SMT siblings */
 
 /* Columns notification events */
 #define HDB_NOTIF_SEGID               1
 #define HDB_NOTIF_EVT_MASK            2
 
+
+/* Header record access through the header directory */
+void * hdb_get_hdr_rec(hdb_db_t db,
+		       int      hdr_type);
+
+int hdb_set_hdr_rec(hdb_db_t   db,
+		    int        hdr_type,
+		    void     * hdr_rec);
+
+
+/* Record a mutation in the change log, must be called with the write lock held */
+void hdb_log_change(hdb_db_t        db,
+		    hdb_table_t     table,
+		    uint64_t        id,
+		    hdb_change_op_t op);
+
+/* 
+ * Hash indexes
+ *    Lookups on exactly the columns of an index go through hdb_find_record()
+ */
+#define HDB_MAX_INDEX_COLS            4
+
+/* (type, column 1): enclave/app/CPU IDs, segids and memory block addresses */
+#define HDB_ID_INDEX_COL              1
+
+/* (type, column 2): enclave, app and segment names */
+#define HDB_NAME_INDEX_COL            2
+
+/* (type, columns 1-3): PMI (app ID, KVS name, key), see HDB_PMI_KVS_ENTRY_* */
+
+int hdb_create_hash_index(hdb_db_t   db,
+			  wg_int   * cols,
+			  int        num_cols);
+
+void * hdb_find_record(hdb_db_t       db,
+		       wg_query_arg * arglist,
+		       int            argc);
+
 #ifdef __cplusplus
 }
 #endif
@@ -13,6 +13,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <sys/time.h>
 
@@ -28,6 +29,26 @@
 extern hdb_db_t hobbes_master_db;
 
 
+/* Command queue connection cache
+ *   Connecting to an enclave's command queue attaches its whole segment, so closed 
+ *   connections are kept and handed back out by the next open of the same enclave.
+ *   Client handles are not thread safe, so a connection is only lent to one user at
+ *   a time. An entry is dropped once the enclave registers a different queue segid.
+ */
+#define HOBBES_CMDQ_CACHE_SIZE 16
+
+struct cmdq_cache_entry {
+    hobbes_id_t   enclave_id;
+    xemem_segid_t segid;
+    hcq_handle_t  hcq;
+    uint32_t      refcnt;
+    int           stale;
+};
+
+static struct cmdq_cache_entry cmdq_cache[HOBBES_CMDQ_CACHE_SIZE];
+static pthread_mutex_t         cmdq_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
 
 
 
@@ -116,11 +137,29 @@ hobbes_set_enclave_dev_id(hobbes_id_t enclave_id,
 
 
 
+/* Called with cmdq_cache_lock held */
+static void
+__evict_cmdq(struct cmdq_cache_entry * entry)
+{
+    if (entry->refcnt > 0) {
+	/* Disconnected when its user closes it */
+	entry->stale = 1;
+	return;
+    }
+
+    hcq_disconnect(entry->hcq);
+
+    memset(entry, 0, sizeof(struct cmdq_cache_entry));
+}
+
 hcq_handle_t 
 hobbes_open_enclave_cmdq(hobbes_id_t enclave_id)
 {
-    xemem_segid_t  segid        = -1;
-    enclave_type_t enclave_type = INVALID_ENCLAVE;
+    struct cmdq_cache_entry * free_entry   = NULL;
+    hcq_handle_t              hcq          = HCQ_INVALID_HANDLE;
+    xemem_segid_t             segid        = -1;
+    enclave_type_t            enclave_type = INVALID_ENCLAVE;
+    int                       i            = 0;
 
     enclave_type = hdb_get_enclave_type(hobbes_master_db, enclave_id);
 
@@ -131,15 +170,119 @@ hobbes_open_enclave_cmdq(hobbes_id_t enclave_id)
     
     segid = hdb_get_enclave_cmdq(hobbes_master_db, enclave_id);
 
-    return hcq_connect(segid);
+    pthread_mutex_lock(&cmdq_cache_lock);
+
+    for (i = 0; i < HOBBES_CMDQ_CACHE_SIZE; i++) {
+	struct cmdq_cache_entry * entry = &(cmdq_cache[i]);
+
+	if (entry->hcq == HCQ_INVALID_HANDLE) {
+	    if (free_entry == NULL) {
+		free_entry = entry;
+	    }
+
+	    continue;
+	}
+
+	if (entry->enclave_id != enclave_id) {
+	    continue;
+	}
+
+	if (entry->segid != segid) {
+	    /* The enclave's command queue was recreated */
+	    __evict_cmdq(entry);
+
+	    if ((entry->hcq == HCQ_INVALID_HANDLE) && (free_entry == NULL)) {
+		free_entry = entry;
+	    }
+
+	    continue;
+	}
+
+	if ((entry->refcnt == 0) && (hcq == HCQ_INVALID_HANDLE)) {
+	    entry->refcnt++;
+	    hcq = entry->hcq;
+	}
+    }
+
+    pthread_mutex_unlock(&cmdq_cache_lock);
+
+    if (hcq != HCQ_INVALID_HANDLE) {
+	return hcq;
+    }
+
+    hcq = hcq_connect(segid);
+
+    if (hcq == HCQ_INVALID_HANDLE) {
+	return HCQ_INVALID_HANDLE;
+    }
+
+    /* If the cache is full the connection is simply torn down when closed */
+    if (free_entry != NULL) {
+	pthread_mutex_lock(&cmdq_cache_lock);
+
+	if (free_entry->hcq == HCQ_INVALID_HANDLE) {
+	    free_entry->enclave_id = enclave_id;
+	    free_entry->segid      = segid;
+	    free_entry->hcq        = hcq;
+	    free_entry->refcnt     = 1;
+	    free_entry->stale      = 0;
+	}
+
+	pthread_mutex_unlock(&cmdq_cache_lock);
+    }
+
+    return hcq;
 }
 
 void
 hobbes_close_enclave_cmdq(hcq_handle_t hcq)
 {
+    int i = 0;
+
+    pthread_mutex_lock(&cmdq_cache_lock);
+
+    for (i = 0; i < HOBBES_CMDQ_CACHE_SIZE; i++) {
+	struct cmdq_cache_entry * entry = &(cmdq_cache[i]);
+
+	if (entry->hcq != hcq) {
+	    continue;
+	}
+
+	entry->refcnt--;
+
+	if (entry->stale) {
+	    __evict_cmdq(entry);
+	}
+
+	pthread_mutex_unlock(&cmdq_cache_lock);
+	return;
+    }
+
+    pthread_mutex_unlock(&cmdq_cache_lock);
+
     hcq_disconnect(hcq);
 }
 
+void
+hobbes_flush_enclave_cmdqs(void)
+{
+    int i = 0;
+
+    pthread_mutex_lock(&cmdq_cache_lock);
+
+    for (i = 0; i < HOBBES_CMDQ_CACHE_SIZE; i++) {
+	struct cmdq_cache_entry * entry = &(cmdq_cache[i]);
+
+	if (entry->hcq == HCQ_INVALID_HANDLE) {
+	    continue;
+	}
+
+	__evict_cmdq(entry);
+    }
+
+    pthread_mutex_unlock(&cmdq_cache_lock);
+}
+
 
 int 
 hobbes_ping_enclave(hobbes_id_t enclave_id, 
@@ -148,7 +291,6 @@ hobbes_ping_enclave(hobbes_id_t enclave_id,
     hcq_handle_t   hcq       = hobbes_open_enclave_cmdq(enclave_id);
     hcq_cmd_t      cmd       = HCQ_INVALID_CMD;
     int            ret       = 0;
-    char         * resp      = NULL;
     uint8_t      * data      = NULL;
     uint32_t       resp_size = 0;
 
@@ -157,35 +299,35 @@ hobbes_ping_enclave(hobbes_id_t enclave_id,
 
     printf("%s: ping\n", hobbes_get_my_enclave_name());
 
-    data = calloc(1, size_in_bytes);
+    gettimeofday(&start, NULL);
+
+    /* The ping payload is built directly in the command queue */
+    cmd = hcq_cmd_reserve(hcq, HOBBES_CMD_PING, size_in_bytes, (void **)&data);
 
-    if (data == NULL) {
-	ERROR("Could not allocate ping data buffer (size=%u bytes)\n", size_in_bytes);
+    if (cmd == HCQ_INVALID_CMD) {
+	ERROR("Could not reserve ping command (size=%u bytes)\n", size_in_bytes);
 	return -1;
     }
 
-    gettimeofday(&start, NULL);
-	
-    cmd = hcq_cmd_issue(hcq, HOBBES_CMD_PING, size_in_bytes, data);
+    memset(data, 0, size_in_bytes);
 
-    if (cmd == HCQ_INVALID_CMD) {
+    cmd = hcq_cmd_commit(hcq, cmd);
+
+    if ((cmd == HCQ_INVALID_CMD) || 
+	(hcq_cmd_wait(hcq, cmd) != 0)) {
 	printf("No Response\n");
 	return -1;
     }
 
-    ret = hcq_get_ret_code(hcq, cmd);
+    ret = hcq_cmd_collect(hcq, cmd, NULL, 0, &resp_size);
+
+    gettimeofday(&end, NULL);
 
     if (ret != 0) {
 	printf("Ping Error\n");
 	return -1;
     }
 
-    resp = hcq_get_ret_data(hcq, cmd, &resp_size);
-    
-    hcq_cmd_complete(hcq, cmd);
-
-    gettimeofday(&end, NULL);
-
     hobbes_close_enclave_cmdq(hcq);
 
     printf("%s: pong\n", hobbes_get_enclave_name(enclave_id));
@@ -195,9 +337,6 @@ hobbes_ping_enclave(hobbes_id_t enclave_id,
     end_us   = (end.tv_sec   * 1e6) + end.tv_usec;
     printf("Ping Latency  : %f\n",  (end_us   - start_us) / (double)1e6);
 
-    free(resp);
-    free(data);
-
     return 0;
 }
 
@@ -223,10 +362,8 @@ int
 hobbes_shutdown_enclave(hobbes_id_t enclave_id)
 {
     hcq_handle_t hcq = HCQ_INVALID_HANDLE;
-    hcq_cmd_t    cmd = HCQ_INVALID_CMD;
 
-    uint32_t  ret_size = 0;
-    uint8_t * ret_data = NULL;
+    char      err_str[128] = {0};
     int            ret = -1;
 
     hcq = hobbes_open_enclave_cmdq(enclave_id);
@@ -235,21 +372,13 @@ hobbes_shutdown_enclave(hobbes_id_t enclave_id)
 	goto out;
     }
 
-    cmd = hcq_cmd_issue(hcq, HOBBES_CMD_SHUTDOWN, 0, NULL);
-    if (cmd == HCQ_INVALID_CMD) {
-	ERROR("Error issuing shutdown command\n");
-	goto out;
-    }
-
-    ret = hcq_get_ret_code(hcq, cmd);
+    ret = hcq_call(hcq, HOBBES_CMD_SHUTDOWN, NULL, 0, err_str, sizeof(err_str) - 1, NULL);
     if (ret != 0) {
-	ret_data = hcq_get_ret_data(hcq, cmd, &ret_size);
-	ERROR("Error shutting down enclave (%s) [ret=%d]\n", ret_data, ret);
+	ERROR("Error shutting down enclave (%s) [ret=%d]\n", err_str, ret);
 	goto out;
     }
 
 out:
-    if (cmd != HCQ_INVALID_CMD)	   hcq_cmd_complete(hcq, cmd);
     if (hcq != HCQ_INVALID_HANDLE) hobbes_close_enclave_cmdq(hcq);;
 
     return ret;
@@ -259,32 +388,35 @@ struct enclave_info *
 hobbes_get_enclave_list(uint32_t * num_enclaves)
 {
     struct enclave_info * info_arr = NULL;
-    hobbes_id_t         * id_arr   = NULL;
 
-    uint32_t id_cnt = 0;
-    uint32_t i      = 0;
+    uint32_t max_cnt = 0;
+    uint32_t cnt     = 0;
 
-    id_arr = hdb_get_enclaves(hobbes_master_db, &id_cnt);
-    
-    if (id_arr == NULL) {
-	ERROR("Could not retrieve list of enclave ids\n");
+    /* Size the array, then snapshot. Retry if enclaves were added in between */
+    if (hdb_snapshot_enclaves(hobbes_master_db, NULL, 0, &cnt) == -1) {
+	ERROR("Could not retrieve enclave list\n");
 	return NULL;
     }
-	
-    info_arr = calloc(sizeof(struct enclave_info), id_cnt);
 
-    for (i = 0; i < id_cnt; i++) {
-	info_arr[i].id    = id_arr[i];
+    do {
+	free(info_arr);
 
-	info_arr[i].type  = hdb_get_enclave_type  ( hobbes_master_db, id_arr[i] );
-	info_arr[i].state = hdb_get_enclave_state ( hobbes_master_db, id_arr[i] );
- 
-	strncpy(info_arr[i].name, hdb_get_enclave_name(hobbes_master_db, id_arr[i]), 31);
-    }
+	max_cnt  = cnt;
+	info_arr = calloc(sizeof(struct enclave_info), (max_cnt > 0) ? max_cnt : 1);
 
-    free(id_arr);
+	if (info_arr == NULL) {
+	    ERROR("Could not allocate enclave list\n");
+	    return NULL;
+	}
+
+	if (hdb_snapshot_enclaves(hobbes_master_db, info_arr, max_cnt, &cnt) == -1) {
+	    ERROR("Could not retrieve enclave list\n");
+	    free(info_arr);
+	    return NULL;
+	}
+    } while (cnt > max_cnt);
 
-    *num_enclaves = id_cnt;
+    *num_enclaves = cnt;
 
     return info_arr;
 }
@@ -55,6 +55,7 @@ int             hobbes_ping_enclave(hobbes_id_t enclave_id, uint32_t size_in_byt
 
 hcq_handle_t    hobbes_open_enclave_cmdq(hobbes_id_t enclave_id);
 void            hobbes_close_enclave_cmdq(hcq_handle_t hcq);
+void            hobbes_flush_enclave_cmdqs(void);
 int             hobbes_register_enclave_cmdq(hobbes_id_t enclave_id, xemem_segid_t segid);
 
 int             hobbes_shutdown_enclave(hobbes_id_t enclave_id);
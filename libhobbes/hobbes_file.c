@@ -56,45 +56,21 @@ hfio_stat(hcq_handle_t   hcq,
 	  char         * path, 
 	  struct stat  * buf)
 {
-    hcq_cmd_t cmd   = HCQ_INVALID_CMD;
-    
     int       ret      = -1;
-    int       ret_size =  0;
-    uint8_t * ret_data =  NULL;
-
-
-    cmd = hcq_cmd_issue(hcq, HOBBES_CMD_FILE_STAT, smart_strlen(path) + 1, path);
-
-    if (cmd == HCQ_INVALID_CMD) {
-	ERROR("Could not issue HFIO stat command\n");
-	goto out;
-    }
+    uint32_t  ret_size =  0;
 
-    ret = hcq_get_ret_code(hcq, cmd);
+    ret = hcq_call(hcq, HOBBES_CMD_FILE_STAT, path, smart_strlen(path) + 1, buf, sizeof(struct stat), &ret_size);
     
     if (ret == -1) {
 	ERROR("Error executing HFIO stat command\n");
-	goto out;
-    }
-
-
-    ret_data = hcq_get_ret_data(hcq, cmd, (void *)&ret_size);
-
-    if (ret_data == NULL) {
-	ERROR("Invalid return data in HFIO stat command\n");
-	goto out;
+	return -1;
     }
 
     if (ret_size != sizeof(struct stat)) {
 	ERROR("Compatibility Error! Inconsistent 'struct stat' types across enclaves\n");
-	goto out;
+	return -1;
     }
 
-    memcpy(buf, ret_data, ret_size);
-
- out:
-    if (cmd != HCQ_INVALID_CMD) hcq_cmd_complete(hcq, cmd);
-
     return ret;
 }
 
@@ -103,47 +79,28 @@ int
 hfio_fstat(hobbes_file_t   file, 
 	   struct stat   * buf)
 {
-    hcq_cmd_t cmd   = HCQ_INVALID_CMD;
-
     int       ret      = -1;
-    int       ret_size =  0;
-    uint8_t * ret_data =  NULL;
+    uint32_t  ret_size =  0;
 
-    cmd = hcq_cmd_issue(file->hcq, 
-			HOBBES_CMD_FILE_FSTAT, 
-			sizeof(uint64_t),
-			(void *)&(file->file_handle));
-
-    if (cmd == HCQ_INVALID_CMD) {
-	ERROR("Could not issue HFIO fstat command\n");
-	goto out;
-    }
-
-    ret = hcq_get_ret_code(file->hcq, cmd);
+    ret = hcq_call(file->hcq, 
+		   HOBBES_CMD_FILE_FSTAT, 
+		   (void *)&(file->file_handle),
+		   sizeof(uint64_t),
+		   buf, 
+		   sizeof(struct stat), 
+		   &ret_size);
 
     if (ret == -1) {
 	ERROR("Error executing HFIO fstat command\n");
-	goto out;
-    }
-
-    ret_data = hcq_get_ret_data(file->hcq, cmd, (void *)&ret_size);
-
-    if (ret_data == NULL) {
-	ERROR("Invalid return data in HFIO fstat command\n");
-	goto out;
+	return -1;
     }
 
     if (ret_size != sizeof(struct stat)) {
 	ERROR("Compatibility Error! Inconsistent 'struct stat' types across enclaves\n");
-	goto out;
+	return -1;
     }
 
-    memcpy(buf, ret_data, ret_size);
-
- out:
-    if (cmd != HCQ_INVALID_CMD) hcq_cmd_complete(file->hcq, cmd);
     return ret;
-
 }
 
 
@@ -170,13 +127,12 @@ hfio_open(hcq_handle_t   hcq,
 {
     struct hobbes_file_state * file = NULL;
 
-    hcq_cmd_t   cmd         = HCQ_INVALID_CMD;
     pet_xml_t   cmd_xml     = PET_INVALID_XML;
-    uint64_t  * file_handle = 0;
+    uint64_t    file_handle = 0;
 
-    char * tmp_str  = NULL;
-    int    ret_size = 0;
-    int    ret      = 0;
+    char     * tmp_str  = NULL;
+    uint32_t   ret_size = 0;
+    int        ret      = 0;
 
 
     file = calloc(sizeof(struct hobbes_file_state), 1);
@@ -226,34 +182,24 @@ hfio_open(hcq_handle_t   hcq,
 
     tmp_str = pet_xml_get_str(cmd_xml);
 
-    cmd = hcq_cmd_issue(hcq, HOBBES_CMD_FILE_OPEN, strlen(tmp_str) + 1, tmp_str);
+    ret = hcq_call(hcq, HOBBES_CMD_FILE_OPEN, tmp_str, strlen(tmp_str) + 1, 
+		   &file_handle, sizeof(uint64_t), &ret_size);
     
     smart_free(tmp_str);
 
-    if (cmd == HCQ_INVALID_CMD) {
-	ERROR("Error issueing open file command (%s)\n", path);
-	goto err;
-    }
-
-    ret = hcq_get_ret_code(hcq, cmd);
-
     if (ret != 0) {
 	ERROR("Error opening hobbes file (%s) [ret=%d]\n", path, ret);
 	goto err;
     }
 
-    file_handle = (uint64_t *)hcq_get_ret_data(hcq, cmd, (void *)&ret_size);
-
     if (ret_size != sizeof(uint64_t)) {
 	ERROR("Invalid return size from Hobbes File Open\n");
 	goto err;
     }
 
     /* Store state info in the file structure */
-    file->hcq         =  hcq;
-    file->file_handle = *file_handle;
-
-    hcq_cmd_complete(hcq, cmd);
+    file->hcq         = hcq;
+    file->file_handle = file_handle;
 
     pet_xml_free(cmd_xml);
 
@@ -264,7 +210,6 @@ hfio_open(hcq_handle_t   hcq,
     if (tmp_str != NULL)            smart_free(tmp_str);		 
     if (file    != NULL)            smart_free(file);
     if (cmd_xml != PET_INVALID_XML) pet_xml_free(cmd_xml);
-    if (cmd     != HCQ_INVALID_CMD) hcq_cmd_complete(hcq, cmd);
     return HOBBES_INVALID_FILE;
 }
 
@@ -272,17 +217,11 @@ hfio_open(hcq_handle_t   hcq,
 void
 hfio_close(hobbes_file_t file)
 {
-    hcq_cmd_t cmd = HCQ_INVALID_CMD;
-    
-    cmd = hcq_cmd_issue(file->hcq, HOBBES_CMD_FILE_CLOSE, sizeof(uint64_t), (void *)&file->file_handle);
-
-    if (cmd == HCQ_INVALID_CMD) {
+    if (hcq_call(file->hcq, HOBBES_CMD_FILE_CLOSE, (void *)&file->file_handle, sizeof(uint64_t), 
+		 NULL, 0, NULL) == -1) {
 	return;
     }
 
-
-    hcq_cmd_complete(file->hcq, cmd);
-
     smart_free(file);
     return;
 }
@@ -293,8 +232,8 @@ hfio_read(hobbes_file_t   file,
 	  char          * buf,
 	  size_t          count)
 {
-    hcq_cmd_t cmd = HCQ_INVALID_CMD;
-    ssize_t   ret = 0;
+    ssize_t   ret       = 0;
+    uint32_t  data_size = 0;
 
     struct hfio_rd_req req;
 
@@ -309,38 +248,21 @@ hfio_read(hobbes_file_t   file,
     req.file_handle = file->file_handle;
     req.data_size   = count;
     
-    cmd = hcq_cmd_issue(file->hcq, HOBBES_CMD_FILE_READ, sizeof(struct hfio_rd_req), &req);
-
-
-    if (cmd == HCQ_INVALID_CMD) {
-	ERROR("Could not issue HFIO read command\n");
-	goto out;
-    }
-    
-    ret = hcq_get_ret_code(file->hcq, cmd);
+    /* The reply is copied straight into the caller's buffer */
+    ret = hcq_call(file->hcq, HOBBES_CMD_FILE_READ, &req, sizeof(struct hfio_rd_req), 
+		   buf, count, &data_size);
 
     if (ret > 0) {
-	void     * data_ptr  = NULL;
-	uint32_t   data_size = 0;
-	
-	data_ptr = hcq_get_ret_data(file->hcq, cmd, &data_size);
-
 	if (count < data_size) {
 	    ERROR("Read more than the requested amount of data\n");
 	    ERROR("File position is likely inconsistent\n");
 	} else if (count > data_size) {
 	    count = data_size;
 	}
-
-	memcpy(buf, data_ptr, count);
 	
 	ret = count;
     }
 
- out:
-    
-    if (cmd != HCQ_INVALID_CMD) hcq_cmd_complete(file->hcq, cmd);
-
     return ret;
 }
 
@@ -351,7 +273,6 @@ hfio_write(hobbes_file_t file,
 	   size_t        count)
 {
     hcq_cmd_t cmd =  HCQ_INVALID_CMD;
-    ssize_t   ret = -1;
 
     struct hfio_wr_req * req = NULL;
 
@@ -360,11 +281,12 @@ hfio_write(hobbes_file_t file,
 	count = MAX_XFER_SIZE;
     }
 
-    req = calloc(sizeof(struct hfio_wr_req) + count, 1);
-    
-    if (req == NULL) {
-	ERROR("Could not allocate memory for write request\n");
-	goto out;
+    /* Build the request directly in the command's payload buffer */
+    cmd = hcq_cmd_reserve(file->hcq, HOBBES_CMD_FILE_WRITE, sizeof(struct hfio_wr_req) + count, (void **)&req);
+
+    if (cmd == HCQ_INVALID_CMD) {
+	ERROR("Could not reserve HFIO write command\n");
+	return -1;
     }
 
     req->file_handle = file->file_handle;
@@ -372,20 +294,20 @@ hfio_write(hobbes_file_t file,
 
     memcpy(req->data, buf, count);
     
-    cmd = hcq_cmd_issue(file->hcq, HOBBES_CMD_FILE_WRITE, sizeof(struct hfio_wr_req) + count, req);
+    cmd = hcq_cmd_commit(file->hcq, cmd);
 
     if (cmd == HCQ_INVALID_CMD) {
 	ERROR("Could not issue HFIO write command\n");
-	goto out;
+	return -1;
     }
 
-    ret = hcq_get_ret_code(file->hcq, cmd);
-
- out:
-    if (req != NULL)            smart_free(req);
-    if (cmd != HCQ_INVALID_CMD) hcq_cmd_complete(file->hcq, cmd);
+    if (hcq_cmd_wait(file->hcq, cmd) != 0) {
+	ERROR("Error waiting for HFIO write command\n");
+	hcq_cmd_cancel(file->hcq, cmd);
+	return -1;
+    }
 
-    return ret;
+    return hcq_cmd_collect(file->hcq, cmd, NULL, 0, NULL);
 }
 
 
@@ -394,11 +316,8 @@ hfio_lseek(hobbes_file_t file,
 	   off_t         offset, 
 	   int           whence)
 {
-    hcq_cmd_t cmd     =  HCQ_INVALID_CMD;
-    off_t     ret     = -1;
-
-    void   * ret_data = NULL;
-    uint32_t ret_size = 0;
+    off_t    ret      = -1;
+    uint32_t ret_size =  0;
 
     struct hfio_seek_req req;
 
@@ -408,29 +327,17 @@ hfio_lseek(hobbes_file_t file,
     req.offset      = offset;
     req.whence      = whence;
 
-    cmd = hcq_cmd_issue(file->hcq, HOBBES_CMD_FILE_SEEK, sizeof(struct hfio_seek_req), (void *)&req);
-    
-    if (cmd == HCQ_INVALID_CMD) {
-	ERROR("Could not issue HFIO seek command\n");
-	goto out;
-    }
-
-    if (hcq_get_ret_code(file->hcq, cmd) != 0) {
+    if (hcq_call(file->hcq, HOBBES_CMD_FILE_SEEK, (void *)&req, sizeof(struct hfio_seek_req), 
+		 &ret, sizeof(off_t), &ret_size) != 0) {
 	ERROR("Could not execute HFIO seek command\n");
-	goto out;
+	return -1;
     }
-    
-    ret_data = hcq_get_ret_data(file->hcq, cmd, &ret_size);
 
-    if (ret_size == 0) {
+    if (ret_size != sizeof(off_t)) {
 	ERROR("Invalid return value from HFIO seek command\n");
-	goto out;
+	return -1;
     }
     
-    ret = *(off_t *)ret_data;
-
- out:
-    if (cmd != HCQ_INVALID_CMD) hcq_cmd_complete(file->hcq, cmd);
     return ret;
 }
 
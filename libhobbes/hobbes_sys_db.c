@@ -51,18 +51,375 @@ __wg_set_record(hdb_db_t   db,
 }
 
 
+/* 
+ * Memory block list links are stored as plain offsets instead of record
+ * references. Record references carry backlinks, which make WhiteDB walk 
+ * the neighboring blocks on every field update. 
+ */
+static hdb_mem_t
+__get_mem_link(hdb_db_t    db,
+	       hdb_mem_t   blk,
+	       wg_int      field_idx)
+{
+    wg_int off = wg_decode_int(db, wg_get_field(db, blk, field_idx));
+
+    if (off == 0) {
+	return NULL;
+    }
+
+    return offsettoptr(db, off);
+}
+
+static void
+__set_mem_link(hdb_db_t    db,
+	       hdb_mem_t   blk,
+	       wg_int      field_idx,
+	       hdb_mem_t   link)
+{
+    wg_set_field(db, blk, field_idx, wg_encode_int(db, (link) ? ptrtooffset(db, link) : 0));
+}
+
+
 static void *
 __get_sys_hdr(hdb_db_t db)
 {
-    static void * sys_hdr = NULL;
-    
-    if (sys_hdr == NULL) {
-	sys_hdr = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_SYS_HDR, NULL);
+    return hdb_get_hdr_rec(db, HDB_REC_SYS_HDR);
+}
+
+
+/* 
+ * Raw arrays in the string area, which WhiteDB never scans for records 
+ *    Returns the offset of the array itself, skipping the object length that WhiteDB keeps in the first gint 
+ */
+static gint
+__alloc_raw_array(hdb_db_t db,
+		  uint64_t size)
+{
+    gint off = wg_alloc_gints(db, &(dbmemsegh(db)->longstr_area_header), 
+			      1 + (size + sizeof(gint) - 1) / sizeof(gint));
+
+    if (off == 0) {
+	return 0;
     }
 
-    return sys_hdr;
+    return off + sizeof(gint);
 }
 
+static void
+__free_raw_array(hdb_db_t db,
+		 gint     off)
+{
+    if (off != 0) {
+	wg_free_object(db, &(dbmemsegh(db)->longstr_area_header), off - sizeof(gint));
+    }
+}
+
+
+/* 
+ * Free memory zones
+ *    Free blocks are tracked per NUMA node by a binary buddy allocator. A zone
+ *    covers the block indices [base_idx, base_idx + capacity), where a block's 
+ *    index is its address divided by the system block size. The per-index
+ *    free list links and states live in raw memory of the string area.
+ */
+#define HDB_ZONE_MAX_ORDER     31
+#define HDB_ZONE_MIN_CAPACITY  64
+#define HDB_ZONE_NIL           ((uint32_t)-1)
+
+/* Zone state values below HDB_ZONE_FREE_INNER are the order of a free chunk's head */
+#define HDB_ZONE_FREE_INNER    0xfe
+#define HDB_ZONE_NOT_FREE      0xff
+
+struct hdb_mem_zone {
+    uint64_t base_idx;
+    uint32_t capacity;
+    uint32_t free_cnt;
+    gint     next_off;   /* uint32_t[capacity] */
+    gint     prev_off;   /* uint32_t[capacity] */
+    gint     state_off;  /* uint8_t[capacity]  */
+    uint32_t free_list[HDB_ZONE_MAX_ORDER + 1];
+};
+
+
+static struct hdb_mem_zone *
+__get_mem_zone(hdb_db_t   db,
+	       void     * hdr,
+	       uint32_t   numa_node)
+{
+    wg_int   off      = wg_decode_int(db, wg_get_field(db, hdr, HDB_SYS_HDR_MEM_ZONES));
+    uint32_t numa_cnt = wg_decode_int(db, wg_get_field(db, hdr, HDB_SYS_HDR_NUMA_CNT));
+
+    if ((off == 0) || (numa_node >= numa_cnt)) {
+	return NULL;
+    }
+
+    return (struct hdb_mem_zone *)offsettoptr(db, off) + numa_node;
+}
+
+static void
+__zone_list_add(hdb_db_t              db,
+		struct hdb_mem_zone * zone,
+		uint32_t              order,
+		uint32_t              idx)
+{
+    uint32_t * next = offsettoptr(db, zone->next_off);
+    uint32_t * prev = offsettoptr(db, zone->prev_off);
+    uint32_t   head = zone->free_list[order];
+
+    next[idx] = head;
+    prev[idx] = HDB_ZONE_NIL;
+
+    if (head != HDB_ZONE_NIL) {
+	prev[head] = idx;
+    }
+
+    zone->free_list[order] = idx;
+}
+
+static void
+__zone_list_del(hdb_db_t              db,
+		struct hdb_mem_zone * zone,
+		uint32_t              order,
+		uint32_t              idx)
+{
+    uint32_t * next = offsettoptr(db, zone->next_off);
+    uint32_t * prev = offsettoptr(db, zone->prev_off);
+
+    if (prev[idx] != HDB_ZONE_NIL) {
+	next[prev[idx]] = next[idx];
+    } else {
+	zone->free_list[order] = next[idx];
+    }
+
+    if (next[idx] != HDB_ZONE_NIL) {
+	prev[next[idx]] = prev[idx];
+    }
+}
+
+/* Free a single block, merging it with its buddies as far as possible */
+static void
+__zone_insert(hdb_db_t              db,
+	      struct hdb_mem_zone * zone,
+	      uint32_t              idx)
+{
+    uint8_t  * state = offsettoptr(db, zone->state_off);
+    uint32_t   order = 0;
+
+    state[idx] = HDB_ZONE_FREE_INNER;
+
+    while (order < HDB_ZONE_MAX_ORDER) {
+	uint32_t buddy = idx ^ (1U << order);
+
+	if ((buddy >= zone->capacity) || (state[buddy] != order)) {
+	    break;
+	}
+
+	__zone_list_del(db, zone, order, buddy);
+	state[buddy] = HDB_ZONE_FREE_INNER;
+
+	idx &= ~(1U << order);
+	order++;
+    }
+
+    state[idx] = order;
+    __zone_list_add(db, zone, order, idx);
+
+    zone->free_cnt++;
+}
+
+/* Take a single free block, splitting the chunk that holds it */
+static int
+__zone_remove(hdb_db_t              db,
+	      struct hdb_mem_zone * zone,
+	      uint32_t              idx)
+{
+    uint8_t  * state = offsettoptr(db, zone->state_off);
+    uint32_t   order = 0;
+    uint32_t   head  = 0;
+
+    if (state[idx] == HDB_ZONE_NOT_FREE) {
+	return -1;
+    }
+
+    for (order = 0; order <= HDB_ZONE_MAX_ORDER; order++) {
+	head = idx & ~((1U << order) - 1);
+
+	if (state[head] == order) {
+	    break;
+	}
+    }
+
+    if (order > HDB_ZONE_MAX_ORDER) {
+	ERROR("Corrupted free memory zone (index %u)\n", idx);
+	return -1;
+    }
+
+    __zone_list_del(db, zone, order, head);
+
+    /* Return the halves that do not hold idx to the free lists */
+    while (order > 0) {
+	uint32_t half = 0;
+
+	order--;
+	half = head + (1U << order);
+
+	if (idx >= half) {
+	    state[head] = order;
+	    __zone_list_add(db, zone, order, head);
+	    head = half;
+	} else {
+	    state[half] = order;
+	    __zone_list_add(db, zone, order, half);
+	}
+    }
+
+    state[idx] = HDB_ZONE_NOT_FREE;
+
+    zone->free_cnt--;
+
+    return 0;
+}
+
+/* Resize a zone so that it covers the block index blk_idx */
+static int
+__zone_grow(hdb_db_t              db,
+	    struct hdb_mem_zone * zone,
+	    uint64_t              blk_idx)
+{
+    struct hdb_mem_zone old_zone = *zone;
+
+    uint64_t  lo        = blk_idx;
+    uint64_t  hi        = blk_idx + 1;
+    uint64_t  new_cap   = HDB_ZONE_MIN_CAPACITY;
+    uint64_t  new_base  = 0;
+    gint      next_off  = 0;
+    gint      prev_off  = 0;
+    gint      state_off = 0;
+    uint8_t * state     = NULL;
+    uint32_t  i         = 0;
+
+    if (old_zone.capacity > 0) {
+	lo      = (blk_idx < old_zone.base_idx) ? blk_idx : old_zone.base_idx;
+	hi      = (blk_idx >= old_zone.base_idx + old_zone.capacity) ? blk_idx + 1 : old_zone.base_idx + old_zone.capacity;
+	new_cap = (uint64_t)old_zone.capacity * 2;
+    }
+
+    while (new_cap < (hi - lo)) {
+	new_cap *= 2;
+    }
+
+    if (new_cap > (1ULL << HDB_ZONE_MAX_ORDER)) {
+	ERROR("Memory zone cannot span %lu blocks\n", hi - lo);
+	return -1;
+    }
+
+    /* Leave room below the zone when it grows downwards */
+    if ((old_zone.capacity > 0) && (blk_idx < old_zone.base_idx)) {
+	new_base = (hi > new_cap) ? (hi - new_cap) : 0;
+    } else {
+	new_base = lo;
+    }
+
+    next_off  = __alloc_raw_array(db, new_cap * sizeof(uint32_t));
+    prev_off  = __alloc_raw_array(db, new_cap * sizeof(uint32_t));
+    state_off = __alloc_raw_array(db, new_cap * sizeof(uint8_t));
+
+    if ((next_off == 0) || (prev_off == 0) || (state_off == 0)) {
+	ERROR("Could not allocate memory zone (capacity=%lu)\n", new_cap);
+	__free_raw_array(db, next_off);
+	__free_raw_array(db, prev_off);
+	__free_raw_array(db, state_off);
+	return -1;
+    }
+
+    memset(offsettoptr(db, state_off), HDB_ZONE_NOT_FREE, new_cap);
+    memset(zone->free_list, 0xff, sizeof(zone->free_list));
+
+    zone->base_idx  = new_base;
+    zone->capacity  = new_cap;
+    zone->free_cnt  = 0;
+    zone->next_off  = next_off;
+    zone->prev_off  = prev_off;
+    zone->state_off = state_off;
+
+    /* Re-insert the free blocks of the old zone */
+    if (old_zone.capacity > 0) {
+	state = offsettoptr(db, old_zone.state_off);
+
+	for (i = 0; i < old_zone.capacity; i++) {
+	    if (state[i] != HDB_ZONE_NOT_FREE) {
+		__zone_insert(db, zone, old_zone.base_idx + i - new_base);
+	    }
+	}
+
+	__free_raw_array(db, old_zone.next_off);
+	__free_raw_array(db, old_zone.prev_off);
+	__free_raw_array(db, old_zone.state_off);
+    }
+
+    return 0;
+}
+
+/* Find span free contiguous blocks, returning the zone index of the first one */
+static uint32_t
+__zone_find_span(hdb_db_t              db,
+		 struct hdb_mem_zone * zone,
+		 uint32_t              span)
+{
+    uint8_t  * state = NULL;
+    uint32_t   order = 0;
+    uint32_t   run   = 0;
+    uint32_t   i     = 0;
+
+    if ((span == 0) || (zone->free_cnt < span)) {
+	return HDB_ZONE_NIL;
+    }
+
+    while ((1ULL << order) < span) {
+	order++;
+    }
+
+    for (; order <= HDB_ZONE_MAX_ORDER; order++) {
+	if (zone->free_list[order] != HDB_ZONE_NIL) {
+	    return zone->free_list[order];
+	}
+    }
+
+    /* No chunk is large enough, but the span may still cross chunk boundaries */
+    state = offsettoptr(db, zone->state_off);
+
+    for (i = 0; i < zone->capacity; i++) {
+	if (state[i] == HDB_ZONE_NOT_FREE) {
+	    run = 0;
+	    continue;
+	}
+
+	if (++run == span) {
+	    return i + 1 - span;
+	}
+    }
+
+    return HDB_ZONE_NIL;
+}
+
+
+/* 
+ * Free CPU map
+ *    One bitmap of free CPU IDs per NUMA node, plus the physical core of each
+ *    registered CPU so allocations can place CPUs relative to their SMT siblings.
+ *    Cores are the IDs the master probed from the CPU topology at registration.
+ *    Like the memory zones, it lives in raw memory of the string area.
+ */
+#define HDB_CPU_NO_CORE        ((uint32_t)-1)
+#define HDB_CPU_MAP_MAX_IDS    (1U << 20)
+
+struct hdb_cpu_map {
+    uint32_t capacity;   /* CPU IDs covered, a multiple of 64 */
+    uint32_t numa_cnt;
+    gint     free_off;   /* uint64_t[numa_cnt][capacity / 64] */
+    gint     core_off;   /* uint32_t[capacity] */
+};
+
 
 /*
  * System Info Database records
@@ -81,16 +438,73 @@ __init_system_info(hdb_db_t db,
     }
 
     /* Create System Info Header */
-    rec = wg_create_record(db, 8);
+    rec = wg_create_record(db, HDB_SYS_HDR_REC_LEN);
     wg_set_field(db, rec, HDB_TYPE_FIELD,               wg_encode_int(db, HDB_REC_SYS_HDR));
     wg_set_field(db, rec, HDB_SYS_HDR_CPU_CNT,          wg_encode_int(db, 0));
     wg_set_field(db, rec, HDB_SYS_HDR_NUMA_CNT,         wg_encode_int(db, numa_nodes));
     wg_set_field(db, rec, HDB_SYS_HDR_MEM_BLK_SIZE,     wg_encode_int(db, mem_blk_size));
     wg_set_field(db, rec, HDB_SYS_HDR_MEM_BLK_CNT,      wg_encode_int(db, 0));
     wg_set_field(db, rec, HDB_SYS_HDR_MEM_FREE_BLK_CNT, wg_encode_int(db, 0));
+    wg_set_field(db, rec, HDB_SYS_HDR_MEM_ZONES,        wg_encode_int(db, 0));
 
-    __wg_set_record(db, rec, HDB_SYS_HDR_MEM_FREE_LIST, NULL);
     __wg_set_record(db, rec, HDB_SYS_HDR_MEM_BLK_LIST,  NULL);
+
+    /* Create an empty free memory zone for each NUMA node */
+    if (numa_nodes > 0) {
+	struct hdb_mem_zone * zones     = NULL;
+	gint                  zones_off = 0;
+	uint32_t              i         = 0;
+
+	zones_off = __alloc_raw_array(db, sizeof(struct hdb_mem_zone) * numa_nodes);
+
+	if (zones_off == 0) {
+	    ERROR("Could not allocate free memory zones\n");
+	    return -1;
+	}
+
+	zones = offsettoptr(db, zones_off);
+	memset(zones, 0, sizeof(struct hdb_mem_zone) * numa_nodes);
+
+	for (i = 0; i < numa_nodes; i++) {
+	    memset(zones[i].free_list, 0xff, sizeof(zones[i].free_list));
+	}
+
+	wg_set_field(db, rec, HDB_SYS_HDR_MEM_ZONES, wg_encode_int(db, zones_off));
+    }
+
+    /* Create an empty free CPU map, which grows as CPUs are registered */
+    {
+	struct hdb_cpu_map * map     = NULL;
+	gint                 map_off = 0;
+
+	map_off = __alloc_raw_array(db, sizeof(struct hdb_cpu_map));
+
+	if (map_off == 0) {
+	    ERROR("Could not allocate free CPU map\n");
+	    return -1;
+	}
+
+	map = offsettoptr(db, map_off);
+	memset(map, 0, sizeof(struct hdb_cpu_map));
+	map->numa_cnt = numa_nodes;
+
+	wg_set_field(db, rec, HDB_SYS_HDR_CPU_MAP, wg_encode_int(db, map_off));
+    }
+
+    if (hdb_set_hdr_rec(db, HDB_REC_SYS_HDR, rec) != 0) {
+	ERROR("Could not add system header to the header directory\n");
+	return -1;
+    }
+
+    /* CPU IDs and memory block indices are looked up through the (type, column 1) index */
+    {
+	wg_int id_cols[2] = {HDB_TYPE_FIELD, HDB_ID_INDEX_COL};
+
+	if (hdb_create_hash_index(db, id_cols, 2) != 0) {
+	    ERROR("Could not create system info index\n");
+	    return -1;
+	}
+    }
  
     return 0;
 }
@@ -102,6 +516,8 @@ hdb_init_system_info(hdb_db_t db,
 {
     wg_int   lock_id;
     int      ret      = -1;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
     
     lock_id = wg_start_write(db);
     
@@ -144,6 +560,8 @@ hdb_get_sys_numa_cnt(hdb_db_t db)
 {
     uint32_t   numa_cnt = 0;
     wg_int     lock_id;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
     
     lock_id = wg_start_read(db);
 
@@ -185,6 +603,8 @@ hdb_get_sys_blk_size(hdb_db_t db)
 {
     uint64_t   blk_size = 0;
     wg_int     lock_id;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
     
     lock_id = wg_start_read(db);
 
@@ -227,6 +647,8 @@ hdb_get_sys_blk_cnt(hdb_db_t db)
 {
     uint64_t   blk_cnt = 0;
     wg_int     lock_id;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
     
     lock_id = wg_start_read(db);
 
@@ -269,6 +691,8 @@ hdb_get_sys_free_blk_cnt(hdb_db_t db)
 {
     uint64_t   blk_cnt = 0;
     wg_int     lock_id;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
     
     lock_id = wg_start_read(db);
 
@@ -299,7 +723,6 @@ __get_cpu_by_id(hdb_db_t db,
 		uint32_t cpu_id)
 {
     hdb_cpu_t      cpu   = NULL;
-    wg_query     * query = NULL;
     wg_query_arg   arglist[2];
 
     arglist[0].column = HDB_TYPE_FIELD;
@@ -310,10 +733,8 @@ __get_cpu_by_id(hdb_db_t db,
     arglist[1].cond   = WG_COND_EQUAL;
     arglist[1].value  = wg_encode_query_param_int(db, cpu_id);
 
-    query = wg_make_query(db, NULL, 0, arglist, 2);
-    cpu   = wg_fetch(db, query);
+    cpu   = hdb_find_record(db, arglist, 2);
 
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
 
@@ -355,18 +776,140 @@ __get_cpu_id(hdb_db_t  db,
     return wg_decode_int(db, wg_get_field(db, cpu, HDB_CPU_ID));
 }
 
+
+static struct hdb_cpu_map *
+__get_cpu_map(hdb_db_t   db,
+	      void     * hdr)
+{
+    wg_int off = wg_decode_int(db, wg_get_field(db, hdr, HDB_SYS_HDR_CPU_MAP));
+
+    if (off == 0) {
+	return NULL;
+    }
+
+    return offsettoptr(db, off);
+}
+
+static uint64_t *
+__cpu_map_node(hdb_db_t             db,
+	       struct hdb_cpu_map * map,
+	       uint32_t             numa_node)
+{
+    return (uint64_t *)offsettoptr(db, map->free_off) + (numa_node * (map->capacity / 64));
+}
+
+static void
+__cpu_map_set(hdb_db_t             db,
+	      struct hdb_cpu_map * map,
+	      uint32_t             numa_node,
+	      uint32_t             cpu_id,
+	      int                  free)
+{
+    uint64_t * bits = __cpu_map_node(db, map, numa_node);
+
+    if (free) {
+	bits[cpu_id / 64] |=  (1ULL << (cpu_id % 64));
+    } else {
+	bits[cpu_id / 64] &= ~(1ULL << (cpu_id % 64));
+    }
+}
+
+/* Resize the map so that it covers cpu_id */
+static int
+__cpu_map_grow(hdb_db_t             db,
+	       struct hdb_cpu_map * map,
+	       uint32_t             cpu_id)
+{
+    uint32_t   new_cap  = (map->capacity > 0) ? (map->capacity * 2) : 64;
+    uint32_t   words    = 0;
+    gint       free_off = 0;
+    gint       core_off = 0;
+    uint32_t * core     = NULL;
+    uint32_t   i        = 0;
+
+    if (cpu_id >= HDB_CPU_MAP_MAX_IDS) {
+	ERROR("CPU ID (%u) is out of range\n", cpu_id);
+	return -1;
+    }
+
+    while (new_cap <= cpu_id) {
+	new_cap *= 2;
+    }
+
+    words    = new_cap / 64;
+    free_off = __alloc_raw_array(db, sizeof(uint64_t) * words * map->numa_cnt);
+    core_off = __alloc_raw_array(db, sizeof(uint32_t) * new_cap);
+
+    if ((free_off == 0) || (core_off == 0)) {
+	ERROR("Could not allocate free CPU map (capacity=%u)\n", new_cap);
+	__free_raw_array(db, free_off);
+	__free_raw_array(db, core_off);
+	return -1;
+    }
+
+    memset(offsettoptr(db, free_off), 0,    sizeof(uint64_t) * words * map->numa_cnt);
+    memset(offsettoptr(db, core_off), 0xff, sizeof(uint32_t) * new_cap);
+
+    core = offsettoptr(db, core_off);
+
+    if (map->capacity > 0) {
+	for (i = 0; i < map->numa_cnt; i++) {
+	    memcpy((uint64_t *)offsettoptr(db, free_off) + (i * words),
+		   __cpu_map_node(db, map, i),
+		   sizeof(uint64_t) * (map->capacity / 64));
+	}
+
+	memcpy(core, offsettoptr(db, map->core_off), sizeof(uint32_t) * map->capacity);
+
+	__free_raw_array(db, map->free_off);
+	__free_raw_array(db, map->core_off);
+    }
+
+    map->capacity = new_cap;
+    map->free_off = free_off;
+    map->core_off = core_off;
+
+    return 0;
+}
+
+/* Mirror a CPU record's state in the free CPU map */
+static void
+__cpu_map_update(hdb_db_t  db,
+		 hdb_cpu_t cpu,
+		 int       free)
+{
+    void               * hdr       = __get_sys_hdr(db);
+    struct hdb_cpu_map * map       = NULL;
+    uint32_t             cpu_id    = __get_cpu_id(db, cpu);
+    uint32_t             numa_node = wg_decode_int(db, wg_get_field(db, cpu, HDB_CPU_NUMA_NODE));
+
+    if ((hdr == NULL) || ((map = __get_cpu_map(db, hdr)) == NULL)) {
+	ERROR("Malformed Database. Missing free CPU map\n");
+	return;
+    }
+
+    if ((cpu_id >= map->capacity) || (numa_node >= map->numa_cnt)) {
+	return;
+    }
+
+    __cpu_map_set(db, map, numa_node, cpu_id, free);
+}
+
+
 static int
 __register_cpu(hdb_db_t    db,
 	       uint32_t    cpu_id,
 	       uint32_t    apic_id,
+	       uint32_t    core_id,
 	       uint32_t    numa_node,
 	       cpu_state_t state,
 	       hobbes_id_t enclave_id,
 	       uint32_t    enclave_logical_id)
 {
-    uint32_t   cpu_cnt  = 0;
-    hdb_cpu_t  cpu      = NULL;
-    void     * hdr_rec  = __get_sys_hdr(db);
+    uint32_t             cpu_cnt  = 0;
+    hdb_cpu_t            cpu      = NULL;
+    struct hdb_cpu_map * map      = NULL;
+    void               * hdr_rec  = __get_sys_hdr(db);
 
     if (!hdr_rec) {
 	ERROR("Malformed Database. Missing System Info Header\n");
@@ -377,11 +920,29 @@ __register_cpu(hdb_db_t    db,
 	ERROR("Tried to register a CPU (%u) that is already present\n", cpu_id);
 	return -1;
     }
+
+    map = __get_cpu_map(db, hdr_rec);
+
+    if (!map) {
+	ERROR("Malformed Database. Missing free CPU map\n");
+	return -1;
+    }
+
+    if ((state == CPU_FREE) && (numa_node >= map->numa_cnt)) {
+	ERROR("Tried to register a free CPU (%u) on an invalid NUMA node (%u)\n", cpu_id, numa_node);
+	return -1;
+    }
+
+    if ((cpu_id >= map->capacity) && 
+	(__cpu_map_grow(db, map, cpu_id) != 0)) {
+	ERROR("Could not add CPU (%u) to the free CPU map\n", cpu_id);
+	return -1;
+    }
     
     cpu_cnt = wg_decode_int(db, wg_get_field(db, hdr_rec, HDB_SYS_HDR_CPU_CNT));
 
 
-    cpu = wg_create_record(db, 7);
+    cpu = wg_create_record(db, 8);
     wg_set_field(db, cpu, HDB_TYPE_FIELD,	      wg_encode_int(db, HDB_REC_CPU));
     wg_set_field(db, cpu, HDB_CPU_ID,		      wg_encode_int(db, cpu_id));
     wg_set_field(db, cpu, HDB_CPU_APIC_ID,	      wg_encode_int(db, apic_id));
@@ -389,10 +950,19 @@ __register_cpu(hdb_db_t    db,
     wg_set_field(db, cpu, HDB_CPU_STATE,	      wg_encode_int(db, state));
     wg_set_field(db, cpu, HDB_CPU_ENCLAVE_ID,	      wg_encode_int(db, enclave_id));
     wg_set_field(db, cpu, HDB_CPU_ENCLAVE_LOGICAL_ID, wg_encode_int(db, enclave_logical_id));
+    wg_set_field(db, cpu, HDB_CPU_CORE_ID,	      wg_encode_int(db, core_id));
+
+    ((uint32_t *)offsettoptr(db, map->core_off))[cpu_id] = core_id;
+
+    if (state == CPU_FREE) {
+	__cpu_map_set(db, map, numa_node, cpu_id, 1);
+    }
 
     /* Update the enclave Header information */
     wg_set_field(db, hdr_rec, HDB_SYS_HDR_CPU_CNT, wg_encode_int(db, cpu_cnt + 1));
 
+    hdb_log_change(db, HDB_TABLE_CPU, cpu_id, HDB_CHANGE_CREATE);
+
     return 0;
 }
 
@@ -400,6 +970,7 @@ int
 hdb_register_cpu(hdb_db_t    db,
 		 uint32_t    cpu_id,
 		 uint32_t    apic_id,
+		 uint32_t    core_id,
 		 uint32_t    numa_node,
 		 cpu_state_t state,
 		 hobbes_id_t enclave_id,
@@ -407,6 +978,8 @@ hdb_register_cpu(hdb_db_t    db,
 {
     wg_int   lock_id;
     int      ret      = -1;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
     
     lock_id = wg_start_write(db);
     
@@ -415,7 +988,7 @@ hdb_register_cpu(hdb_db_t    db,
 	return -1;
     }
 
-    ret = __register_cpu(db, cpu_id, apic_id, numa_node, state, enclave_id, enclave_logical_id);
+    ret = __register_cpu(db, cpu_id, apic_id, core_id, numa_node, state, enclave_id, enclave_logical_id);
     
     if (!wg_end_write(db, lock_id)) {
 	ERROR("Apparently this is catastrophic...\n");
@@ -450,6 +1023,8 @@ hdb_get_cpu_apic_id(hdb_db_t db,
     uint32_t apic_id = 0;
     wg_int   lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_read(db);
 
     if (!lock_id) {
@@ -491,6 +1066,8 @@ hdb_get_cpu_numa_node(hdb_db_t db,
     uint32_t numa_node = 0;
     wg_int   lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_read(db);
 
     if (!lock_id) {
@@ -533,6 +1110,8 @@ hdb_get_cpu_state(hdb_db_t db,
     wg_int      lock_id;
     cpu_state_t state = CPU_INVALID;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_read(db);
 
     if (!lock_id) {
@@ -574,6 +1153,8 @@ hdb_get_cpu_enclave_id(hdb_db_t db,
 {
     wg_int      lock_id;
     hobbes_id_t enclave_id = HOBBES_INVALID_ID;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
   
     lock_id = wg_start_read(db);
 
@@ -616,6 +1197,8 @@ hdb_get_cpu_enclave_logical_id(hdb_db_t db,
     uint32_t logical_id = 0;
     wg_int   lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_read(db);
 
     if (!lock_id) {
@@ -647,6 +1230,8 @@ __set_cpu_enclave_logical_id(hdb_db_t db,
 
     wg_set_field(db, cpu, HDB_CPU_ENCLAVE_LOGICAL_ID, wg_encode_int(db, logical_id));
 
+    hdb_log_change(db, HDB_TABLE_CPU, cpu_id, HDB_CHANGE_UPDATE);
+
     return 0;
 }
 
@@ -658,6 +1243,8 @@ hdb_set_cpu_enclave_logical_id(hdb_db_t db,
     int ret;
     wg_int lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_write(db);
 
     if (!lock_id) {
@@ -680,39 +1267,33 @@ static hdb_cpu_t
 __find_free_cpu(hdb_db_t db,
 		uint32_t numa_node)
 {
-    hdb_cpu_t      cpu   = NULL;
-    wg_query     * query = NULL;
-    wg_query_arg   arglist[3];
+    void               * hdr_rec = __get_sys_hdr(db);
+    struct hdb_cpu_map * map     = NULL;
+    uint32_t             node    = 0;
+    uint32_t             i       = 0;
 
-    int i      = 0;
-    int argcnt = 2;
-
-    arglist[0].column = HDB_TYPE_FIELD;
-    arglist[0].cond   = WG_COND_EQUAL;
-    arglist[0].value  = wg_encode_query_param_int(db, HDB_REC_CPU);
-
-    arglist[1].column = HDB_CPU_STATE;
-    arglist[1].cond   = WG_COND_EQUAL;
-    arglist[1].value  = wg_encode_query_param_int(db, CPU_FREE);
-	
-    if (numa_node != HOBBES_ANY_NUMA_ID) {
-	arglist[2].column = HDB_CPU_NUMA_NODE;
-	arglist[2].cond   = WG_COND_EQUAL;
-	arglist[2].value  = wg_encode_query_param_int(db, numa_node);
-
-	argcnt++;
+    if ((hdr_rec == NULL) || ((map = __get_cpu_map(db, hdr_rec)) == NULL)) {
+	ERROR("Malformed Database. Missing free CPU map\n");
+	return NULL;
     }
 
-    query = wg_make_query(db, NULL, 0, arglist, argcnt);
-    cpu   = wg_fetch(db, query);
+    for (node = 0; node < map->numa_cnt; node++) {
+	uint64_t * bits = NULL;
 
-    wg_free_query(db, query);
+	if ((numa_node != node) && (numa_node != HOBBES_ANY_NUMA_ID)) {
+	    continue;
+	}
+
+	bits = __cpu_map_node(db, map, node);
 
-    for (i = 0; i < argcnt; i++) {
-	wg_free_query_param(db, arglist[i].value);
+	for (i = 0; i < map->capacity / 64; i++) {
+	    if (bits[i] != 0) {
+		return __get_cpu_by_id(db, (i * 64) + __builtin_ctzll(bits[i]));
+	    }
+	}
     }
-    
-    return cpu;
+
+    return NULL;
 }
 
 
@@ -746,6 +1327,10 @@ __alloc_cpu(hdb_db_t    db,
     wg_set_field(db, cpu, HDB_CPU_STATE,      wg_encode_int(db, CPU_ALLOCATED));
     wg_set_field(db, cpu, HDB_CPU_ENCLAVE_ID, wg_encode_int(db, enclave_id)); 
 
+    __cpu_map_update(db, cpu, 0);
+
+    hdb_log_change(db, HDB_TABLE_CPU, cpu_id, HDB_CHANGE_UPDATE);
+
     return cpu_id;
 }
 
@@ -759,6 +1344,8 @@ hdb_alloc_cpu(hdb_db_t    db,
     uint32_t ret_val = HOBBES_INVALID_CPU_ID;
     wg_int   lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_write(db);
 
     if (!lock_id) {
@@ -796,6 +1383,10 @@ __free_cpu(hdb_db_t db,
     wg_set_field(db, cpu, HDB_CPU_ENCLAVE_ID,	      wg_encode_int(db, HOBBES_INVALID_ID));
     wg_set_field(db, cpu, HDB_CPU_ENCLAVE_LOGICAL_ID, wg_encode_int(db, HOBBES_INVALID_CPU_ID));
 
+    __cpu_map_update(db, cpu, 1);
+
+    hdb_log_change(db, HDB_TABLE_CPU, cpu_id, HDB_CHANGE_UPDATE);
+
     return 0;
 }
 
@@ -805,7 +1396,284 @@ hdb_free_cpu(hdb_db_t db,
 	     uint32_t cpu_id)
 {
     wg_int lock_id;
-    int    ret = 0;
+    int    ret = 0;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
+    lock_id = wg_start_write(db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return -1;
+    }
+
+    ret = __free_cpu(db, cpu_id);
+
+    if (!wg_end_write(db, lock_id)) {
+	ERROR("Catastrophic database locking error\n");
+	return -1;
+    }
+
+    return ret;
+}
+
+
+/* 
+ * Bulk CPU allocation
+ *    Collects the free CPUs, orders them by a policy specific key, and takes the first num_cpus
+ */
+struct cpu_candidate {
+    uint32_t cpu_id;
+    uint32_t numa_node;
+    uint32_t core_id;
+    uint32_t sibling_rank;  /* Position among the free CPUs of its core */
+    uint32_t core_busy;     /* CPUs of its core that are not free */
+    uint32_t key[4];
+};
+
+static int
+__cmp_cpu_candidate(const void * a,
+		    const void * b)
+{
+    const struct cpu_candidate * x = a;
+    const struct cpu_candidate * y = b;
+    int                          i = 0;
+
+    for (i = 0; i < 4; i++) {
+	if (x->key[i] != y->key[i]) {
+	    return (x->key[i] < y->key[i]) ? -1 : 1;
+	}
+    }
+
+    return 0;
+}
+
+static void
+__set_cpu_key(struct cpu_candidate * cand,
+	      uint32_t               k0,
+	      uint32_t               k1,
+	      uint32_t               k2,
+	      uint32_t               k3)
+{
+    cand->key[0] = k0;
+    cand->key[1] = k1;
+    cand->key[2] = k2;
+    cand->key[3] = k3;
+}
+
+static int
+__alloc_cpus(hdb_db_t       db,
+	     hobbes_id_t    enclave_id,
+	     uint32_t       numa_node,
+	     uint32_t       num_cpus,
+	     cpu_policy_t   policy,
+	     uint32_t     * cpu_array)
+{
+    void                 * hdr_rec   = __get_sys_hdr(db);
+    struct hdb_cpu_map   * map       = NULL;
+    struct cpu_candidate * cands     = NULL;
+    uint32_t             * node_free = NULL;
+    uint32_t             * core      = NULL;
+    uint32_t               cnt       = 0;
+    uint32_t               eligible  = 0;
+    uint32_t               target    = 0;
+    uint32_t               node      = 0;
+    uint32_t               i         = 0;
+    uint32_t               j         = 0;
+    uint32_t               k         = 0;
+    int                    ret       = -1;
+
+    if ((hdr_rec == NULL) || ((map = __get_cpu_map(db, hdr_rec)) == NULL)) {
+	ERROR("Malformed Database. Missing free CPU map\n");
+	return -1;
+    }
+
+    if ((numa_node != HOBBES_ANY_NUMA_ID) && (numa_node >= map->numa_cnt)) {
+	ERROR("Invalid NUMA node (%u)\n", numa_node);
+	return -1;
+    }
+
+    if (num_cpus == 0) {
+	return 0;
+    }
+
+    cands     = calloc(sizeof(struct cpu_candidate), map->capacity + 1);
+    node_free = calloc(sizeof(uint32_t),             map->numa_cnt  + 1);
+
+    if ((cands == NULL) || (node_free == NULL)) {
+	ERROR("Could not allocate CPU candidate list\n");
+	goto out;
+    }
+
+    core = offsettoptr(db, map->core_off);
+
+    /* Collect the free CPUs */
+    for (node = 0; node < map->numa_cnt; node++) {
+	uint64_t * bits = NULL;
+
+	if ((numa_node != node) && (numa_node != HOBBES_ANY_NUMA_ID)) {
+	    continue;
+	}
+
+	bits = __cpu_map_node(db, map, node);
+
+	for (i = 0; i < map->capacity; i++) {
+	    if (bits[i / 64] & (1ULL << (i % 64))) {
+		cands[cnt].cpu_id    = i;
+		cands[cnt].numa_node = node;
+		cands[cnt].core_id   = core[i];
+		cnt++;
+
+		node_free[node]++;
+	    }
+	}
+    }
+
+    /* Rank each CPU among the free CPUs of its core, and count the core's busy CPUs */
+    for (i = 0; i < cnt; i++) {
+	__set_cpu_key(&(cands[i]), cands[i].core_id, cands[i].cpu_id, 0, 0);
+    }
+
+    qsort(cands, cnt, sizeof(struct cpu_candidate), __cmp_cpu_candidate);
+
+    for (i = 0; i < cnt; i = j) {
+	uint32_t core_cpus = 0;
+
+	for (j = i; (j < cnt) && (cands[j].core_id == cands[i].core_id); j++) {
+	    cands[j].sibling_rank = j - i;
+	}
+
+	for (k = 0; k < map->capacity; k++) {
+	    core_cpus += (core[k] == cands[i].core_id);
+	}
+
+	for (k = i; k < j; k++) {
+	    cands[k].core_busy = core_cpus - (j - i);
+	}
+    }
+
+    /* Order the candidates for the policy */
+    switch (policy) {
+	case CPU_POLICY_COMPACT: {
+	    /* Start from the first node that can hold every CPU, keeping siblings together */
+	    uint32_t start = 0;
+
+	    for (node = 0; node < map->numa_cnt; node++) {
+		if (node_free[node] >= num_cpus) {
+		    start = node;
+		    break;
+		}
+	    }
+
+	    for (i = 0; i < cnt; i++) {
+		__set_cpu_key(&(cands[i]), 
+			      (cands[i].numa_node + map->numa_cnt - start) % map->numa_cnt,
+			      cands[i].core_id, 
+			      cands[i].cpu_id, 
+			      0);
+	    }
+
+	    eligible = cnt;
+	    break;
+	}
+	case CPU_POLICY_SCATTER: {
+	    /* Round robin across the nodes, using every core before any sibling */
+	    uint32_t pos = 0;
+
+	    for (i = 0; i < cnt; i++) {
+		__set_cpu_key(&(cands[i]), cands[i].numa_node, cands[i].sibling_rank, cands[i].core_id, 0);
+	    }
+
+	    qsort(cands, cnt, sizeof(struct cpu_candidate), __cmp_cpu_candidate);
+
+	    for (i = 0; i < cnt; i++) {
+		pos = ((i > 0) && (cands[i].numa_node == cands[i - 1].numa_node)) ? pos + 1 : 0;
+		__set_cpu_key(&(cands[i]), pos, cands[i].numa_node, 0, 0);
+	    }
+
+	    eligible = cnt;
+	    break;
+	}
+	case CPU_POLICY_SAME_NUMA: {
+	    /* Use the requested node, or the one with the most free CPUs */
+	    target = (numa_node != HOBBES_ANY_NUMA_ID) ? numa_node : 0;
+
+	    for (node = 0; (numa_node == HOBBES_ANY_NUMA_ID) && (node < map->numa_cnt); node++) {
+		if (node_free[node] > node_free[target]) {
+		    target = node;
+		}
+	    }
+
+	    for (i = 0; i < cnt; i++) {
+		__set_cpu_key(&(cands[i]), 
+			      (cands[i].numa_node != target), 
+			      cands[i].sibling_rank, 
+			      cands[i].core_id, 
+			      cands[i].cpu_id);
+	    }
+
+	    eligible = (target < map->numa_cnt) ? node_free[target] : 0;
+	    break;
+	}
+	case CPU_POLICY_AVOID_SIBLINGS: {
+	    /* One CPU per core, preferring cores that are otherwise idle */
+	    for (i = 0; i < cnt; i++) {
+		__set_cpu_key(&(cands[i]), 
+			      (cands[i].sibling_rank > 0), 
+			      cands[i].core_busy, 
+			      cands[i].numa_node, 
+			      cands[i].core_id);
+
+		eligible += (cands[i].sibling_rank == 0);
+	    }
+
+	    break;
+	}
+	default:
+	    ERROR("Invalid CPU allocation policy (%d)\n", policy);
+	    goto out;
+    }
+
+    if (eligible < num_cpus) {
+	ERROR("Could not find %u free CPUs for allocation policy %d\n", num_cpus, policy);
+	goto out;
+    }
+
+    qsort(cands, cnt, sizeof(struct cpu_candidate), __cmp_cpu_candidate);
+
+    for (i = 0; i < num_cpus; i++) {
+	cpu_array[i] = __alloc_cpu(db, cands[i].cpu_id, HOBBES_ANY_NUMA_ID, enclave_id);
+
+	if (cpu_array[i] == HOBBES_INVALID_CPU_ID) {
+	    for (j = 0; j < i; j++) {
+		__free_cpu(db, cpu_array[j]);
+	    }
+
+	    goto out;
+	}
+    }
+
+    ret = 0;
+
+ out:
+    free(cands);
+    free(node_free);
+
+    return ret;
+}
+
+int
+hdb_alloc_cpus(hdb_db_t       db,
+	       hobbes_id_t    enclave_id,
+	       uint32_t       numa_node,
+	       uint32_t       num_cpus,
+	       cpu_policy_t   policy,
+	       uint32_t     * cpu_array)
+{
+    wg_int lock_id;
+    int    ret = -1;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
 
     lock_id = wg_start_write(db);
 
@@ -814,7 +1682,7 @@ hdb_free_cpu(hdb_db_t db,
 	return -1;
     }
 
-    ret = __free_cpu(db, cpu_id);
+    ret = __alloc_cpus(db, enclave_id, numa_node, num_cpus, policy, cpu_array);
 
     if (!wg_end_write(db, lock_id)) {
 	ERROR("Catastrophic database locking error\n");
@@ -844,6 +1712,8 @@ hdb_free_enclave_cpus(hdb_db_t    db,
     wg_int lock_id;
     int    ret = 0;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_write(db);
     
     if (!lock_id) {
@@ -915,6 +1785,8 @@ hdb_get_cpus(hdb_db_t   db,
     uint32_t * cpu_arr = NULL;
     wg_int     lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     if (!num_cpus) {
 	return NULL;
     }
@@ -937,59 +1809,112 @@ hdb_get_cpus(hdb_db_t   db,
 }
 
 
+static int
+__snapshot_cpus(hdb_db_t                 db,
+		struct hobbes_cpu_info * cpu_arr,
+		uint32_t                 max_cpus,
+		uint32_t               * num_cpus)
+{
+    void     * db_rec = NULL;
+    uint32_t   cnt    = 0;
+
+    while ((db_rec = wg_find_record_int(db, HDB_TYPE_FIELD, WG_COND_EQUAL, HDB_REC_CPU, db_rec)) != NULL) {
+
+	if (cnt < max_cpus) {
+	    struct hobbes_cpu_info * cpu = &(cpu_arr[cnt]);
 
-/* Memory resource Accessors */
+	    cpu->cpu_id             = wg_decode_int(db, wg_get_field(db, db_rec, HDB_CPU_ID));
+	    cpu->apic_id            = wg_decode_int(db, wg_get_field(db, db_rec, HDB_CPU_APIC_ID));
+	    cpu->numa_node          = wg_decode_int(db, wg_get_field(db, db_rec, HDB_CPU_NUMA_NODE));
+	    cpu->state              = wg_decode_int(db, wg_get_field(db, db_rec, HDB_CPU_STATE));
+	    cpu->enclave_id         = wg_decode_int(db, wg_get_field(db, db_rec, HDB_CPU_ENCLAVE_ID));
+	    cpu->enclave_logical_id = wg_decode_int(db, wg_get_field(db, db_rec, HDB_CPU_ENCLAVE_LOGICAL_ID));
+	}
 
+	cnt++;
+    }
 
-static hdb_mem_t
-__get_mem_blk_by_addr(hdb_db_t  db,
-		      uintptr_t addr)
+    *num_cpus = cnt;
+
+    return 0;
+}
+
+/**
+ * Copy the state of every CPU into cpu_arr under a single read lock
+ *  - At most max_cpus entries are filled in
+ *  - *num_cpus is set to the number of CPUs in the database, which can be 
+ *    larger than max_cpus (the caller should then retry with a larger array)
+ **/
+int
+hdb_snapshot_cpus(hdb_db_t                 db,
+		  struct hobbes_cpu_info * cpu_arr,
+		  uint32_t                 max_cpus,
+		  uint32_t               * num_cpus)
 {
-    hdb_mem_t      blk   = NULL;
-    wg_query     * query = NULL;
-    wg_query_arg   arglist[2];
+    wg_int lock_id;
+    int    ret = -1;
 
-    arglist[0].column = HDB_TYPE_FIELD;
-    arglist[0].cond   = WG_COND_EQUAL;
-    arglist[0].value  = wg_encode_query_param_int(db, HDB_REC_MEM);
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
 
-    arglist[1].column = HDB_MEM_BASE_ADDR;
-    arglist[1].cond   = WG_COND_EQUAL;
-    arglist[1].value  = wg_encode_query_param_int(db, addr);
+    if (!num_cpus) {
+	return -1;
+    }
 
-    query = wg_make_query(db, NULL, 0, arglist, 2);
-    
-    blk   = wg_fetch(db, query);
+    lock_id = wg_start_read(db);
 
-    wg_free_query(db, query);
-    wg_free_query_param(db, arglist[0].value);
-    wg_free_query_param(db, arglist[1].value);
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return -1;
+    }
 
-    return blk;
+    ret = __snapshot_cpus(db, cpu_arr, max_cpus, num_cpus);
+
+    if (!wg_end_read(db, lock_id)) {
+	ERROR("Catastrophic database locking error\n");
+	return -1;
+    }
+
+    return ret;
 }
 
 
+
+/* Memory resource Accessors */
+
+
 static hdb_mem_t
-__get_mem_blk_by_enclave_id(hdb_db_t    db,
-			    hobbes_id_t enclave_id)
+__get_mem_blk_by_addr(hdb_db_t  db,
+		      uintptr_t addr)
 {
-    hdb_mem_t      blk   = NULL;
-    wg_query     * query = NULL;
+    void         * hdr_rec  = NULL;
+    hdb_mem_t      blk      = NULL;
+    uint64_t       blk_size = 0;
     wg_query_arg   arglist[2];
 
+    hdr_rec = __get_sys_hdr(db);
+
+    if (!hdr_rec) {
+	ERROR("Malformed Database. Missing System Info Header\n");
+	return NULL;
+    }
+
+    blk_size = wg_decode_int(db, wg_get_field(db, hdr_rec, HDB_SYS_HDR_MEM_BLK_SIZE));
+
+    /* Only block aligned addresses are ever registered */
+    if ((blk_size == 0) || ((addr % blk_size) != 0)) {
+	return NULL;
+    }
+
     arglist[0].column = HDB_TYPE_FIELD;
     arglist[0].cond   = WG_COND_EQUAL;
     arglist[0].value  = wg_encode_query_param_int(db, HDB_REC_MEM);
 
-    arglist[1].column = HDB_MEM_ENCLAVE_ID;
+    arglist[1].column = HDB_MEM_BLK_IDX;
     arglist[1].cond   = WG_COND_EQUAL;
-    arglist[1].value  = wg_encode_query_param_int(db, enclave_id);
+    arglist[1].value  = wg_encode_query_param_int(db, addr / blk_size);
 
-    query = wg_make_query(db, NULL, 0, arglist, 2);
-    
-    blk   = wg_fetch(db, query);
+    blk   = hdb_find_record(db, arglist, 2);
 
-    wg_free_query(db, query);
     wg_free_query_param(db, arglist[0].value);
     wg_free_query_param(db, arglist[1].value);
 
@@ -1017,36 +1942,30 @@ __remove_free_mem_blk(hdb_db_t   db,
 		      void     * hdr,
 		      hdb_mem_t  blk)
 {
-    hdb_mem_t next_blk = __wg_get_record(db, blk, HDB_MEM_NEXT_FREE);
-    hdb_mem_t prev_blk = __wg_get_record(db, blk, HDB_MEM_PREV_FREE);
+    struct hdb_mem_zone * zone     = NULL;
+    uint64_t              blk_size = 0;
+    uint64_t              blk_idx  = 0;
 
     if (wg_decode_int(db, wg_get_field(db, blk, HDB_MEM_STATE)) != MEMORY_FREE) {
 	ERROR("Tried to remove a non-free memory block from free list\n");
 	return -1;
     }
 
-    /* Update the head of the list if necessary */
-    
-
-    if (__wg_get_record(db, hdr, HDB_SYS_HDR_MEM_FREE_LIST) == blk) {
-	__wg_set_record(db, hdr, HDB_SYS_HDR_MEM_FREE_LIST, next_blk);
-    }
-
-    if (next_blk) {
-	__wg_set_record(db, next_blk, HDB_MEM_PREV_FREE, prev_blk);
-    }
+    zone     = __get_mem_zone(db, hdr, __get_mem_blk_numa(db, blk));
+    blk_size = wg_decode_int(db, wg_get_field(db, hdr, HDB_SYS_HDR_MEM_BLK_SIZE));
+    blk_idx  = __get_mem_blk_addr(db, blk) / blk_size;
 
-    if (prev_blk) {
-	__wg_set_record(db, prev_blk, HDB_MEM_NEXT_FREE, next_blk);
+    if ((zone == NULL) || 
+	(blk_idx <  zone->base_idx) ||
+	(blk_idx >= zone->base_idx + zone->capacity) ||
+	(__zone_remove(db, zone, blk_idx - zone->base_idx) != 0)) {
+	ERROR("Memory block (%p) is not in its free memory zone\n", (void *)__get_mem_blk_addr(db, blk));
+	return -1;
     }
 
-    __wg_set_record(db, blk, HDB_MEM_NEXT_FREE, NULL);
-    __wg_set_record(db, blk, HDB_MEM_PREV_FREE, NULL);
-    
-   {
+    {
 	uint64_t free_mem = wg_decode_int(db, wg_get_field(db, hdr, HDB_SYS_HDR_MEM_FREE_BLK_CNT));
 	wg_set_field(db, hdr, HDB_SYS_HDR_MEM_FREE_BLK_CNT, wg_encode_int(db, free_mem - 1));
-	
     }
 
     return 0;
@@ -1059,65 +1978,42 @@ __insert_free_mem_blk(hdb_db_t   db,
 		      void     * hdr,
 		      hdb_mem_t  blk)
 {
-    uintptr_t blk_addr = __get_mem_blk_addr(db, blk);
-    hdb_mem_t iter_blk = __wg_get_record(db, hdr, HDB_SYS_HDR_MEM_FREE_LIST);
-
-    if (iter_blk == NULL) {
-	/* First entry: Prev=NULL, Next=NULL, HDR=this_blk */
-	    
-	__wg_set_record(db, blk, HDB_MEM_NEXT_FREE,         NULL);
-	__wg_set_record(db, blk, HDB_MEM_PREV_FREE,         NULL);
-	__wg_set_record(db, hdr, HDB_SYS_HDR_MEM_FREE_LIST, blk);
-	    
-    } else if (blk_addr < __get_mem_blk_addr(db, iter_blk)) {
-	/* Add to the head of the list: 
-	 *   Prev=NULL, Next=iter_blk, HDR=this_blk, iter_blk.prev=this_blk 
-	 */
+    struct hdb_mem_zone * zone     = NULL;
+    uintptr_t             blk_addr = __get_mem_blk_addr(db, blk);
+    uint64_t              blk_size = 0;
+    uint64_t              blk_idx  = 0;
+    uint8_t             * state    = NULL;
 
-	__wg_set_record(db, blk,      HDB_MEM_PREV_FREE,         NULL);
-	__wg_set_record(db, blk,      HDB_MEM_NEXT_FREE,         iter_blk);
-	__wg_set_record(db, iter_blk, HDB_MEM_PREV_FREE,         blk);
-	__wg_set_record(db, hdr,      HDB_SYS_HDR_MEM_FREE_LIST, blk);
-
-    } else {
-	hdb_mem_t next_blk = NULL;
+    zone     = __get_mem_zone(db, hdr, __get_mem_blk_numa(db, blk));
+    blk_size = wg_decode_int(db, wg_get_field(db, hdr, HDB_SYS_HDR_MEM_BLK_SIZE));
+    blk_idx  = blk_addr / blk_size;
 
-	while (1) {
-	    uintptr_t next_addr = 0;
+    if (zone == NULL) {
+	ERROR("Memory block (%p) is on an invalid NUMA node (%u)\n", (void *)blk_addr, __get_mem_blk_numa(db, blk));
+	return -1;
+    }
 
-	    next_blk = __wg_get_record(db, iter_blk, HDB_MEM_NEXT_FREE);
-		
-	    if (next_blk == NULL) {
-		break;
-	    }
+    if ((blk_idx <  zone->base_idx) ||
+	(blk_idx >= zone->base_idx + zone->capacity)) {
 
-	    next_addr = __get_mem_blk_addr(db, next_blk);
-		
-	    if (next_addr > blk_addr) {
-		break;
-	    }
-		
-	    iter_blk = next_blk;
+	if (__zone_grow(db, zone, blk_idx) != 0) {
+	    ERROR("Could not grow free memory zone for block (%p)\n", (void *)blk_addr);
+	    return -1;
 	}
-	
-	    
-	/* At this point iter_blk must be valid, but next_blk may or may not be NULL 
-	 *  Prev = iter_blk, next = next_blk, iter_blk.next = this_blk, if(next_blk) next_blk.prev=this_blk
-	 */
+    }
 
-	__wg_set_record(db, blk,      HDB_MEM_PREV_FREE, iter_blk);
-	__wg_set_record(db, blk,      HDB_MEM_NEXT_FREE, next_blk);
-	__wg_set_record(db, iter_blk, HDB_MEM_NEXT_FREE, blk);
+    state = offsettoptr(db, zone->state_off);
 
-	if (next_blk) {
-	    __wg_set_record(db, next_blk, HDB_MEM_PREV_FREE, blk);
-	} 
+    if (state[blk_idx - zone->base_idx] != HDB_ZONE_NOT_FREE) {
+	ERROR("Memory block (%p) is already free\n", (void *)blk_addr);
+	return -1;
     }
 
+    __zone_insert(db, zone, blk_idx - zone->base_idx);
+
     {
 	uint64_t free_mem = wg_decode_int(db, wg_get_field(db, hdr, HDB_SYS_HDR_MEM_FREE_BLK_CNT));
 	wg_set_field(db, hdr, HDB_SYS_HDR_MEM_FREE_BLK_CNT, wg_encode_int(db, free_mem + 1));
-	
     }
 
     return 0;	
@@ -1129,19 +2025,50 @@ __insert_mem_blk(hdb_db_t   db,
 		 hdb_mem_t  blk)
 {
     uint64_t  blk_cnt  = 0;
+    uint64_t  blk_size = 0;
     uintptr_t blk_addr = __get_mem_blk_addr(db, blk);
+    hdb_mem_t nbr_blk  = NULL;
 
-    blk_cnt = wg_decode_int(db, wg_get_field(db, hdr, HDB_SYS_HDR_MEM_BLK_CNT));
+    blk_cnt  = wg_decode_int(db, wg_get_field(db, hdr, HDB_SYS_HDR_MEM_BLK_CNT));
+    blk_size = wg_decode_int(db, wg_get_field(db, hdr, HDB_SYS_HDR_MEM_BLK_SIZE));
 
     /* Do block list insertion */
-    {
+    if ((blk_addr >= blk_size) && 
+	((nbr_blk = __get_mem_blk_by_addr(db, blk_addr - blk_size)) != NULL)) {
+	/* Adjacent to the previous block: Prev=nbr_blk, Next=nbr_blk.next */
+	hdb_mem_t next_blk = __get_mem_link(db, nbr_blk, HDB_MEM_NEXT_BLK);
+
+	__set_mem_link(db, blk,     HDB_MEM_PREV_BLK, nbr_blk);
+	__set_mem_link(db, blk,     HDB_MEM_NEXT_BLK, next_blk);
+	__set_mem_link(db, nbr_blk, HDB_MEM_NEXT_BLK, blk);
+
+	if (next_blk) {
+	    __set_mem_link(db, next_blk, HDB_MEM_PREV_BLK, blk);
+	}
+
+    } else if ((nbr_blk = __get_mem_blk_by_addr(db, blk_addr + blk_size)) != NULL) {
+	/* Adjacent to the next block: Prev=nbr_blk.prev, Next=nbr_blk */
+	hdb_mem_t prev_blk = __get_mem_link(db, nbr_blk, HDB_MEM_PREV_BLK);
+
+	__set_mem_link(db, blk,     HDB_MEM_PREV_BLK, prev_blk);
+	__set_mem_link(db, blk,     HDB_MEM_NEXT_BLK, nbr_blk);
+	__set_mem_link(db, nbr_blk, HDB_MEM_PREV_BLK, blk);
+
+	if (prev_blk) {
+	    __set_mem_link(db, prev_blk, HDB_MEM_NEXT_BLK, blk);
+	} else {
+	    __wg_set_record(db, hdr, HDB_SYS_HDR_MEM_BLK_LIST, blk);
+	}
+
+    } else {
+	/* No neighbors, so walk the list */
 	hdb_mem_t iter_blk = __wg_get_record(db, hdr, HDB_SYS_HDR_MEM_BLK_LIST);
 
 	if (iter_blk == NULL) {
 	    /* First entry: Prev=NULL, Next=NULL, HDR=this_blk */
 
-	    __wg_set_record(db, blk, HDB_MEM_NEXT_BLK,         NULL);
-	    __wg_set_record(db, blk, HDB_MEM_PREV_BLK,         NULL);
+	    __set_mem_link(db, blk, HDB_MEM_NEXT_BLK,         NULL);
+	    __set_mem_link(db, blk, HDB_MEM_PREV_BLK,         NULL);
 
 	    __wg_set_record(db, hdr, HDB_SYS_HDR_MEM_BLK_LIST, blk);
 
@@ -1150,9 +2077,9 @@ __insert_mem_blk(hdb_db_t   db,
 	     *   Prev=NULL, Next=iter_blk, HDR=this_blk, iter_blk.prev=this_blk 
 	     */
 	    
-	    __wg_set_record(db, blk,      HDB_MEM_PREV_BLK,         NULL     );
-	    __wg_set_record(db, blk,      HDB_MEM_NEXT_BLK,         iter_blk );
-	    __wg_set_record(db, iter_blk, HDB_MEM_PREV_BLK,         blk      );
+	    __set_mem_link(db, blk,      HDB_MEM_PREV_BLK,         NULL     );
+	    __set_mem_link(db, blk,      HDB_MEM_NEXT_BLK,         iter_blk );
+	    __set_mem_link(db, iter_blk, HDB_MEM_PREV_BLK,         blk      );
 	    __wg_set_record(db, hdr,      HDB_SYS_HDR_MEM_BLK_LIST, blk      );
 	    
 	} else {
@@ -1161,7 +2088,7 @@ __insert_mem_blk(hdb_db_t   db,
 	    while (1) {
 		uintptr_t next_addr = 0;
 		
-		next_blk = __wg_get_record(db, iter_blk, HDB_MEM_NEXT_BLK);
+		next_blk = __get_mem_link(db, iter_blk, HDB_MEM_NEXT_BLK);
 		
 		if (next_blk == NULL) {
 		    break;
@@ -1180,12 +2107,12 @@ __insert_mem_blk(hdb_db_t   db,
 	     *  Prev = iter_blk, next = next_blk, iter_blk.next = this_blk, if(next_blk) next_blk.prev=this_blk
 	     */
 
-	    __wg_set_record(db, blk,      HDB_MEM_PREV_BLK, iter_blk);
-	    __wg_set_record(db, iter_blk, HDB_MEM_NEXT_BLK, blk);
-	    __wg_set_record(db, blk,      HDB_MEM_NEXT_BLK, next_blk);
+	    __set_mem_link(db, blk,      HDB_MEM_PREV_BLK, iter_blk);
+	    __set_mem_link(db, iter_blk, HDB_MEM_NEXT_BLK, blk);
+	    __set_mem_link(db, blk,      HDB_MEM_NEXT_BLK, next_blk);
 
 	    if (next_blk) {
-		__wg_set_record(db, next_blk, HDB_MEM_PREV_BLK, blk);
+		__set_mem_link(db, next_blk, HDB_MEM_PREV_BLK, blk);
 	    }	
 	}
     }
@@ -1194,9 +2121,9 @@ __insert_mem_blk(hdb_db_t   db,
     wg_set_field(db, hdr, HDB_SYS_HDR_MEM_BLK_CNT, wg_encode_int(db, blk_cnt + 1));
 
 
-    /* Do free list insertion */
+    /* Do free zone insertion */
     if (wg_decode_int(db, wg_get_field(db, blk, HDB_MEM_STATE)) == MEMORY_FREE) {
-	__insert_free_mem_blk(db, hdr, blk);
+	return __insert_free_mem_blk(db, hdr, blk);
     }
 
     return 0;
@@ -1216,11 +2143,17 @@ __free_block(hdb_db_t  db,
 	return -1;
     }
 
+    /* A block that is in no free zone could never be allocated again, so leave it as it was */
+    if (__insert_free_mem_blk(db, hdr, blk) != 0) {
+	ERROR("Could not free memory block (%p)\n", (void *)__get_mem_blk_addr(db, blk));
+	return -1;
+    }
+
     wg_set_field(db, blk, HDB_MEM_ENCLAVE_ID, wg_encode_int(db, HOBBES_INVALID_ID));
     wg_set_field(db, blk, HDB_MEM_APP_ID,     wg_encode_int(db, HOBBES_INVALID_ID));
     wg_set_field(db, blk, HDB_MEM_STATE,      wg_encode_int(db, MEMORY_FREE));
 
-    __insert_free_mem_blk(db, hdr, blk);
+    hdb_log_change(db, HDB_TABLE_MEM, __get_mem_blk_addr(db, blk), HDB_CHANGE_UPDATE);
 
     return 0;
 }
@@ -1233,6 +2166,7 @@ __free_span(hdb_db_t  db,
 {
     hdb_mem_t blk = __get_mem_blk_by_addr(db, base_addr);
     uint32_t  i   = 0;
+    int       ret = 0;
 
     if (blk == NULL) {
 	ERROR("Tried to free and invalid block at (%p)\n", (void *)base_addr);
@@ -1241,12 +2175,14 @@ __free_span(hdb_db_t  db,
 
     for (i = 0; i < block_span; i++) {
 
-	__free_block(db, blk);
+	if (__free_block(db, blk) != 0) {
+	    ret = -1;
+	}
 
-	blk = __wg_get_record(db, blk, HDB_MEM_NEXT_BLK);
+	blk = __get_mem_link(db, blk, HDB_MEM_NEXT_BLK);
     }
     
-    return 0;
+    return ret;
 }
 
 
@@ -1258,6 +2194,8 @@ hdb_free_block(hdb_db_t  db,
     wg_int lock_id;
     int    ret = 0;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_write(db);
 
     if (!lock_id) {
@@ -1279,13 +2217,30 @@ static int
 __free_enclave_blocks(hdb_db_t    db,
 		      hobbes_id_t enclave_id)
 {
-    hdb_mem_t blk = NULL;
+    void    * hdr_rec = NULL;
+    hdb_mem_t blk     = NULL;
+    int       ret     = 0;
+
+    hdr_rec = __get_sys_hdr(db);
+
+    if (!hdr_rec) {
+	ERROR("Malformed Database. Missing System Info Header\n");
+	return -1;
+    }
+
+    /* A single pass over the block list, rather than a query per block */
+    blk = __wg_get_record(db, hdr_rec, HDB_SYS_HDR_MEM_BLK_LIST);
 
-    while ((blk = __get_mem_blk_by_enclave_id(db, enclave_id)) != NULL) {
-	__free_block(db, blk);
+    while (blk) {
+	if ((wg_decode_int(db, wg_get_field(db, blk, HDB_MEM_ENCLAVE_ID)) == enclave_id) &&
+	    (__free_block(db, blk) != 0)) {
+	    ret = -1;
+	}
+
+	blk = __get_mem_link(db, blk, HDB_MEM_NEXT_BLK);
     }
 
-    return 0;
+    return ret;
 }
 
 
@@ -1296,6 +2251,8 @@ hdb_free_enclave_blocks(hdb_db_t    db,
     wg_int lock_id;
     int    ret = 0;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_write(db);
 
     if (!lock_id) {
@@ -1336,6 +2293,8 @@ __alloc_block(hdb_db_t    db,
     wg_set_field(db, blk, HDB_MEM_STATE,      wg_encode_int(db, MEMORY_ALLOCATED));
     wg_set_field(db, blk, HDB_MEM_ENCLAVE_ID, wg_encode_int(db, enclave_id));
 
+    hdb_log_change(db, HDB_TABLE_MEM, __get_mem_blk_addr(db, blk), HDB_CHANGE_UPDATE);
+
     return 0;
 }
 
@@ -1347,8 +2306,11 @@ __alloc_span(hdb_db_t    db,
 	     uint32_t    blk_span)
 {
     void    * hdr_rec  = NULL;
-    hdb_mem_t iter_blk = NULL;
+    uint64_t  blk_size = 0;
+    uint32_t  numa_cnt = 0;
+    uint32_t  node     = 0;
     uintptr_t ret_addr = 0;
+    uint32_t  i        = 0;
 
     hdr_rec = __get_sys_hdr(db);
 
@@ -1356,83 +2318,46 @@ __alloc_span(hdb_db_t    db,
 	ERROR("Malformed Database. Missing System Info Header\n");
 	return -1;
     }
-    
-    /* Scan free list */
-    iter_blk = __wg_get_record(db, hdr_rec, HDB_SYS_HDR_MEM_FREE_LIST);
-    
-    if (!iter_blk) {
-	ERROR("Could not find any free memory\n");
+
+    if (blk_span == 0) {
+	ERROR("Tried to allocate an empty span of memory blocks\n");
 	return -1;
     }
 
+    blk_size = wg_decode_int(db, wg_get_field(db, hdr_rec, HDB_SYS_HDR_MEM_BLK_SIZE));
+    numa_cnt = wg_decode_int(db, wg_get_field(db, hdr_rec, HDB_SYS_HDR_NUMA_CNT));
+
     /* We assume the system is sane and NUMA interleaving is disabled*/
-    while (iter_blk) {
-	uint32_t blk_numa = __get_mem_blk_numa(db, iter_blk);
+    for (node = 0; node < numa_cnt; node++) {
+	struct hdb_mem_zone * zone = NULL;
+	uint32_t              idx  = HDB_ZONE_NIL;
 
-	if ((numa_node == blk_numa) || (numa_node == HOBBES_ANY_NUMA_ID)) {
-	    break;
+	if ((numa_node != node) && (numa_node != HOBBES_ANY_NUMA_ID)) {
+	    continue;
 	}
 
-	iter_blk = __wg_get_record(db, iter_blk, HDB_MEM_NEXT_FREE);
-    }
-
+	zone = __get_mem_zone(db, hdr_rec, node);
 
-    if (iter_blk == NULL) {
-	/* Couldn't find anything */
-	return -1;
-    }
-
-    if (blk_span == 1) {
-	__alloc_block(db, iter_blk, enclave_id);
-
-	return __get_mem_blk_addr(db, iter_blk);	
-    } else {
-	// allocate a contiguous range
-	uint32_t i = 0; 
-
-	while (iter_blk) {
-	    hdb_mem_t next_free_blk = __wg_get_record(db, iter_blk, HDB_MEM_NEXT_FREE);
-	    hdb_mem_t next_blk      = __wg_get_record(db, iter_blk, HDB_MEM_NEXT_BLK);
+	if (zone == NULL) {
+	    continue;
+	}
 
-	    for (i = 0; i < blk_span - 1; i++) {
-		if ((!next_blk) || (next_blk != next_free_blk)) {
-		    iter_blk = next_blk;
-		    break;
-		}
-		
-		if ((numa_node != HOBBES_ANY_NUMA_ID) &&
-		    (numa_node != __get_mem_blk_numa(db, next_blk))) {
-		    /* Error because NUMA should not be interleaved */
-		    return -1;
-		}
+	idx = __zone_find_span(db, zone, blk_span);
 
-		next_free_blk = __wg_get_record(db, next_blk, HDB_MEM_NEXT_FREE);
-		next_blk      = __wg_get_record(db, next_blk, HDB_MEM_NEXT_BLK);
-	    }
-	    
-	    if (i == blk_span - 1) {
-		break;
-	    }
+	if (idx != HDB_ZONE_NIL) {
+	    ret_addr = (zone->base_idx + idx) * blk_size;
+	    break;
 	}
+    }
 
-	if (iter_blk == NULL) {
-	    return -1;
-	}
+    if (node == numa_cnt) {
+	/* Couldn't find anything */
+	return -1;
+    }
 
-	ret_addr = __get_mem_blk_addr(db, iter_blk);
-	    
-	//printf("Allocating span starting at %p\n", (void *)ret_addr);
-	/* Allocate N Blocks starting at iter_blk */
-	{
-	    
-	    for (i = 0; i < blk_span; i++) {
-		
-		//printf("Allocating block %d of span\n", i);
-		__alloc_block(db, iter_blk, enclave_id);
-		
-		iter_blk = __wg_get_record(db, iter_blk, HDB_MEM_NEXT_BLK);
-	    }
-	}
+    /* Allocate N Blocks starting at ret_addr */
+    for (i = 0; i < blk_span; i++) {
+	__alloc_block(db, __get_mem_blk_by_addr(db, ret_addr + (i * blk_size)), enclave_id);
     }
 
     return ret_addr;
@@ -1448,6 +2373,8 @@ hdb_alloc_block(hdb_db_t    db,
     wg_int    lock_id;
     uintptr_t ret = 0;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_write(db);
     
     if (!lock_id) {
@@ -1513,6 +2440,8 @@ hdb_alloc_blocks(hdb_db_t    db,
     wg_int lock_id;
     int    ret = 0;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_write(db);
     
     if (!lock_id) {
@@ -1604,6 +2533,8 @@ hdb_alloc_block_addr(hdb_db_t    db,
     wg_int lock_id;
     int    ret = 0;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_write(db);
 
     if (!lock_id) {
@@ -1652,9 +2583,22 @@ __register_memory(hdb_db_t    db,
 	return -1;
     }
 
+    if ((base_addr % blk_size) != 0) {
+	ERROR("Tried to register an unaligned memory block (%p)\n", (void *)base_addr);
+	return -1;
+    }
+
+    /* Free blocks must fit in a free memory zone */
+    if ((state == MEMORY_FREE) && 
+	(__get_mem_zone(db, hdr_rec, numa_node) == NULL)) {
+	ERROR("Tried to register a free memory block (%p) on an invalid NUMA node (%u)\n", 
+	      (void *)base_addr, numa_node);
+	return -1;
+    }
 
-    blk = wg_create_record(db, 11);
+    blk = wg_create_record(db, HDB_MEM_REC_LEN);
     wg_set_field(db, blk, HDB_TYPE_FIELD,     wg_encode_int(db, HDB_REC_MEM));
+    wg_set_field(db, blk, HDB_MEM_BLK_IDX,    wg_encode_int(db, base_addr / blk_size));
     wg_set_field(db, blk, HDB_MEM_BASE_ADDR,  wg_encode_int(db, base_addr));
     wg_set_field(db, blk, HDB_MEM_BLK_SIZE,   wg_encode_int(db, blk_size));
     wg_set_field(db, blk, HDB_MEM_NUMA_NODE,  wg_encode_int(db, numa_node));
@@ -1662,10 +2606,8 @@ __register_memory(hdb_db_t    db,
     wg_set_field(db, blk, HDB_MEM_ENCLAVE_ID, wg_encode_int(db, enclave_id));
     wg_set_field(db, blk, HDB_MEM_APP_ID,     wg_encode_int(db, HOBBES_INVALID_ID));
 
-    __wg_set_record(db, blk, HDB_MEM_NEXT_FREE, NULL);
-    __wg_set_record(db, blk, HDB_MEM_PREV_FREE, NULL);
-    __wg_set_record(db, blk, HDB_MEM_NEXT_BLK,  NULL);
-    __wg_set_record(db, blk, HDB_MEM_PREV_BLK,  NULL);
+    __set_mem_link(db, blk, HDB_MEM_NEXT_BLK,  NULL);
+    __set_mem_link(db, blk, HDB_MEM_PREV_BLK,  NULL);
 
     /* Insert block into  */
     if (__insert_mem_blk(db, hdr_rec, blk) == -1) {
@@ -1673,6 +2615,8 @@ __register_memory(hdb_db_t    db,
 	return -1;
     }
 
+    hdb_log_change(db, HDB_TABLE_MEM, base_addr, HDB_CHANGE_CREATE);
+
     return 0;
 }
 
@@ -1688,6 +2632,8 @@ hdb_register_memory(hdb_db_t    db,
     wg_int   lock_id;
     int      ret      = -1;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_write(db);
     
     if (!lock_id) {
@@ -1731,6 +2677,8 @@ hdb_get_mem_app_id(hdb_db_t  db,
     hobbes_id_t app_id = HOBBES_INVALID_ID;
     wg_int      lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_read(db);
 
     if (!lock_id) {
@@ -1774,6 +2722,8 @@ hdb_get_mem_enclave_id(hdb_db_t  db,
     hobbes_id_t enclave_id = HOBBES_INVALID_ID;
     wg_int      lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_read(db);
 
     if (!lock_id) {
@@ -1817,6 +2767,8 @@ hdb_get_mem_state(hdb_db_t  db,
     wg_int   lock_id;
     mem_state_t state = MEMORY_INVALID;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_read(db);
 
     if (!lock_id) {
@@ -1861,6 +2813,8 @@ hdb_get_mem_numa_node(hdb_db_t  db,
     uint32_t numa_node = 0;
     wg_int   lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     lock_id = wg_start_read(db);
 
     if (!lock_id) {
@@ -1933,6 +2887,8 @@ __hdb_get_mem_blocks(hdb_db_t    db,
     uintptr_t * addr_arr = NULL;
     wg_int      lock_id;
 
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
     if (!num_blks) {
 	return NULL;
     }
@@ -1970,6 +2926,94 @@ hdb_get_enclave_mem_blocks(hdb_db_t    db,
 }
 
 
+static int
+__snapshot_mem_blocks(hdb_db_t                    db,
+		      hobbes_id_t                 enclave_id,
+		      struct hobbes_memory_info * blk_arr,
+		      uint64_t                    max_blks,
+		      uint64_t                  * num_blks)
+{
+    void      * hdr_rec  = __get_sys_hdr(db);
+    hdb_mem_t   iter_blk = NULL;
+    uint64_t    cnt      = 0;
+
+    if (!hdr_rec) {
+	ERROR("Malformed database. Missing System Info Header\n");
+	return -1;
+    }
+
+    /* The block list holds every block, sorted by address */
+    iter_blk = __wg_get_record(db, hdr_rec, HDB_SYS_HDR_MEM_BLK_LIST);
+
+    while (iter_blk) {
+	hobbes_id_t blk_enc_id = wg_decode_int(db, wg_get_field(db, iter_blk, HDB_MEM_ENCLAVE_ID));
+
+	if ((enclave_id == HOBBES_INVALID_ID) ||
+	    (enclave_id == blk_enc_id)) {
+
+	    if (cnt < max_blks) {
+		struct hobbes_memory_info * blk = &(blk_arr[cnt]);
+
+		blk->base_addr     = wg_decode_int(db, wg_get_field(db, iter_blk, HDB_MEM_BASE_ADDR));
+		blk->size_in_bytes = wg_decode_int(db, wg_get_field(db, iter_blk, HDB_MEM_BLK_SIZE));
+		blk->numa_node     = wg_decode_int(db, wg_get_field(db, iter_blk, HDB_MEM_NUMA_NODE));
+		blk->state         = wg_decode_int(db, wg_get_field(db, iter_blk, HDB_MEM_STATE));
+		blk->enclave_id    = blk_enc_id;
+		blk->app_id        = wg_decode_int(db, wg_get_field(db, iter_blk, HDB_MEM_APP_ID));
+	    }
+
+	    cnt++;
+	}
+
+	iter_blk = __get_mem_link(db, iter_blk, HDB_MEM_NEXT_BLK);
+    }
+
+    *num_blks = cnt;
+
+    return 0;
+}
+
+/**
+ * Copy the state of the memory blocks owned by an enclave (or of every block if 
+ * enclave_id is HOBBES_INVALID_ID) into blk_arr under a single read lock
+ *  - At most max_blks entries are filled in, in address order
+ *  - *num_blks is set to the number of matching blocks, which can be larger 
+ *    than max_blks (the caller should then retry with a larger array)
+ **/
+int
+hdb_snapshot_mem_blocks(hdb_db_t                    db,
+			hobbes_id_t                 enclave_id,
+			struct hobbes_memory_info * blk_arr,
+			uint64_t                    max_blks,
+			uint64_t                  * num_blks)
+{
+    wg_int lock_id;
+    int    ret = -1;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
+
+    if (!num_blks) {
+	return -1;
+    }
+
+    lock_id = wg_start_read(db);
+
+    if (!lock_id) {
+	ERROR("Could not lock database\n");
+	return -1;
+    }
+
+    ret = __snapshot_mem_blocks(db, enclave_id, blk_arr, max_blks, num_blks);
+
+    if (!wg_end_read(db, lock_id)) {
+	ERROR("Catastrophic database locking error\n");
+	return -1;
+    }
+
+    return ret;
+}
+
+
 /* Debugging */
 
 
@@ -1986,29 +3030,22 @@ __sys_print_free_blks(hdb_db_t db)
 	return;
     }
 
-    iter_blk = __wg_get_record(db, hdr_rec, HDB_SYS_HDR_MEM_FREE_LIST);
-    
-    if (iter_blk == NULL) {
-	printf("No Free blocks available\n");
-	return;
-    }
+    iter_blk = __wg_get_record(db, hdr_rec, HDB_SYS_HDR_MEM_BLK_LIST);
 
     while (iter_blk) {
-	char * free_str = NULL;
 	
 	if (wg_decode_int(db, wg_get_field(db, iter_blk, HDB_MEM_STATE)) == MEMORY_FREE) {
-	    free_str = "FREE";
-	} else {
-	    free_str = "ALLOCATED";
+	    printf("Free Block %d: [0x%.8lx] (NUMA=%d) <FREE>\n", i, 
+		   __get_mem_blk_addr(db, iter_blk), 
+		   __get_mem_blk_numa(db, iter_blk));
+	    i++;
 	}
 
-	printf("Free Block %d: [0x%.8lx] (NUMA=%d) <%s>\n", i, 
-	       __get_mem_blk_addr(db, iter_blk), 
-	       __get_mem_blk_numa(db, iter_blk),
-	       free_str);
-	
-	iter_blk = __wg_get_record(db, iter_blk, HDB_MEM_NEXT_FREE);
-        i++;
+	iter_blk = __get_mem_link(db, iter_blk, HDB_MEM_NEXT_BLK);
+    }
+
+    if (i == 0) {
+	printf("No Free blocks available\n");
     }
     
     return;
@@ -2019,6 +3056,8 @@ void
 hdb_sys_print_free_blks(hdb_db_t db) 
 {
     wg_int     lock_id;
+
+    db = hdb_get_partition(db, HDB_PART_SYSTEM);
     
     lock_id = wg_start_read(db);
 
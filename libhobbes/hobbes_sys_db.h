@@ -47,6 +47,7 @@ int
 hdb_register_cpu(hdb_db_t    db,
 		 uint32_t    cpu_id,
 		 uint32_t    apic_id,
+		 uint32_t    core_id,
 		 uint32_t    numa_node,
 		 cpu_state_t state,
 		 hobbes_id_t enclave_id,
@@ -84,6 +85,14 @@ hdb_alloc_cpu(hdb_db_t    db,
 	      uint32_t    numa_node,
 	      hobbes_id_t enclave_id); 
 
+int
+hdb_alloc_cpus(hdb_db_t      db,
+	       hobbes_id_t   enclave_id,
+	       uint32_t      numa_node,
+	       uint32_t      num_cpus,
+	       cpu_policy_t  policy,
+	       uint32_t    * cpu_array);
+
 int 
 hdb_free_cpu(hdb_db_t db,
 	     uint32_t cpu_id);
@@ -97,6 +106,12 @@ uint32_t *
 hdb_get_cpus(hdb_db_t   db,
 	     uint32_t * num_cpus);
 
+int
+hdb_snapshot_cpus(hdb_db_t                 db,
+		  struct hobbes_cpu_info * cpu_arr,
+		  uint32_t                 max_cpus,
+		  uint32_t               * num_cpus);
+
 
 
 /* Memory Info */
@@ -169,6 +184,13 @@ hdb_get_enclave_mem_blocks(hdb_db_t    db,
 		           hobbes_id_t enclave_id,
 		           uint64_t  * num_blks);
 
+int
+hdb_snapshot_mem_blocks(hdb_db_t                    db,
+			hobbes_id_t                 enclave_id,
+			struct hobbes_memory_info * blk_arr,
+			uint64_t                    max_blks,
+			uint64_t                  * num_blks);
+
 
 
 /* Debugging */
@@ -6,6 +6,7 @@
  * redistribute, and modify it as specified in the file "PETLAB_LICENSE".
  */
 
+#include <strings.h>
 
 #include <pet_log.h>
 #include <pet_xml.h>
@@ -178,6 +179,16 @@ hobbes_alloc_specific_cpu(hobbes_id_t enclave_id,
     return hdb_alloc_cpu(hobbes_master_db, cpu_id, HOBBES_ANY_NUMA_ID, enclave_id);
 }
 
+int
+hobbes_alloc_cpus(hobbes_id_t  enclave_id,
+		  uint32_t     numa_node,
+		  uint32_t     num_cpus,
+		  cpu_policy_t policy,
+		  uint32_t   * cpu_array)
+{
+    return hdb_alloc_cpus(hobbes_master_db, enclave_id, numa_node, num_cpus, policy, cpu_array);
+}
+
 int 
 hobbes_free_cpu(uint32_t cpu_id)
 {
@@ -196,41 +207,38 @@ static struct hobbes_memory_info *
 __get_memory_list(hobbes_id_t  enclave_id,
 		  uint64_t   * num_mem_blks)
 {
-    struct hobbes_memory_info * blk_arr  = NULL;
-    uint64_t                  * addr_arr = NULL;
+    struct hobbes_memory_info * blk_arr = NULL;
     
-    uint64_t blk_cnt = 0;
-    uint64_t i       = 0;
-
-    if (enclave_id == HOBBES_INVALID_ID)
-	addr_arr = hdb_get_mem_blocks(hobbes_master_db, &blk_cnt);
-    else
-	addr_arr = hdb_get_enclave_mem_blocks(hobbes_master_db, enclave_id, &blk_cnt);
+    uint64_t max_blks = 0;
+    uint64_t blk_cnt  = 0;
 
-    if (addr_arr == NULL) {
+    /* Size the array, then snapshot. Retry if blocks were added in between */
+    if (hdb_snapshot_mem_blocks(hobbes_master_db, enclave_id, NULL, 0, &blk_cnt) == -1) {
 	ERROR("Could not retrieve memory block list\n");
 	return NULL;
     }
-    
-    blk_arr = calloc(sizeof(struct hobbes_memory_info), blk_cnt);
-    
-    for (i = 0; i < blk_cnt; i++) {
-	blk_arr[i].base_addr = addr_arr[i];
-	
-	blk_arr[i].size_in_bytes = hdb_get_sys_blk_size(hobbes_master_db);
-
-	blk_arr[i].numa_node     = hdb_get_mem_numa_node  ( hobbes_master_db, addr_arr[i] );
-	blk_arr[i].state         = hdb_get_mem_state      ( hobbes_master_db, addr_arr[i] );
-	blk_arr[i].enclave_id    = hdb_get_mem_enclave_id ( hobbes_master_db, addr_arr[i] );
-	blk_arr[i].app_id        = hdb_get_mem_app_id     ( hobbes_master_db, addr_arr[i] );
-    }
 
-    free(addr_arr);
+    do {
+	free(blk_arr);
+
+	max_blks = blk_cnt;
+	blk_arr  = calloc(sizeof(struct hobbes_memory_info), (max_blks > 0) ? max_blks : 1);
+
+	if (blk_arr == NULL) {
+	    ERROR("Could not allocate memory block list\n");
+	    return NULL;
+	}
+
+	if (hdb_snapshot_mem_blocks(hobbes_master_db, enclave_id, blk_arr, max_blks, &blk_cnt) == -1) {
+	    ERROR("Could not retrieve memory block list\n");
+	    free(blk_arr);
+	    return NULL;
+	}
+    } while (blk_cnt > max_blks);
 
     *num_mem_blks = blk_cnt;
 
     return blk_arr;
-
 }
 
 struct hobbes_memory_info * 
@@ -251,32 +259,35 @@ struct hobbes_cpu_info *
 hobbes_get_cpu_list(uint32_t * num_cpus)
 {
     struct hobbes_cpu_info * cpu_arr = NULL;
-    uint32_t               * id_arr  = NULL;
-
-    uint32_t cpu_cnt = 0;
-    uint32_t i       = 0;
 
-    id_arr = hdb_get_cpus(hobbes_master_db, &cpu_cnt);
-    *num_cpus = cpu_cnt;
+    uint32_t max_cpus = 0;
+    uint32_t cpu_cnt  = 0;
 
-    if (id_arr == NULL) {
+    /* Size the array, then snapshot. Retry if CPUs were added in between */
+    if (hdb_snapshot_cpus(hobbes_master_db, NULL, 0, &cpu_cnt) == -1) {
 	ERROR("Could not retrieve CPU list\n");
 	return NULL;
     }
 
-    cpu_arr = calloc(sizeof(struct hobbes_cpu_info), cpu_cnt);
+    do {
+	free(cpu_arr);
 
-    for (i = 0; i < cpu_cnt; i++) {
-	cpu_arr[i].cpu_id	      = id_arr[i];
+	max_cpus = cpu_cnt;
+	cpu_arr  = calloc(sizeof(struct hobbes_cpu_info), (max_cpus > 0) ? max_cpus : 1);
 
-	cpu_arr[i].apic_id	      = hdb_get_cpu_apic_id	       ( hobbes_master_db, id_arr[i] );
-	cpu_arr[i].numa_node	      = hdb_get_cpu_numa_node	       ( hobbes_master_db, id_arr[i] );
-	cpu_arr[i].state	      = hdb_get_cpu_state	       ( hobbes_master_db, id_arr[i] );
-	cpu_arr[i].enclave_id	      = hdb_get_cpu_enclave_id	       ( hobbes_master_db, id_arr[i] );
-	cpu_arr[i].enclave_logical_id = hdb_get_cpu_enclave_logical_id ( hobbes_master_db, id_arr[i] );
-    }
+	if (cpu_arr == NULL) {
+	    ERROR("Could not allocate CPU list\n");
+	    return NULL;
+	}
+
+	if (hdb_snapshot_cpus(hobbes_master_db, cpu_arr, max_cpus, &cpu_cnt) == -1) {
+	    ERROR("Could not retrieve CPU list\n");
+	    free(cpu_arr);
+	    return NULL;
+	}
+    } while (cpu_cnt > max_cpus);
 
-    free(id_arr);
+    *num_cpus = cpu_cnt;
 
     return cpu_arr;
 }
@@ -327,6 +338,40 @@ cpu_state_to_str(cpu_state_t state)
     return NULL;
 }
 
+const char *
+cpu_policy_to_str(cpu_policy_t policy)
+{
+    switch (policy) {
+	case CPU_POLICY_COMPACT:        return "compact";
+	case CPU_POLICY_SCATTER:        return "scatter";
+	case CPU_POLICY_SAME_NUMA:      return "same-numa";
+	case CPU_POLICY_AVOID_SIBLINGS: return "avoid-siblings";
+
+	default: return NULL;
+    }
+
+    return NULL;
+}
+
+cpu_policy_t
+cpu_policy_from_str(char * str)
+{
+    if (str == NULL) {
+	return CPU_POLICY_INVALID;
+    }
+
+    if (strcasecmp(str, "compact") == 0) {
+	return CPU_POLICY_COMPACT;
+    } else if (strcasecmp(str, "scatter") == 0) {
+	return CPU_POLICY_SCATTER;
+    } else if (strcasecmp(str, "same-numa") == 0) {
+	return CPU_POLICY_SAME_NUMA;
+    } else if (strcasecmp(str, "avoid-siblings") == 0) {
+	return CPU_POLICY_AVOID_SIBLINGS;
+    }
+
+    return CPU_POLICY_INVALID;
+}
 
 
 int
@@ -336,11 +381,9 @@ hobbes_assign_cpu(hobbes_id_t enclave_id,
 {
     hcq_handle_t hcq   = HCQ_INVALID_HANDLE;
 
-    hcq_cmd_t cmd      = HCQ_INVALID_CMD;
     pet_xml_t cmd_xml  = PET_INVALID_XML;
 
-    uint32_t  ret_size =  0;
-    uint8_t * ret_data =  NULL;
+    char      err_str[128] = {0};
 
     char    * tmp_str  =  NULL;
     int       ret      = -1;
@@ -378,24 +421,13 @@ hobbes_assign_cpu(hobbes_id_t enclave_id,
     smart_free(tmp_str);
     
     tmp_str = pet_xml_get_str(cmd_xml);
-    cmd     = hcq_cmd_issue(hcq, HOBBES_CMD_ADD_CPU, strlen(tmp_str) + 1, tmp_str);
-    
-    if (cmd == HCQ_INVALID_CMD) {
-	ERROR("Error issuing add memory command (%s)\n", tmp_str);
-	goto err;
-    } 
-
-
-    ret = hcq_get_ret_code(hcq, cmd);
+    ret     = hcq_call(hcq, HOBBES_CMD_ADD_CPU, tmp_str, strlen(tmp_str) + 1, err_str, sizeof(err_str) - 1, NULL);
     
     if (ret != 0) {
-	ret_data = hcq_get_ret_data(hcq, cmd, &ret_size);
-	ERROR("Error adding cpu (%s) [ret=%d]\n", ret_data, ret);
+	ERROR("Error adding cpu (%s) [ret=%d]\n", err_str, ret);
 	goto err;
     }
 
-    hcq_cmd_complete(hcq, cmd);
-
     hcq_disconnect(hcq);
 
     smart_free(tmp_str);
@@ -406,7 +438,6 @@ hobbes_assign_cpu(hobbes_id_t enclave_id,
  err:
     if (tmp_str != NULL)               smart_free(tmp_str);                 
     if (cmd_xml != PET_INVALID_XML)    pet_xml_free(cmd_xml);
-    if (cmd     != HCQ_INVALID_CMD)    hcq_cmd_complete(hcq, cmd);
     if (hcq     != HCQ_INVALID_HANDLE) hcq_disconnect(hcq);
     return -1;
 
@@ -424,11 +455,9 @@ hobbes_assign_memory(hobbes_id_t  enclave_id,
 {
     hcq_handle_t hcq   = HCQ_INVALID_HANDLE;
 
-    hcq_cmd_t cmd      = HCQ_INVALID_CMD;
     pet_xml_t cmd_xml  = PET_INVALID_XML;
 
-    uint32_t  ret_size =  0;
-    uint8_t * ret_data =  NULL;
+    char      err_str[128] = {0};
 
     char    * tmp_str  =  NULL;
     int       ret      = -1;
@@ -470,24 +499,13 @@ hobbes_assign_memory(hobbes_id_t  enclave_id,
     pet_xml_add_val(cmd_xml, "zeroed",    (zeroed)    ? "1" : "0");
 
     tmp_str = pet_xml_get_str(cmd_xml);
-    cmd     = hcq_cmd_issue(hcq, HOBBES_CMD_ADD_MEM, strlen(tmp_str) + 1, tmp_str);
-    
-    if (cmd == HCQ_INVALID_CMD) {
-	ERROR("Error issuing add memory command (%s)\n", tmp_str);
-	goto err;
-    } 
-
-
-    ret = hcq_get_ret_code(hcq, cmd);
+    ret     = hcq_call(hcq, HOBBES_CMD_ADD_MEM, tmp_str, strlen(tmp_str) + 1, err_str, sizeof(err_str) - 1, NULL);
     
     if (ret != 0) {
-	ret_data = hcq_get_ret_data(hcq, cmd, &ret_size);
-	ERROR("Error adding memory (%s) [ret=%d]\n", ret_data, ret);
+	ERROR("Error adding memory (%s) [ret=%d]\n", err_str, ret);
 	goto err;
     }
 
-    hcq_cmd_complete(hcq, cmd);
-
     hcq_disconnect(hcq);
 
     smart_free(tmp_str);
@@ -498,7 +516,6 @@ hobbes_assign_memory(hobbes_id_t  enclave_id,
  err:
     if (tmp_str != NULL)               smart_free(tmp_str);                 
     if (cmd_xml != PET_INVALID_XML)    pet_xml_free(cmd_xml);
-    if (cmd     != HCQ_INVALID_CMD)    hcq_cmd_complete(hcq, cmd);
     if (hcq     != HCQ_INVALID_HANDLE) hcq_disconnect(hcq);
     return -1;
 }
@@ -511,11 +528,9 @@ hobbes_remove_memory(hobbes_id_t  enclave_id,
 {
     hcq_handle_t hcq   = HCQ_INVALID_HANDLE;
 
-    hcq_cmd_t cmd      = HCQ_INVALID_CMD;
     pet_xml_t cmd_xml  = PET_INVALID_XML;
 
-    uint32_t  ret_size =  0;
-    uint8_t * ret_data =  NULL;
+    char      err_str[128] = {0};
 
     char    * tmp_str  =  NULL;
     int       ret      = -1;
@@ -556,24 +571,13 @@ hobbes_remove_memory(hobbes_id_t  enclave_id,
     pet_xml_add_val(cmd_xml, "allocated", (allocated) ? "1" : "0");
     
     tmp_str = pet_xml_get_str(cmd_xml);
-    cmd     = hcq_cmd_issue(hcq, HOBBES_CMD_REMOVE_MEM, strlen(tmp_str) + 1, tmp_str);
-    
-    if (cmd == HCQ_INVALID_CMD) {
-	ERROR("Error issuing remove memory command (%s)\n", tmp_str);
-	goto err;
-    } 
-
-
-    ret = hcq_get_ret_code(hcq, cmd);
+    ret     = hcq_call(hcq, HOBBES_CMD_REMOVE_MEM, tmp_str, strlen(tmp_str) + 1, err_str, sizeof(err_str) - 1, NULL);
     
     if (ret != 0) {
-	ret_data = hcq_get_ret_data(hcq, cmd, &ret_size);
-	ERROR("Error removing memory (%s) [ret=%d]\n", ret_data, ret);
+	ERROR("Error removing memory (%s) [ret=%d]\n", err_str, ret);
 	goto err;
     }
 
-    hcq_cmd_complete(hcq, cmd);
-
     hcq_disconnect(hcq);
 
     smart_free(tmp_str);
@@ -584,7 +588,6 @@ hobbes_remove_memory(hobbes_id_t  enclave_id,
  err:
     if (tmp_str != NULL)               smart_free(tmp_str);                 
     if (cmd_xml != PET_INVALID_XML)    pet_xml_free(cmd_xml);
-    if (cmd     != HCQ_INVALID_CMD)    hcq_cmd_complete(hcq, cmd);
     if (hcq     != HCQ_INVALID_HANDLE) hcq_disconnect(hcq);
     return -1;
 }
@@ -40,6 +40,14 @@ typedef enum {
     CPU_ALLOCATED = 3
 } cpu_state_t;
 
+typedef enum {
+    CPU_POLICY_INVALID        = 0,
+    CPU_POLICY_COMPACT        = 1, /* Pack onto as few NUMA nodes and cores as possible      */
+    CPU_POLICY_SCATTER        = 2, /* Spread across NUMA nodes, then across cores            */
+    CPU_POLICY_SAME_NUMA      = 3, /* All on one NUMA node, one CPU per core where possible  */
+    CPU_POLICY_AVOID_SIBLINGS = 4  /* At most one CPU per core, preferring idle cores        */
+} cpu_policy_t;
+
 
 
 struct hobbes_system_info {
@@ -66,6 +74,14 @@ uint32_t
 hobbes_alloc_specific_cpu(hobbes_id_t enclave_id,
 			  uint32_t    cpu_id);
 
+/* Allocate num_cpus CPUs at once, placed according to policy. All or nothing */
+int
+hobbes_alloc_cpus(hobbes_id_t  enclave_id,
+		  uint32_t     numa_node,
+		  uint32_t     num_cpus,
+		  cpu_policy_t policy,
+		  uint32_t   * cpu_array);
+
 int 
 hobbes_free_cpu(uint32_t cpu_id);
 
@@ -171,6 +187,8 @@ hobbes_set_cpu_enclave_logical_id(uint32_t cpu_id, uint32_t logilca_id);
 
 const char * mem_state_to_str(mem_state_t state);
 const char * cpu_state_to_str(cpu_state_t state);
+const char * cpu_policy_to_str(cpu_policy_t policy);
+cpu_policy_t cpu_policy_from_str(char * str);
 
 
 
@@ -8,6 +8,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 #include <xpmem.h>
@@ -20,6 +21,191 @@
 extern hdb_db_t hobbes_master_db;
 
 
+/* 
+ * APID cache
+ *    Signalling a segment needs an APID for it, and getting and releasing one costs an 
+ *    ioctl each. So each process keeps the APIDs of the segments it has signalled, in a 
+ *    direct mapped table indexed by segid.
+ *
+ *    Entries are refcounted. The table holds one reference, and each signal in flight 
+ *    holds another, so an entry can be dropped when its segment is removed without 
+ *    releasing an APID that another thread is still using. Segments removed by other 
+ *    processes are found through the segment table's change log.
+ */
+#define XEMEM_APID_CACHE_SIZE      256
+#define XEMEM_APID_CACHE_CHANGES   64
+
+struct apid_entry {
+    xemem_segid_t segid;
+    xemem_apid_t  apid;
+    uint32_t      refcnt;
+};
+
+static struct {
+    pthread_mutex_t     lock;
+    uint64_t            seg_gen;
+    struct apid_entry * entries[XEMEM_APID_CACHE_SIZE];
+} apid_cache = {PTHREAD_MUTEX_INITIALIZER, 0, {NULL}};
+
+
+static struct apid_entry **
+__apid_slot(xemem_segid_t segid)
+{
+    uint64_t key = (uint64_t)segid;
+
+    return &(apid_cache.entries[(key ^ (key >> 32)) % XEMEM_APID_CACHE_SIZE]);
+}
+
+/* Drop a reference to an entry, releasing the APID with the last one. Lock must be held */
+static void
+__put_apid_entry(struct apid_entry * entry)
+{
+    if (--entry->refcnt > 0) {
+	return;
+    }
+
+    xemem_release(entry->apid);
+    free(entry);
+}
+
+static void
+__invalidate_apid(xemem_segid_t segid)
+{
+    struct apid_entry ** slot = __apid_slot(segid);
+
+    if ((*slot == NULL) || ((*slot)->segid != segid)) {
+	return;
+    }
+
+    __put_apid_entry(*slot);
+    *slot = NULL;
+}
+
+static void
+__flush_apid_cache(void)
+{
+    int i = 0;
+
+    for (i = 0; i < XEMEM_APID_CACHE_SIZE; i++) {
+	if (apid_cache.entries[i] != NULL) {
+	    __put_apid_entry(apid_cache.entries[i]);
+	    apid_cache.entries[i] = NULL;
+	}
+    }
+}
+
+/* Drop the entries of segments that were removed since the last check */
+static void
+__sync_apid_cache(void)
+{
+    struct hdb_change changes[XEMEM_APID_CACHE_CHANGES];
+    uint64_t          cur_gen = 0;
+    int               cnt     = 0;
+    int               i       = 0;
+
+    if (hdb_get_table_generation(hobbes_master_db, HDB_TABLE_SEGMENT) <= apid_cache.seg_gen) {
+	return;
+    }
+
+    do {
+	cnt = hdb_get_changes(hobbes_master_db, apid_cache.seg_gen, 
+			      changes, XEMEM_APID_CACHE_CHANGES, &cur_gen);
+
+	if (cnt < 0) {
+	    /* Some changes were lost, so any entry could be stale */
+	    __flush_apid_cache();
+	    apid_cache.seg_gen = cur_gen;
+	    return;
+	}
+
+	for (i = 0; i < cnt; i++) {
+	    if ((changes[i].table == HDB_TABLE_SEGMENT) &&
+		(changes[i].op    == HDB_CHANGE_DELETE)) {
+		__invalidate_apid(changes[i].id);
+	    }
+
+	    apid_cache.seg_gen = changes[i].gen;
+	}
+    } while (cnt == XEMEM_APID_CACHE_CHANGES);
+
+    apid_cache.seg_gen = cur_gen;
+}
+
+/* Get a referenced entry for a segment, filling the cache on a miss */
+static struct apid_entry *
+__get_apid_entry(xemem_segid_t segid)
+{
+    struct apid_entry ** slot  = NULL;
+    struct apid_entry  * entry = NULL;
+
+    pthread_mutex_lock(&(apid_cache.lock));
+
+    __sync_apid_cache();
+
+    slot = __apid_slot(segid);
+
+    if ((*slot != NULL) && ((*slot)->segid == segid)) {
+	entry = *slot;
+	entry->refcnt++;
+	goto out;
+    }
+
+    entry = malloc(sizeof(struct apid_entry));
+
+    if (entry == NULL) {
+	ERROR("Could not allocate APID cache entry\n");
+	goto out;
+    }
+
+    entry->segid  = segid;
+    entry->apid   = xemem_get(segid, XEMEM_RDWR);
+    entry->refcnt = 2; /* The cache's, and the caller's */
+
+    if (entry->apid <= 0) {
+	ERROR("Could not get APID for SEGID (%lu)\n", segid);
+	free(entry);
+	entry = NULL;
+	goto out;
+    }
+
+    /* Evict whatever was in the slot */
+    if (*slot != NULL) {
+	__put_apid_entry(*slot);
+    }
+
+    *slot = entry;
+
+ out:
+    pthread_mutex_unlock(&(apid_cache.lock));
+
+    return entry;
+}
+
+static void
+__release_apid_entry(struct apid_entry * entry, 
+		     int                 invalidate)
+{
+    pthread_mutex_lock(&(apid_cache.lock));
+
+    if ((invalidate) && (*__apid_slot(entry->segid) == entry)) {
+	__invalidate_apid(entry->segid);
+    }
+
+    __put_apid_entry(entry);
+
+    pthread_mutex_unlock(&(apid_cache.lock));
+}
+
+void
+xemem_flush_apid_cache(void)
+{
+    pthread_mutex_lock(&(apid_cache.lock));
+    __flush_apid_cache();
+    pthread_mutex_unlock(&(apid_cache.lock));
+}
+
+
+
 
 xemem_segid_t
 xemem_make(void   * vaddr, 
@@ -126,6 +312,10 @@ int
 xemem_remove(xemem_segid_t segid)
 {
     int ret = 0;
+
+    pthread_mutex_lock(&(apid_cache.lock));
+    __invalidate_apid(segid);
+    pthread_mutex_unlock(&(apid_cache.lock));
  
     ret = hdb_delete_xemem_segment(hobbes_master_db, segid);
     
@@ -181,23 +371,31 @@ xemem_signal(xemem_apid_t apid)
     return ret;
 }
 
+/* Repeated signals to a segment reuse its cached APID, costing one ioctl instead of three */
 int
 xemem_signal_segid(xemem_segid_t segid)
 {
-    xemem_apid_t apid = 0;
-    
-    apid = xemem_get(segid, XEMEM_RDWR);
+    struct apid_entry * entry = NULL;
+    int                 tries = 0;
 
-    if (apid <= 0) {
-	ERROR("Could not get APID for SEGID (%lu)\n", segid);
-	return -1;
-    }
+    for (tries = 0; tries < 2; tries++) {
+	entry = __get_apid_entry(segid);
 
-    xemem_signal(apid);
+	if (entry == NULL) {
+	    return -1;
+	}
 
-    xemem_release(apid);
-    
-    return 0;
+	if (xemem_signal(entry->apid) == 0) {
+	    __release_apid_entry(entry, 0);
+	    return 0;
+	}
+
+	/* The APID went stale before we saw the segment's removal. Retry with a new one */
+	__release_apid_entry(entry, 1);
+    }
+
+    ERROR("Could not signal SEGID (%lu)\n", segid);
+    return -1;
 }
 
 
@@ -278,39 +476,41 @@ struct xemem_segment *
 xemem_get_segment_list(int * num_segments)
 {
     struct xemem_segment * seg_arr = NULL;
-    xemem_segid_t        * id_arr  = NULL;
 
+    int max_segs =  0;
     int num_segs = -1;
-    int i        =  0;
 
-    id_arr = hdb_get_segments(hobbes_master_db, &num_segs);
-    
-    if (num_segs == -1) {
+    /* Size the array, then snapshot. Retry if segments were added in between */
+    if (hdb_snapshot_segments(hobbes_master_db, NULL, 0, &num_segs) == -1) {
 	ERROR("Could not retrieve segment list from database\n");
 	return NULL;
     }
 
-    *num_segments = num_segs;
+    while (num_segs > max_segs) {
+	free(seg_arr);
 
-    if (num_segs == 0) {
-	return NULL;
-    }
+	max_segs = num_segs;
+	seg_arr  = calloc(sizeof(struct xemem_segment), max_segs);
 
-    seg_arr = calloc(sizeof(struct xemem_segment), num_segs);
+	if (seg_arr == NULL) {
+	    ERROR("Could not allocate segment list\n");
+	    return NULL;
+	}
 
-    for (i = 0; i < num_segs; i++) {
-	seg_arr[i].segid      = id_arr[i];
+	if (hdb_snapshot_segments(hobbes_master_db, seg_arr, max_segs, &num_segs) == -1) {
+	    ERROR("Could not retrieve segment list from database\n");
+	    free(seg_arr);
+	    return NULL;
+	}
+    }
 
-	seg_arr[i].enclave_id = hdb_get_xemem_enclave(hobbes_master_db, id_arr[i]);
-	seg_arr[i].app_id     = hdb_get_xemem_app(hobbes_master_db, id_arr[i]);
+    *num_segments = num_segs;
 
-	strncpy(seg_arr[i].name, 
-		hdb_get_xemem_name(hobbes_master_db, id_arr[i]), 
-		XEMEM_SEG_NAME_LEN - 1);
+    if (num_segs == 0) {
+	free(seg_arr);
+	return NULL;
     }
 
-    free(id_arr);
-
     return seg_arr;
 }
 
@@ -328,5 +528,9 @@ xemem_export_segment(xemem_segid_t  segid,
 int
 xemem_remove_segment(xemem_segid_t segid)
 {
+    pthread_mutex_lock(&(apid_cache.lock));
+    __invalidate_apid(segid);
+    pthread_mutex_unlock(&(apid_cache.lock));
+
     return hdb_delete_xemem_segment(hobbes_master_db, segid);
 }
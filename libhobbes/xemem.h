@@ -80,6 +80,9 @@ int xemem_release(xemem_apid_t apid);
 int xemem_signal(xemem_apid_t apid);
 int xemem_signal_segid(xemem_segid_t segid);
 
+/* Release the APIDs cached by xemem_signal_segid() */
+void xemem_flush_apid_cache(void);
+
 int xemem_ack(int fd);
 int xemem_ack_all(int fd);
 
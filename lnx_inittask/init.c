@@ -128,6 +128,13 @@ main(int argc, char ** argv, char * envp[])
 	exit(-1);
     }
 
+    /* Periodically checkpoint the system resources, for fast restarts */
+    if (hobbes_is_master_inittask()) {
+	if (master_init_checkpoints() == -1) {
+	    ERROR("Could not initialize master checkpoints\n");
+	}
+    }
+
     /* Initialize Palacios commands if VMM is available */
     if (palacios_is_available()) {
 	palacios_init();
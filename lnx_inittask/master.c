@@ -3,7 +3,9 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <assert.h>
 
 
@@ -17,6 +19,7 @@
 #include <v3vee.h>
 
 #include "master.h"
+#include "init.h"
 #include "hobbes_ctrl.h"
 #include "hobbes_db.h"
 #include "hobbes_sys_db.h"
@@ -24,11 +27,23 @@
 
 #define PAGE_SIZE sysconf(_SC_PAGESIZE)
 
+/* The system resource partition is checkpointed here, and restored from it on startup */
+#define DEFAULT_CHECKPOINT_FILE      "/var/tmp/leviathan_system.ckpt"
+#define DEFAULT_CHECKPOINT_INTERVAL  60 /* seconds */
+
 extern hdb_db_t hobbes_master_db;
 
+static char     * ckpt_file       = DEFAULT_CHECKPOINT_FILE;
+static uint32_t   ckpt_interval   = DEFAULT_CHECKPOINT_INTERVAL;
+static uint64_t   ckpt_generation = 0;
+
 static void * create_master_db(void);
+static int    create_partition(hdb_part_t part);
 static int    export_master_db(void);
+static int    init_system_info(hdb_db_t db, int cold_start);
 static int    populate_system_info(hdb_db_t db);
+static int    restore_system_info(hdb_db_t db);
+static int    checkpoint_system_info(void);
 
 
 static int    reserve_cpu_list ( char * cpu_list );
@@ -41,7 +56,10 @@ static void usage(char * exec_name) {
 	   " [-n, --numa=<numa_zone>]\n"	\
 	   " Alternatively a specific set of cpus can be specified with: \n" \
 	   " [--cpulist=<cpus>]\n" \
-	   " [-m, --mem=<size_in_MB>]\n",
+	   " [-m, --mem=<size_in_MB>]\n" \
+	   " [--checkpoint=<file>]            : System resource checkpoint (default: " DEFAULT_CHECKPOINT_FILE ")\n" \
+	   " [--checkpoint-interval=<secs>]   : Seconds between checkpoints, 0 to only checkpoint on exit (default: 60)\n" \
+	   " [--cold-start]                   : Ignore the checkpoint and rebuild the system resource state\n",
 	   exec_name
 	   );
     exit(-1);
@@ -53,6 +71,7 @@ int master_init(int argc, char ** argv) {
     static int cpu_list_is_set  = 0;
     static int cpu_str_is_set   = 0;
     static int mem_str_is_set   = 0;
+    static int cold_start       = 0;
 
     int      numa_zone   = -1;
     int      num_cpus    = -1;
@@ -82,6 +101,9 @@ int master_init(int argc, char ** argv) {
 	    {"numa",     required_argument, NULL,		'n'},
 	    {"cpulist",  required_argument, &cpu_list_is_set,    1 },
 	    {"mem",      required_argument, NULL,		'm'},
+	    {"checkpoint",          required_argument, NULL,         0 },
+	    {"checkpoint-interval", required_argument, NULL,         0 },
+	    {"cold-start",          no_argument,       &cold_start,  1 },
 	    {0, 0, 0, 0}
 	};
 
@@ -122,6 +144,18 @@ int master_init(int argc, char ** argv) {
 		    switch (opt_index) {
 			case 2:
 			    cpu_list = optarg;
+			    break;
+			case 4:
+			    ckpt_file = optarg;
+			    break;
+			case 5:
+			    ckpt_interval = smart_atou32(-1, optarg);
+
+			    if (ckpt_interval == (uint32_t)-1) {
+				ERROR("Invalid checkpoint interval (%s)\n", optarg);
+				usage(argv[0]);
+			    }
+
 			    break;
 		    }
 		    break;
@@ -216,7 +250,7 @@ int master_init(int argc, char ** argv) {
     }
 
     /* Initialize the system resource state */
-    populate_system_info(db);
+    init_system_info(db, cold_start);
 
 
     /* Export Database */
@@ -450,6 +484,9 @@ master_exit(void)
 
     free(enclaves);
 
+    /* Save the final resource state, so the next start can skip rebuilding it */
+    checkpoint_system_info();
+
     /* Re-online all resources */
     release_memory();
     release_cpus();
@@ -628,13 +665,21 @@ create_master_db(void)
 {
 
     hobbes_id_t     enclave_id = HOBBES_INVALID_ID;
+    hdb_part_t      part       = HDB_PART_REGISTRY;
 
 
     hobbes_master_db    = hdb_create(HDB_MASTER_DB_SIZE);
 
 
     /* Initialize Master DB State */
-    hdb_init_master_db(hobbes_master_db);
+    hdb_init_partition(hobbes_master_db, HDB_PART_REGISTRY);
+
+    /* The other partitions get their own database (and lock) */
+    for (part = HDB_PART_REGISTRY + 1; part < HDB_NUM_PARTS; part++) {
+	if (create_partition(part) != 0) {
+	    return NULL;
+	}
+    }
 
     /* Create Master enclave */
     enclave_id = hdb_create_enclave(hobbes_master_db, "master", 0, MASTER_ENCLAVE, HOBBES_INVALID_ID);
@@ -655,35 +700,219 @@ create_master_db(void)
 
 
 
+/* Create a new database for a partition of the master DB, replacing any existing one */
+static int
+create_partition(hdb_part_t part)
+{
+    hdb_db_t old_db  = hdb_get_partition(hobbes_master_db, part);
+    hdb_db_t part_db = hdb_create(hdb_get_partition_size(part));
+
+    if ((part_db == NULL) || 
+	(hdb_init_partition(part_db, part) != 0)) {
+	ERROR("Could not create database partition (%d)\n", part);
+
+	if (part_db) {
+	    hdb_detach(part_db);
+	}
+
+	return -1;
+    }
+
+    hdb_set_partition(hobbes_master_db, part, part_db);
+
+    if (old_db != hobbes_master_db) {
+	hdb_detach(old_db);
+    }
+
+    return 0;
+}
 
 
 static int
 export_master_db(void)
 {
-    xpmem_segid_t   segid      = HDB_MASTER_DB_SEGID;
-    void          * db_addr    = NULL;
+    hdb_part_t part = HDB_PART_REGISTRY;
 
-    db_addr = hdb_get_db_addr(hobbes_master_db);
+    /* Each partition is exported as its own segment */
+    for (part = HDB_PART_REGISTRY; part < HDB_NUM_PARTS; part++) {
+	xpmem_segid_t   segid      = hdb_get_partition_segid(part);
+	uint64_t        db_size    = hdb_get_partition_size(part);
+	void          * db_addr    = NULL;
 
-    madvise(db_addr, HDB_MASTER_DB_SIZE, MADV_DONTFORK);
+	db_addr = hdb_get_db_addr(hdb_get_partition(hobbes_master_db, part));
 
-    printf("HDB SegID = %d, db_addr=%p, db_size=%d\n", (int)segid, db_addr, HDB_MASTER_DB_SIZE);
-    //segid = xpmem_make(db_addr, HDB_MASTER_DB_SIZE, XPMEM_REQUEST_MODE, (void *)segid);
-    segid = xpmem_make_ext(db_addr, HDB_MASTER_DB_SIZE, 
-			   XPMEM_GLOBAL_MODE, (void *)0,
-			   XPMEM_MEM_MODE | XPMEM_REQUEST_MODE, segid, 
-			   NULL);
+	madvise(db_addr, db_size, MADV_DONTFORK);
 
-    if (segid <= 0) {
-	printf("Error Creating SegID (%lld)\n", segid);
-	return -1;
-    } 
+	printf("HDB SegID = %d, db_addr=%p, db_size=%lu\n", (int)segid, db_addr, db_size);
+	//segid = xpmem_make(db_addr, db_size, XPMEM_REQUEST_MODE, (void *)segid);
+	segid = xpmem_make_ext(db_addr, db_size, 
+			       XPMEM_GLOBAL_MODE, (void *)0,
+			       XPMEM_MEM_MODE | XPMEM_REQUEST_MODE, segid, 
+			       NULL);
+
+	if (segid <= 0) {
+	    printf("Error Creating SegID (%lld)\n", segid);
+	    return -1;
+	} 
 
-    printf("segid: %llu\n", segid);
+	printf("segid: %llu\n", segid);
+    }
 
     return 0;
 }
 
+/* 
+ * Physical core of a CPU, named after the lowest CPU ID among it and its SMT siblings.
+ * Linux drops the topology of offline CPUs, so this must run before claim_cpu(). 
+ * A CPU whose topology is unknown counts as a core of its own.
+ */
+static uint32_t
+probe_cpu_core(uint32_t cpu_id)
+{
+    char     path[128];
+    FILE   * fp      = NULL;
+    uint32_t core_id = cpu_id;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu_id);
+
+    fp = fopen(path, "r");
+
+    if (fp == NULL) {
+	return cpu_id;
+    }
+
+    /* The list is sorted ("0,4" or "0-1"), so the first ID is the lowest */
+    if (fscanf(fp, "%u", &core_id) != 1) {
+	core_id = cpu_id;
+    }
+
+    fclose(fp);
+
+    return core_id;
+}
+
+/* 
+ * Take a CPU away from Linux, and work out the state it is registered with 
+ */
+static void
+claim_cpu(struct pet_cpu * cpu,
+	  cpu_state_t    * state,
+	  hobbes_id_t    * enclave_id,
+	  uint32_t       * logical_id)
+{
+    *state      = CPU_INVALID;
+    *enclave_id = HOBBES_INVALID_ID;
+    *logical_id = HOBBES_INVALID_CPU_ID;
+
+    switch (cpu->state) {
+	case PET_CPU_ONLINE: {
+	    int cpu_id = cpu->cpu_id;
+		    
+	    pet_offline_cpu(cpu_id);
+		    
+	    if (pet_cpu_status(cpu_id) != PET_CPU_OFFLINE) {
+		*state      = CPU_ALLOCATED;
+		*enclave_id = HOBBES_MASTER_ENCLAVE_ID;
+		break;
+	    }
+		    
+	    *state = CPU_FREE;
+		    
+	    break;
+	}	
+	case PET_CPU_RSVD:
+	    *state      = CPU_ALLOCATED;
+	    *enclave_id = HOBBES_MASTER_ENCLAVE_ID;
+	    *logical_id = cpu->cpu_id; /* Logical id = cpu id in the master */
+	    break;
+	case PET_CPU_OFFLINE:
+	case PET_CPU_INVALID:
+	default: 
+	    *state = CPU_INVALID;
+	    break;
+    }
+}
+
+/* 
+ * Take a memory block away from Linux, and work out the state it is registered with 
+ */
+static void
+claim_block(struct mem_block * blk,
+	    mem_state_t      * state,
+	    hobbes_id_t      * enclave_id)
+{
+    *state      = MEMORY_INVALID;
+    *enclave_id = HOBBES_INVALID_ID;
+
+    switch (blk->state) {
+	case PET_BLOCK_ONLINE: {
+	    int blk_index = blk->base_addr / pet_block_size();
+		    
+	    if (pet_offline_block(blk_index) != 0) {
+		*state      = MEMORY_ALLOCATED;
+		*enclave_id = HOBBES_MASTER_ENCLAVE_ID;
+		break;
+	    }
+		    
+	    *state      = MEMORY_FREE;
+		    
+	    break;
+	}
+
+	case PET_BLOCK_RSVD: 
+	    *state      = MEMORY_ALLOCATED;
+	    *enclave_id = HOBBES_MASTER_ENCLAVE_ID;
+	    break;
+	case PET_BLOCK_OFFLINE:
+	case PET_BLOCK_INVALID:
+	default: 
+	    *state = MEMORY_INVALID;
+	    break;
+    }
+}
+
+
+static uint64_t
+__now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* 
+ * Warm start from the last checkpoint when it is still valid, otherwise rebuild 
+ * the system resource state from scratch (a cold start)
+ */
+static int
+init_system_info(hdb_db_t db,
+		 int      cold_start)
+{
+    uint64_t start_ms = __now_ms();
+    int      ret      = 0;
+
+    if ((cold_start == 0) && 
+	(restore_system_info(db) == 0)) {
+	printf("System resources restored in %lums (warm start)\n", __now_ms() - start_ms);
+	return 0;
+    }
+
+    /* A failed restore leaves the partition in an undefined state */
+    if ((cold_start == 0) &&
+	(create_partition(HDB_PART_SYSTEM) != 0)) {
+	ERROR("Could not reset system resource database\n");
+	return -1;
+    }
+
+    ret = populate_system_info(db);
+
+    printf("System resources registered in %lums (cold start)\n", __now_ms() - start_ms);
+
+    return ret;
+}
+
 static int 
 populate_system_info(hdb_db_t db) 
 {
@@ -725,44 +954,22 @@ populate_system_info(hdb_db_t db)
 	    cpu_state_t state      = CPU_INVALID;
 	    hobbes_id_t enclave_id = HOBBES_INVALID_ID;
 	    uint32_t    logical_id = HOBBES_INVALID_CPU_ID;
+	    uint32_t    core_id    = probe_cpu_core(cpu_arr[i].cpu_id);
 
+	    claim_cpu(&(cpu_arr[i]), &state, &enclave_id, &logical_id);
 
-	    switch (cpu_arr[i].state) {
-		case PET_CPU_ONLINE: {
-		    int cpu_id = cpu_arr[i].cpu_id;
-		    
-		    pet_offline_cpu(cpu_id);
-		    
-		    if (pet_cpu_status(cpu_id) != PET_CPU_OFFLINE) {
-			state      = CPU_ALLOCATED;
-			enclave_id = HOBBES_MASTER_ENCLAVE_ID;
-			break;
-		    }
-		    
-		    free_cpus++;
-		    state = CPU_FREE;
-		    
-		    break;
-		}	
-		case PET_CPU_RSVD:
-		    state      = CPU_ALLOCATED;
-		    enclave_id = HOBBES_MASTER_ENCLAVE_ID;
-		    logical_id = cpu_arr[i].cpu_id;
-		    break;
-		case PET_CPU_OFFLINE:
-		case PET_CPU_INVALID:
-		default: 
-		    state = CPU_INVALID;
-		    break;
+	    if (state == CPU_FREE) {
+		free_cpus++;
 	    }
 	    
 	    ret = hdb_register_cpu(db, 
 			cpu_arr[i].cpu_id, 
 			cpu_arr[i].apic_id, 
+			core_id,
 			cpu_arr[i].numa_node, 
 			state, 
 			enclave_id,
-			logical_id); /* Logical id = cpu id in the master */
+			logical_id);
 	    
 	    if (ret == -1) {
 		ERROR("Error registering CPU with database\n");
@@ -798,31 +1005,10 @@ populate_system_info(hdb_db_t db)
 	    mem_state_t state      = MEMORY_INVALID;
 	    hobbes_id_t enclave_id = HOBBES_INVALID_ID;
 
-	    switch (blk_arr[i].state) {
-		case PET_BLOCK_ONLINE: {
-		    int blk_index = blk_arr[i].base_addr / pet_block_size();
-		    
-		    if (pet_offline_block(blk_index) != 0) {
-		  	state      = MEMORY_ALLOCATED;
-			enclave_id = HOBBES_MASTER_ENCLAVE_ID;
-			break;
-		    }
-		    
-		    free_blks++;
-		    state      = MEMORY_FREE;
-		    
-		    break;
-		}
+	    claim_block(&(blk_arr[i]), &state, &enclave_id);
 
-		case PET_BLOCK_RSVD: 
-		    state      = MEMORY_ALLOCATED;
-		    enclave_id = HOBBES_MASTER_ENCLAVE_ID;
-		    break;
-		case PET_BLOCK_OFFLINE:
-		case PET_BLOCK_INVALID:
-		default: 
-		    state = MEMORY_INVALID;
-		    break;
+	    if (state == MEMORY_FREE) {
+		free_blks++;
 	    }
 
 	    ret = hdb_register_memory(db, 
@@ -847,3 +1033,363 @@ populate_system_info(hdb_db_t db)
     return 0;
 
 }
+
+
+static int
+__cmp_cpu_info(const void * a,
+	       const void * b)
+{
+    uint32_t id_a = ((struct hobbes_cpu_info *)a)->cpu_id;
+    uint32_t id_b = ((struct hobbes_cpu_info *)b)->cpu_id;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+static int
+__cmp_mem_info(const void * a,
+	       const void * b)
+{
+    uintptr_t addr_a = ((struct hobbes_memory_info *)a)->base_addr;
+    uintptr_t addr_b = ((struct hobbes_memory_info *)b)->base_addr;
+
+    return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+static struct hobbes_cpu_info *
+__find_ckpt_cpu(struct hobbes_cpu_info * ckpt_cpus,
+		uint32_t                 num_cpus,
+		uint32_t                 cpu_id)
+{
+    struct hobbes_cpu_info key = {.cpu_id = cpu_id};
+
+    return bsearch(&key, ckpt_cpus, num_cpus, sizeof(struct hobbes_cpu_info), __cmp_cpu_info);
+}
+
+static struct hobbes_memory_info *
+__find_ckpt_blk(struct hobbes_memory_info * ckpt_blks,
+		uint64_t                    num_blks,
+		uintptr_t                   base_addr)
+{
+    struct hobbes_memory_info key = {.base_addr = base_addr};
+
+    return bsearch(&key, ckpt_blks, num_blks, sizeof(struct hobbes_memory_info), __cmp_mem_info);
+}
+
+/* 
+ * A checkpoint is only usable if it describes exactly the hardware we are running on, 
+ * and only with states that reconcile_*() knows how to bring up to date
+ */
+static int
+validate_checkpoint(hdb_db_t                    db,
+		    struct pet_cpu            * cpu_arr,
+		    uint32_t                    num_cpus,
+		    struct hobbes_cpu_info    * ckpt_cpus,
+		    struct mem_block          * blk_arr,
+		    uint32_t                    num_blks,
+		    struct hobbes_memory_info * ckpt_blks)
+{
+    uint32_t numa_cnt = pet_num_numa_nodes();
+    uint64_t blk_size = pet_block_size();
+    uint32_t i        = 0;
+
+    if ((hdb_get_sys_numa_cnt(db) != numa_cnt) ||
+	(hdb_get_sys_blk_size(db) != blk_size)) {
+	printf("Checkpoint NUMA/block layout does not match the system\n");
+	return -1;
+    }
+
+    for (i = 0; i < num_cpus; i++) {
+	struct hobbes_cpu_info * ckpt   = __find_ckpt_cpu(ckpt_cpus, num_cpus, cpu_arr[i].cpu_id);
+	int                      usable = ((cpu_arr[i].state == PET_CPU_ONLINE) || 
+					   (cpu_arr[i].state == PET_CPU_RSVD));
+
+	if ((ckpt                  == NULL)                    ||
+	    (ckpt->apic_id         != cpu_arr[i].apic_id)      ||
+	    (ckpt->numa_node       != cpu_arr[i].numa_node)    ||
+	    ((ckpt->state != CPU_INVALID) != usable)           ||
+	    ((ckpt->state != CPU_INVALID) && 
+	     (ckpt->state != CPU_FREE)    && 
+	     (ckpt->state != CPU_ALLOCATED))) {
+	    printf("Checkpoint does not match CPU %u\n", cpu_arr[i].cpu_id);
+	    return -1;
+	}
+    }
+
+    for (i = 0; i < num_blks; i++) {
+	struct hobbes_memory_info * ckpt   = __find_ckpt_blk(ckpt_blks, num_blks, blk_arr[i].base_addr);
+	int                         usable = ((blk_arr[i].state == PET_BLOCK_ONLINE) || 
+					      (blk_arr[i].state == PET_BLOCK_RSVD));
+
+	if ((ckpt                  == NULL)                              ||
+	    (ckpt->size_in_bytes   != blk_arr[i].pages * PAGE_SIZE)      ||
+	    (ckpt->numa_node       != blk_arr[i].numa_node)              ||
+	    ((ckpt->state != MEMORY_INVALID) != usable)                  ||
+	    ((ckpt->state != MEMORY_INVALID) && 
+	     (ckpt->state != MEMORY_FREE)    && 
+	     (ckpt->state != MEMORY_ALLOCATED))) {
+	    printf("Checkpoint does not match memory block %p\n", (void *)blk_arr[i].base_addr);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/* 
+ * Bring a checkpointed CPU up to date with the state it was just claimed in.
+ * No enclave outlives the master, so anything it recorded as held by one is free again.
+ */
+static int
+reconcile_cpu(hdb_db_t                 db,
+	      struct hobbes_cpu_info * ckpt,
+	      cpu_state_t              state,
+	      hobbes_id_t              enclave_id,
+	      uint32_t                 logical_id)
+{
+    if ((ckpt->state      != state) || 
+	(ckpt->enclave_id != enclave_id)) {
+
+	if ((ckpt->state == CPU_ALLOCATED) &&
+	    (hdb_free_cpu(db, ckpt->cpu_id) != 0)) {
+	    return -1;
+	}
+
+	if ((state == CPU_ALLOCATED) &&
+	    (hdb_alloc_cpu(db, ckpt->cpu_id, HOBBES_ANY_NUMA_ID, enclave_id) != ckpt->cpu_id)) {
+	    return -1;
+	}
+    }
+
+    if ((state == CPU_ALLOCATED) &&
+	(hdb_get_cpu_enclave_logical_id(db, ckpt->cpu_id) != logical_id)) {
+	return hdb_set_cpu_enclave_logical_id(db, ckpt->cpu_id, logical_id);
+    }
+
+    return 0;
+}
+
+static int
+reconcile_block(hdb_db_t                    db,
+		struct hobbes_memory_info * ckpt,
+		mem_state_t                 state,
+		hobbes_id_t                 enclave_id)
+{
+    if ((ckpt->state      == state) && 
+	(ckpt->enclave_id == enclave_id)) {
+	return 0;
+    }
+
+    if ((ckpt->state == MEMORY_ALLOCATED) &&
+	(hdb_free_block(db, ckpt->base_addr, 1) != 0)) {
+	return -1;
+    }
+
+    if ((state == MEMORY_ALLOCATED) &&
+	(hdb_alloc_block_addr(db, enclave_id, 1, ckpt->base_addr) != 0)) {
+	return -1;
+    }
+
+    return 0;
+}
+
+/* 
+ * Warm start: load the system resource state from the checkpoint, instead of registering 
+ * every CPU and memory block again. Nothing is taken from Linux until the checkpoint has 
+ * been validated, so on failure (-1) the caller can fall back to a cold start.
+ */
+static int
+restore_system_info(hdb_db_t db)
+{
+    struct pet_cpu            * cpu_arr   = NULL;
+    struct mem_block          * blk_arr   = NULL;
+    struct hobbes_cpu_info    * ckpt_cpus = NULL;
+    struct hobbes_memory_info * ckpt_blks = NULL;
+
+    uint32_t num_cpus      = 0;
+    uint32_t num_blks      = 0;
+    uint32_t ckpt_cpu_cnt  = 0;
+    uint64_t ckpt_blk_cnt  = 0;
+    uint32_t free_cpus     = 0;
+    uint32_t free_blks     = 0;
+    uint32_t errors        = 0;
+    uint32_t i             = 0;
+
+    int ret = -1;
+
+    if (access(ckpt_file, R_OK) != 0) {
+	printf("No system resource checkpoint found (%s)\n", ckpt_file);
+	return -1;
+    }
+
+    printf("Restoring Leviathan resources from checkpoint (%s)\n", ckpt_file);
+
+    if (hdb_restore(hdb_get_partition(db, HDB_PART_SYSTEM), HDB_PART_SYSTEM, ckpt_file) != 0) {
+	ERROR("Could not restore system resource checkpoint\n");
+	return -1;
+    }
+
+    if ((pet_probe_cpus(&num_cpus, &cpu_arr) != 0) ||
+	(pet_probe_mem(&num_blks, &blk_arr)  != 0)) {
+	ERROR("Could not probe system resources\n");
+	goto out;
+    }
+
+    ckpt_cpus = calloc(num_cpus + 1, sizeof(struct hobbes_cpu_info));
+    ckpt_blks = calloc(num_blks + 1, sizeof(struct hobbes_memory_info));
+
+    if ((ckpt_cpus == NULL) || (ckpt_blks == NULL)) {
+	ERROR("Could not allocate checkpoint state\n");
+	goto out;
+    }
+
+    /* Block snapshots are already in address order */
+    if ((hdb_snapshot_cpus(db, ckpt_cpus, num_cpus, &ckpt_cpu_cnt)                          != 0) ||
+	(hdb_snapshot_mem_blocks(db, HOBBES_INVALID_ID, ckpt_blks, num_blks, &ckpt_blk_cnt) != 0)) {
+	ERROR("Could not read checkpointed resources\n");
+	goto out;
+    }
+
+    if ((ckpt_cpu_cnt != num_cpus) || 
+	(ckpt_blk_cnt != num_blks)) {
+	printf("Checkpoint has %u CPUs and %lu memory blocks, the system has %u CPUs and %u memory blocks\n",
+	       ckpt_cpu_cnt, ckpt_blk_cnt, num_cpus, num_blks);
+	goto out;
+    }
+
+    qsort(ckpt_cpus, num_cpus, sizeof(struct hobbes_cpu_info), __cmp_cpu_info);
+
+    if (validate_checkpoint(db, cpu_arr, num_cpus, ckpt_cpus, blk_arr, num_blks, ckpt_blks) != 0) {
+	goto out;
+    }
+
+    /* The checkpoint is usable: claim the resources and bring their records up to date */
+    for (i = 0; i < num_cpus; i++) {
+	cpu_state_t state      = CPU_INVALID;
+	hobbes_id_t enclave_id = HOBBES_INVALID_ID;
+	uint32_t    logical_id = HOBBES_INVALID_CPU_ID;
+
+	claim_cpu(&(cpu_arr[i]), &state, &enclave_id, &logical_id);
+
+	if (state == CPU_FREE) {
+	    free_cpus++;
+	}
+
+	if (reconcile_cpu(db, __find_ckpt_cpu(ckpt_cpus, num_cpus, cpu_arr[i].cpu_id), 
+			  state, enclave_id, logical_id) != 0) {
+	    ERROR("Could not update CPU %u from checkpoint\n", cpu_arr[i].cpu_id);
+	    errors++;
+	}
+    }
+
+    for (i = 0; i < num_blks; i++) {
+	mem_state_t state      = MEMORY_INVALID;
+	hobbes_id_t enclave_id = HOBBES_INVALID_ID;
+
+	claim_block(&(blk_arr[i]), &state, &enclave_id);
+
+	if (state == MEMORY_FREE) {
+	    free_blks++;
+	}
+
+	if (reconcile_block(db, __find_ckpt_blk(ckpt_blks, num_blks, blk_arr[i].base_addr), 
+			    state, enclave_id) != 0) {
+	    ERROR("Could not update memory block %p from checkpoint\n", (void *)blk_arr[i].base_addr);
+	    errors++;
+	}
+    }
+
+    if (errors > 0) {
+	ERROR("%u resources could not be updated from the checkpoint\n", errors);
+    }
+
+    printf("Restored %u CPUs (%u free) and %u memory blocks (%u free) with Leviathan\n", 
+	   num_cpus, free_cpus, num_blks, free_blks);
+
+    ret = 0;
+
+ out:
+    free(cpu_arr);
+    free(blk_arr);
+    free(ckpt_cpus);
+    free(ckpt_blks);
+
+    return ret;
+}
+
+
+/* 
+ * Checkpoints are skipped when the system resources have not changed since the last one
+ */
+static int
+checkpoint_system_info(void)
+{
+    hdb_db_t sys_db     = hdb_get_partition(hobbes_master_db, HDB_PART_SYSTEM);
+    uint64_t generation = hdb_get_generation(sys_db);
+
+    if ((generation != 0) && 
+	(generation == ckpt_generation)) {
+	return 0;
+    }
+
+    if (hdb_checkpoint(sys_db, ckpt_file) != 0) {
+	ERROR("Could not checkpoint system resources (%s)\n", ckpt_file);
+	return -1;
+    }
+
+    ckpt_generation = generation;
+
+    return 0;
+}
+
+static int
+checkpoint_timer_handler(int    fd,
+			 void * priv_data)
+{
+    uint64_t expirations = 0;
+
+    if (read(fd, &expirations, sizeof(uint64_t)) != sizeof(uint64_t)) {
+	ERROR("Could not read checkpoint timer\n");
+	return -1;
+    }
+
+    checkpoint_system_info();
+
+    return 0;
+}
+
+int
+master_init_checkpoints(void)
+{
+    struct itimerspec timer;
+    int               fd = -1;
+
+    /* Always start from a fresh checkpoint of the state we booted with */
+    if (checkpoint_system_info() != 0) {
+	return -1;
+    }
+
+    if (ckpt_interval == 0) {
+	return 0;
+    }
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+    if (fd == -1) {
+	ERROR("Could not create checkpoint timer\n");
+	return -1;
+    }
+
+    memset(&timer, 0, sizeof(struct itimerspec));
+
+    timer.it_value.tv_sec    = ckpt_interval;
+    timer.it_interval.tv_sec = ckpt_interval;
+
+    if ((timerfd_settime(fd, 0, &timer, NULL)                != 0) ||
+	(add_fd_handler(fd, checkpoint_timer_handler, NULL) != 0)) {
+	ERROR("Could not start checkpoint timer\n");
+	close(fd);
+	return -1;
+    }
+
+    return 0;
+}
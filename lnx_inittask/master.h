@@ -8,4 +8,6 @@
 int master_init(int argc, char ** argv);
 int master_exit(void);
 
+int master_init_checkpoints(void);
+
 #endif
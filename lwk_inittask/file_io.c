@@ -212,7 +212,13 @@ file_read_handler(hcq_handle_t hcq,
 
     fd = req->file_handle;
 
-    dst_buf = (uint8_t *)calloc(req->data_size, 1);
+    /* Read straight into the command's return buffer */
+    dst_buf = (uint8_t *)hcq_ret_reserve(hcq, cmd, req->data_size);
+
+    if (dst_buf == NULL) {
+	ERROR("Could not reserve return buffer for read request\n");
+	goto out;
+    }
 
     {
 	ssize_t left_to_read = req->data_size;
@@ -231,10 +237,11 @@ file_read_handler(hcq_handle_t hcq,
     
     ret = total_read;
 
- out:
-    hcq_cmd_return(hcq, cmd, ret, total_read, dst_buf);
+    hcq_ret_commit(hcq, cmd, ret, total_read);
+    return 0;
 
-    if (dst_buf != NULL) free(dst_buf);
+ out:
+    hcq_cmd_return(hcq, cmd, ret, 0, NULL);
     return 0;
 }
 
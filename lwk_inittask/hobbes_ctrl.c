@@ -26,28 +26,34 @@ static hcq_handle_t hcq = HCQ_INVALID_HANDLE;
 
 extern int exit_leviathan;
 
+/* Maximum number of commands drained from the queue per wakeup */
+#define HOBBES_CMD_BATCH 32
+
 static int 
 __handle_cmd(int    fd, 
 	     void * priv_data)
 {
     hcq_handle_t  hcq      = (hcq_handle_t)priv_data;
-    hcq_cmd_fn    handler  = NULL;
-    hcq_cmd_t     cmd      = hcq_get_next_cmd(hcq);
+    hcq_cmd_t     cmds[HOBBES_CMD_BATCH];
+    int           cmd_cnt  = 0;
+    int           ret      = 0;
+    int           i        = 0;
+
+    /* A batched submission signals once for all of its commands, so take as many as are queued */
+    cmd_cnt = hcq_get_next_cmds(hcq, HOBBES_CMD_BATCH, cmds);
 
-    if (cmd == HCQ_INVALID_CMD) {
+    if (cmd_cnt <= 0) {
 	ERROR("Received invalid command\n");
 	return -1;
     }
 
-    handler  = hcq_get_cmd_handler(hcq, cmd);
-    
-    if (handler == NULL) {
-	ERROR("Received invalid Hobbes command (%lu)\n", hcq_get_cmd_code(hcq, cmd));
-	hcq_cmd_return(hcq, cmd, -1, 0, NULL);
-	return -1;;
+    for (i = 0; i < cmd_cnt; i++) {
+	if (hcq_dispatch_cmd(hcq, cmds[i]) != 0) {
+	    ret = -1;
+	}
     }
-    
-    return handler(hcq, cmd);
+
+    return ret;
 }
 
 
@@ -58,6 +64,13 @@ hobbes_register_cmd(uint64_t        cmd,
     return hcq_register_cmd(hcq, cmd, handler_fn);
 }
 
+int
+hobbes_register_parallel_cmd(uint64_t      cmd,
+			     hobbes_cmd_fn handler_fn)
+{
+    return hcq_register_cmd_ext(hcq, cmd, handler_fn, HCQ_CMD_PARALLEL);
+}
+
 
 static int
 __shutdown(hcq_handle_t hcq,
@@ -506,18 +519,30 @@ hobbes_init(void)
     hobbes_register_cmd(HOBBES_CMD_APP_LAUNCH, __launch_app);
     hobbes_register_cmd(HOBBES_CMD_APP_KILL,   __kill_app);
     hobbes_register_cmd(HOBBES_CMD_LOAD_FILE,  __load_file);
-    hobbes_register_cmd(HOBBES_CMD_PING,       __ping);
     hobbes_register_cmd(HOBBES_CMD_ADD_CPU,    __add_cpu);
     hobbes_register_cmd(HOBBES_CMD_ADD_MEM,    __add_memory);
     hobbes_register_cmd(HOBBES_CMD_REMOVE_MEM, __remove_memory);
-    hobbes_register_cmd(HOBBES_CMD_FILE_OPEN,  file_open_handler);
-    hobbes_register_cmd(HOBBES_CMD_FILE_CLOSE, file_close_handler);
-    hobbes_register_cmd(HOBBES_CMD_FILE_READ,  file_read_handler);
-    hobbes_register_cmd(HOBBES_CMD_FILE_WRITE, file_write_handler);
-    hobbes_register_cmd(HOBBES_CMD_FILE_STAT,  file_stat_handler);
-    hobbes_register_cmd(HOBBES_CMD_FILE_FSTAT, file_fstat_handler);
+
+    /* Handlers that are safe to run concurrently with other commands */
+    hobbes_register_parallel_cmd(HOBBES_CMD_PING,       __ping);
+    hobbes_register_parallel_cmd(HOBBES_CMD_FILE_OPEN,  file_open_handler);
+    hobbes_register_parallel_cmd(HOBBES_CMD_FILE_CLOSE, file_close_handler);
+    hobbes_register_parallel_cmd(HOBBES_CMD_FILE_READ,  file_read_handler);
+    hobbes_register_parallel_cmd(HOBBES_CMD_FILE_WRITE, file_write_handler);
+    hobbes_register_parallel_cmd(HOBBES_CMD_FILE_STAT,  file_stat_handler);
+    hobbes_register_parallel_cmd(HOBBES_CMD_FILE_FSTAT, file_fstat_handler);
+
+    /* Control commands are served ahead of queued file I/O and app launches */
+    hcq_set_cmd_priority(hcq, HOBBES_CMD_SHUTDOWN, HCQ_PRIO_HIGH);
+    hcq_set_cmd_priority(hcq, HOBBES_CMD_APP_KILL, HCQ_PRIO_HIGH);
+    hcq_set_cmd_priority(hcq, HOBBES_CMD_PING,     HCQ_PRIO_HIGH);
 
     
+    /* Optionally hand commands to a worker pool, so slow handlers do not block the rest */
+    if (hcq_start_workers(hcq, smart_atou32(0, getenv(HCQ_ENV_WORKERS))) != 0) {
+	ERROR("Could not start command workers, handling commands inline\n");
+    }
+
     /* Get File descriptor */    
     hcq_fd = hcq_get_fd(hcq);
     
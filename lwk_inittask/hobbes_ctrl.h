@@ -19,6 +19,9 @@ void hobbes_exit( void );
 
 int hobbes_register_cmd(uint64_t cmd, hobbes_cmd_fn handler);
 
+/* Parallel handlers may run concurrently with other commands when workers are enabled */
+int hobbes_register_parallel_cmd(uint64_t cmd, hobbes_cmd_fn handler);
+
 
 
 
@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <getopt.h>
+#include <time.h>
 
 #include <hobbes_db.h>
 #include <hobbes_file.h>
@@ -200,8 +201,16 @@ ping_enclave_main(int argc, char ** argv)
     if (do_walk == 0) {
 	hobbes_ping_enclave(enclave_id, size_in_bytes);
     } else {
+	uint32_t size = 0;
+
 	// walk from 1 byte to 1MB
+	for (size = 1; size <= (1024 * 1024); size <<= 1) {
+	    printf("Ping size: %u bytes\n", size);
 
+	    if (hobbes_ping_enclave(enclave_id, size) != 0) {
+		break;
+	    }
+	}
     }
 
     return 0;
@@ -402,6 +411,189 @@ dump_cmd_queue_main(int argc, char ** argv)
     return 0;
 }
 
+/* TSC cycles per microsecond, measured against the monotonic clock */
+static double
+__tsc_per_usec(void)
+{
+    struct timespec start_ts;
+    struct timespec end_ts;
+    uint64_t        start_tsc = 0;
+    uint64_t        end_tsc   = 0;
+    uint64_t        nsecs     = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+    start_tsc = __builtin_ia32_rdtsc();
+
+    usleep(50000);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_ts);
+    end_tsc = __builtin_ia32_rdtsc();
+
+    nsecs = ((end_ts.tv_sec - start_ts.tv_sec) * 1000000000ULL) + end_ts.tv_nsec - start_ts.tv_nsec;
+
+    return ((double)(end_tsc - start_tsc) * 1000.0) / nsecs;
+}
+
+/* Upper bound (in usecs) of the histogram bucket holding the given percentile */
+static double
+__hist_percentile(uint64_t * hist,
+		  double     pct,
+		  double     tsc_per_usec)
+{
+    uint64_t total = 0;
+    uint64_t count = 0;
+    int      i     = 0;
+
+    for (i = 0; i < HCQ_STATS_HIST_BUCKETS; i++) {
+	total += hist[i];
+    }
+
+    if (total == 0) {
+	return 0;
+    }
+
+    for (i = 0; i < HCQ_STATS_HIST_BUCKETS - 1; i++) {
+	count += hist[i];
+
+	if (count >= (total * pct)) {
+	    break;
+	}
+    }
+
+    return (double)(2ULL << i) / tsc_per_usec;
+}
+
+static void
+__print_hcq_stats(struct hcq_stats * stats,
+		  struct hcq_stats * prev,
+		  double             tsc_per_usec)
+{
+    int i = 0;
+
+    printf("Issued: %lu  Completed: %lu  Abandoned: %lu  Expired: %lu  Depth: %lu  Max Depth: %lu\n",
+	   stats->issued, stats->completed, stats->abandoned, stats->expired,
+	   stats->depth, stats->max_depth);
+
+    if (prev) {
+	printf("Interval: %lu issued, %lu completed\n",
+	       stats->issued    - prev->issued,
+	       stats->completed - prev->completed);
+    }
+
+    printf("-------------------------------------------------------------------------------------\n");
+    printf("| CMD Code         | Returned   | Wait p50   | Wait p99   | Svc p50    | Svc p99    |\n");
+    printf("-------------------------------------------------------------------------------------\n");
+
+    for (i = 0; i < HCQ_STATS_MAX_CODES; i++) {
+	struct hcq_code_stats * code = &(stats->codes[i]);
+
+	if ((code->cmd_code == HCQ_STATS_UNUSED_CODE) ||
+	    ((code->cmd_code == HCQ_STATS_OTHER_CODES) && (code->returned == 0))) {
+	    continue;
+	}
+
+	if (code->cmd_code == HCQ_STATS_OTHER_CODES) {
+	    printf("| %-16s ", "(other)");
+	} else {
+	    printf("| 0x%-14lx ", code->cmd_code);
+	}
+
+	/* Percentiles are bucket upper bounds, so they are accurate to within 2x */
+	printf("| %-10lu | %8.1fus | %8.1fus | %8.1fus | %8.1fus |\n",
+	       code->returned,
+	       __hist_percentile(code->wait_hist,    0.50, tsc_per_usec),
+	       __hist_percentile(code->wait_hist,    0.99, tsc_per_usec),
+	       __hist_percentile(code->service_hist, 0.50, tsc_per_usec),
+	       __hist_percentile(code->service_hist, 0.99, tsc_per_usec));
+    }
+}
+
+static void
+hcq_stats_usage(void)
+{
+    printf("Usage: hobbes hcq_stats [options] <enclave name>\n"			\
+	   " [-i, --interval=<secs>] : Refresh the statistics every <secs> seconds\n");
+}
+
+int
+hcq_stats_main(int argc, char ** argv)
+{
+    hobbes_id_t      enclave_id   = HOBBES_INVALID_ID;
+    hcq_handle_t     hcq          = HCQ_INVALID_HANDLE;
+    uint32_t         interval     = 0;
+    double           tsc_per_usec = 0;
+    struct hcq_stats stats;
+    struct hcq_stats prev;
+
+    {
+	char c = 0;
+	int  opt_index = 0;
+
+	struct option long_options[] = {
+	    {"interval", required_argument, 0, 'i'},
+	    {0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "i:", long_options, &opt_index)) != -1) {
+	    switch (c) {
+		case 'i':
+		    interval = smart_atou32(interval, optarg);
+		    break;
+		case '?':
+		default:
+		    hcq_stats_usage();
+		    return -1;
+	    }
+	}
+
+	if (optind + 1 != argc) {
+	    hcq_stats_usage();
+	    return -1;
+	}
+    }
+
+    enclave_id = hobbes_get_enclave_id(argv[optind]);
+
+    if (enclave_id == HOBBES_INVALID_ID) {
+	printf("Invalid Enclave\n");
+	return -1;
+    }
+
+    hcq = hobbes_open_enclave_cmdq(enclave_id);
+
+    if (hcq == HCQ_INVALID_HANDLE) {
+	ERROR("Could not open command queue for enclave (%s)\n", argv[optind]);
+	return -1;
+    }
+
+    tsc_per_usec = __tsc_per_usec();
+
+    if (hcq_get_stats(hcq, &stats) != 0) {
+	ERROR("Could not read command queue statistics\n");
+	hobbes_close_enclave_cmdq(hcq);
+	return -1;
+    }
+
+    __print_hcq_stats(&stats, NULL, tsc_per_usec);
+
+    while (interval > 0) {
+	prev = stats;
+
+	sleep(interval);
+
+	if (hcq_get_stats(hcq, &stats) != 0) {
+	    break;
+	}
+
+	printf("\n");
+	__print_hcq_stats(&stats, &prev, tsc_per_usec);
+    }
+
+    hobbes_close_enclave_cmdq(hcq);
+
+    return 0;
+}
+
 int
 list_enclaves_main(int argc, char ** argv)
 {
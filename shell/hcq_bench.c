@@ -0,0 +1,859 @@
+/* Hobbes command queue benchmarks
+ * (c) 2015, Jack Lange <jacklange@cs.pitt.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pet_log.h>
+
+#include <hobbes.h>
+#include <hobbes_cmd_queue.h>
+#include <hobbes_enclave.h>
+#include <hobbes_util.h>
+
+
+#define BENCH_CMD_ECHO 1
+
+
+struct bench_server {
+    hcq_handle_t   hcq;
+    pthread_t      thread;
+    volatile int   stop;
+};
+
+
+static uint64_t
+__now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+
+/* Local HCQ server: echoes the command data back to the client */
+static int
+__echo_handler(hcq_handle_t hcq,
+	       hcq_cmd_t    cmd)
+{
+    void     * data      = NULL;
+    uint32_t   data_size = 0;
+
+    data = hcq_get_cmd_data(hcq, cmd, &data_size);
+
+    return hcq_cmd_return(hcq, cmd, 0, data_size, data);
+}
+
+static void *
+__server_thread(void * arg)
+{
+    struct bench_server * server = arg;
+    struct pollfd         ufd    = {hcq_get_fd(server->hcq), POLLIN, 0};
+
+    while (server->stop == 0) {
+	hcq_cmd_t cmd = HCQ_INVALID_CMD;
+
+	if (poll(&ufd, 1, 100) <= 0) {
+	    continue;
+	}
+
+	cmd = hcq_get_next_cmd(server->hcq);
+
+	if (cmd == HCQ_INVALID_CMD) {
+	    continue;
+	}
+
+	hcq_dispatch_cmd(server->hcq, cmd);
+    }
+
+    return NULL;
+}
+
+/* A queue_size of 0 takes the size from HCQ_QUEUE_SIZE, like hcq_create_queue() */
+static int
+__start_server(struct bench_server * server,
+	       hcq_backend_t         backend,
+	       uint32_t              num_workers,
+	       uint64_t              queue_size)
+{
+    memset(server, 0, sizeof(struct bench_server));
+
+    if (queue_size == 0) {
+	server->hcq = hcq_create_queue_ext("hcq-bench", backend);
+    } else {
+	server->hcq = hcq_create_queue_sized("hcq-bench", backend, queue_size);
+    }
+
+    if (server->hcq == HCQ_INVALID_HANDLE) {
+	ERROR("Could not create benchmark command queue\n");
+	return -1;
+    }
+
+    if ((hcq_register_cmd_ext(server->hcq, BENCH_CMD_ECHO, __echo_handler, HCQ_CMD_PARALLEL) != 0) ||
+	(hcq_start_workers(server->hcq, num_workers) != 0)) {
+	ERROR("Could not set up benchmark command handlers\n");
+	hcq_free_queue(server->hcq);
+	return -1;
+    }
+
+    if (pthread_create(&(server->thread), NULL, __server_thread, server) != 0) {
+	ERROR("Could not start benchmark server thread\n");
+	hcq_free_queue(server->hcq);
+	return -1;
+    }
+
+    return 0;
+}
+
+static void
+__stop_server(struct bench_server * server)
+{
+    server->stop = 1;
+    pthread_join(server->thread, NULL);
+
+    hcq_free_queue(server->hcq);
+}
+
+
+static hcq_backend_t
+__parse_backend(char * str)
+{
+    if (strcmp(str, "ring") == 0) {
+	return HCQ_BACKEND_RING;
+    }
+
+    return HCQ_BACKEND_DB;
+}
+
+
+
+/*
+ * Lookup cost vs. queue occupancy:
+ *   Leaves an increasing number of returned but uncompleted commands in the queue,
+ *   and times the per-command accessors and a full round trip at each level.
+ */
+
+static void
+__lookup_usage(void)
+{
+    printf("Usage: hobbes hcq_lookup_bench [options]\n"						\
+	   " [-b, --backend=<db|ring>]   : Command queue backend (default: db)\n"		\
+	   " [-o, --occupancy=<count>]   : Maximum number of outstanding commands (default: 1024)\n"	\
+	   " [-n, --iterations=<count>]  : Iterations per occupancy level (default: 10000)\n"	\
+	   );
+}
+
+int
+hcq_lookup_bench_main(int argc, char ** argv)
+{
+    struct bench_server server;
+
+    hcq_backend_t   backend       = HCQ_BACKEND_DB;
+    uint32_t        max_occupancy = 1024;
+    uint32_t        iterations    = 10000;
+    hcq_handle_t    hcq           = HCQ_INVALID_HANDLE;
+    hcq_cmd_t     * leaked        = NULL;
+    uint32_t        occupancy     = 0;
+    uint32_t        level         = 0;
+    uint32_t        i             = 0;
+
+    {
+	int  opt_idx = 0;
+	char c       = 0;
+
+	opterr = 1;
+
+	static struct option long_options[] = {
+	    {"backend",    required_argument, 0, 'b'},
+	    {"occupancy",  required_argument, 0, 'o'},
+	    {"iterations", required_argument, 0, 'n'},
+	    {0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "b:o:n:", long_options, &opt_idx)) != -1) {
+	    switch (c) {
+		case 'b':
+		    backend = __parse_backend(optarg);
+		    break;
+		case 'o':
+		    max_occupancy = smart_atou32(max_occupancy, optarg);
+		    break;
+		case 'n':
+		    iterations = smart_atou32(iterations, optarg);
+		    break;
+		default:
+		    __lookup_usage();
+		    return -1;
+	    }
+	}
+    }
+
+    if (iterations == 0) {
+	__lookup_usage();
+	return -1;
+    }
+
+    leaked = calloc(sizeof(hcq_cmd_t), max_occupancy + 1);
+
+    if (leaked == NULL) {
+	ERROR("Could not allocate command array\n");
+	return -1;
+    }
+
+    if (__start_server(&server, backend, 0, 0) != 0) {
+	free(leaked);
+	return -1;
+    }
+
+    hcq = hcq_connect(hcq_get_segid(server.hcq));
+
+    if (hcq == HCQ_INVALID_HANDLE) {
+	ERROR("Could not connect to benchmark command queue\n");
+	goto out;
+    }
+
+    printf("HCQ lookup benchmark (%s backend, %u iterations per level)\n",
+	   (backend == HCQ_BACKEND_RING) ? "ring" : "db", iterations);
+    printf("----------------------------------------------------------\n");
+    printf("| Outstanding | Lookup (ns/call) | Round trip (us/cmd)   |\n");
+    printf("----------------------------------------------------------\n");
+
+    for (level = 0; level <= max_occupancy; level = (level == 0) ? 1 : level * 4) {
+	hcq_cmd_t cmd        = HCQ_INVALID_CMD;
+	uint64_t  start      = 0;
+	uint64_t  lookup_ns  = 0;
+	uint64_t  rt_ns      = 0;
+
+	/* Grow the number of abandoned commands up to this level */
+	while (occupancy < level) {
+	    leaked[occupancy] = hcq_cmd_issue(hcq, BENCH_CMD_ECHO, 0, NULL);
+
+	    if (leaked[occupancy] == HCQ_INVALID_CMD) {
+		break;
+	    }
+
+	    occupancy++;
+	}
+
+	if (occupancy < level) {
+	    printf("| Queue full at %u outstanding commands                  |\n", occupancy);
+	    break;
+	}
+
+	cmd = hcq_cmd_issue(hcq, BENCH_CMD_ECHO, 0, NULL);
+
+	if (cmd == HCQ_INVALID_CMD) {
+	    ERROR("Could not issue benchmark command\n");
+	    break;
+	}
+
+	start = __now_ns();
+	for (i = 0; i < iterations; i++) {
+	    hcq_get_ret_code(hcq, cmd);
+	}
+	lookup_ns = (__now_ns() - start) / iterations;
+
+	hcq_cmd_complete(hcq, cmd);
+
+	start = __now_ns();
+	for (i = 0; i < iterations; i++) {
+	    uint32_t ret_size = 0;
+
+	    cmd = hcq_cmd_issue(hcq, BENCH_CMD_ECHO, 0, NULL);
+
+	    if (cmd == HCQ_INVALID_CMD) {
+		break;
+	    }
+
+	    hcq_get_ret_code(hcq, cmd);
+	    hcq_get_ret_data(hcq, cmd, &ret_size);
+	    hcq_cmd_complete(hcq, cmd);
+	}
+	rt_ns = (__now_ns() - start) / iterations;
+
+	printf("| %11u | %16lu | %21.2f |\n", level, lookup_ns, (double)rt_ns / 1000.0);
+    }
+
+    printf("----------------------------------------------------------\n");
+
+    for (i = 0; i < occupancy; i++) {
+	hcq_cmd_complete(hcq, leaked[i]);
+    }
+
+    hcq_disconnect(hcq);
+
+ out:
+    __stop_server(&server);
+    free(leaked);
+
+    return 0;
+}
+
+
+
+/*
+ * Round trip latency and throughput:
+ *   Concurrent clients issue echo commands (HOBBES_CMD_PING on an enclave, or a local
+ *   server) over a sweep of payload sizes, and report latency percentiles and the
+ *   aggregate command rate at each size.
+ */
+
+#define BENCH_WARMUP_ITERS 100
+
+struct bench_client {
+    pthread_t           thread;
+    pthread_barrier_t * barrier;
+
+    hcq_handle_t        hcq;
+    uint64_t            cmd_code;
+    uint32_t            data_size;
+    uint32_t            iterations;
+
+    uint8_t           * in;
+    uint8_t           * out;
+
+    uint64_t          * lat_ns;
+    uint64_t            start_ns;
+    uint64_t            end_ns;
+    uint32_t            errors;
+};
+
+static void *
+__client_thread(void * arg)
+{
+    struct bench_client * client = arg;
+    uint32_t              i      = 0;
+
+    for (i = 0; i < BENCH_WARMUP_ITERS; i++) {
+	hcq_call(client->hcq, client->cmd_code, client->in, client->data_size, 
+		 client->out, client->data_size, NULL);
+    }
+
+    pthread_barrier_wait(client->barrier);
+
+    client->start_ns = __now_ns();
+
+    for (i = 0; i < client->iterations; i++) {
+	uint64_t start    = __now_ns();
+	uint32_t out_len  = 0;
+	int64_t  ret      = 0;
+
+	ret = hcq_call(client->hcq, client->cmd_code, client->in, client->data_size, 
+		       client->out, client->data_size, &out_len);
+
+	client->lat_ns[i] = __now_ns() - start;
+
+	if ((ret != 0) || (out_len != client->data_size)) {
+	    client->errors++;
+	}
+    }
+
+    client->end_ns = __now_ns();
+
+    return NULL;
+}
+
+static int
+__cmp_u64(const void * a, 
+	  const void * b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+__percentile_us(uint64_t * sorted_ns,
+		uint64_t   count,
+		double     pct)
+{
+    return sorted_ns[(uint64_t)((count - 1) * pct)] / 1000.0;
+}
+
+static void
+__rt_usage(void)
+{
+    printf("Usage: hobbes hcq_bench [options]\n"								\
+	   " [-e, --enclave=<name>]      : Benchmark an enclave's command queue (default: local server)\n"	\
+	   " [-b, --backend=<db|ring>]   : Local server queue backend (default: db)\n"				\
+	   " [-w, --workers=<count>]     : Local server worker threads (default: 0)\n"				\
+	   " [-c, --clients=<count>]     : Concurrent clients (default: 1)\n"					\
+	   " [-n, --iterations=<count>]  : Commands per client at each size (default: 10000)\n"		\
+	   " [-s, --min-size=<bytes>]    : Smallest payload (default: 0)\n"					\
+	   " [-S, --max-size=<bytes>]    : Largest payload, sizes double from the smallest (default: 64KB)\n"	\
+	   );
+}
+
+int
+hcq_bench_main(int argc, char ** argv)
+{
+    struct bench_server   server;
+    struct bench_client * clients    = NULL;
+    pthread_barrier_t     barrier;
+
+    char          * enclave_name = NULL;
+    hobbes_id_t     enclave_id   = HOBBES_INVALID_ID;
+    hcq_backend_t   backend      = HCQ_BACKEND_DB;
+    uint64_t        cmd_code     = BENCH_CMD_ECHO;
+    uint32_t        num_workers  = 0;
+    uint32_t        num_clients  = 1;
+    uint32_t        iterations   = 10000;
+    uint32_t        min_size     = 0;
+    uint32_t        max_size     = 64 * 1024;
+    uint64_t      * all_ns       = NULL;
+    uint32_t        size         = 0;
+    uint32_t        i            = 0;
+    int             ret          = -1;
+
+    {
+	int  opt_idx = 0;
+	char c       = 0;
+
+	opterr = 1;
+
+	static struct option long_options[] = {
+	    {"enclave",    required_argument, 0, 'e'},
+	    {"backend",    required_argument, 0, 'b'},
+	    {"workers",    required_argument, 0, 'w'},
+	    {"clients",    required_argument, 0, 'c'},
+	    {"iterations", required_argument, 0, 'n'},
+	    {"min-size",   required_argument, 0, 's'},
+	    {"max-size",   required_argument, 0, 'S'},
+	    {0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "e:b:w:c:n:s:S:", long_options, &opt_idx)) != -1) {
+	    switch (c) {
+		case 'e':
+		    enclave_name = optarg;
+		    break;
+		case 'b':
+		    backend = __parse_backend(optarg);
+		    break;
+		case 'w':
+		    num_workers = smart_atou32(num_workers, optarg);
+		    break;
+		case 'c':
+		    num_clients = smart_atou32(num_clients, optarg);
+		    break;
+		case 'n':
+		    iterations = smart_atou32(iterations, optarg);
+		    break;
+		case 's':
+		    min_size = smart_atou32(min_size, optarg);
+		    break;
+		case 'S':
+		    max_size = smart_atou32(max_size, optarg);
+		    break;
+		default:
+		    __rt_usage();
+		    return -1;
+	    }
+	}
+    }
+
+    if ((iterations == 0) || (num_clients == 0) || (min_size > max_size)) {
+	__rt_usage();
+	return -1;
+    }
+
+    if (enclave_name != NULL) {
+	enclave_id = hobbes_get_enclave_id(enclave_name);
+
+	if (enclave_id == HOBBES_INVALID_ID) {
+	    ERROR("Invalid Enclave (%s)\n", enclave_name);
+	    return -1;
+	}
+
+	cmd_code = HOBBES_CMD_PING;
+    } else if (__start_server(&server, backend, num_workers, 0) != 0) {
+	return -1;
+    }
+
+    clients = calloc(sizeof(struct bench_client), num_clients);
+    all_ns  = calloc(sizeof(uint64_t), (uint64_t)num_clients * iterations);
+
+    if ((clients == NULL) || (all_ns == NULL)) {
+	ERROR("Could not allocate benchmark state\n");
+	goto out;
+    }
+
+    pthread_barrier_init(&barrier, NULL, num_clients);
+
+    for (i = 0; i < num_clients; i++) {
+	struct bench_client * client = &(clients[i]);
+
+	if (enclave_name != NULL) {
+	    client->hcq = hobbes_open_enclave_cmdq(enclave_id);
+	} else {
+	    client->hcq = hcq_connect(hcq_get_segid(server.hcq));
+	}
+
+	client->barrier    = &barrier;
+	client->cmd_code   = cmd_code;
+	client->iterations = iterations;
+	client->in         = calloc(1, max_size + 1);
+	client->out        = calloc(1, max_size + 1);
+	client->lat_ns     = calloc(sizeof(uint64_t), iterations);
+
+	if ((client->hcq    == HCQ_INVALID_HANDLE) || 
+	    (client->in     == NULL) || 
+	    (client->out    == NULL) ||
+	    (client->lat_ns == NULL)) {
+	    ERROR("Could not set up benchmark client %u\n", i);
+	    goto out_clients;
+	}
+    }
+
+    printf("HCQ round trip benchmark (%s, %u clients, %u commands per client per size)\n",
+	   (enclave_name != NULL) ? enclave_name : 
+	   ((backend == HCQ_BACKEND_RING) ? "local ring server" : "local db server"),
+	   num_clients, iterations);
+    printf("-------------------------------------------------------------------------------------\n");
+    printf("| Size (bytes) | p50 (us)  | p99 (us)  | p99.9 (us) | Max (us)   | Cmds/s     | Errs |\n");
+    printf("-------------------------------------------------------------------------------------\n");
+
+    for (size = min_size; size <= max_size; size = (size == 0) ? 1 : size * 2) {
+	uint64_t first_ns = (uint64_t)-1;
+	uint64_t last_ns  = 0;
+	uint64_t count    = 0;
+	uint32_t errors   = 0;
+
+	for (i = 0; i < num_clients; i++) {
+	    clients[i].data_size = size;
+	    clients[i].errors    = 0;
+
+	    if (pthread_create(&(clients[i].thread), NULL, __client_thread, &(clients[i])) != 0) {
+		/* The barrier would never open, so bail out entirely */
+		ERROR("Could not start benchmark client thread\n");
+		exit(-1);
+	    }
+	}
+
+	for (i = 0; i < num_clients; i++) {
+	    pthread_join(clients[i].thread, NULL);
+
+	    memcpy(&(all_ns[count]), clients[i].lat_ns, sizeof(uint64_t) * iterations);
+	    count  += iterations;
+	    errors += clients[i].errors;
+
+	    if (clients[i].start_ns < first_ns) {
+		first_ns = clients[i].start_ns;
+	    }
+
+	    if (clients[i].end_ns > last_ns) {
+		last_ns  = clients[i].end_ns;
+	    }
+	}
+
+	qsort(all_ns, count, sizeof(uint64_t), __cmp_u64);
+
+	printf("| %12u | %9.2f | %9.2f | %10.2f | %10.2f | %10.0f | %4u |\n",
+	       size, 
+	       __percentile_us(all_ns, count, 0.50),
+	       __percentile_us(all_ns, count, 0.99),
+	       __percentile_us(all_ns, count, 0.999),
+	       all_ns[count - 1] / 1000.0,
+	       count / ((last_ns - first_ns) / 1e9),
+	       errors);
+
+	/* Avoid wrapping around at the top of the range */
+	if (size > (max_size / 2)) {
+	    break;
+	}
+    }
+
+    printf("-------------------------------------------------------------------------------------\n");
+
+    ret = 0;
+
+ out_clients:
+    for (i = 0; i < num_clients; i++) {
+	if (clients[i].hcq != HCQ_INVALID_HANDLE) {
+	    if (enclave_name != NULL) {
+		hobbes_close_enclave_cmdq(clients[i].hcq);
+	    } else {
+		hcq_disconnect(clients[i].hcq);
+	    }
+	}
+
+	free(clients[i].in);
+	free(clients[i].out);
+	free(clients[i].lat_ns);
+    }
+
+    pthread_barrier_destroy(&barrier);
+
+ out:
+    if (enclave_name == NULL) {
+	__stop_server(&server);
+    }
+
+    free(clients);
+    free(all_ns);
+
+    return ret;
+}
+
+
+
+/*
+ * Slot reuse under contention (ring backend):
+ *   Clients that cancel their commands and disconnect churn through a small queue, 
+ *   so their slots are constantly freed and reused by steady clients, whose echo 
+ *   commands must all come back intact. A command cancelled on behalf of another
+ *   client shows up as a timeout or a mismatched echo.
+ */
+
+#define REUSE_WAIT_US       (2 * 1000 * 1000)
+#define REUSE_CHURN_CMDS    4
+
+struct reuse_client {
+    pthread_t       thread;
+    xemem_segid_t   segid;
+    uint32_t        id;
+    volatile int  * run;
+
+    uint64_t        ops;
+    uint64_t        errors;
+};
+
+static void *
+__steady_thread(void * arg)
+{
+    struct reuse_client * client = arg;
+    hcq_handle_t          hcq    = HCQ_INVALID_HANDLE;
+    uint64_t              tag    = (uint64_t)client->id << 32;
+
+    hcq = hcq_connect(client->segid);
+
+    if (hcq == HCQ_INVALID_HANDLE) {
+	ERROR("Could not connect steady client %u\n", client->id);
+	client->errors++;
+	return NULL;
+    }
+
+    while (*(client->run)) {
+	hcq_cmd_t cmd     = HCQ_INVALID_CMD;
+	uint64_t  echo    = 0;
+	uint32_t  echo_sz = 0;
+
+	tag++;
+
+	/* The queue may be full of churned commands */
+	cmd = hcq_cmd_submit(hcq, BENCH_CMD_ECHO, sizeof(uint64_t), &tag);
+
+	if (cmd == HCQ_INVALID_CMD) {
+	    continue;
+	}
+
+	if (hcq_cmd_wait_timeout(hcq, cmd, REUSE_WAIT_US) != 0) {
+	    ERROR("Steady client %u: command (ID=%lu) never returned\n", client->id, cmd);
+	    hcq_cmd_cancel(hcq, cmd);
+	    client->errors++;
+	    continue;
+	}
+
+	if ((hcq_cmd_collect(hcq, cmd, &echo, sizeof(uint64_t), &echo_sz) != 0) ||
+	    (echo_sz != sizeof(uint64_t)) || 
+	    (echo    != tag)) {
+	    ERROR("Steady client %u: command (ID=%lu) returned a bad echo\n", client->id, cmd);
+	    client->errors++;
+	    continue;
+	}
+
+	client->ops++;
+    }
+
+    hcq_disconnect(hcq);
+
+    return NULL;
+}
+
+static void *
+__churn_thread(void * arg)
+{
+    struct reuse_client * client = arg;
+    uint64_t              tag    = 0;
+
+    while (*(client->run)) {
+	hcq_handle_t hcq = hcq_connect(client->segid);
+	hcq_cmd_t    cmds[REUSE_CHURN_CMDS];
+	uint32_t     i   = 0;
+
+	if (hcq == HCQ_INVALID_HANDLE) {
+	    ERROR("Could not connect churn client %u\n", client->id);
+	    client->errors++;
+	    return NULL;
+	}
+
+	for (i = 0; i < REUSE_CHURN_CMDS; i++) {
+	    cmds[i] = hcq_cmd_submit(hcq, BENCH_CMD_ECHO, sizeof(uint64_t), &tag);
+	}
+
+	/* Keep pace with the server, so the queue does not fill up with cancelled commands */
+	if (cmds[REUSE_CHURN_CMDS - 1] != HCQ_INVALID_CMD) {
+	    hcq_cmd_wait_timeout(hcq, cmds[REUSE_CHURN_CMDS - 1], REUSE_WAIT_US);
+	}
+
+	/* Cancel half of the commands now, and leave the rest to hcq_disconnect() */
+	for (i = 0; i < REUSE_CHURN_CMDS / 2; i++) {
+	    if (cmds[i] != HCQ_INVALID_CMD) {
+		hcq_cmd_cancel(hcq, cmds[i]);
+	    }
+	}
+
+	hcq_disconnect(hcq);
+
+	client->ops++;
+    }
+
+    return NULL;
+}
+
+static void
+__reuse_usage(void)
+{
+    printf("Usage: hobbes hcq_reuse_test [options]\n"							\
+	   " [-w, --workers=<count>]     : Server worker threads (default: 2)\n"				\
+	   " [-c, --clients=<count>]     : Steady clients (default: 4)\n"					\
+	   " [-C, --churners=<count>]    : Clients that cancel and disconnect (default: 4)\n"		\
+	   " [-q, --queue-size=<bytes>]  : Queue size, small enough to reuse slots (default: 2MB)\n"	\
+	   " [-t, --time=<seconds>]      : Test duration (default: 10)\n"					\
+	   );
+}
+
+int
+hcq_reuse_test_main(int argc, char ** argv)
+{
+    struct bench_server   server;
+    struct reuse_client * clients    = NULL;
+    volatile int          run        = 1;
+
+    uint32_t        num_workers  = 2;
+    uint32_t        num_steady   = 4;
+    uint32_t        num_churn    = 4;
+    uint64_t        queue_size   = 2 * 1024 * 1024;
+    uint32_t        duration     = 10;
+    uint64_t        steady_ops   = 0;
+    uint64_t        churn_ops    = 0;
+    uint64_t        errors       = 0;
+    uint32_t        started      = 0;
+    uint32_t        i            = 0;
+
+    {
+	int  opt_idx = 0;
+	char c       = 0;
+
+	opterr = 1;
+
+	static struct option long_options[] = {
+	    {"workers",    required_argument, 0, 'w'},
+	    {"clients",    required_argument, 0, 'c'},
+	    {"churners",   required_argument, 0, 'C'},
+	    {"queue-size", required_argument, 0, 'q'},
+	    {"time",       required_argument, 0, 't'},
+	    {0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "w:c:C:q:t:", long_options, &opt_idx)) != -1) {
+	    switch (c) {
+		case 'w':
+		    num_workers = smart_atou32(num_workers, optarg);
+		    break;
+		case 'c':
+		    num_steady = smart_atou32(num_steady, optarg);
+		    break;
+		case 'C':
+		    num_churn = smart_atou32(num_churn, optarg);
+		    break;
+		case 'q':
+		    queue_size = smart_atou64(queue_size, optarg);
+		    break;
+		case 't':
+		    duration = smart_atou32(duration, optarg);
+		    break;
+		default:
+		    __reuse_usage();
+		    return -1;
+	    }
+	}
+    }
+
+    if ((num_steady == 0) || (duration == 0)) {
+	__reuse_usage();
+	return -1;
+    }
+
+    clients = calloc(sizeof(struct reuse_client), num_steady + num_churn);
+
+    if (clients == NULL) {
+	ERROR("Could not allocate test clients\n");
+	return -1;
+    }
+
+    if (__start_server(&server, HCQ_BACKEND_RING, num_workers, queue_size) != 0) {
+	free(clients);
+	return -1;
+    }
+
+    printf("HCQ slot reuse test (%u steady clients, %u churners, %u seconds)\n",
+	   num_steady, num_churn, duration);
+
+    for (i = 0; i < num_steady + num_churn; i++) {
+	struct reuse_client * client = &(clients[i]);
+
+	client->segid = hcq_get_segid(server.hcq);
+	client->id    = i;
+	client->run   = &run;
+
+	if (pthread_create(&(client->thread), NULL, 
+			   (i < num_steady) ? __steady_thread : __churn_thread, client) != 0) {
+	    ERROR("Could not start test client thread\n");
+	    break;
+	}
+
+	started++;
+    }
+
+    sleep(duration);
+    run = 0;
+
+    for (i = 0; i < started; i++) {
+	pthread_join(clients[i].thread, NULL);
+
+	if (i < num_steady) {
+	    steady_ops += clients[i].ops;
+	} else {
+	    churn_ops  += clients[i].ops;
+	}
+
+	errors += clients[i].errors;
+    }
+
+    __stop_server(&server);
+    free(clients);
+
+    printf("%lu steady commands, %lu churned connections, %lu errors\n", 
+	   steady_ops, churn_ops, errors);
+
+    if ((started != num_steady + num_churn) || (errors > 0)) {
+	printf("FAILED\n");
+	return -1;
+    }
+
+    printf("PASSED\n");
+
+    return 0;
+}
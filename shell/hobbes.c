@@ -119,6 +119,11 @@ extern int       list_cpus_main(int argc, char ** argv);
 extern int   assign_memory_main(int argc, char ** argv);
 extern int     assign_cpus_main(int argc, char ** argv);
 extern int	   console_main(int argc, char ** argv);
+extern int hcq_lookup_bench_main(int argc, char ** argv);
+extern int        hcq_bench_main(int argc, char ** argv);
+extern int   hcq_reuse_test_main(int argc, char ** argv);
+extern int        hcq_stats_main(int argc, char ** argv);
+extern int        mem_bench_main(int argc, char ** argv);
 
 
 static struct hobbes_cmd cmds[] = {
@@ -139,6 +144,11 @@ static struct hobbes_cmd cmds[] = {
     {"assign_memory"   , assign_memory_main    , "Assign memory to an Enclave"		       },
     {"assign_cpus"     , assign_cpus_main      , "Assign CPUs to an Enclave"		       },
     {"console"	       , console_main	       , "Attach to an Enclave Console"		       },
+    {"hcq_lookup_bench", hcq_lookup_bench_main , "Benchmark HCQ lookups vs. queue occupancy"   },
+    {"hcq_bench"       , hcq_bench_main        , "Benchmark HCQ round trip latency/throughput" },
+    {"hcq_reuse_test"  , hcq_reuse_test_main   , "Stress HCQ slot reuse by disconnecting clients"},
+    {"hcq_stats"       , hcq_stats_main        , "Show command queue statistics for an enclave"},
+    {"mem_bench"       , mem_bench_main        , "Benchmark memory block allocation"           },
     {0, 0, 0}
 };
 
@@ -0,0 +1,243 @@
+/* Hobbes memory block allocator benchmarks
+ * (c) 2015, Jack Lange <jacklange@cs.pitt.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <pet_log.h>
+
+#include <hobbes.h>
+#include <hobbes_db.h>
+#include <hobbes_sys_db.h>
+#include <hobbes_util.h>
+
+
+#define BENCH_BLK_SIZE    (128ULL * 1024 * 1024)
+#define BENCH_BASE_ADDR   (4ULL * 1024 * 1024 * 1024)
+#define BENCH_ENCLAVE_ID  1
+
+
+static uint64_t
+__now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void
+__print_result(char     * name,
+	       uint64_t   ops,
+	       uint64_t   elapsed_ns,
+	       uint32_t   errors)
+{
+    printf("| %-24s | %10lu | %12.3f | %12.3f | %6u |\n",
+	   name,
+	   ops,
+	   elapsed_ns / 1000000.0,
+	   (ops > 0) ? (elapsed_ns / 1000.0) / ops : 0.0,
+	   errors);
+}
+
+
+static void
+__mb_usage(void)
+{
+    printf("Usage: hobbes mem_bench [options]\n"								\
+	   " [-b, --blocks=<count>]      : Memory blocks to register (default: 262144)\n"			\
+	   " [-n, --numa=<count>]        : NUMA nodes to spread the blocks across (default: 2)\n"		\
+	   " [-s, --span=<blocks>]       : Blocks per contiguous allocation (default: 8)\n"			\
+	   " [-m, --db-size=<MB>]        : Size of the private benchmark database (default: 2KB per block + 64MB)\n" \
+	   );
+}
+
+int
+mem_bench_main(int argc, char ** argv)
+{
+    hdb_db_t    db         = NULL;
+    uintptr_t * addrs      = NULL;
+    uint64_t    num_blocks = 256 * 1024;
+    uint32_t    numa_cnt   = 2;
+    uint32_t    span       = 8;
+    uint64_t    db_size    = 0;
+    uint64_t    num_allocs = 0;
+    uint64_t    start_ns   = 0;
+    uint32_t    errors     = 0;
+    uint64_t    i          = 0;
+    int         ret        = -1;
+
+    {
+	int  opt_idx = 0;
+	char c       = 0;
+
+	opterr = 1;
+
+	static struct option long_options[] = {
+	    {"blocks",  required_argument, 0, 'b'},
+	    {"numa",    required_argument, 0, 'n'},
+	    {"span",    required_argument, 0, 's'},
+	    {"db-size", required_argument, 0, 'm'},
+	    {0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "b:n:s:m:", long_options, &opt_idx)) != -1) {
+	    switch (c) {
+		case 'b':
+		    num_blocks = smart_atou64(num_blocks, optarg);
+		    break;
+		case 'n':
+		    numa_cnt = smart_atou32(numa_cnt, optarg);
+		    break;
+		case 's':
+		    span = smart_atou32(span, optarg);
+		    break;
+		case 'm':
+		    db_size = smart_atou64(db_size, optarg) * 1024 * 1024;
+		    break;
+		default:
+		    __mb_usage();
+		    return -1;
+	    }
+	}
+    }
+
+    if ((num_blocks == 0) || (numa_cnt == 0) || (span == 0) || (span > num_blocks)) {
+	__mb_usage();
+	return -1;
+    }
+
+    if (db_size == 0) {
+	db_size = (num_blocks * 2048) + (64 * 1024 * 1024);
+    }
+
+    /* The database size must be page aligned */
+    db_size = (db_size + 4095) & ~4095ULL;
+
+    /* Run against a private database, so the live system's memory map is left alone */
+    db    = hdb_create(db_size);
+    addrs = calloc(sizeof(uintptr_t), num_blocks);
+
+    if ((db == NULL) || (addrs == NULL)) {
+	ERROR("Could not allocate benchmark state\n");
+	goto out;
+    }
+
+    if ((hdb_init_master_db(db)                             != 0) ||
+	(hdb_init_system_info(db, numa_cnt, BENCH_BLK_SIZE) != 0)) {
+	ERROR("Could not initialize benchmark database\n");
+	goto out;
+    }
+
+    printf("Memory block allocator benchmark (%lu blocks, %u NUMA nodes, %u block spans, %luMB database)\n",
+	   num_blocks, numa_cnt, span, db_size / (1024 * 1024));
+    printf("-----------------------------------------------------------------------------\n");
+    printf("| Operation                | Ops        | Total (ms)   | Per op (us)  | Errs   |\n");
+    printf("-----------------------------------------------------------------------------\n");
+
+    /* Each NUMA node gets a contiguous range of blocks */
+    start_ns = __now_ns();
+
+    for (i = 0; i < num_blocks; i++) {
+	if (hdb_register_memory(db,
+				BENCH_BASE_ADDR + (i * BENCH_BLK_SIZE),
+				BENCH_BLK_SIZE,
+				(i * numa_cnt) / num_blocks,
+				MEMORY_FREE,
+				HOBBES_INVALID_ID) != 0) {
+	    errors++;
+	}
+    }
+
+    __print_result("register", num_blocks, __now_ns() - start_ns, errors);
+
+    if (errors > 0) {
+	ERROR("Could not register all memory blocks (is the database large enough?)\n");
+	goto out;
+    }
+
+    /* Single blocks: allocate half of memory, then free it again */
+    num_allocs = num_blocks / 2;
+    errors     = 0;
+    start_ns   = __now_ns();
+
+    for (i = 0; i < num_allocs; i++) {
+	addrs[i] = hdb_alloc_block(db, BENCH_ENCLAVE_ID, HOBBES_ANY_NUMA_ID, 1);
+
+	if (addrs[i] == (uintptr_t)-1) {
+	    errors++;
+	}
+    }
+
+    __print_result("alloc block", num_allocs, __now_ns() - start_ns, errors);
+
+    errors   = 0;
+    start_ns = __now_ns();
+
+    for (i = 0; i < num_allocs; i++) {
+	if ((addrs[i] == (uintptr_t)-1) ||
+	    (hdb_free_block(db, addrs[i], 1) != 0)) {
+	    errors++;
+	}
+    }
+
+    __print_result("free block", num_allocs, __now_ns() - start_ns, errors);
+
+    /* Contiguous spans on a fixed NUMA node */
+    num_allocs = (num_blocks / numa_cnt) / (2 * span);
+    errors     = 0;
+    start_ns   = __now_ns();
+
+    for (i = 0; i < num_allocs; i++) {
+	if (hdb_alloc_block(db, BENCH_ENCLAVE_ID, numa_cnt - 1, span) == (uintptr_t)-1) {
+	    errors++;
+	}
+    }
+
+    __print_result("alloc span (node)", num_allocs, __now_ns() - start_ns, errors);
+
+    /* Batched spans from any NUMA node */
+    num_allocs = num_blocks / (4 * span);
+    errors     = 0;
+    start_ns   = __now_ns();
+
+    if (hdb_alloc_blocks(db, BENCH_ENCLAVE_ID, HOBBES_ANY_NUMA_ID, num_allocs, span, addrs) != 0) {
+	errors++;
+    }
+
+    __print_result("alloc blocks (batch)", num_allocs, __now_ns() - start_ns, errors);
+
+    /* Return everything */
+    errors   = 0;
+    start_ns = __now_ns();
+
+    if (hdb_free_enclave_blocks(db, BENCH_ENCLAVE_ID) != 0) {
+	errors++;
+    }
+
+    __print_result("free enclave blocks", 1, __now_ns() - start_ns, errors);
+    printf("-----------------------------------------------------------------------------\n");
+
+    if (hdb_get_sys_free_blk_cnt(db) != num_blocks) {
+	ERROR("Free block count mismatch after benchmark (%lu of %lu blocks free)\n",
+	      hdb_get_sys_free_blk_cnt(db), num_blocks);
+	goto out;
+    }
+
+    ret = 0;
+
+ out:
+    if (db) {
+	hdb_detach(db);
+    }
+
+    free(addrs);
+
+    return ret;
+}
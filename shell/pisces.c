@@ -313,31 +313,70 @@ pisces_enclave_create(pet_xml_t   xml,
 	    } 
 
 	    while (cores_tree) {
-		int numa_node  = -1;
-		int core_count = -1;
+		int          numa_node  = -1;
+		int          core_count = -1;
+		char       * policy_str = NULL;
+		cpu_policy_t policy     = CPU_POLICY_COMPACT;
+		uint32_t   * cpu_ids    = NULL;
 
 		int i =  0;
 		
 		numa_node  = smart_atoi(numa_node,  pet_xml_get_val(cores_tree, "numa"));
 		core_count = smart_atoi(core_count, pet_xml_tag_str(cores_tree));
+		policy_str = pet_xml_get_val(cores_tree, "policy");
 
-		for (i = 0; i < core_count; i++) {
-		    uint32_t cpu_id = hobbes_alloc_cpu(enclave_id, numa_node);
-		    
-		    if (cpu_id == HOBBES_INVALID_CPU_ID) {
-			WARN("Only able to allocate %d CPUs for enclave (%d)\n", i, enclave_id);
-			break;
+		if (policy_str) {
+		    policy = cpu_policy_from_str(policy_str);
+
+		    if (policy == CPU_POLICY_INVALID) {
+			WARN("Invalid CPU policy (%s), using compact placement\n", policy_str);
+			policy = CPU_POLICY_COMPACT;
 		    }
+		}
 
-		    if (add_cpu_to_pisces(pisces_id, cpu_id) != 0) {
-			WARN("Could not add CPU (%d) to enclave (%d), continuing...\n", 
-			     cpu_id, enclave_id);
+		if (core_count <= 0) {
+		    WARN("Invalid CPU count (%s) in enclave configuration. Ignoring...\n", 
+			 pet_xml_tag_str(cores_tree));
+		    goto cores_next;
+		}
 
-			hobbes_free_cpu(cpu_id);
+		cpu_ids = calloc(sizeof(uint32_t), core_count);
+
+		if (!cpu_ids) {
+		    ERROR("Could not allocate CPU array\n");
+		    goto cores_next;
+		}
+
+		/* Grab every core in one step so the policy sees the whole request.
+		 * If that many are not free, fall back to booting with whatever is left
+		 */
+		if (hobbes_alloc_cpus(enclave_id, numa_node, core_count, policy, cpu_ids) != 0) {
+		    WARN("Unable to allocate %d CPUs (%s) for enclave (%d), ignoring placement policy\n",
+			 core_count, cpu_policy_to_str(policy), enclave_id);
+
+		    for (i = 0; i < core_count; i++) {
+			cpu_ids[i] = hobbes_alloc_cpu(enclave_id, numa_node);
+
+			if (cpu_ids[i] == HOBBES_INVALID_CPU_ID) {
+			    WARN("Only able to allocate %d CPUs for enclave (%d)\n", i, enclave_id);
+			    break;
+			}
 		    }
 
+		    core_count = i;
+		}
+
+		for (i = 0; i < core_count; i++) {
+		    if (add_cpu_to_pisces(pisces_id, cpu_ids[i]) != 0) {
+			WARN("Could not add CPU (%d) to enclave (%d), continuing...\n", 
+			     cpu_ids[i], enclave_id);
+
+			hobbes_free_cpu(cpu_ids[i]);
+		    }
 		}
 
+	    cores_next:
+		free(cpu_ids);
 		cores_tree = pet_xml_get_next(cores_tree);
 	    }
 
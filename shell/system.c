@@ -348,7 +348,8 @@ static void
 assign_cpus_usage(char * exec_name)
 {
     printf("Usage: %s [options] <enclave name> <num cpus>\n"
-	"[-n, --numa=<numa zone>]\n",
+	"[-n, --numa=<numa zone>]\n"
+	"[-p, --policy=<compact|scatter|same-numa|avoid-siblings>] (default: compact)\n",
 	exec_name
     );
 }
@@ -378,9 +379,10 @@ __assign_cpu_master(hobbes_id_t enclave_id,
 }
 
 static int
-assign_cpus(char   * enclave_name,
-	    uint32_t num_cpus,
-	    uint32_t numa_node)
+assign_cpus(char       * enclave_name,
+	    uint32_t     num_cpus,
+	    uint32_t     numa_node,
+	    cpu_policy_t policy)
 {
     hobbes_id_t    enclave_id     = HOBBES_INVALID_ID;
     enclave_type_t enclave_type   = INVALID_ENCLAVE;
@@ -411,14 +413,12 @@ assign_cpus(char   * enclave_name,
 	return -1;
     }
 
-    for (cpu_off = 0; cpu_off < num_cpus; cpu_off++) {
-	cpu_id = hobbes_alloc_cpu(enclave_id, numa_node);
-	if (cpu_id == HOBBES_INVALID_CPU_ID) {
-	    ERROR("Cannot allocate cpu for enclave %s\n", enclave_name);
-	    goto cpu_free;
-	}
-
-	cpu_ids[cpu_off] = cpu_id;
+    /* All or nothing, so there is nothing to release if this fails */
+    if (hobbes_alloc_cpus(enclave_id, numa_node, num_cpus, policy, cpu_ids) != 0) {
+	ERROR("Cannot allocate %u cpus (%s) for enclave %s\n", 
+	      num_cpus, cpu_policy_to_str(policy), enclave_name);
+	free(cpu_ids);
+	return -1;
     }
 
     for (cpu_off = 0; cpu_off < num_cpus; cpu_off++) {
@@ -453,28 +453,15 @@ assign_cpus(char   * enclave_name,
 	enclave_name);
 
     return 0;
-
-cpu_free:
-    {
-	uint32_t i = 0;
-
-	for (i = 0; i < cpu_off; i++) {
-	    cpu_id = cpu_ids[i];
-	    hobbes_free_cpu(cpu_id);
-	}
-    }
-
-    free(cpu_ids);
-
-    return -1;
 }
 
 int
 assign_cpus_main(int argc, char ** argv)
 {
-    uint32_t numa_node	  = HOBBES_ANY_NUMA_ID;
-    uint32_t num_cpus	  =  0;
-    char   * enclave_name = NULL;
+    uint32_t     numa_node    = HOBBES_ANY_NUMA_ID;
+    uint32_t     num_cpus     =  0;
+    cpu_policy_t policy       = CPU_POLICY_COMPACT;
+    char       * enclave_name = NULL;
 
     /* Get command line options */
     {
@@ -484,10 +471,11 @@ assign_cpus_main(int argc, char ** argv)
 	struct option long_options[] =
 	{
 	    {"numa",	required_argument, 0, 'n'},
+	    {"policy",	required_argument, 0, 'p'},
 	    {0, 0, 0, 0}
 	};
 
-	while ((c = getopt_long_only(argc, argv, "n:", long_options, &opt_index)) != -1) {
+	while ((c = getopt_long_only(argc, argv, "n:p:", long_options, &opt_index)) != -1) {
 	    switch (c) {
 		case 'n':
 		    numa_node = smart_atou32(numa_node, optarg);
@@ -506,6 +494,16 @@ assign_cpus_main(int argc, char ** argv)
 
 		    break;
 
+		case 'p':
+		    policy = cpu_policy_from_str(optarg);
+		    if (policy == CPU_POLICY_INVALID) {
+			ERROR("Invalid CPU policy (%s)\n", optarg);
+			assign_cpus_usage(argv[0]);
+			return -1;
+		    }
+
+		    break;
+
 		case '?':
 		    ERROR("Invalid option specified\n");
 		    assign_cpus_usage(argv[0]);
@@ -527,5 +525,5 @@ assign_cpus_main(int argc, char ** argv)
 	}
     }
 
-    return assign_cpus(enclave_name, num_cpus, numa_node);
+    return assign_cpus(enclave_name, num_cpus, numa_node, policy);
 }